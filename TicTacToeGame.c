@@ -69,9 +69,10 @@ player_input parse(char* client_inp_str){
     
 
 
+    char* msg_pt2 = NULL;
     char* msg_pt1 = strtok(NULL, "|");
     if(msg_pt1 == NULL) goto process_inp_toks; // command is RSGN, or bad command
-    char* msg_pt2 = strtok(NULL, "|"); // this is the 4th field, which is NULL for command PLAY
+    msg_pt2 = strtok(NULL, "|"); // this is the 4th field, which is NULL for command PLAY
     
     process_inp_toks:
     
@@ -103,12 +104,12 @@ player_input parse(char* client_inp_str){
             goto garbled; // missing X/O or missing coords
         if (msg_pt1[0] == 'X')
             ret.x_or_o = 'X';
-        else if ((msg_pt1[0] == 'O')
+        else if (msg_pt1[0] == 'O')
             ret.x_or_o = 'O';
         else goto garbled; // player isn't X or O
         
-        if (msg_pt2[0] != '1' && msg_pt2[0] != '2' && msg_pt2[0] != '3'
-          ||msg_pt2[2] != '1' && msg_pt2[2] != '2' && msg_pt2[2] != '3')
+        if ((msg_pt2[0] != '1' && msg_pt2[0] != '2' && msg_pt2[0] != '3')
+          ||(msg_pt2[2] != '1' && msg_pt2[2] != '2' && msg_pt2[2] != '3'))
         {
             strcpy((char* ) & ret.client_response_msg, 
              "Position must be in the form x,y with {1,2,3} for each\n");
@@ -0,0 +1,53 @@
+// CPU and NUMA placement for the event loop thread. The loop owns every game,
+// so pinning it keeps both players' connection data, their client_pair_t and
+// the socket buffers the kernel touches for them on one core and one node.
+// Memory policy is set through the raw system call so there is no dependency
+// on libnuma.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "affinity.h"
+
+#define MPOL_PREFERRED 1 // From linux/mempolicy.h, which not every libc ships
+
+int cpu_node(int cpu)
+{
+    char path[64];
+    struct dirent *entry;
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        return 0;
+    int node = 0;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, "node", 4) == 0 && sscanf(entry->d_name + 4, "%d", &node) == 1)
+            break;
+    }
+    closedir(dir);
+    return node;
+}
+
+int pin_to_cpu(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set))
+    {
+        perror("sched_setaffinity");
+        return -1;
+    }
+
+    // Preferred rather than bound, so allocation still succeeds elsewhere when
+    // the node runs out
+    int node = cpu_node(cpu);
+    unsigned long mask = 1ul << node;
+    if (node < (int)(8 * sizeof(mask)) && syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, 8 * sizeof(mask)))
+        perror("set_mempolicy"); // Not fatal, the pinning alone helps most
+    return node;
+}
@@ -0,0 +1,16 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+/*
+Returns the NUMA node a CPU belongs to, or 0 on machines without NUMA.
+*/
+int cpu_node(int cpu);
+
+/*
+Pins the calling thread to one CPU and makes memory it allocates from then on
+come from that CPU's NUMA node when the node has memory free. Returns the
+node, or -1 if the CPU cannot be used.
+*/
+int pin_to_cpu(int cpu);
+
+#endif
@@ -0,0 +1,490 @@
+// The archive of finished games. The event loop copies each game into a
+// batch in memory; a writer thread turns full batches into the columns of
+// memory-mapped segment files, so the game path never waits for the disk.
+// The other half maps those files for reading, for the query tool.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "archive.h"
+#include "lockprof.h"
+#include "hashtable.h"
+
+#define SEGMENT_PREFIX "games-"
+#define SEGMENT_SUFFIX ".tta"
+#define INITIAL_NAME_SLOTS 4096
+
+/*
+A game as the event loop hands it over
+*/
+typedef struct archived_game
+{
+    uint8_t moves[9];
+    uint8_t length;
+    uint8_t result;
+    uint32_t time;
+    char x[ARCHIVE_NAME_SIZE];
+    char o[ARCHIVE_NAME_SIZE];
+} archived_game;
+
+typedef struct batch
+{
+    int count;
+    struct batch *next;
+    archived_game games[ARCHIVE_BATCH];
+} batch;
+
+// Shared between the event loop and the writer
+static prof_mutex archive_mutex = PROF_MUTEX_INITIALIZER("archive_mutex");
+static pthread_cond_t archive_cond = PTHREAD_COND_INITIALIZER;
+static batch *queue_head = NULL, *queue_tail = NULL; // Full batches, oldest first
+static batch *spare = NULL;                          // Written batches, for reuse
+static int stopping = 0;
+
+// The event loop's
+static int archive_on = 0;
+static batch *filling = NULL;
+static time_t filling_since;
+static pthread_t writer;
+
+// The writer's
+static char *segment_dir;
+static int next_segment;
+static unsigned long archived = 0;
+static int seg_fd = -1;
+static uint32_t seg_count;          // Games in the segment, published to readers in its header
+static uint8_t *seg_map;
+static archive_header *seg_header;
+static char *names;                // This segment's names, back to back
+static uint32_t names_len = 0, names_size = 0, names_written = 0;
+static uint32_t *name_offsets = NULL; // Where each player's name starts in names
+static uint32_t *name_slots = NULL;   // Open addressing table of player number + 1, 0 when empty
+static uint32_t num_slots = 0, num_names = 0;
+
+/*
+Doubles the table of names once it is half full, or makes the first one.
+*/
+static int grow_names(void)
+{
+    uint32_t size = num_slots ? num_slots * 2 : INITIAL_NAME_SLOTS;
+    uint32_t *slots = calloc(size, sizeof(uint32_t));
+    uint32_t *offsets = realloc(name_offsets, sizeof(uint32_t) * (size / 2));
+    if (slots == NULL || offsets == NULL)
+    {
+        free(slots);
+        if (offsets != NULL)
+            name_offsets = offsets;
+        return -1;
+    }
+    name_offsets = offsets;
+    for (uint32_t id = 0; id < num_names; id++)
+    {
+        uint32_t i = hash_string(names + name_offsets[id]) & (size - 1);
+        while (slots[i] != 0)
+            i = (i + 1) & (size - 1);
+        slots[i] = id + 1;
+    }
+    free(name_slots);
+    name_slots = slots;
+    num_slots = size;
+    return 0;
+}
+
+/*
+Returns the player number of name in the current segment, adding it if it
+is new, or -1 if memory runs out.
+*/
+static int64_t intern(const char *name)
+{
+    if (num_names >= num_slots / 2 && grow_names())
+        return -1;
+    uint32_t i = hash_string(name) & (num_slots - 1);
+    while (name_slots[i] != 0)
+    {
+        uint32_t id = name_slots[i] - 1;
+        if (strcmp(names + name_offsets[id], name) == 0)
+            return id;
+        i = (i + 1) & (num_slots - 1);
+    }
+    uint32_t len = strlen(name) + 1;
+    if (names_len + len > names_size)
+    {
+        uint32_t size = names_size ? names_size * 2 : 65536;
+        while (size < names_len + len)
+            size *= 2;
+        char *grown = realloc(names, size);
+        if (grown == NULL)
+            return -1;
+        names = grown;
+        names_size = size;
+    }
+    memcpy(names + names_len, name, len);
+    name_offsets[num_names] = names_len;
+    names_len += len;
+    name_slots[i] = num_names + 1;
+    return num_names++;
+}
+
+/*
+Writes the names added since the last batch after the columns, then
+publishes the games, so a reader never sees a player number without its
+name.
+*/
+static void publish(void)
+{
+    if (names_len > names_written)
+    {
+        if (pwrite(seg_fd, names + names_written, names_len - names_written,
+                   seg_header->names_offset + names_written) != (ssize_t)(names_len - names_written))
+            perror("archive");
+        names_written = names_len;
+    }
+    seg_header->num_names = num_names;
+    seg_header->names_bytes = names_written;
+    __atomic_store_n(&seg_header->count, seg_count, __ATOMIC_RELEASE);
+}
+
+static void close_segment(void)
+{
+    if (seg_fd < 0)
+        return;
+    publish();
+    munmap(seg_map, seg_header->names_offset);
+    close(seg_fd);
+    seg_fd = -1;
+}
+
+static int open_segment(void)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/" SEGMENT_PREFIX "%06d" SEGMENT_SUFFIX, segment_dir, next_segment++);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    uint64_t c = ARCHIVE_SEGMENT_GAMES;
+    uint64_t columns = ARCHIVE_HEADER_SIZE + 23 * c;
+    if (fd < 0 || ftruncate(fd, columns))
+    {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    uint8_t *map = mmap(NULL, columns, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    archive_header *h = (archive_header *)map;
+    memcpy(h->magic, ARCHIVE_MAGIC, sizeof(h->magic));
+    h->capacity = c;
+    for (int k = 0; k < 9; k++)
+        h->moves_offset[k] = ARCHIVE_HEADER_SIZE + k * c;
+    h->length_offset = ARCHIVE_HEADER_SIZE + 9 * c;
+    h->result_offset = ARCHIVE_HEADER_SIZE + 10 * c;
+    h->x_offset = ARCHIVE_HEADER_SIZE + 11 * c;
+    h->o_offset = ARCHIVE_HEADER_SIZE + 15 * c;
+    h->time_offset = ARCHIVE_HEADER_SIZE + 19 * c;
+    h->names_offset = columns;
+    seg_fd = fd;
+    seg_map = map;
+    seg_header = h;
+    seg_count = 0;
+
+    // Player numbers start again in every segment
+    memset(name_slots, 0, sizeof(uint32_t) * num_slots);
+    num_names = 0;
+    names_len = names_written = 0;
+    return 0;
+}
+
+/*
+Appends a batch to the columns, starting new segments as they fill.
+*/
+static void write_batch(batch *b)
+{
+    for (int g = 0; g < b->count; g++)
+    {
+        archived_game *game = &b->games[g];
+        if (seg_fd < 0 || seg_count == ARCHIVE_SEGMENT_GAMES)
+        {
+            close_segment();
+            if (open_segment())
+                return;
+        }
+        int64_t x = intern(game->x), o = intern(game->o);
+        if (x < 0 || o < 0)
+            return;
+        archive_header *h = seg_header;
+        uint32_t i = seg_count++;
+        for (int k = 0; k < 9; k++)
+            seg_map[h->moves_offset[k] + i] = game->moves[k];
+        seg_map[h->length_offset + i] = game->length;
+        seg_map[h->result_offset + i] = game->result;
+        ((uint32_t *)(seg_map + h->x_offset))[i] = x;
+        ((uint32_t *)(seg_map + h->o_offset))[i] = o;
+        ((uint32_t *)(seg_map + h->time_offset))[i] = game->time;
+        archived++;
+    }
+    if (seg_fd >= 0)
+        publish();
+}
+
+static void *write_batches(void *arg)
+{
+    for (;;)
+    {
+        prof_lock(&archive_mutex);
+        while (queue_head == NULL && !stopping)
+            pthread_cond_wait(&archive_cond, &archive_mutex.mutex);
+        batch *b = queue_head;
+        if (b != NULL && (queue_head = b->next) == NULL)
+            queue_tail = NULL;
+        prof_unlock(&archive_mutex);
+        if (b == NULL)
+            break;
+
+        write_batch(b);
+        b->count = 0;
+        prof_lock(&archive_mutex);
+        b->next = spare;
+        spare = b;
+        prof_unlock(&archive_mutex);
+    }
+    close_segment();
+    return NULL;
+}
+
+int archive_open(const char *dir)
+{
+    char **paths;
+    if (mkdir(dir, 0755) && errno != EEXIST)
+    {
+        perror(dir);
+        return -1;
+    }
+    int n = archive_list(dir, &paths);
+    if (n < 0)
+        return -1;
+    next_segment = 0;
+    if (n > 0)
+    {
+        const char *last = strrchr(paths[n - 1], '/') + 1;
+        next_segment = atoi(last + strlen(SEGMENT_PREFIX)) + 1;
+    }
+    for (int i = 0; i < n; i++)
+        free(paths[i]);
+    free(paths);
+
+    segment_dir = strdup(dir);
+    if (segment_dir == NULL || grow_names() || pthread_create(&writer, NULL, write_batches, NULL))
+    {
+        fprintf(stderr, "Could not start writing the archive in %s\n", dir);
+        return -1;
+    }
+    archive_on = 1;
+    return 0;
+}
+
+/*
+Queues the batch being filled for the writer.
+*/
+static void hand_over(void)
+{
+    prof_lock(&archive_mutex);
+    if (queue_tail != NULL)
+        queue_tail->next = filling;
+    else
+        queue_head = filling;
+    queue_tail = filling;
+    filling->next = NULL;
+    pthread_cond_signal(&archive_cond);
+    prof_unlock(&archive_mutex);
+    filling = NULL;
+}
+
+void archive_add(const char moves[9], int length, int result, const char *x, const char *o)
+{
+    if (!archive_on)
+        return;
+    if (filling == NULL)
+    {
+        prof_lock(&archive_mutex);
+        filling = spare;
+        if (filling != NULL)
+            spare = filling->next;
+        prof_unlock(&archive_mutex);
+        if (filling == NULL && (filling = malloc(sizeof(batch))) == NULL)
+            return; // The game is lost rather than the server
+        filling->count = 0;
+    }
+    archived_game *game = &filling->games[filling->count];
+    for (int k = 0; k < 9; k++)
+        game->moves[k] = k < length ? (uint8_t)moves[k] : ARCHIVE_NO_MOVE;
+    game->length = length;
+    game->result = result;
+    game->time = time(NULL);
+    snprintf(game->x, ARCHIVE_NAME_SIZE, "%s", x);
+    snprintf(game->o, ARCHIVE_NAME_SIZE, "%s", o);
+    if (filling->count++ == 0)
+        filling_since = game->time;
+    if (filling->count == ARCHIVE_BATCH)
+        hand_over();
+}
+
+int archive_tick(void)
+{
+    if (filling == NULL || filling->count == 0)
+        return 0;
+    if (time(NULL) - filling_since >= 1)
+    {
+        hand_over();
+        return 0;
+    }
+    return 1;
+}
+
+unsigned long archive_close(void)
+{
+    if (!archive_on)
+        return 0;
+    if (filling != NULL && filling->count > 0)
+        hand_over();
+    free(filling);
+    prof_lock(&archive_mutex);
+    stopping = 1;
+    pthread_cond_signal(&archive_cond);
+    prof_unlock(&archive_mutex);
+    pthread_join(writer, NULL);
+
+    while (spare != NULL)
+    {
+        batch *next = spare->next;
+        free(spare);
+        spare = next;
+    }
+    free(names);
+    free(name_offsets);
+    free(name_slots);
+    free(segment_dir);
+    archive_on = 0;
+    return archived;
+}
+
+int archive_map(const char *path, archive_segment *s)
+{
+    struct stat st;
+    memset(s, 0, sizeof(*s));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st))
+    {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    void *map = st.st_size >= ARCHIVE_HEADER_SIZE ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    const archive_header *h = map;
+    uint64_t c = map != MAP_FAILED ? h->capacity : 0;
+    if (map == MAP_FAILED || memcmp(h->magic, ARCHIVE_MAGIC, sizeof(h->magic)) != 0 ||
+        h->names_offset < h->time_offset + 4 * c || h->names_offset + h->names_bytes > (uint64_t)st.st_size ||
+        h->x_offset % 4 || h->o_offset % 4 || h->time_offset % 4)
+    {
+        fprintf(stderr, "%s is not an archive segment\n", path);
+        if (map != MAP_FAILED)
+            munmap(map, st.st_size);
+        return -1;
+    }
+    s->map = map;
+    s->size = st.st_size;
+    s->header = h;
+    s->count = __atomic_load_n(&h->count, __ATOMIC_ACQUIRE);
+    if (s->count > c)
+        s->count = c;
+
+    // The names must be read after count, so every player counted has one
+    uint32_t num_names = h->num_names, names_bytes = h->names_bytes;
+    const char *p = (const char *)map + h->names_offset, *end = p + names_bytes;
+    s->names = malloc(sizeof(char *) * (num_names + 1));
+    if (s->names == NULL)
+    {
+        archive_unmap(s);
+        return -1;
+    }
+    uint32_t n = 0;
+    while (n < num_names && p < end)
+    {
+        s->names[n++] = p;
+        p += strnlen(p, end - p) + 1;
+    }
+    while (n < num_names)
+        s->names[n++] = "?";
+
+    const uint8_t *base = map;
+    for (int k = 0; k < 9; k++)
+        s->moves[k] = base + h->moves_offset[k];
+    s->length = base + h->length_offset;
+    s->result = base + h->result_offset;
+    s->x = (const uint32_t *)(base + h->x_offset);
+    s->o = (const uint32_t *)(base + h->o_offset);
+    s->time = (const uint32_t *)(base + h->time_offset);
+    return 0;
+}
+
+void archive_unmap(archive_segment *s)
+{
+    free(s->names);
+    if (s->map != NULL)
+        munmap(s->map, s->size);
+    memset(s, 0, sizeof(*s));
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int archive_list(const char *dir, char ***paths)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL)
+    {
+        perror(dir);
+        return -1;
+    }
+    int n = 0, size = 16;
+    char **list = malloc(sizeof(char *) * size);
+    struct dirent *entry;
+    while (list != NULL && (entry = readdir(d)) != NULL)
+    {
+        size_t len = strlen(entry->d_name);
+        if (strncmp(entry->d_name, SEGMENT_PREFIX, strlen(SEGMENT_PREFIX)) != 0 || len < strlen(SEGMENT_SUFFIX) ||
+            strcmp(entry->d_name + len - strlen(SEGMENT_SUFFIX), SEGMENT_SUFFIX) != 0)
+            continue;
+        if (n == size)
+        {
+            char **grown = realloc(list, sizeof(char *) * (size *= 2));
+            if (grown == NULL)
+                break;
+            list = grown;
+        }
+        if (asprintf(&list[n], "%s/%s", dir, entry->d_name) >= 0)
+            n++;
+    }
+    closedir(d);
+    if (list == NULL)
+        return -1;
+    // Numbers are zero padded, so names sort in the order they were written
+    qsort(list, n, sizeof(char *), compare_paths);
+    *paths = list;
+    return n;
+}
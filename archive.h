@@ -0,0 +1,103 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+
+#define ARCHIVE_MAGIC "TTTSARC1"
+#define ARCHIVE_SEGMENT_GAMES (1 << 20) // Games in one segment file
+#define ARCHIVE_BATCH 4096              // Games the event loop hands the writer at once
+#define ARCHIVE_NAME_SIZE 128
+#define ARCHIVE_HEADER_SIZE 4096
+
+// The result byte: who won in the low two bits, and how it ended
+#define ARCHIVE_X_WON 0
+#define ARCHIVE_O_WON 1
+#define ARCHIVE_DRAW 2
+#define ARCHIVE_WINNER 3    // Mask for the above
+#define ARCHIVE_ON_BOARD 4  // Three in a row or a full grid, rather than a resignation, agreement or forfeit
+
+#define ARCHIVE_NO_MOVE 0xFF // Move column of a game that was over before that move
+
+/*
+Each segment file holds up to ARCHIVE_SEGMENT_GAMES games as columns: nine
+one-byte columns for the cell (0-8, row by row) taken by each move, then
+columns for the number of moves, the result, the X and O players and the
+time the game ended. A game is 23 bytes. Players are numbers into the
+segment's table of names, kept after the columns as NUL-terminated strings
+in the order they first appeared. Columns are filled front to back and
+count says how far; everything the header points at is complete up to it.
+*/
+typedef struct archive_header
+{
+    char magic[8];
+    uint32_t capacity;       // Games each column has room for
+    uint32_t count;          // Games written
+    uint32_t num_names;
+    uint32_t names_bytes;
+    uint64_t names_offset;
+    uint64_t moves_offset[9];
+    uint64_t length_offset;
+    uint64_t result_offset;
+    uint64_t x_offset;       // uint32_t player numbers
+    uint64_t o_offset;
+    uint64_t time_offset;    // uint32_t Unix time
+} archive_header;
+
+/*
+Starts a thread that writes the games added with archive_add() to segment
+files in dir, numbered on from any already there. Returns -1 and prints why
+if it cannot.
+*/
+int archive_open(const char *dir);
+
+/*
+Copies a finished game into the batch being filled. Only the event loop's
+thread may call it. Does nothing unless an archive is open.
+*/
+void archive_add(const char moves[9], int length, int result, const char *x, const char *o);
+
+/*
+Hands the writer a partly filled batch once its first game is a second old,
+so games reach the files while the server is quiet. Returns 1 while games
+are still waiting in the batch, so the loop should wake up within a second.
+*/
+int archive_tick(void);
+
+/*
+Writes every game added so far and stops the writer. Returns the number of
+games archived.
+*/
+unsigned long archive_close(void);
+
+/*
+A segment file mapped for reading, with its columns and names
+*/
+typedef struct archive_segment
+{
+    void *map;
+    uint64_t size;
+    const archive_header *header;
+    uint32_t count;
+    const uint8_t *moves[9];
+    const uint8_t *length;
+    const uint8_t *result;
+    const uint32_t *x;
+    const uint32_t *o;
+    const uint32_t *time;
+    const char **names;      // By player number
+} archive_segment;
+
+/*
+Maps a segment file. Returns -1 and prints why if it is not one.
+*/
+int archive_map(const char *path, archive_segment *s);
+
+void archive_unmap(archive_segment *s);
+
+/*
+Lists the segment files in dir in the order they were written. Returns how
+many there are, or -1; *paths is an array of strings the caller frees.
+*/
+int archive_list(const char *dir, char ***paths);
+
+#endif
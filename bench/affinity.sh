@@ -0,0 +1,63 @@
+#!/bin/sh
+# Runs the same load with the server's event loop and the load generator
+# placed in different ways: left to the scheduler, sharing one core, on two
+# cores of one NUMA node, and on two nodes. With perf installed it also counts
+# the server's loads and stores that went to another node.
+#
+# Usage: bench/affinity.sh [games] [concurrent_games]
+SERVER=${SERVER:-./server}
+LOADGEN=${LOADGEN:-./loadgen}
+GAMES=${1:-20000}
+CONCURRENCY=${2:-50}
+PORT=${PORT:-15993}
+
+# Expands a node's cpulist, such as 0-3,8-11, into one CPU per word
+node_cpus() {
+    tr ',' '\n' < /sys/devices/system/node/node$1/cpulist | while IFS=- read first last; do
+        seq $first ${last:-$first}
+    done | tr '\n' ' '
+}
+nodes=$(ls -d /sys/devices/system/node/node[0-9]* 2> /dev/null | sed 's/.*node//')
+node0=$(echo $nodes | cut -d' ' -f1)
+node1=$(echo $nodes | cut -d' ' -f2 -s)
+if [ -n "$node0" ]; then
+    cpu0=$(node_cpus $node0 | cut -d' ' -f1)
+    cpu0b=$(node_cpus $node0 | cut -d' ' -f2 -s)
+else
+    cpu0=0
+fi
+
+run() {
+    name=$1
+    server_cpu=$2
+    loadgen_cpu=$3
+    echo "== $name"
+    $SERVER ${server_cpu:+-a $server_cpu} $PORT > /dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    if command -v perf > /dev/null; then
+        perf stat -e node-loads,node-load-misses,node-stores,node-store-misses -p $pid -o /tmp/ttts-affinity.perf &
+        perf_pid=$!
+    fi
+    $LOADGEN ${loadgen_cpu:+-a $loadgen_cpu} -n $GAMES -c $CONCURRENCY 127.0.0.1 $PORT | grep -E "games/sec|p99|errors"
+    if [ -n "$perf_pid" ]; then
+        kill -INT $perf_pid
+        wait $perf_pid
+        grep -E "node-" /tmp/ttts-affinity.perf
+        perf_pid=
+    fi
+    kill -INT $pid
+    wait $pid
+}
+
+run "unpinned"
+run "same core (cpu $cpu0)" $cpu0 $cpu0
+if [ -n "$cpu0b" ]; then
+    run "same node (cpus $cpu0, $cpu0b)" $cpu0 $cpu0b
+fi
+if [ -n "$node1" ]; then
+    cpu1=$(node_cpus $node1 | cut -d' ' -f1)
+    run "two nodes (cpus $cpu0, $cpu1)" $cpu0 $cpu1
+else
+    echo "== one NUMA node, nothing to compare across nodes"
+fi
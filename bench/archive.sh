@@ -0,0 +1,21 @@
+#!/bin/sh
+# Times the archive: fills a directory with random games through the
+# server's writer, then runs each query over it. The queries scan every
+# segment, so the second pass over the same files shows the rate from the
+# page cache rather than the disk.
+#
+# Usage: bench/archive.sh [games]
+ARCHIVEGEN=${ARCHIVEGEN:-./archivegen}
+QUERY=${QUERY:-./query}
+GAMES=${1:-20000000}
+DIR=${DIR:-build/archive-bench}
+
+rm -rf "$DIR"
+mkdir -p "$(dirname "$DIR")"
+$ARCHIVEGEN -d "$DIR" -n $GAMES || exit 1
+du -sh "$DIR"
+for q in summary openings lengths "player player42" "top 5"; do
+    echo "== $q"
+    $QUERY -d "$DIR" $q > /dev/null 2>&1
+    $QUERY -d "$DIR" $q
+done
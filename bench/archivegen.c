@@ -0,0 +1,104 @@
+// Fills an archive with random games through the same writer the server
+// uses, to time the writer and to give query something large to scan. Each
+// game is played to the end with random legal moves between two of a pool of
+// players, except that about one in ten ends early by resignation, agreement
+// or forfeit.
+//
+// Usage: archivegen [-d dir] [-n games] [-p players]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "../archive.h"
+
+static uint64_t rng = 88172645463325252ull;
+
+static uint32_t next_random(void)
+{
+    // xorshift64
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng >> 32;
+}
+
+static int three_in_a_row(const char *b, char c)
+{
+    static const int lines[8][3] = {{0, 1, 2}, {3, 4, 5}, {6, 7, 8}, {0, 3, 6},
+                                    {1, 4, 7}, {2, 5, 8}, {0, 4, 8}, {2, 4, 6}};
+    for (int l = 0; l < 8; l++)
+        if (b[lines[l][0]] == c && b[lines[l][1]] == c && b[lines[l][2]] == c)
+            return 1;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = "archive";
+    unsigned long num_games = 1000000;
+    int num_players = 10000, opt;
+    while ((opt = getopt(argc, argv, "d:n:p:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            dir = optarg;
+            break;
+        case 'n':
+            num_games = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            num_players = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d dir] [-n games] [-p players]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (num_players < 2)
+        num_players = 2;
+    if (archive_open(dir))
+        exit(EXIT_FAILURE);
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (unsigned long g = 0; g < num_games; g++)
+    {
+        char board[9], moves[9], x[24], o[24];
+        int free_cells[9], length = 0, result = ARCHIVE_DRAW | ARCHIVE_ON_BOARD;
+        int early = next_random() % 10 == 0 ? next_random() % 9 : 9;
+        memset(board, '.', sizeof(board));
+        for (int c = 0; c < 9; c++)
+            free_cells[c] = c;
+        while (length < 9)
+        {
+            if (length == early)
+            {
+                result = next_random() % 3;
+                break;
+            }
+            int pick = next_random() % (9 - length);
+            int cell = free_cells[pick];
+            free_cells[pick] = free_cells[8 - length];
+            char mark = length % 2 ? 'O' : 'X';
+            board[cell] = mark;
+            moves[length++] = cell;
+            if (three_in_a_row(board, mark))
+            {
+                result = (mark == 'X' ? ARCHIVE_X_WON : ARCHIVE_O_WON) | ARCHIVE_ON_BOARD;
+                break;
+            }
+        }
+        int a = next_random() % num_players, b = next_random() % (num_players - 1);
+        snprintf(x, sizeof(x), "player%d", a);
+        snprintf(o, sizeof(o), "player%d", b < a ? b : b + 1);
+        archive_add(moves, length, result, x, o);
+    }
+    unsigned long written = archive_close();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    printf("Wrote %lu games to %s in %.3f s, %.0f games/s\n", written, dir, seconds, written / seconds);
+    return written == num_games ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,92 @@
+#!/bin/sh
+# Runs the benchmark suite and writes the results as JSON, or compares two
+# result files and fails if any result got worse by more than a threshold.
+# The suite is the microbenchmarks in bench/micro.c, the headless simulator
+# on one thread, then loadgen against a local server at several numbers of
+# concurrent games.
+#
+# Usage: bench/bench.sh run [output.json]
+#        bench/bench.sh compare baseline.json current.json [threshold_percent]
+MICRO=${MICRO:-./micro}
+SIMULATE=${SIMULATE:-./simulate}
+SERVER=${SERVER:-./server}
+LOADGEN=${LOADGEN:-./loadgen}
+GAMES=${GAMES:-10000}
+LEVELS=${LEVELS:-"1 50 500"}
+PORT=${PORT:-15992}
+SOCK=${SOCK:-/tmp/ttts-bench-suite.sock}
+
+run() {
+    out=${1:-/dev/stdout}
+    results=$(mktemp)
+    status=0
+    $MICRO -j >> $results || status=1
+    $SIMULATE -J -j 1 -n 5000000 >> $results || status=1
+    $SIMULATE -J -j 1 -n 5000000 -x perfect -o greedy >> $results || status=1
+
+    $SERVER -u $SOCK $PORT > /dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    for level in $LEVELS; do
+        $LOADGEN -j -n $GAMES -c $level 127.0.0.1 $PORT >> $results || status=1
+    done
+    $LOADGEN -j -n $GAMES -c 50 -u $SOCK >> $results || status=1
+    $LOADGEN -j -n $GAMES -c 50 -r 20 127.0.0.1 $PORT >> $results || status=1
+    kill -INT $pid
+    wait $pid
+
+    {
+        printf '{\n  "commit": "%s",\n' "$(git rev-parse --short HEAD 2> /dev/null)"
+        printf '  "date": "%s",\n' "$(date -u +%Y-%m-%dT%H:%M:%SZ)"
+        printf '  "host": "%s",\n' "$(uname -n)"
+        printf '  "results": [\n'
+        # One result per line; separators are redone since each tool ends its own list
+        sed -e 's/},$/}/' -e '$!s/$/,/' -e 's/^/    /' $results
+        printf '  ]\n}\n'
+    } > $out
+    rm -f $results
+    return $status
+}
+
+# Prints each result next to its baseline and exits with 1 if any moved the
+# wrong way by more than the threshold
+compare() {
+    awk -F'"' -v threshold=${3:-10} '
+    /"name":/ {
+        value = $11
+        gsub(/[:, ]/, "", value)
+        if (FILENAME == ARGV[1]) {
+            base[$4] = value
+            next
+        }
+        if (!($4 in base)) {
+            printf "%-44s %12s %12s %9s  new\n", $4, "-", value, "-"
+            next
+        }
+        b = base[$4]
+        change = b != 0 ? (value - b) / b * 100 : (value != 0 ? 100 : 0)
+        worse = $14 == "lower" ? change > threshold : -change > threshold
+        if (worse)
+            regressions++
+        printf "%-44s %12s %12s %+8.1f%%  %s\n", $4, b, value, change, worse ? "REGRESSION" : "ok"
+    }
+    END {
+        printf "%d regression(s) beyond %s%%\n", regressions, threshold
+        exit regressions > 0
+    }' "$1" "$2"
+}
+
+case $1 in
+run)
+    run "$2"
+    ;;
+compare)
+    [ $# -ge 3 ] || { echo "Usage: $0 compare baseline.json current.json [threshold_percent]" >&2; exit 2; }
+    compare "$2" "$3" "$4"
+    ;;
+*)
+    echo "Usage: $0 run [output.json]" >&2
+    echo "       $0 compare baseline.json current.json [threshold_percent]" >&2
+    exit 2
+    ;;
+esac
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Runs a cluster on this machine: a coordinator and several game servers on
+# consecutive ports, then one load generator spreading its players over all
+# of them, so most games pair players from two different servers. Prints the
+# load generator's results, how many players each server relayed to another
+# and hosted from another, and the coordinator's counts. With several games
+# per connection, keep games a multiple of it, so the players the
+# coordinator pairs always have the same number of games left.
+#
+# Usage: bench/cluster.sh [games] [concurrent_games] [nodes] [games_per_connection]
+SERVER=${SERVER:-./server}
+COORDINATOR=${COORDINATOR:-./coordinator}
+LOADGEN=${LOADGEN:-./loadgen}
+GAMES=${1:-5000}
+CONCURRENCY=${2:-50}
+NODES=${3:-3}
+PER_CONNECTION=${4:-1}
+BACKEND=${BACKEND:-epoll}
+COORDINATOR_PORT=${COORDINATOR_PORT:-15990}
+PORT=${PORT:-15991}
+LOG_DIR=${LOG_DIR:-build/cluster}
+
+mkdir -p $LOG_DIR
+rm -f $LOG_DIR/*.log
+$COORDINATOR -b $BACKEND $COORDINATOR_PORT > $LOG_DIR/coordinator.log 2>&1 &
+coordinator=$!
+sleep 0.3
+servers= ports=
+for i in $(seq 0 $((NODES - 1))); do
+    port=$((PORT + i))
+    $SERVER -b $BACKEND -C localhost:$COORDINATOR_PORT $port > $LOG_DIR/server$i.log 2>&1 &
+    servers="$servers $!"
+    ports="$ports $port"
+done
+sleep 0.5
+$LOADGEN -n $GAMES -c $CONCURRENCY -r $PER_CONNECTION 127.0.0.1 $ports | grep -E "games/sec|p50|p99|errors"
+kill -INT $servers
+wait $servers
+kill -INT $coordinator
+wait $coordinator
+grep -h "^Cluster" $LOG_DIR/server*.log
+grep -h "^coordinator" $LOG_DIR/coordinator.log
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Runs the same load against each event loop backend and transport, then
+# prints throughput from the load generator and syscalls per game from the
+# server's shutdown report.
+#
+# Usage: bench/compare_backends.sh [games] [concurrent_games]
+SERVER=${SERVER:-./server}
+LOADGEN=${LOADGEN:-./loadgen}
+GAMES=${1:-20000}
+CONCURRENCY=${2:-50}
+PORT=${PORT:-15990}
+SOCK=${SOCK:-/tmp/ttts-bench.sock}
+
+for backend in epoll uring; do
+    log=$(mktemp)
+    $SERVER -b $backend -u $SOCK $PORT > $log 2>&1 &
+    pid=$!
+    sleep 0.5
+    for transport in tcp unix; do
+        if [ $transport = unix ]; then
+            target="-u $SOCK"
+        else
+            target="127.0.0.1 $PORT"
+        fi
+        echo "== $backend / $transport"
+        $LOADGEN -n $GAMES -c $CONCURRENCY $target | grep -E "games/sec|p50|p99|errors"
+    done
+    kill -INT $pid
+    wait $pid
+    grep -E "syscalls|falling back" $log
+    rm -f $log
+done
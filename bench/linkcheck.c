@@ -0,0 +1,162 @@
+// Checks that io_send_pair() really hard links the two writes on io_uring:
+// the loop is built into this program so the submission ring can be read
+// before the kernel sees it. Each case queues a pair the way the server does,
+// with either player already holding output or with the ring one entry short
+// of full, ends the pass, and looks at the sends it left in the ring, then
+// lets them go out and reads both copies.
+//
+// Usage: linkcheck
+#include "../ioloop.c"
+
+#define PAIR_MESSAGE "MOVD|16|X|2,2|....X....|\n"
+
+static void ignore_accept(io_loop *loop, int fd, int listener, struct sockaddr *addr, socklen_t addr_len)
+{
+}
+
+static void ignore_conn(io_loop *loop, io_conn *c)
+{
+}
+
+/*
+Returns the next submission entry the loop queued and the kernel has not
+taken, or NULL if there are none left.
+*/
+static struct io_uring_sqe *next_queued(io_loop *loop, unsigned *head)
+{
+    if (*head == loop->sqe_tail)
+        return NULL;
+    return &loop->sqes[loop->sq_array[(*head)++ & *loop->sq_mask]];
+}
+
+static io_conn *send_target(struct io_uring_sqe *sqe)
+{
+    return (io_conn *)(uintptr_t)(sqe->user_data & ~(uint64_t)OP_MASK);
+}
+
+/*
+Reads what reached the far end of a connection, expecting the pair's message
+after whatever was sent to it before.
+*/
+static int received_copy(int fd, const char *before)
+{
+    char buf[256], want[256];
+    int want_len = snprintf(want, sizeof(want), "%s%s", before, PAIR_MESSAGE), got = 0;
+    while (got < want_len)
+    {
+        int n = read(fd, buf + got, sizeof(buf) - got);
+        if (n <= 0)
+            return 0;
+        got += n;
+    }
+    return got == want_len && memcmp(buf, want, want_len) == 0;
+}
+
+/*
+Sends a pair after first_alone is sent to one side on its own, as when a
+player gets a reply just before the move both players see. With crowded, the
+ring is filled with no-ops up to one free entry first, so the two sends only
+fit once the no-ops are submitted. Returns the number of failures.
+*/
+static int check_pair(io_loop *loop, int first_alone, int crowded)
+{
+    static const char *names[] = {"neither sent alone", "first sent alone", "second sent alone"};
+    const char *name = crowded ? "ring nearly full" : names[first_alone];
+    io_conn *conns[2];
+    int far[2], failures = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        int fds[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        conns[i] = aligned_alloc(64, sizeof(io_conn));
+        io_add(loop, conns[i], fds[0]);
+        far[i] = fds[1];
+    }
+    // Submits the receives, so only the sends are left in the ring
+    io_run_once(loop, 0);
+
+    const char *before[2] = {"", ""};
+    if (first_alone)
+    {
+        before[first_alone - 1] = "WAIT|0|\n";
+        io_send(loop, conns[first_alone - 1], before[first_alone - 1], strlen(before[first_alone - 1]));
+    }
+    // No-ops complete with no connection to hand them to, and are ignored
+    while (crowded && loop->sq_entries - (loop->sqe_tail - *loop->sq_head) > 1)
+        uring_get_sqe(loop);
+    io_send_pair(loop, conns[0], conns[1], PAIR_MESSAGE, strlen(PAIR_MESSAGE));
+    end_pass(loop);
+
+    unsigned head = *loop->sq_head;
+    struct io_uring_sqe *lead = next_queued(loop, &head), *linked = next_queued(loop, &head);
+    if (lead == NULL || linked == NULL || next_queued(loop, &head) != NULL)
+    {
+        printf("FAIL %s: expected exactly two sends queued\n", name);
+        failures++;
+    }
+    else
+    {
+        if (lead->opcode != IORING_OP_SEND || linked->opcode != IORING_OP_SEND ||
+            send_target(lead) == send_target(linked))
+        {
+            printf("FAIL %s: the two sends are not one to each player\n", name);
+            failures++;
+        }
+        if (!(lead->flags & IOSQE_IO_HARDLINK))
+        {
+            printf("FAIL %s: the first send is not hard linked\n", name);
+            failures++;
+        }
+        if (linked->flags & (IOSQE_IO_HARDLINK | IOSQE_IO_LINK))
+        {
+            printf("FAIL %s: the link runs past the pair\n", name);
+            failures++;
+        }
+    }
+
+    // Lets the sends go out, then checks both players got the message
+    io_run_once(loop, 0);
+    for (int i = 0; i < 2; i++)
+        if (!received_copy(far[i], before[i]))
+        {
+            printf("FAIL %s: player %d did not get its copy\n", name, i + 1);
+            failures++;
+        }
+    if (failures == 0)
+        printf("ok   %s: linked pair of sends\n", name);
+
+    for (int i = 0; i < 2; i++)
+    {
+        io_close(loop, conns[i]);
+        close(far[i]);
+    }
+    // Closing waits for the receives to be cancelled
+    for (int pass = 0; pass < 4; pass++)
+        io_run_once(loop, 10);
+    return failures;
+}
+
+static void free_conn(io_loop *loop, io_conn *c)
+{
+    free(c);
+}
+
+int main(void)
+{
+    io_callbacks callbacks = {ignore_accept, ignore_conn, ignore_conn, free_conn};
+    io_loop *loop = io_loop_create("uring", &callbacks);
+    if (loop == NULL)
+        return EXIT_FAILURE;
+    if (strcmp(io_loop_backend(loop), "uring") != 0)
+    {
+        printf("skipped: io_uring is not available\n");
+        io_loop_destroy(loop);
+        return EXIT_SUCCESS;
+    }
+    int failures = 0;
+    for (int first_alone = 0; first_alone < 3; first_alone++)
+        failures += check_pair(loop, first_alone, 0);
+    failures += check_pair(loop, 0, 1);
+    io_loop_destroy(loop);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
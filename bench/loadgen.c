@@ -0,0 +1,669 @@
+// Load generator for ttts: plays many scripted games at once and reports
+// games/sec and MOVE->MOVD latency. Works over TCP or a unix domain socket
+// so the two transports can be compared with the same workload. With -r, each
+// pair of connections plays several games in a row through REMT. With -t the
+// games are played over TLS, resuming the last session for each new
+// connection; -T makes every connection do a full handshake. With -w each
+// player talks to the server as a browser would, over WebSocket, and over
+// secure WebSocket together with -t or -T. Given several ports, players
+// take turns connecting to each, so the two players of a game usually land
+// on different servers of a cluster. With -E every player enters the named
+// tournament instead, all at once, and plays whatever games it is paired in
+// until the server sends its place; -n is then the number of entrants. A
+// player the server turns away with BUSY asks again once the server says to,
+// on the same connection, or on a new one if the server closed it for having
+// too many. With -j the results are printed as
+// JSON for bench/bench.sh.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include "../affinity.h"
+#include "../tls.h"
+
+#define BUFLEN 256
+#define MAX_CONCURRENCY 8192 // Games, so a tournament can have twice as many entrants
+
+/*
+Moves played by each side. X takes the top row on its third move.
+*/
+static const char *x_moves[] = {"1,1", "2,1", "3,1"};
+static const char *o_moves[] = {"1,2", "2,2"};
+
+/*
+Stores data about one simulated player
+*/
+typedef struct player
+{
+    int fd;
+    tls_session *tls;    // Set when playing over TLS
+    char frames[BUFLEN * 4]; // WebSocket frames received but not yet unwrapped
+    int frames_len;
+    char role;           // X or O once BEGN arrives
+    int next_move;       // Index into this role's move list
+    double sent_at;      // Time the last MOVE was written
+    int games_left;      // Games still to play on this connection
+    double retry_at;     // When to ask to play again after BUSY, 0 if not waiting to
+    char buf[BUFLEN * 4]; // Bytes received but not yet split into lines
+    int buf_len;
+} player;
+
+static char *host, **services, *unix_path;
+static int num_services = 1, next_service = 0;
+static int total_games = 1000, concurrency = 50, games_per_connection = 1, json = 0;
+static int use_tls = 0, tls_resume = 1, handshakes = 0, resumed = 0, use_ws = 0;
+static char *event_name = NULL;
+static int placed = 0;
+
+static player players[MAX_CONCURRENCY * 2];
+static struct pollfd fds[MAX_CONCURRENCY * 2];
+static int num_open = 0, started = 0, finished = 0, errors = 0, name_counter = 0;
+
+static double *latencies;
+static int num_latencies = 0, max_latencies = 0;
+
+// Players turned away, waiting to connect again
+static double retry_at[MAX_CONCURRENCY * 2];
+static int retry_games[MAX_CONCURRENCY * 2];
+static int num_retries = 0, busy = 0;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_inet(char *host, char *service)
+{
+    struct addrinfo hints, *info_list, *info;
+    int sock = -1, error;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    error = getaddrinfo(host, service, &hints, &info_list);
+    if (error)
+    {
+        fprintf(stderr, "error looking up %s:%s: %s\n", host, service, gai_strerror(error));
+        return -1;
+    }
+    for (info = info_list; info != NULL; info = info->ai_next)
+    {
+        sock = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        if (sock < 0)
+            continue;
+        if (connect(sock, info->ai_addr, info->ai_addrlen) == 0)
+        {
+            int one = 1;
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            break;
+        }
+        close(sock);
+    }
+    freeaddrinfo(info_list);
+    return info == NULL ? -1 : sock;
+}
+
+static int connect_unix(char *path)
+{
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static int transport_write(player *p, const char *buf, int len)
+{
+    return p->tls ? tls_write(p->tls, buf, len) : write(p->fd, buf, len);
+}
+
+static int transport_read(player *p, char *buf, int len)
+{
+    return p->tls ? tls_read(p->tls, buf, len) : read(p->fd, buf, len);
+}
+
+/*
+Sends a message, over WebSocket as one masked text frame without its newline,
+the way a browser sends it.
+*/
+static void send_msg(player *p, const char *msg)
+{
+    char frame[BUFLEN + 6];
+    int len = strlen(msg);
+    if (use_ws)
+    {
+        if (len > 0 && msg[len - 1] == '\n')
+            len--;
+        unsigned mask = rand();
+        frame[0] = (char)0x81; // A whole text message
+        frame[1] = (char)(0x80 | len);
+        memcpy(frame + 2, &mask, 4);
+        for (int i = 0; i < len; i++)
+            frame[6 + i] = msg[i] ^ frame[2 + (i & 3)];
+        msg = frame;
+        len += 6;
+    }
+    if (transport_write(p, msg, len) != len)
+        errors++;
+}
+
+/*
+Asks the server to switch the connection to WebSocket and checks its answer
+against the example in RFC 6455. The socket blocks, so this waits for it.
+*/
+static int ws_upgrade(player *p)
+{
+    char request[256], reply[512];
+    int len = snprintf(request, sizeof(request),
+                       "GET /ttts HTTP/1.1\r\nHost: %s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                       "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n",
+                       host);
+    if (transport_write(p, request, len) != len)
+        return -1;
+    len = 0;
+    while (len < (int)sizeof(reply) - 1)
+    {
+        int bytes = transport_read(p, reply + len, sizeof(reply) - 1 - len);
+        if (bytes == TLS_WANT_READ) // A session ticket
+            continue;
+        if (bytes <= 0)
+            return -1;
+        len += bytes;
+        reply[len] = '\0';
+        if (strstr(reply, "\r\n\r\n") != NULL)
+            return strncmp(reply, "HTTP/1.1 101", 12) == 0 && strstr(reply, "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=") ? 0 : -1;
+    }
+    return -1;
+}
+
+/*
+Unwraps the server's complete frames into lines of input. Returns 1 once the
+server closed the WebSocket.
+*/
+static int ws_unwrap(player *p)
+{
+    unsigned char *f = (unsigned char *)p->frames;
+    int used = 0;
+    while (p->frames_len - used >= 2)
+    {
+        int header = 2, len = f[used + 1] & 0x7F;
+        if (len == 126)
+        {
+            if (p->frames_len - used < 4)
+                break;
+            len = f[used + 2] << 8 | f[used + 3];
+            header = 4;
+        }
+        if (p->frames_len - used < header + len)
+            break;
+        if ((f[used] & 0x0F) == 0x8)
+            return 1;
+        if (p->buf_len + len + 1 >= (int)sizeof(p->buf))
+            return 1;
+        memcpy(p->buf + p->buf_len, p->frames + used + header, len);
+        p->buf_len += len;
+        p->buf[p->buf_len++] = '\n';
+        used += header + len;
+    }
+    p->frames_len -= used;
+    memmove(p->frames, p->frames + used, p->frames_len);
+    return 0;
+}
+
+static void send_move(player *p)
+{
+    char msg[BUFLEN];
+    const char *pos = p->role == 'X' ? x_moves[p->next_move] : o_moves[p->next_move];
+    snprintf(msg, BUFLEN, "MOVE|6|%c|%s|\n", p->role, pos);
+    p->next_move++;
+    p->sent_at = now();
+    send_msg(p, msg);
+}
+
+static void record_latency(double seconds)
+{
+    if (num_latencies == max_latencies)
+    {
+        max_latencies = max_latencies ? max_latencies * 2 : 4096;
+        latencies = realloc(latencies, max_latencies * sizeof(double));
+    }
+    latencies[num_latencies++] = seconds;
+}
+
+/*
+Queues for a game, or enters the tournament, with a unique name.
+*/
+static void send_play(player *p)
+{
+    char msg[BUFLEN], name[64];
+    snprintf(name, sizeof(name), "lg%d_%d", (int)getpid(), name_counter++);
+    if (event_name != NULL)
+        snprintf(msg, BUFLEN, "TRNY|%d|%s|%s|\n", (int)(strlen(name) + strlen(event_name)) + 2, name, event_name);
+    else
+        snprintf(msg, BUFLEN, "PLAY|%d|%s|\n", (int)strlen(name) + 1, name);
+    send_msg(p, msg);
+}
+
+/*
+Opens a new connection and asks to play.
+*/
+static int open_player(int games)
+{
+    int fd;
+    if (unix_path != NULL)
+        fd = connect_unix(unix_path);
+    else
+    {
+        fd = connect_inet(host, services[next_service]);
+        next_service = (next_service + 1) % num_services;
+    }
+    if (fd < 0)
+    {
+        errors++;
+        return -1;
+    }
+    player *p = &players[num_open];
+    memset(p, 0, sizeof(player));
+    p->fd = fd;
+    if (use_tls)
+    {
+        // The socket blocks, so the handshake finishes or fails here
+        p->tls = tls_connect(fd);
+        if (p->tls == NULL || tls_handshake(p->tls))
+        {
+            if (p->tls != NULL)
+                tls_free(p->tls);
+            close(fd);
+            errors++;
+            return -1;
+        }
+        handshakes++;
+        resumed += tls_resumed(p->tls);
+    }
+    if (use_ws && ws_upgrade(p))
+    {
+        if (p->tls != NULL)
+            tls_free(p->tls);
+        close(fd);
+        errors++;
+        return -1;
+    }
+    p->games_left = games;
+    fds[num_open].fd = fd;
+    fds[num_open].events = POLLIN;
+    num_open++;
+    send_play(p);
+    return 0;
+}
+
+static void close_player(int i)
+{
+    if (players[i].tls != NULL)
+        tls_free(players[i].tls);
+    close(players[i].fd);
+    num_open--;
+    players[i] = players[num_open];
+    fds[i] = fds[num_open];
+}
+
+/*
+Reacts to one line from the server. Returns 1 when the connection is done.
+*/
+static int handle_line(player *p, char *line)
+{
+    if (strncmp(line, "WAIT|", 5) == 0 || strncmp(line, "REMT|", 5) == 0 || strncmp(line, "TOKN|", 5) == 0)
+        return 0;
+    if (strncmp(line, "BEGN|", 5) == 0)
+    {
+        char *role = strchr(line + 5, '|');
+        if (role == NULL)
+            return 1;
+        p->role = role[1];
+        if (p->role == 'X')
+            send_move(p);
+        return 0;
+    }
+    if (strncmp(line, "MOVD|", 5) == 0)
+    {
+        char mover = line[8];
+        if (mover == p->role)
+            record_latency(now() - p->sent_at);
+        else
+        {
+            int moves = p->role == 'X' ? 3 : 2;
+            if (p->next_move < moves)
+                send_move(p);
+        }
+        return 0;
+    }
+    if (strncmp(line, "BUSY|", 5) == 0)
+    {
+        char *retry = strchr(line + 5, '|');
+        double at = now() + (retry != NULL ? atoi(retry + 1) : 1000) / 1000.0;
+        busy++;
+        if (strstr(line, "Too many players.") == NULL)
+        {
+            p->retry_at = at;
+            return 0;
+        }
+        // The server closes the connection, so come back on a new one
+        if (num_retries < MAX_CONCURRENCY * 2)
+        {
+            retry_at[num_retries] = at;
+            retry_games[num_retries++] = p->games_left;
+        }
+        return 1;
+    }
+    if (strncmp(line, "INVL|34|Your opponent has left the table.|", 42) == 0)
+    {
+        // Turned away players came back in another order, so the two who
+        // began together ran out of games at different times
+        send_play(p);
+        return 0;
+    }
+    if (strncmp(line, "RANK|", 5) == 0 && event_name != NULL)
+    {
+        placed++;
+        return 1;
+    }
+    if (strncmp(line, "OVER|", 5) == 0)
+    {
+        finished++;
+        p->role = 0;
+        p->next_move = 0;
+        if (event_name != NULL) // The next round, or the place, comes on its own
+            return 0;
+        if (--p->games_left == 0)
+            return 1;
+        // Ask the same opponent for another game; roles swap when it begins
+        send_msg(p, "REMT|0|\n");
+        return 0;
+    }
+    fprintf(stderr, "unexpected: %s\n", line);
+    errors++;
+    return 1;
+}
+
+/*
+Reads whatever is available and handles every complete line.
+Returns 1 when the connection should be closed.
+*/
+static int handle_input(player *p)
+{
+    int bytes;
+    if (use_ws)
+        bytes = transport_read(p, p->frames + p->frames_len, sizeof(p->frames) - p->frames_len);
+    else
+        bytes = transport_read(p, p->buf + p->buf_len, sizeof(p->buf) - p->buf_len - 1);
+    if (bytes == TLS_WANT_READ) // Only a session ticket or part of a record
+        return 0;
+    if (bytes <= 0)
+        return 1;
+    if (!use_ws)
+        p->buf_len += bytes;
+    else
+    {
+        p->frames_len += bytes;
+        if (ws_unwrap(p))
+            return 1;
+    }
+    p->buf[p->buf_len] = '\0';
+
+    char *line = p->buf, *end;
+    while ((end = strchr(line, '\n')) != NULL)
+    {
+        *end = '\0';
+        if (handle_line(p, line))
+            return 1;
+        line = end + 1;
+    }
+    p->buf_len -= line - p->buf;
+    memmove(p->buf, line, p->buf_len);
+    return 0;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double p)
+{
+    if (num_latencies == 0)
+        return 0;
+    int idx = (int)(p * (num_latencies - 1));
+    return latencies[idx] * 1e6;
+}
+
+/*
+Asks again for the players turned away whose wait is over, connecting again
+those the server hung up on as far as concurrency allows.
+*/
+static void retry_players(void)
+{
+    double t = now();
+    for (int i = 0; i < num_open; i++)
+        if (players[i].retry_at != 0 && players[i].retry_at <= t)
+        {
+            players[i].retry_at = 0;
+            send_play(&players[i]);
+        }
+    for (int i = num_retries - 1; i >= 0 && num_open < concurrency * 2; i--)
+    {
+        if (retry_at[i] > t)
+            continue;
+        int games = retry_games[i];
+        num_retries--;
+        retry_at[i] = retry_at[num_retries];
+        retry_games[i] = retry_games[num_retries];
+        open_player(games);
+    }
+}
+
+/*
+Waits for input and handles it on every connection. Returns -1 if the
+server stops answering.
+*/
+static int pump(void)
+{
+    int timeout = 5000, waiting = num_retries;
+    double t = now(), next = t + 5;
+    for (int i = 0; i < num_retries; i++)
+        next = retry_at[i] < next ? retry_at[i] : next;
+    for (int i = 0; i < num_open; i++)
+        if (players[i].retry_at != 0)
+        {
+            next = players[i].retry_at < next ? players[i].retry_at : next;
+            waiting++;
+        }
+    if (waiting > 0)
+        timeout = next > t ? (int)((next - t) * 1000) + 1 : 0;
+    int ready = poll(fds, num_open, timeout);
+    if (ready < 0 || (ready == 0 && waiting == 0))
+    {
+        fprintf(stderr, "server stopped responding\n");
+        return -1;
+    }
+    for (int i = num_open - 1; i >= 0; i--)
+    {
+        int done = fds[i].revents && handle_input(&players[i]);
+        // A record can hold more than fits in the buffer at once
+        while (!done && players[i].tls != NULL && tls_buffered(players[i].tls) > 0)
+            done = handle_input(&players[i]);
+        if (done)
+            close_player(i);
+    }
+    return 0;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n games] [-c concurrent_games] [-r games_per_connection] [-a cpu] [-t|-T] [-w] [-j] [-E tournament] (-u socket_path | host port [port...])\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    signal(SIGPIPE, SIG_IGN); // A player turned away may find its connection closed
+    while ((opt = getopt(argc, argv, "n:c:r:a:tTwju:E:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            total_games = atoi(optarg);
+            break;
+        case 'c':
+            concurrency = atoi(optarg);
+            break;
+        case 'r':
+            games_per_connection = atoi(optarg);
+            break;
+        case 'a':
+            if (pin_to_cpu(atoi(optarg)) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 't':
+            use_tls = 1;
+            break;
+        case 'T':
+            use_tls = 1;
+            tls_resume = 0;
+            break;
+        case 'w':
+            use_ws = 1;
+            break;
+        case 'j':
+            json = 1;
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 'E':
+            event_name = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (unix_path == NULL)
+    {
+        if (argc - optind < 2)
+            usage(argv[0]);
+        host = argv[optind];
+        services = argv + optind + 1;
+        num_services = argc - optind - 1;
+    }
+    if (concurrency < 1 || concurrency > MAX_CONCURRENCY || total_games < 1 || games_per_connection < 1)
+        usage(argv[0]);
+    if (use_tls && (unix_path != NULL || tls_client_init(tls_resume)))
+        usage(argv[0]);
+    if (use_ws && unix_path != NULL)
+        usage(argv[0]);
+    if (event_name != NULL && total_games > MAX_CONCURRENCY * 2)
+        usage(argv[0]);
+
+    if (event_name != NULL)
+    {
+        // The clock starts with the first entrant and stops with the last place
+        double start = now();
+        for (int i = 0; i < total_games; i++)
+            if (open_player(0))
+                break;
+        while (num_open > 0 && pump() == 0)
+            ;
+        double elapsed = now() - start;
+        errors += total_games - placed;
+        qsort(latencies, num_latencies, sizeof(double), compare_double);
+        if (json)
+        {
+            printf("{\"name\": \"tournament_%d_seconds\", \"unit\": \"s\", \"value\": %.3f, \"better\": \"lower\"},\n", total_games, elapsed);
+            printf("{\"name\": \"tournament_%d_errors\", \"unit\": \"count\", \"value\": %d, \"better\": \"lower\"}\n", total_games, errors);
+        }
+        else
+        {
+            printf("entrants:     %d (%d placed)\n", total_games, placed);
+            printf("games:        %d\n", finished / 2);
+            printf("elapsed:      %.3f s\n", elapsed);
+            printf("games/sec:    %.1f\n", finished / 2 / elapsed);
+            printf("move p50:     %.1f us\n", percentile(0.50));
+            printf("move p99:     %.1f us\n", percentile(0.99));
+            printf("errors:       %d\n", errors);
+        }
+        free(latencies);
+        return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    double start = now();
+    while (finished < total_games * 2)
+    {
+        retry_players();
+        // Keep the requested number of games in flight, two players each
+        while (started < total_games && num_open + 2 <= concurrency * 2)
+        {
+            int games = total_games - started < games_per_connection ? total_games - started : games_per_connection;
+            if (open_player(games) || open_player(games))
+                break;
+            started += games;
+        }
+        // Turned away players can come back in another order, which can
+        // leave the last one owed games with no one left to play them
+        if (started == total_games && num_open == 1 && num_retries == 0 && players[0].role == 0 &&
+            players[0].retry_at == 0)
+            break;
+        if ((num_open == 0 && num_retries == 0) || pump())
+            break;
+    }
+    double elapsed = now() - start;
+
+    qsort(latencies, num_latencies, sizeof(double), compare_double);
+    const char *transport = unix_path ? "unix" : !use_tls ? "tcp" : tls_resume ? "tls" : "tlsfull";
+    if (use_ws)
+        transport = !use_tls ? "ws" : tls_resume ? "wss" : "wssfull";
+    if (json)
+    {
+        // Named after the workload, so runs at other settings are kept apart
+        char label[64];
+        snprintf(label, sizeof(label), "loadgen_%s_c%d_r%d", transport, concurrency, games_per_connection);
+        printf("{\"name\": \"%s_games_per_sec\", \"unit\": \"games/s\", \"value\": %.1f, \"better\": \"higher\"},\n", label, finished / 2 / elapsed);
+        printf("{\"name\": \"%s_move_p50\", \"unit\": \"us\", \"value\": %.1f, \"better\": \"lower\"},\n", label, percentile(0.50));
+        printf("{\"name\": \"%s_move_p99\", \"unit\": \"us\", \"value\": %.1f, \"better\": \"lower\"},\n", label, percentile(0.99));
+        printf("{\"name\": \"%s_errors\", \"unit\": \"count\", \"value\": %d, \"better\": \"lower\"}\n", label, errors);
+        free(latencies);
+        return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    printf("transport:    %s\n", transport);
+    printf("games:        %d\n", finished / 2);
+    printf("elapsed:      %.3f s\n", elapsed);
+    printf("games/sec:    %.1f\n", finished / 2 / elapsed);
+    printf("moves:        %d\n", num_latencies);
+    printf("move p50:     %.1f us\n", percentile(0.50));
+    printf("move p99:     %.1f us\n", percentile(0.99));
+    if (use_tls)
+        printf("handshakes:   %d (%d resumed)\n", handshakes, resumed);
+    if (busy)
+        printf("busy:         %d (asked again)\n", busy);
+    printf("errors:       %d\n", errors);
+    free(latencies);
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,396 @@
+// Microbenchmarks for the server's hot paths: parse(), checkWinner(),
+// add_username(), create_game(), finding games by handle and whole moves
+// through process_player_move() across more games than fit in cache, paging
+// through and opening rooms in a lobby of 100k rooms, and handing work to the
+// event loop from another thread through its mailbox.
+// The server is built into this program with its main() renamed, so the
+// functions measured are the ones it runs. Each benchmark is timed several
+// times and the fastest run is kept, since anything slower was disturbed by
+// something else on the machine.
+//
+// Usage: micro [-j] [-t milliseconds_per_run] [benchmark...]
+#define main ttts_main
+#include "../ttts.c"
+#undef main
+
+#include <time.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+
+#define RUNS 5
+#define REGISTERED_NAMES 1000 // Names already taken when add_username() runs
+#define MOVE_GAMES 10000      // Games the move benchmark cycles through
+#define LOBBY_ROOMS 100000    // Public rooms opened before the lobby benchmarks
+
+static volatile long sink; // Keeps results alive so the compiler cannot drop the work
+static int run_ms = 200;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench_parse_move(long n)
+{
+    for (long i = 0; i < n; i++)
+        sink += parse("MOVE|6|X|2,2|").type;
+}
+
+static void bench_parse_play(long n)
+{
+    for (long i = 0; i < n; i++)
+        sink += parse("PLAY|5|DORK|").type;
+}
+
+static void bench_parse_bad(long n)
+{
+    for (long i = 0; i < n; i++)
+        sink += parse("MOVE|9|X|2,2|").type;
+}
+
+/*
+A mix of boards from every stage of a game, with and without a winner
+*/
+static client_pair_t boards[8];
+
+static void setup_boards(void)
+{
+    static const char *layouts[] = {
+        ".........", "X...O....", "XO.XO....", "XOXOXO...",
+        "XXXOO....", "OXXXOXXXO", "XOXXOOOXX", "X.O.XO..X"};
+    for (int i = 0; i < 8; i++)
+        memcpy(boards[i].board, layouts[i], 10);
+}
+
+static void bench_check_winner(long n)
+{
+    for (long i = 0; i < n; i++)
+        sink += checkWinner(&boards[i & 7]);
+}
+
+static void setup_names(void)
+{
+    char name[32];
+    for (int i = 0; i < REGISTERED_NAMES; i++)
+    {
+        snprintf(name, sizeof(name), "player%d", i);
+        add_username(name);
+    }
+}
+
+static void bench_add_username(long n)
+{
+    for (long i = 0; i < n; i++)
+    {
+        // A name that is not taken, the common case
+        sink += add_username("newcomer");
+        remove_username("newcomer");
+    }
+}
+
+static void bench_add_username_taken(long n)
+{
+    for (long i = 0; i < n; i++)
+        sink += add_username("player500");
+}
+
+static struct connection_data players[2];
+
+static void bench_create_game(long n)
+{
+    for (long i = 0; i < n; i++)
+    {
+        add_client(&players[0]);
+        add_client(&players[1]);
+        client_pair_t *pair = create_game();
+        sink += pair->currentTurn;
+        leave_table(&players[0]);
+        leave_table(&players[1]);
+    }
+}
+
+/*
+A lobby of LOBBY_ROOMS public rooms, one in ten of them closed again, so some
+pages continue from a room that is gone.
+*/
+static void setup_rooms(void)
+{
+    char name[ROOM_NAME_SIZE];
+    for (int i = 0; i < LOBBY_ROOMS; i++)
+    {
+        snprintf(name, sizeof(name), "room%d", i);
+        room *r = lobby_create(name, "", NULL);
+        if (i % 10 == 5)
+            lobby_cancel(r);
+    }
+}
+
+/*
+Lists one page continuing from rooms scattered across the lobby, as clients
+paging through it from different places would.
+*/
+static void bench_lobby_list_100k(long n)
+{
+    static long next = 0;
+    char names[BUFSIZE / 2];
+    unsigned long last;
+    for (long i = 0; i < n; i++, next++)
+        sink += lobby_list(next * 7919 % LOBBY_ROOMS, names, sizeof(names), &last);
+}
+
+static void bench_lobby_open_close_100k(long n)
+{
+    for (long i = 0; i < n; i++)
+    {
+        room *r = lobby_create("newroom", "", NULL);
+        sink += r->levels;
+        lobby_cancel(r);
+    }
+}
+
+/*
+Games played in memory: output is queued on connections that are never
+flushed, and each game restarts once it is won.
+*/
+static client_pair_t *games[MOVE_GAMES];
+static game_handle handles[MOVE_GAMES];
+static const char *move_script[] = {"MOVE|6|X|1,1|", "MOVE|6|O|1,2|", "MOVE|6|X|2,1|", "MOVE|6|O|2,2|", "MOVE|6|X|3,1|"};
+
+static struct connection_data *new_player(const char *name)
+{
+    struct connection_data *con = aligned_alloc(64, sizeof(struct connection_data));
+    memset(con, 0, sizeof(struct connection_data));
+    con->io.fd = -1;
+    con->state = CONN_PLAYING;
+    snprintf(con->name, sizeof(con->name), "%s", name);
+    return con;
+}
+
+static void setup_games(void)
+{
+    static io_callbacks callbacks = {on_accept, on_read, on_hangup, on_release};
+    char name[32];
+    loop = io_loop_create("epoll", &callbacks);
+    for (int i = 0; i < MOVE_GAMES; i++)
+    {
+        snprintf(name, sizeof(name), "x%d", i);
+        struct connection_data *x = new_player(name);
+        snprintf(name, sizeof(name), "o%d", i);
+        games[i] = create_pair(x, new_player(name));
+        handles[i] = x->game;
+    }
+}
+
+/*
+Finds games by handle in a scattered order, as players' messages arrive.
+*/
+static void bench_game_lookup_10k(long n)
+{
+    static long next = 0;
+    for (long i = 0; i < n; i++, next++)
+    {
+        client_pair_t *pair = game_get(handles[next * 7919 % MOVE_GAMES]);
+        sink += pair->moves;
+    }
+}
+
+static void bench_move_10k_games(long n)
+{
+    // The server prints each board; keep that cost but not the output
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO), devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+
+    static long next = 0;
+    for (long i = 0; i < n; i++, next++)
+    {
+        client_pair_t *pair = games[next % MOVE_GAMES];
+        int move = pair->moves;
+        if (pair->clients[0]->state == CONN_FINISHED)
+        {
+            initializeNewGame(pair);
+            for (int j = 0; j < 2; j++)
+            {
+                pair->clients[j]->state = CONN_PLAYING;
+                pair->clients[j]->io.out_len = 0;
+            }
+            move = 0;
+        }
+        sink += process_player_move(pair, move & 1, (char *)move_script[move]);
+    }
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    close(devnull);
+}
+
+/*
+A second event loop on its own thread, standing in for the server's, and a
+task that counts how often it ran there.
+*/
+static io_loop *mailbox_loop;
+static io_task counted_task;
+static long tasks_run;
+static int mailbox_open = 1;
+
+static void count_task(io_loop *loop, void *arg)
+{
+    __atomic_fetch_add(&tasks_run, 1, __ATOMIC_RELEASE);
+}
+
+static void *mailbox_thread(void *arg)
+{
+    while (__atomic_load_n(&mailbox_open, __ATOMIC_ACQUIRE))
+        io_run_once(mailbox_loop, -1);
+    return NULL;
+}
+
+static pthread_t setup_mailbox(void)
+{
+    static io_callbacks callbacks = {on_accept, on_read, on_hangup, on_release};
+    pthread_t thread;
+    mailbox_loop = io_loop_create("epoll", &callbacks);
+    counted_task.run = count_task;
+    pthread_create(&thread, NULL, mailbox_thread, NULL);
+    return thread;
+}
+
+static void stop_mailbox(pthread_t thread)
+{
+    __atomic_store_n(&mailbox_open, 0, __ATOMIC_RELEASE);
+    io_post(mailbox_loop, &counted_task);
+    pthread_join(thread, NULL);
+    io_loop_destroy(mailbox_loop);
+}
+
+/*
+Posts a task and waits for the loop to run it: one wakeup of a sleeping loop
+and one handoff each time.
+*/
+static void bench_mailbox_handoff(long n)
+{
+    for (long i = 0; i < n; i++)
+    {
+        long before = __atomic_load_n(&tasks_run, __ATOMIC_ACQUIRE);
+        io_post(mailbox_loop, &counted_task);
+        while (__atomic_load_n(&tasks_run, __ATOMIC_ACQUIRE) == before)
+            sched_yield();
+    }
+}
+
+typedef struct benchmark
+{
+    const char *name;
+    void (*run)(long n);
+} benchmark;
+
+static const benchmark benchmarks[] = {
+    {"parse_move", bench_parse_move},
+    {"parse_play", bench_parse_play},
+    {"parse_bad_length", bench_parse_bad},
+    {"check_winner", bench_check_winner},
+    {"add_username_1000", bench_add_username},
+    {"add_username_taken_1000", bench_add_username_taken},
+    {"create_game", bench_create_game},
+    {"move_10k_games", bench_move_10k_games},
+    {"game_lookup_10k", bench_game_lookup_10k},
+    {"lobby_list_100k", bench_lobby_list_100k},
+    {"lobby_open_close_100k", bench_lobby_open_close_100k},
+    {"mailbox_handoff", bench_mailbox_handoff},
+};
+
+#define NUM_BENCHMARKS (int)(sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+/*
+Returns the fastest time per call over RUNS runs of about run_ms each.
+*/
+static double measure(const benchmark *b)
+{
+    // Find an iteration count that takes about run_ms
+    long n = 1000;
+    while (1)
+    {
+        double start = now_ns();
+        b->run(n);
+        double elapsed = now_ns() - start;
+        if (elapsed > run_ms * 1e6 / 4 || n > (1L << 40))
+        {
+            n = (long)(n * (run_ms * 1e6 / elapsed)) + 1;
+            break;
+        }
+        n *= 4;
+    }
+    double best = 0;
+    for (int r = 0; r < RUNS; r++)
+    {
+        double start = now_ns();
+        b->run(n);
+        double per_op = (now_ns() - start) / n;
+        if (r == 0 || per_op < best)
+            best = per_op;
+    }
+    return best;
+}
+
+static int selected(const char *name, int argc, char **argv)
+{
+    if (optind == argc)
+        return 1;
+    for (int i = optind; i < argc; i++)
+        if (strcmp(argv[i], name) == 0)
+            return 1;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int json = 0, opt, first = 1;
+    while ((opt = getopt(argc, argv, "jt:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'j':
+            json = 1;
+            break;
+        case 't':
+            run_ms = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-j] [-t milliseconds_per_run] [benchmark...]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    setup_boards();
+    setup_names();
+    setup_games();
+    setup_rooms();
+    pthread_t mailbox = setup_mailbox();
+
+    for (int i = 0; i < NUM_BENCHMARKS; i++)
+    {
+        const benchmark *b = &benchmarks[i];
+        if (!selected(b->name, argc, argv))
+            continue;
+        double ns = measure(b);
+        if (json)
+        {
+            // One result per line, the same shape bench/bench.sh writes for
+            // the end to end results
+            printf("%s{\"name\": \"%s\", \"unit\": \"ns/op\", \"value\": %.2f, \"better\": \"lower\"}",
+                   first ? "" : ",\n", b->name, ns);
+            first = 0;
+        }
+        else
+            printf("%-26s %10.2f ns/op\n", b->name, ns);
+        fflush(stdout);
+    }
+    if (json && !first)
+        printf("\n");
+    stop_mailbox(mailbox);
+    free_unique_names();
+    return EXIT_SUCCESS;
+}
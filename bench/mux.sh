@@ -0,0 +1,40 @@
+#!/bin/sh
+# Compares playing over one connection per player with playing over a few
+# multiplexed connections (CHAN), at the same number of concurrent games.
+# For each it prints games/sec, move latency and the server's system calls
+# per game, which shows how much writing all of a connection's games at once
+# saves.
+#
+# Usage: bench/mux.sh [games] [concurrent_games]
+SERVER=${SERVER:-./server}
+LOADGEN=${LOADGEN:-./loadgen}
+MUXGEN=${MUXGEN:-./muxgen}
+GAMES=${1:-20000}
+CONCURRENCY=${2:-500}
+CARRIERS=${CARRIERS:-"1 4 16"} # Multiplexed connections to try
+PORT=${PORT:-15996}
+LOG=$(mktemp)
+
+ulimit -n "$(ulimit -Hn)"
+printf "%-18s %10s %10s %10s %14s\n" connections games/s p50_us p99_us syscalls/game
+run() {
+    label=$1
+    shift
+    $SERVER $PORT > $LOG 2>&1 &
+    server=$!
+    sleep 0.3
+    result=$("$@" 127.0.0.1 $PORT | awk '
+        /games\/sec/ { rate = $2 }
+        /move p50/ { p50 = $3 }
+        /move p99/ { p99 = $3 }
+        END { printf "%10s %10s %10s", rate, p50, p99 }')
+    kill -INT $server
+    wait $server
+    syscalls=$(sed -n 's/.*(\([0-9.]*\) per game).*/\1/p' $LOG)
+    printf "%-18s %s %14s\n" "$label" "$result" "$syscalls"
+}
+run "$((CONCURRENCY * 2)) (one each)" $LOADGEN -n $GAMES -c $CONCURRENCY
+for k in $CARRIERS; do
+    run "$k (multiplexed)" $MUXGEN -n $GAMES -c $CONCURRENCY -k $k
+done
+rm -f $LOG
@@ -0,0 +1,401 @@
+// Load generator for multiplexed connections: plays many scripted games at
+// once the way a bot operator would, over a few connections that each carry
+// many players on channels of their own (CHAN, section VIII of the README),
+// and reports games/sec and MOVE->MOVD latency like loadgen. Everything a
+// pass has to say on a connection goes out in one write. When a player's
+// game is over its channel is closed with QUIT and opened again for a new
+// player, until the games are all played.
+//
+// Usage: muxgen [-n games] [-c concurrent_games] [-k connections] [-j] (-u socket_path | host port)
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#define BUFLEN 256
+#define MAX_CONCURRENCY 32768
+#define MAX_CARRIERS 256
+#define CARRIER_BUF (1 << 16)
+
+/*
+Moves played by each side. X takes the top row on its third move.
+*/
+static const char *x_moves[] = {"1,1", "2,1", "3,1"};
+static const char *o_moves[] = {"1,2", "2,2"};
+
+/*
+One simulated player, on a channel of a carrier
+*/
+typedef struct player
+{
+    char role;       // X or O once BEGN arrives
+    int next_move;   // Index into this role's move list
+    double sent_at;  // Time the last MOVE was written
+} player;
+
+/*
+One connection and the players on it. Channel n is players[n - 1].
+*/
+typedef struct carrier
+{
+    int fd;
+    player *players;
+    int num_players;
+    char in[CARRIER_BUF]; // Bytes received but not yet split into lines
+    int in_len;
+    char *out;            // Messages for the server, written once a pass
+    int out_len, out_size;
+} carrier;
+
+static carrier carriers[MAX_CARRIERS];
+static struct pollfd fds[MAX_CARRIERS];
+static int num_carriers = 4, total_games = 10000, concurrency = 500, json = 0;
+static int started = 0, finished = 0, errors = 0, name_counter = 0;
+static char *host, *service, *unix_path;
+
+static double *latencies;
+static int num_latencies = 0, max_latencies = 0;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_server(void)
+{
+    if (unix_path != NULL)
+    {
+        struct sockaddr_un addr;
+        int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock < 0)
+            return -1;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, unix_path, sizeof(addr.sun_path) - 1);
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)))
+        {
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+    struct addrinfo hints, *info_list, *info;
+    int sock = -1;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, service, &hints, &info_list))
+        return -1;
+    for (info = info_list; info != NULL; info = info->ai_next)
+    {
+        sock = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        if (sock < 0)
+            continue;
+        if (connect(sock, info->ai_addr, info->ai_addrlen) == 0)
+        {
+            int one = 1;
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            break;
+        }
+        close(sock);
+    }
+    freeaddrinfo(info_list);
+    return info == NULL ? -1 : sock;
+}
+
+/*
+Queues a message for a channel, with the channel's number after the length,
+which counts it.
+*/
+static void send_on(carrier *c, int channel, const char *command, const char *fields)
+{
+    char id[8];
+    int id_len = snprintf(id, sizeof(id), "%d", channel);
+    if (c->out_len + BUFLEN > c->out_size)
+    {
+        errors++;
+        return;
+    }
+    c->out_len += snprintf(c->out + c->out_len, BUFLEN, "%s|%d|%s|%s\n", command, (int)strlen(fields) + id_len + 1,
+                           id, fields);
+}
+
+static void flush(carrier *c)
+{
+    int done = 0;
+    while (done < c->out_len)
+    {
+        int bytes = write(c->fd, c->out + done, c->out_len - done);
+        if (bytes <= 0)
+        {
+            errors++;
+            break;
+        }
+        done += bytes;
+    }
+    c->out_len = 0;
+}
+
+static void record_latency(double seconds)
+{
+    if (num_latencies == max_latencies)
+    {
+        max_latencies = max_latencies ? max_latencies * 2 : 4096;
+        latencies = realloc(latencies, max_latencies * sizeof(double));
+    }
+    latencies[num_latencies++] = seconds;
+}
+
+/*
+Puts a new player on a channel, if any games are left to start.
+*/
+static void send_play(carrier *c, int channel)
+{
+    char fields[64];
+    if (started >= total_games * 2)
+        return;
+    started++;
+    c->players[channel - 1].role = 0;
+    c->players[channel - 1].next_move = 0;
+    snprintf(fields, sizeof(fields), "mx%d_%d|", (int)getpid(), name_counter++);
+    send_on(c, channel, "PLAY", fields);
+}
+
+static void send_move(carrier *c, int channel)
+{
+    char fields[16];
+    player *p = &c->players[channel - 1];
+    snprintf(fields, sizeof(fields), "%c|%s|", p->role, p->role == 'X' ? x_moves[p->next_move] : o_moves[p->next_move]);
+    p->next_move++;
+    p->sent_at = now();
+    send_on(c, channel, "MOVE", fields);
+}
+
+/*
+Reacts to one line from the server, for the player on the channel it names.
+*/
+static void handle_line(carrier *c, char *line)
+{
+    char *length = strchr(line, '|');
+    char *id = length != NULL ? strchr(length + 1, '|') : NULL;
+    if (id == NULL)
+        goto unexpected;
+    int channel = atoi(id + 1);
+    char *fields = strchr(id + 1, '|');
+    if (channel < 1 || channel > c->num_players || fields == NULL)
+        goto unexpected;
+    fields++;
+    player *p = &c->players[channel - 1];
+
+    if (strncmp(line, "WAIT|", 5) == 0 || strncmp(line, "TOKN|", 5) == 0 || strncmp(line, "QUIT|", 5) == 0)
+        return;
+    if (strncmp(line, "BEGN|", 5) == 0)
+    {
+        p->role = fields[0];
+        if (p->role == 'X')
+            send_move(c, channel);
+        return;
+    }
+    if (strncmp(line, "MOVD|", 5) == 0)
+    {
+        if (fields[0] == p->role)
+            record_latency(now() - p->sent_at);
+        else if (p->next_move < (p->role == 'X' ? 3 : 2))
+            send_move(c, channel);
+        return;
+    }
+    if (strncmp(line, "OVER|", 5) == 0)
+    {
+        // The channel is free once it is closed, so the next player can use it
+        finished++;
+        send_on(c, channel, "QUIT", "");
+        send_play(c, channel);
+        return;
+    }
+unexpected:
+    fprintf(stderr, "unexpected: %s\n", line);
+    errors++;
+}
+
+/*
+Reads whatever is available and handles every complete line. Returns -1 once
+the server closes the connection.
+*/
+static int handle_input(carrier *c)
+{
+    int bytes = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len - 1);
+    if (bytes <= 0)
+        return -1;
+    c->in_len += bytes;
+    c->in[c->in_len] = '\0';
+    char *line = c->in, *end;
+    while ((end = strchr(line, '\n')) != NULL)
+    {
+        *end = '\0';
+        handle_line(c, line);
+        line = end + 1;
+    }
+    c->in_len -= line - c->in;
+    memmove(c->in, line, c->in_len);
+    return 0;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double p)
+{
+    if (num_latencies == 0)
+        return 0;
+    return latencies[(int)(p * (num_latencies - 1))] * 1e6;
+}
+
+/*
+Connects and asks for channels, spreading the players over the connections.
+*/
+static int open_carriers(void)
+{
+    char reply[16];
+    for (int i = 0; i < num_carriers; i++)
+    {
+        carrier *c = &carriers[i];
+        c->fd = connect_server();
+        if (c->fd < 0)
+            return -1;
+        if (write(c->fd, "CHAN|0|\n", 8) != 8 || read(c->fd, reply, 8) != 8 || strncmp(reply, "CHAN|0|\n", 8) != 0)
+            return -1;
+        c->num_players = concurrency * 2 / num_carriers + (i < concurrency * 2 % num_carriers);
+        c->players = calloc(c->num_players, sizeof(player));
+        // Room for a few messages for every player, in case all of them move at once
+        c->out_size = (c->num_players + 1) * BUFLEN;
+        c->out = malloc(c->out_size);
+        if (c->players == NULL || c->out == NULL)
+            return -1;
+        fds[i].fd = c->fd;
+        fds[i].events = POLLIN;
+    }
+    return 0;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n games] [-c concurrent_games] [-k connections] [-j] (-u socket_path | host port)\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    signal(SIGPIPE, SIG_IGN);
+    while ((opt = getopt(argc, argv, "n:c:k:ju:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            total_games = atoi(optarg);
+            break;
+        case 'c':
+            concurrency = atoi(optarg);
+            break;
+        case 'k':
+            num_carriers = atoi(optarg);
+            break;
+        case 'j':
+            json = 1;
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (unix_path == NULL)
+    {
+        if (argc - optind != 2)
+            usage(argv[0]);
+        host = argv[optind];
+        service = argv[optind + 1];
+    }
+    if (concurrency < 1 || concurrency > MAX_CONCURRENCY || total_games < 1 || num_carriers < 1 ||
+        num_carriers > MAX_CARRIERS || num_carriers > concurrency * 2)
+        usage(argv[0]);
+    if (open_carriers())
+    {
+        fprintf(stderr, "could not open %d multiplexed connections\n", num_carriers);
+        return EXIT_FAILURE;
+    }
+
+    double start = now();
+    for (int i = 0; i < num_carriers; i++)
+    {
+        for (int channel = 1; channel <= carriers[i].num_players; channel++)
+            send_play(&carriers[i], channel);
+        flush(&carriers[i]);
+    }
+    while (finished < total_games * 2)
+    {
+        int ready = poll(fds, num_carriers, 5000);
+        if (ready <= 0)
+        {
+            fprintf(stderr, "server stopped responding\n");
+            errors++;
+            break;
+        }
+        for (int i = 0; i < num_carriers; i++)
+            if (fds[i].revents && handle_input(&carriers[i]))
+            {
+                fprintf(stderr, "server closed a connection\n");
+                errors++;
+                finished = total_games * 2;
+            }
+        for (int i = 0; i < num_carriers; i++)
+            if (carriers[i].out_len > 0)
+                flush(&carriers[i]);
+    }
+    double elapsed = now() - start;
+
+    qsort(latencies, num_latencies, sizeof(double), compare_double);
+    if (json)
+    {
+        char label[64];
+        snprintf(label, sizeof(label), "muxgen_c%d_k%d", concurrency, num_carriers);
+        printf("{\"name\": \"%s_games_per_sec\", \"unit\": \"games/s\", \"value\": %.1f, \"better\": \"higher\"},\n", label, finished / 2 / elapsed);
+        printf("{\"name\": \"%s_move_p50\", \"unit\": \"us\", \"value\": %.1f, \"better\": \"lower\"},\n", label, percentile(0.50));
+        printf("{\"name\": \"%s_move_p99\", \"unit\": \"us\", \"value\": %.1f, \"better\": \"lower\"},\n", label, percentile(0.99));
+        printf("{\"name\": \"%s_errors\", \"unit\": \"count\", \"value\": %d, \"better\": \"lower\"}\n", label, errors);
+    }
+    else
+    {
+        printf("connections:  %d\n", num_carriers);
+        printf("games:        %d\n", finished / 2);
+        printf("elapsed:      %.3f s\n", elapsed);
+        printf("games/sec:    %.1f\n", finished / 2 / elapsed);
+        printf("moves:        %d\n", num_latencies);
+        printf("move p50:     %.1f us\n", percentile(0.50));
+        printf("move p99:     %.1f us\n", percentile(0.99));
+        printf("errors:       %d\n", errors);
+    }
+    for (int i = 0; i < num_carriers; i++)
+    {
+        close(carriers[i].fd);
+        free(carriers[i].players);
+        free(carriers[i].out);
+    }
+    free(latencies);
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
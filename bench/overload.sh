@@ -0,0 +1,39 @@
+#!/bin/sh
+# Shows what admission control does past saturation. loadgen offers more and
+# more concurrent games to a server with no limits and to one limited to
+# MAX_GAMES games in progress, and prints games/sec, move latency and how
+# many players were told BUSY at each level. Without a limit every game slows
+# down as more are offered; with one, the games that are let in keep the same
+# latency and the rest are asked to come back.
+#
+# Usage: bench/overload.sh [max_games] [games_per_level]
+SERVER=${SERVER:-./server}
+LOADGEN=${LOADGEN:-./loadgen}
+MAX_GAMES=${1:-50}
+GAMES=${2:-20000}
+LEVELS=${LEVELS:-"1 2 4 8 16"} # Multiples of max_games offered
+RETRY_MS=${RETRY_MS:-20}
+PORT=${PORT:-15994}
+
+ulimit -n "$(ulimit -Hn)"
+printf "%-10s %8s %10s %10s %10s %8s\n" limit offered games/s p50_us p99_us busy
+for limit in none $MAX_GAMES; do
+    if [ $limit = none ]; then
+        $SERVER $PORT > /dev/null 2>&1 &
+    else
+        $SERVER -G $limit -B $RETRY_MS $PORT > /dev/null 2>&1 &
+    fi
+    server=$!
+    sleep 0.3
+    for level in $LEVELS; do
+        offered=$((MAX_GAMES * level))
+        $LOADGEN -n $GAMES -c $offered 127.0.0.1 $PORT | awk -v limit=$limit -v offered=$offered '
+            /games\/sec/ { rate = $2 }
+            /move p50/ { p50 = $3 }
+            /move p99/ { p99 = $3 }
+            /busy/ { busy = $2 }
+            END { printf "%-10s %8d %10s %10s %10s %8d\n", limit, offered, rate, p50, p99, busy }'
+    done
+    kill -INT $server
+    wait $server
+done
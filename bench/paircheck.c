@@ -0,0 +1,188 @@
+// Checks spawn_pair_client(): bots on the far ends of socketpairs the loop
+// was handed play a whole game through the server, and a client that stops
+// reading while it floods the server with requests does not hold up anyone
+// else. The server is built into this program with its main() renamed, and
+// its event loop runs in a child process for each backend while a thread of
+// the child plays the bots.
+//
+// Usage: paircheck
+#define main ttts_main
+#include "../ttts.c"
+#undef main
+
+#include <poll.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#define REPLY_MS 2000 // How long a bot waits for each message from the server
+
+/*
+A request from the bots' thread for the loop to spawn a client
+*/
+typedef struct spawn_request
+{
+    io_task task;
+    int fd; // -2 until the loop has answered
+} spawn_request;
+
+static void run_spawn(io_loop *loop, void *arg)
+{
+    spawn_request *request = arg;
+    __atomic_store_n(&request->fd, spawn_pair_client(), __ATOMIC_RELEASE);
+}
+
+static int spawn_bot(void)
+{
+    spawn_request request = {{run_spawn, NULL, NULL, 0}, -2};
+    request.task.arg = &request;
+    io_post(loop, &request.task);
+    while (__atomic_load_n(&request.fd, __ATOMIC_ACQUIRE) == -2)
+        sched_yield();
+    return request.fd;
+}
+
+static void say(int fd, const char *msg)
+{
+    if (write(fd, msg, strlen(msg)) != (ssize_t)strlen(msg))
+        perror("write");
+}
+
+/*
+Reads messages until one starts with want. Returns 0 once it has, or -1 if
+the server goes quiet for REPLY_MS or closes the connection first.
+*/
+static int expect(int fd, const char *want)
+{
+    char line[BUFSIZE];
+    int len = 0;
+    for (;;)
+    {
+        struct pollfd p = {fd, POLLIN, 0};
+        if (poll(&p, 1, REPLY_MS) <= 0 || read(fd, line + len, 1) != 1)
+            return -1;
+        if (line[len] != '\n' && len < BUFSIZE - 2)
+        {
+            len++;
+            continue;
+        }
+        line[len] = '\0';
+        if (strncmp(line, want, strlen(want)) == 0)
+            return 0;
+        len = 0;
+    }
+}
+
+static int check(const char *what, int ok)
+{
+    fprintf(stderr, "%s %s: %s\n", ok ? "ok  " : "FAIL", io_loop_backend(loop), what);
+    return !ok;
+}
+
+/*
+Two bots queue for a game and X wins it along the top row, each move
+answered to both of them.
+*/
+static int check_game(void)
+{
+    static const char *moves[] = {"MOVE|6|X|1,1|\n", "MOVE|6|O|2,1|\n", "MOVE|6|X|1,2|\n",
+                                  "MOVE|6|O|2,2|\n", "MOVE|6|X|1,3|\n"};
+    int x = spawn_bot(), o = spawn_bot(), ok = x >= 0 && o >= 0;
+    if (ok)
+    {
+        say(x, "PLAY|6|XBOT1|\n");
+        ok = expect(x, "WAIT") == 0;
+        say(o, "PLAY|6|OBOT1|\n");
+        ok = ok && expect(x, "BEGN|8|X|OBOT1|") == 0 && expect(o, "BEGN|8|O|XBOT1|") == 0;
+        for (int m = 0; ok && m < 5; m++)
+        {
+            say(m % 2 ? o : x, moves[m]);
+            ok = expect(x, "MOVD") == 0 && expect(o, "MOVD") == 0;
+        }
+        ok = ok && expect(x, "OVER|") == 0 && expect(o, "OVER|") == 0;
+    }
+    close(x);
+    close(o);
+    return check("bots play a game over socketpairs", ok);
+}
+
+/*
+One bot sends LIST as fast as it can and never reads the answers. Once its
+end of the pair has filled up, another bot must still be answered at once;
+an epoll write to a blocking socket would wait for the flooder instead.
+*/
+static int check_stalled_reader(void)
+{
+    int flooder = spawn_bot(), bot = spawn_bot(), ok = flooder >= 0 && bot >= 0;
+    if (ok)
+    {
+        char requests[8 * 512];
+        for (int i = 0; i < 512; i++)
+            memcpy(requests + 8 * i, "LIST|0|\n", 8);
+        // Keeps sending for a second, whether the server takes the requests,
+        // holds them or closes the connection
+        double until = seconds_now() + 1;
+        while (seconds_now() < until)
+            if (send(flooder, requests, sizeof(requests), MSG_DONTWAIT) < 0)
+                sched_yield();
+        say(bot, "PLAY|6|XBOT2|\n");
+        ok = expect(bot, "WAIT") == 0;
+    }
+    close(flooder);
+    close(bot);
+    return check("a client that stops reading does not stall the loop", ok);
+}
+
+static void *play_bots(void *arg)
+{
+    int *failures = arg;
+    *failures = check_game() + check_stalled_reader();
+    io_post(loop, &shutdown_task);
+    return NULL;
+}
+
+/*
+Runs the server's event loop with the given backend, and the bots against it
+from a thread of their own. Returns the number of failures.
+*/
+static int run_backend(const char *backend)
+{
+    static io_callbacks callbacks = {on_accept, on_read, on_hangup, on_release};
+    int failures = 0;
+    pthread_t bots;
+    // The server's own messages are not the point here
+    if (freopen("/dev/null", "w", stdout) == NULL)
+        return 1;
+    signal(SIGPIPE, SIG_IGN);
+    grace_seconds = 0;
+    loop = io_loop_create(backend, &callbacks);
+    if (loop == NULL)
+        return 1;
+    if (strcmp(io_loop_backend(loop), backend) != 0)
+        fprintf(stderr, "skipped %s: not available\n", backend);
+    else
+    {
+        pthread_create(&bots, NULL, play_bots, &failures);
+        while (active && io_run_once(loop, -1) >= 0)
+            ;
+        pthread_join(bots, NULL);
+    }
+    io_loop_destroy(loop);
+    return failures;
+}
+
+int main(void)
+{
+    static const char *backends[] = {"epoll", "uring"};
+    int failures = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        int status;
+        fflush(stderr);
+        pid_t child = fork();
+        if (child == 0)
+            exit(run_backend(backends[i]) ? EXIT_FAILURE : EXIT_SUCCESS);
+        if (child < 0 || waitpid(child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failures++;
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
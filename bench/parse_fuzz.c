@@ -0,0 +1,477 @@
+// Fuzzing, differential and throughput harness for parse().
+//
+// Built with -DLIBFUZZER and clang -fsanitize=fuzzer, it is a libFuzzer target
+// that checks every input against the reference parser. Built normally, it is
+// a command line tool:
+//
+//   parse_fuzz corpus dir       write the seed corpus for libFuzzer or AFL
+//   parse_fuzz run [file...]    parse each line of the files (or stdin), so
+//                               afl-fuzz can drive it with "run @@"
+//   parse_fuzz spec             check the seeds against the README's cases
+//   parse_fuzz diff [-n N] [-s seed] [dir]
+//                               compare parse() with the reference over the
+//                               seeds, N mutations of them and the files in dir
+//   parse_fuzz bench [-n N] [-s seed] [-t seconds]
+//                               messages/sec for both parsers over that corpus
+//
+// Every mode aborts on a divergence, so fuzzers report it like a crash.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "../parse.h"
+
+#define MAX_INPUT 4096
+
+player_input parse_reference(char *unparsed_input);
+
+/*
+Messages from the README's test cases and the later protocol additions, with
+the command each must parse to.
+*/
+typedef struct seed
+{
+    const char *msg;
+    command_type expect;
+} seed;
+
+static const seed seeds[] = {
+    {"PLAY|5|DORK|", PLAY},
+    {"PLAY|7|DILLON|", PLAY},
+    {"MOVE|6|X|1,3|", MOVE},
+    {"MOVE|6|O|3,3|", MOVE},
+    {"MOVE|6|X|0,1|", INVALID},
+    {"DRAW|2|S|", SUGDRAW},
+    {"DRAW|2|A|", ACCDRAW},
+    {"DRAW|2|R|", REJDRAW},
+    {"DRAW|2|K|", INVALID},
+    {"RSGN|0|", RESIGN},
+    {"OVER|12|L|You Lose!|", INVALID},
+    {"WAIT|0|", INVALID},
+    {"CREA|9|DORK|den|", CREATE},
+    {"CREA|14|DORK|den|NERD|", CREATE},
+    {"JOIN|9|NERD|den|", JOIN},
+    {"LIST|0|", LIST},
+    {"LIST|4|den|", LIST},
+    {"REMT|0|", REMATCH},
+    {"RCON|17|3f9c0a51d2e47b86|", RECONNECT},
+    {"TRNY|10|DORK|open|", TOURNAMENT},
+    {"CHAN|0|", CHANNELS},
+    {"RANK|10|open|1|16|", INVALID},
+    {"BUSY|21|1000|Too many games.|", INVALID},
+    // Formatting errors, section III of the README
+    {"", BAD_COMMAND},
+    {"PLAY|5|", BAD_COMMAND},
+    {"HELO|5|DORK|", BAD_COMMAND},
+    {"PLAY|5|DOR|", BAD_COMMAND},
+    {"PLAY|9|DORK|", BAD_COMMAND},
+    {"MOVE|6|X|1,1|2|", BAD_COMMAND},
+    {"PLAY|5", BAD_COMMAND},
+    {"|PLAY|5|DORK|", BAD_COMMAND},
+};
+#define NUM_SEEDS (int)(sizeof(seeds) / sizeof(seeds[0]))
+
+static const char *command_names[] = {
+    "PLAY", "SUGDRAW", "ACCDRAW", "REJDRAW", "RESIGN", "MOVE", "CREATE", "JOIN",
+    "LIST", "REMATCH", "RECONNECT", "TOURNAMENT", "CHANNELS", "INVALID", "BAD_COMMAND"};
+
+static void print_escaped(FILE *out, const char *msg)
+{
+    for (; *msg; msg++)
+    {
+        if (*msg >= 32 && *msg < 127 && *msg != '\\')
+            fputc(*msg, out);
+        else
+            fprintf(out, "\\x%02x", (unsigned char)*msg);
+    }
+}
+
+/*
+Returns the name of the first field in which two parse results differ, or NULL.
+*/
+static const char *compare_inputs(const player_input *a, const player_input *b)
+{
+    if (a->type != b->type)
+        return "type";
+    if (strcmp(a->name, b->name) != 0)
+        return "name";
+    if (a->x_or_o != b->x_or_o)
+        return "x_or_o";
+    if (a->horizontal_pos != b->horizontal_pos || a->vertical_pos != b->vertical_pos)
+        return "position";
+    if (strcmp(a->client_response_msg, b->client_response_msg) != 0)
+        return "client_response_msg";
+    if (strcmp(a->room, b->room) != 0)
+        return "room";
+    if (strcmp(a->invitee, b->invitee) != 0)
+        return "invitee";
+    if (strcmp(a->token, b->token) != 0)
+        return "token";
+    return NULL;
+}
+
+/*
+Runs both parsers on one message and aborts if they disagree.
+*/
+static void check_message(const char *msg)
+{
+    char copy[MAX_INPUT];
+    snprintf(copy, sizeof(copy), "%s", msg);
+    player_input got = parse(copy);
+    snprintf(copy, sizeof(copy), "%s", msg);
+    player_input want = parse_reference(copy);
+
+    const char *field = compare_inputs(&got, &want);
+    if (field != NULL)
+    {
+        fprintf(stderr, "divergence in %s for \"", field);
+        print_escaped(stderr, msg);
+        fprintf(stderr, "\": parse() gave %s, reference gave %s\n",
+                command_names[got.type], command_names[want.type]);
+        abort();
+    }
+}
+
+#ifdef LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    char msg[MAX_INPUT];
+    if (size >= MAX_INPUT)
+        size = MAX_INPUT - 1;
+    memcpy(msg, data, size);
+    msg[size] = '\0'; // parse() sees everything up to the first NUL, as in the server
+    check_message(msg);
+    return 0;
+}
+
+#else
+
+static uint64_t rng_state;
+
+static uint64_t next_random(void)
+{
+    // xorshift64*, so a seed always produces the same corpus
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ull;
+}
+
+/*
+Writes a mutation of a random seed into out: replaced, inserted or deleted
+bytes, a repeated or dropped field, or two seeds spliced together.
+*/
+static void mutate(char *out, int out_size)
+{
+    static const char alphabet[] = "||||,,0123456789XOSAR.abc \t\n\x7f\xff";
+    char buf[MAX_INPUT];
+    int len = snprintf(buf, sizeof(buf), "%s", seeds[next_random() % NUM_SEEDS].msg);
+    int rounds = next_random() % 4 == 0 ? 2 + next_random() % 3 : 1;
+
+    for (int r = 0; r < rounds; r++)
+    {
+        int pos = len ? next_random() % (len + 1) : 0;
+        char c = alphabet[next_random() % (sizeof(alphabet) - 1)];
+        if (next_random() % 8 == 0)
+            c = 1 + next_random() % 255;
+        switch (next_random() % 6)
+        {
+        case 0: // replace
+            if (pos < len)
+                buf[pos] = c;
+            break;
+        case 1: // insert
+            if (len < MAX_INPUT - 2)
+            {
+                memmove(buf + pos + 1, buf + pos, len - pos + 1);
+                buf[pos] = c;
+                len++;
+            }
+            break;
+        case 2: // delete
+            if (pos < len)
+            {
+                memmove(buf + pos, buf + pos + 1, len - pos);
+                len--;
+            }
+            break;
+        case 3: // repeat the tail, which doubles fields and grows past BUFSIZE
+            if (len + (len - pos) < MAX_INPUT - 1)
+            {
+                memcpy(buf + len, buf + pos, len - pos);
+                len += len - pos;
+                buf[len] = '\0';
+            }
+            break;
+        case 4: // truncate
+            len = pos;
+            buf[len] = '\0';
+            break;
+        default: // splice another seed onto the front
+        {
+            const char *other = seeds[next_random() % NUM_SEEDS].msg;
+            int keep = strlen(other) ? next_random() % (strlen(other) + 1) : 0;
+            if (keep + (len - pos) < MAX_INPUT - 1)
+            {
+                memmove(buf + keep, buf + pos, len - pos + 1);
+                memcpy(buf, other, keep);
+                len = keep + (len - pos);
+            }
+        }
+        }
+    }
+    snprintf(out, out_size, "%s", buf);
+}
+
+/*
+Builds the corpus: the seeds, an overlong message, then count mutations.
+*/
+static char **build_corpus(int count, int *size)
+{
+    char **corpus = malloc((NUM_SEEDS + 1 + count) * sizeof(char *));
+    int n = 0;
+    for (int i = 0; i < NUM_SEEDS; i++)
+        corpus[n++] = strdup(seeds[i].msg);
+
+    char *long_msg = malloc(BUFSIZE + 64);
+    int len = snprintf(long_msg, BUFSIZE + 64, "PLAY|%d|", BUFSIZE + 20);
+    memset(long_msg + len, 'A', BUFSIZE + 19);
+    strcpy(long_msg + len + BUFSIZE + 19, "|");
+    corpus[n++] = long_msg;
+
+    for (int i = 0; i < count; i++)
+    {
+        char msg[MAX_INPUT];
+        mutate(msg, sizeof(msg));
+        corpus[n++] = strdup(msg);
+    }
+    *size = n;
+    return corpus;
+}
+
+/*
+Parses every line of a file, the way the server splits its input.
+*/
+static int run_file(FILE *in)
+{
+    char line[MAX_INPUT];
+    int count = 0;
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        check_message(line);
+        count++;
+    }
+    return count;
+}
+
+static int check_dir(const char *path)
+{
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    char file[4096];
+    int count = 0;
+    if (dir == NULL)
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+            continue;
+        snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+        FILE *in = fopen(file, "r");
+        if (in == NULL)
+            continue;
+        count += run_file(in);
+        fclose(in);
+    }
+    closedir(dir);
+    return count;
+}
+
+static int write_corpus(const char *path)
+{
+    char file[4096];
+    for (int i = 0; i < NUM_SEEDS; i++)
+    {
+        snprintf(file, sizeof(file), "%s/seed%02d", path, i);
+        FILE *out = fopen(file, "w");
+        if (out == NULL)
+        {
+            perror(file);
+            return EXIT_FAILURE;
+        }
+        fputs(seeds[i].msg, out);
+        fclose(out);
+    }
+    printf("wrote %d seeds to %s\n", NUM_SEEDS, path);
+    return EXIT_SUCCESS;
+}
+
+static int check_spec(void)
+{
+    int failures = 0;
+    for (int i = 0; i < NUM_SEEDS; i++)
+    {
+        char copy[MAX_INPUT];
+        snprintf(copy, sizeof(copy), "%s", seeds[i].msg);
+        player_input got = parse(copy);
+        if (got.type != seeds[i].expect)
+        {
+            printf("FAIL \"");
+            print_escaped(stdout, seeds[i].msg);
+            printf("\": expected %s, got %s\n", command_names[seeds[i].expect], command_names[got.type]);
+            failures++;
+        }
+        check_message(seeds[i].msg);
+    }
+    printf("%d of %d README cases parse as expected\n", NUM_SEEDS - failures, NUM_SEEDS);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+Parses the corpus over and over for at least the given time and returns
+messages per second.
+*/
+static double measure(player_input (*parser)(char *), char **corpus, int size, double seconds)
+{
+    char copy[MAX_INPUT];
+    volatile int sink = 0;
+    long messages = 0;
+    double start = now(), elapsed;
+    do
+    {
+        for (int i = 0; i < size; i++)
+        {
+            // The copy mirrors what on_read() does before it calls parse()
+            strcpy(copy, corpus[i]);
+            sink += parser(copy).type;
+        }
+        messages += size;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+    (void)sink;
+    return messages / elapsed;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s corpus dir\n"
+            "       %s run [file...]\n"
+            "       %s spec\n"
+            "       %s diff [-n mutations] [-s seed] [dir]\n"
+            "       %s bench [-n mutations] [-s seed] [-t seconds]\n",
+            prog, prog, prog, prog, prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    int mutations = 100000, opt;
+    double seconds = 1.0;
+    rng_state = 0x2545F4914F6CDD1Dull;
+
+    if (argc < 2)
+        usage(argv[0]);
+    char *mode = argv[1];
+    if (strcmp(mode, "corpus") == 0)
+    {
+        if (argc != 3)
+            usage(argv[0]);
+        return write_corpus(argv[2]);
+    }
+    if (strcmp(mode, "run") == 0)
+    {
+        int count = 0;
+        if (argc == 2)
+            count = run_file(stdin);
+        for (int i = 2; i < argc; i++)
+        {
+            FILE *in = fopen(argv[i], "r");
+            if (in == NULL)
+            {
+                perror(argv[i]);
+                return EXIT_FAILURE;
+            }
+            count += run_file(in);
+            fclose(in);
+        }
+        fprintf(stderr, "%d messages, no divergence\n", count);
+        return EXIT_SUCCESS;
+    }
+    if (strcmp(mode, "spec") == 0)
+        return check_spec();
+
+    optind = 2;
+    while ((opt = getopt(argc, argv, "n:s:t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            mutations = atoi(optarg);
+            break;
+        case 's':
+            rng_state = strtoull(optarg, NULL, 0) | 1;
+            break;
+        case 't':
+            seconds = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    int size;
+    char **corpus = build_corpus(mutations, &size);
+    if (strcmp(mode, "diff") == 0)
+    {
+        int count = size;
+        for (int i = 0; i < size; i++)
+            check_message(corpus[i]);
+        if (optind < argc)
+            count += check_dir(argv[optind]);
+        printf("%d messages, no divergence\n", count);
+    }
+    else if (strcmp(mode, "bench") == 0)
+    {
+        int counts[BAD_COMMAND + 1] = {0};
+        for (int i = 0; i < size; i++)
+        {
+            char copy[MAX_INPUT];
+            strcpy(copy, corpus[i]);
+            counts[parse(copy).type]++;
+        }
+        printf("corpus:       %d messages\n", size);
+        for (int t = 0; t <= BAD_COMMAND; t++)
+            if (counts[t])
+                printf("  %-11s %d\n", command_names[t], counts[t]);
+        double fast = measure(parse, corpus, size, seconds);
+        double ref = measure(parse_reference, corpus, size, seconds);
+        printf("parse():      %.0f messages/sec (%.1f ns each)\n", fast, 1e9 / fast);
+        printf("reference:    %.0f messages/sec (%.1f ns each)\n", ref, 1e9 / ref);
+    }
+    else
+        usage(argv[0]);
+
+    for (int i = 0; i < size; i++)
+        free(corpus[i]);
+    free(corpus);
+    return EXIT_SUCCESS;
+}
+
+#endif
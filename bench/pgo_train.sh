@@ -0,0 +1,25 @@
+#!/bin/sh
+# Runs an instrumented server through the workloads that matter for profile
+# guided optimization: whole games over TCP and the unix socket, rematches on
+# kept connections, and the README scenarios for the error and lobby paths.
+# The server writes its profile when it shuts down on SIGINT.
+#
+# Usage: SERVER=build/pgo/server bench/pgo_train.sh [games]
+SERVER=${SERVER:-./server}
+LOADGEN=${LOADGEN:-./loadgen}
+REPLAY=${REPLAY:-./replay}
+GAMES=${1:-20000}
+PORT=${PORT:-15991}
+SOCK=${SOCK:-/tmp/ttts-pgo.sock}
+
+for backend in epoll uring; do
+    $SERVER -b $backend -E replay:single:2 -u $SOCK $PORT > /dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    $LOADGEN -n $GAMES -c 50 127.0.0.1 $PORT > /dev/null || status=1
+    $LOADGEN -n $GAMES -c 50 -r 20 -u $SOCK > /dev/null || status=1
+    $REPLAY -E replay -n 1500 -c 30 -u $SOCK > /dev/null || status=1
+    kill -INT $pid
+    wait $pid
+done
+exit ${status:-0}
@@ -0,0 +1,907 @@
+// Re-drives sessions recorded with client -r against a server, all at once,
+// to reproduce the shape of real traffic. Each session connects when it did
+// in the capture, relative to the first, and sends what its client sent.
+// A message waits for the server messages that came before it in the
+// capture, then for the time the client took after the later of those and
+// its own last message, so thinking time is kept while the server's replies
+// may be faster or slower than they were. -s divides every wait, to replay
+// 10 or 100 times faster. -x plays every session that many times, each copy
+// started -i milliseconds of capture time after the one before, with its
+// own player and room names; copies take turns queueing with PLAY so each
+// player meets the opponent it met in the capture. Reconnect tokens in RCON
+// are swapped for the ones this run was given.
+//
+// Usage: playback [-s speed] [-x copies] [-i copy_interval_ms] [-t timeout_ms] [-j] (-u socket_path | host port) capture...
+//        playback -p capture...    prints the sessions
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include "../capture.h"
+
+#define LINELEN 512
+#define TOKEN_LEN 16
+
+typedef enum
+{
+    NOT_STARTED,
+    OPEN,
+    DONE
+} session_state;
+
+/*
+One run of a captured session
+*/
+typedef struct replayed
+{
+    capture_session *cs;
+    int copy;
+    session_state state;
+    int fd;
+    int next;             // Record to act on next: the client's next message or close
+    int need;             // Server messages before it in the capture
+    int received;         // Server messages so far
+    int server_record;    // Captured record the next server message is compared with
+    double start;         // Time due to connect
+    double last_sent;     // Time of the last message sent, or of connecting
+    double need_met;      // Time the needed server messages were all in
+    double last_progress; // Time anything last happened, for the timeout
+    double sent_at;       // Time of a message the capture shows a reply to
+    int awaiting_reply;
+    int queued;           // Sent PLAY and heard nothing but WAIT since
+    int blocked;          // 1 while waiting in blocked[] for another copy's players to be paired
+    double queue_at;      // Time due to queue with PLAY by the capture, which orders blocked[]
+    int hurry;            // Queue with PLAY as soon as possible, as an opponent is waiting
+    int eof;
+    unsigned stamp;       // Changed when rescheduled, so old timers are skipped
+    char in[LINELEN * 2];
+    int in_len;
+} replayed;
+
+/*
+A wakeup for a session, in a binary heap ordered by time
+*/
+typedef struct timer
+{
+    double at;
+    int session;
+    unsigned stamp;
+} timer;
+
+/*
+A captured reconnect token and the one this run's copy was given instead
+*/
+typedef struct token_swap
+{
+    int copy;
+    int session;     // Session given the token
+    char captured[TOKEN_LEN + 1];
+    char live[TOKEN_LEN + 1];
+} token_swap;
+
+static capture_set set;
+static replayed *sessions;
+static int num_sessions = 0, open_sessions = 0, peak_sessions = 0, done = 0;
+static timer *timers;
+static int num_timers = 0, max_timers = 0;
+static token_swap *swaps;
+static int num_swaps = 0, max_swaps = 0;
+static int *blocked; // Sessions waiting for the copy queueing with PLAY to be paired
+static int num_blocked = 0;
+static int pairing_copy = -1, pairing_count = 0, pairing_session = -1;
+static int *partners; // By captured session, the one that joined it in the queue, or -1
+
+static char *host, *service, *unix_path;
+static double speed = 1, copy_interval = 0.1, timeout = 5;
+static int copies = 1, json = 0, epfd;
+static unsigned long sent = 0, received = 0, expected = 0, stalls = 0, diverged = 0, errors = 0, closed_early = 0;
+
+static double *latencies, *lags;
+static int num_latencies = 0, max_latencies = 0, num_lags = 0, max_lags = 0;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_server(void)
+{
+    if (unix_path != NULL)
+    {
+        struct sockaddr_un addr;
+        int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock < 0)
+            return -1;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, unix_path, sizeof(addr.sun_path) - 1);
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)))
+        {
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+    struct addrinfo hints, *info_list, *info;
+    int sock = -1;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, service, &hints, &info_list))
+        return -1;
+    for (info = info_list; info != NULL; info = info->ai_next)
+    {
+        sock = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        if (sock < 0)
+            continue;
+        if (connect(sock, info->ai_addr, info->ai_addrlen) == 0)
+        {
+            int one = 1;
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            break;
+        }
+        close(sock);
+    }
+    freeaddrinfo(info_list);
+    return info == NULL ? -1 : sock;
+}
+
+static void add_sample(double **samples, int *num, int *max, double value)
+{
+    if (*num == *max)
+    {
+        *max = *max ? *max * 2 : 4096;
+        double *grown = realloc(*samples, *max * sizeof(double));
+        if (grown == NULL)
+            return;
+        *samples = grown;
+    }
+    (*samples)[(*num)++] = value;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double *samples, int num, double p)
+{
+    if (num == 0)
+        return 0;
+    return samples[(int)(p * (num - 1))] * 1e6;
+}
+
+static void schedule(int i, double at)
+{
+    if (num_timers == max_timers)
+    {
+        max_timers = max_timers ? max_timers * 2 : 1024;
+        timers = realloc(timers, max_timers * sizeof(timer));
+        if (timers == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    int n = num_timers++;
+    timer t = {at, i, ++sessions[i].stamp};
+    while (n > 0 && timers[(n - 1) / 2].at > at)
+    {
+        timers[n] = timers[(n - 1) / 2];
+        n = (n - 1) / 2;
+    }
+    timers[n] = t;
+}
+
+static timer pop_timer(void)
+{
+    timer top = timers[0], last = timers[--num_timers];
+    int n = 0;
+    while (2 * n + 1 < num_timers)
+    {
+        int child = 2 * n + 1;
+        if (child + 1 < num_timers && timers[child + 1].at < timers[child].at)
+            child++;
+        if (last.at <= timers[child].at)
+            break;
+        timers[n] = timers[child];
+        n = child;
+    }
+    if (num_timers > 0)
+        timers[n] = last;
+    return top;
+}
+
+/*
+Counts the server messages before the session's next client record.
+*/
+static void find_next(replayed *r)
+{
+    while (r->next < r->cs->num_records && r->cs->records[r->next].from_server)
+    {
+        if (r->cs->records[r->next].len > 0)
+            r->need++;
+        r->next++;
+    }
+}
+
+static void advance(int i, double t);
+static void hurry_partner(double t);
+
+/*
+Lets the sessions kept from queueing try again, in the order they were kept
+waiting, so players queue in the order they did in the capture. Those of
+other copies than the one that gets to queue next keep their places.
+*/
+static void wake_blocked(double t)
+{
+    static int waking = 0;
+    if (waking)
+        return; // The loop below carries on with them
+    waking = 1;
+    while (num_blocked > 0 && pairing_count == 0)
+    {
+        int kept = 0;
+        for (int k = 0; k < num_blocked; k++)
+        {
+            replayed *r = &sessions[blocked[k]];
+            if (r->state == OPEN && (pairing_count == 0 || r->copy == pairing_copy))
+            {
+                r->blocked = 2; // Kept waiting again, it comes back to 1 in its place
+                advance(blocked[k], t);
+            }
+            if (r->state == OPEN && r->blocked == 1)
+                blocked[kept++] = blocked[k];
+            else
+                r->blocked = 0;
+        }
+        num_blocked = kept;
+        if (num_blocked > 0)
+            hurry_partner(t);
+    }
+    waking = 0;
+}
+
+static void release_pairing(replayed *r, double t)
+{
+    if (!r->queued)
+        return;
+    r->queued = 0;
+    if (--pairing_count > 0)
+        return;
+    pairing_copy = pairing_session = -1;
+    wake_blocked(t);
+}
+
+static void finish(replayed *r, double t)
+{
+    if (r->state != OPEN)
+        return;
+    release_pairing(r, t);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, r->fd, NULL);
+    close(r->fd);
+    r->state = DONE;
+    r->stamp++;
+    open_sessions--;
+    done++;
+}
+
+static token_swap *find_swap(int copy, const char *captured)
+{
+    for (int i = 0; i < num_swaps; i++)
+        if (swaps[i].copy == copy && strncmp(swaps[i].captured, captured, TOKEN_LEN) == 0)
+            return &swaps[i];
+    return NULL;
+}
+
+/*
+Says whether a captured RCON can be sent: the session that was given its
+token in this run has left, or no session in the capture was given it.
+*/
+static int can_reconnect(replayed *r, const capture_record *rec)
+{
+    const char *token = memchr(rec->text + 5, '|', rec->len - 5);
+    if (token == NULL || token + 1 + TOKEN_LEN > rec->text + rec->len)
+        return 1;
+    token++;
+    token_swap *s = find_swap(r->copy, token);
+    if (s != NULL)
+        return sessions[s->session].state == DONE;
+    for (int i = 0; i < set.num_sessions; i++)
+        for (int j = 0; j < set.sessions[i].num_records; j++)
+        {
+            const capture_record *given = &set.sessions[i].records[j];
+            if (given->from_server && given->len > 5 + TOKEN_LEN && strncmp(given->text, "TOKN|", 5) == 0 &&
+                memmem(given->text, given->len, token, TOKEN_LEN) != NULL)
+                return 0;
+        }
+    return 1;
+}
+
+/*
+Gives copies after the first their own names: the player name in PLAY, CREA,
+JOIN and TRNY, and the room and invitee in CREA, JOIN and LIST, get the
+copy's number after a dot. Fixes up the length. Swaps captured reconnect
+tokens in RCON for live ones.
+*/
+static int rewrite(replayed *r, const char *text, int len, char *out, int out_size)
+{
+    char fields[8][LINELEN];
+    int num_fields = 0, names = 0, at;
+    if (r->copy > 0 && len > 5)
+    {
+        // Fields 1 to names are named by the client
+        if (strncmp(text, "PLAY|", 5) == 0 || strncmp(text, "TRNY|", 5) == 0 || strncmp(text, "LIST|", 5) == 0)
+            names = 1;
+        else if (strncmp(text, "JOIN|", 5) == 0)
+            names = 2;
+        else if (strncmp(text, "CREA|", 5) == 0)
+            names = 3;
+    }
+    const char *p = len > 5 ? memchr(text + 5, '|', len - 5) : NULL, *end = text + len;
+    if (p == NULL || (names == 0 && strncmp(text, "RCON|", 5) != 0))
+    {
+        memcpy(out, text, len);
+        return len;
+    }
+    // Split the fields after the length, leaving the newline aside
+    int newline = end[-1] == '\n';
+    end -= newline;
+    for (p++; p < end && num_fields < 8; num_fields++)
+    {
+        const char *bar = memchr(p, '|', end - p);
+        int n = bar != NULL ? bar - p : end - p;
+        if (n > LINELEN - 16)
+            n = LINELEN - 16;
+        memcpy(fields[num_fields], p, n);
+        fields[num_fields][n] = '\0';
+        p = bar != NULL ? bar + 1 : end;
+    }
+    for (int f = 0; f < num_fields && f < names; f++)
+        if (fields[f][0] != '\0')
+            sprintf(fields[f] + strlen(fields[f]), ".%d", r->copy);
+    token_swap *s = names == 0 && num_fields == 1 ? find_swap(r->copy, fields[0]) : NULL;
+    if (s != NULL && strlen(fields[0]) == TOKEN_LEN)
+        strcpy(fields[0], s->live);
+    int body = 0;
+    for (int f = 0; f < num_fields; f++)
+        body += strlen(fields[f]) + 1;
+    at = snprintf(out, out_size, "%.4s|%d|", text, body);
+    for (int f = 0; f < num_fields && at < out_size; f++)
+        at += snprintf(out + at, out_size - at, "%s|", fields[f]);
+    if (at >= out_size - 1)
+        at = out_size - 2;
+    if (newline)
+        out[at++] = '\n';
+    return at;
+}
+
+/*
+Sends the session's next client message, or closes the connection if that is
+what the client did next.
+*/
+static void send_next(replayed *r, double t)
+{
+    capture_record *rec = &r->cs->records[r->next];
+    char out[LINELEN * 2];
+    r->next++;
+    if (rec->len == 0)
+    {
+        finish(r, t);
+        return;
+    }
+    int len = rewrite(r, rec->text, rec->len, out, sizeof(out));
+    if (write(r->fd, out, len) != len)
+    {
+        errors++;
+        finish(r, t);
+        return;
+    }
+    sent++;
+    r->last_sent = r->last_progress = t;
+    if (copies > 1 && strncmp(out, "PLAY|", 5) == 0)
+    {
+        r->queued = 1;
+        r->hurry = 0;
+        if (pairing_count++ == 0)
+            pairing_session = r - sessions;
+        pairing_copy = r->copy;
+    }
+    // Time the reply when the capture has the server answering next
+    r->awaiting_reply = r->next < r->cs->num_records && r->cs->records[r->next].from_server &&
+                        r->cs->records[r->next].len > 0;
+    r->sent_at = t;
+    find_next(r);
+    if (r->received >= r->need)
+        r->need_met = t;
+}
+
+static void start_session(int i, double t);
+
+/*
+Sends the PLAY of the player that joined the waiting player of the copy
+now queueing, rather than keep every other copy waiting until it was due.
+*/
+static void hurry_partner(double t)
+{
+    if (pairing_session < 0)
+        return;
+    replayed *waiting = &sessions[pairing_session];
+    int partner = partners[waiting->cs - set.sessions];
+    if (partner < 0)
+        return;
+    int i = waiting->copy * set.num_sessions + partner;
+    replayed *r = &sessions[i];
+    if (r->hurry || r->queued || r->state == DONE)
+        return;
+    r->hurry = 1;
+    if (r->state == NOT_STARTED)
+        start_session(i, t);
+    else
+        advance(i, t);
+}
+
+/*
+Does whatever the session is due to do by now, and sets a timer for the
+next thing it will do without hearing from the server.
+*/
+static void advance(int i, double t)
+{
+    replayed *r = &sessions[i];
+    while (r->state == OPEN)
+    {
+        if (r->next == r->cs->num_records)
+        {
+            // The server closed the connection in the capture; wait for it to again
+            if (r->eof)
+                finish(r, t);
+            else if (t - r->last_progress >= timeout)
+            {
+                stalls++;
+                finish(r, t);
+            }
+            else
+                schedule(i, r->last_progress + timeout);
+            return;
+        }
+        if (r->received < r->need)
+        {
+            if (t - r->last_progress < timeout)
+            {
+                schedule(i, r->last_progress + timeout);
+                return;
+            }
+            // The server said less than it did in the capture; carry on regardless
+            stalls++;
+            r->need = r->received;
+            r->need_met = t;
+        }
+        capture_record *rec = &r->cs->records[r->next];
+        double cause = r->last_sent > r->need_met ? r->last_sent : r->need_met;
+        double gap = rec->at - (r->next > 0 ? r->cs->records[r->next - 1].at : 0);
+        double due = cause + gap / 1e6 / speed;
+        int play = rec->len >= 5 && strncmp(rec->text, "PLAY|", 5) == 0;
+        if (due > t && !(r->hurry && play))
+        {
+            schedule(i, due);
+            return;
+        }
+        if (rec->len > 5 && strncmp(rec->text, "RCON|", 5) == 0 && t - r->last_progress < timeout &&
+            !can_reconnect(r, rec))
+        {
+            // The player it takes over from has not been given its token, or is still connected
+            schedule(i, t + 0.001);
+            return;
+        }
+        if (copies > 1 && pairing_count > 0 && pairing_copy != r->copy && play)
+        {
+            if (r->blocked == 0)
+            {
+                // In the order the capture queued them, however late they became due
+                int k = num_blocked++;
+                r->queue_at = r->start + rec->at / 1e6 / speed;
+                for (; k > 0 && sessions[blocked[k - 1]].queue_at > r->queue_at; k--)
+                    blocked[k] = blocked[k - 1];
+                blocked[k] = i;
+            }
+            r->blocked = 1;
+            r->stamp++;
+            hurry_partner(t);
+            return;
+        }
+        if (r->blocked == 1)
+            r->blocked = 3; // Let go early; its place in blocked[] is dropped next time
+        add_sample(&lags, &num_lags, &max_lags, t > due ? t - due : 0);
+        send_next(r, t);
+    }
+}
+
+static void start_session(int i, double t)
+{
+    replayed *r = &sessions[i];
+    r->fd = connect_server();
+    if (r->fd < 0)
+    {
+        errors++;
+        r->state = DONE;
+        done++;
+        return;
+    }
+    fcntl(r->fd, F_SETFL, O_NONBLOCK);
+    struct epoll_event ev = {.events = EPOLLIN, .data.u32 = i};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, r->fd, &ev);
+    r->state = OPEN;
+    r->last_sent = r->need_met = r->last_progress = t;
+    if (++open_sessions > peak_sessions)
+        peak_sessions = open_sessions;
+    find_next(r);
+    add_sample(&lags, &num_lags, &max_lags, t > r->start ? t - r->start : 0);
+    advance(i, t);
+}
+
+/*
+Handles one message from the server: compares it with the capture, times it
+and learns reconnect tokens.
+*/
+static void handle_line(replayed *r, const char *line, double t)
+{
+    const capture_record *captured = NULL;
+    while (r->server_record < r->cs->num_records)
+    {
+        const capture_record *rec = &r->cs->records[r->server_record++];
+        if (rec->from_server && rec->len > 0)
+        {
+            captured = rec;
+            break;
+        }
+    }
+    received++;
+    r->received++;
+    r->last_progress = t;
+    if (captured == NULL || captured->len < 4 || strncmp(captured->text, line, 4) != 0)
+        diverged++;
+    else if (strncmp(line, "TOKN|", 5) == 0)
+    {
+        // TOKN|17|token|: remember which token this run got for the captured one
+        const char *live = strchr(line + 5, '|'), *old = memchr(captured->text + 5, '|', captured->len - 5);
+        if (live != NULL && old != NULL && strlen(live + 1) > TOKEN_LEN && old + 1 + TOKEN_LEN < captured->text + captured->len)
+        {
+            if (num_swaps == max_swaps)
+            {
+                max_swaps = max_swaps ? max_swaps * 2 : 256;
+                swaps = realloc(swaps, max_swaps * sizeof(token_swap));
+                if (swaps == NULL)
+                {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            token_swap *s = &swaps[num_swaps++];
+            s->copy = r->copy;
+            s->session = r - sessions;
+            memcpy(s->captured, old + 1, TOKEN_LEN);
+            memcpy(s->live, live + 1, TOKEN_LEN);
+            s->captured[TOKEN_LEN] = s->live[TOKEN_LEN] = '\0';
+        }
+    }
+    if (r->awaiting_reply)
+    {
+        add_sample(&latencies, &num_latencies, &max_latencies, t - r->sent_at);
+        r->awaiting_reply = 0;
+    }
+    if (r->queued && strncmp(line, "WAIT|", 5) != 0)
+        release_pairing(r, t);
+    if (r->received == r->need)
+        r->need_met = t;
+}
+
+static void handle_input(int i, double t)
+{
+    replayed *r = &sessions[i];
+    int n = read(r->fd, r->in + r->in_len, sizeof(r->in) - 1 - r->in_len);
+    if (n < 0 && errno == EAGAIN)
+        return;
+    if (n <= 0)
+    {
+        r->eof = 1;
+        r->last_progress = t;
+        if (r->next < r->cs->num_records)
+            closed_early++;
+        finish(r, t);
+        return;
+    }
+    r->in_len += n;
+    r->in[r->in_len] = '\0';
+    char *line = r->in, *newline;
+    while ((newline = strchr(line, '\n')) != NULL)
+    {
+        *newline = '\0';
+        handle_line(r, line, t);
+        line = newline + 1;
+    }
+    r->in_len -= line - r->in;
+    memmove(r->in, line, r->in_len);
+    if (r->in_len == sizeof(r->in) - 1)
+        r->in_len = 0; // A line too long to be a message
+    advance(i, t);
+}
+
+/*
+Reads the name a session first sent PLAY with, and the opponent the BEGN
+after it named. Returns the record index of the PLAY, or -1.
+*/
+static int first_game(capture_session *s, char *name, char *opponent)
+{
+    int play = -1;
+    name[0] = opponent[0] = '\0';
+    for (int i = 0; i < s->num_records; i++)
+    {
+        capture_record *rec = &s->records[i];
+        if (rec->len < 6)
+            continue;
+        if (play < 0 && !rec->from_server && sscanf(rec->text, "PLAY|%*d|%127[^|\n]", name) == 1)
+            play = i;
+        else if (play >= 0 && rec->from_server && sscanf(rec->text, "BEGN|%*d|%*c|%127[^|\n]", opponent) == 1)
+            return play;
+    }
+    return -1;
+}
+
+/*
+Pairs up the captured sessions that met in the queue: the partner of a
+waiting player is the one that queued after it and was named as its
+opponent.
+*/
+static int find_partners(void)
+{
+    int n = set.num_sessions;
+    char (*names)[128] = malloc(n * sizeof(*names)), (*opponents)[128] = malloc(n * sizeof(*opponents));
+    double *queued_at = malloc(n * sizeof(double));
+    partners = malloc(n * sizeof(int));
+    if (names == NULL || opponents == NULL || queued_at == NULL || partners == NULL)
+        return -1;
+    for (int s = 0; s < n; s++)
+    {
+        int play = first_game(&set.sessions[s], names[s], opponents[s]);
+        queued_at[s] = play < 0 ? -1 : set.sessions[s].start + (double)set.sessions[s].records[play].at;
+        partners[s] = -1;
+    }
+    for (int s = 0; s < n; s++)
+        for (int p = 0; p < n && queued_at[s] >= 0; p++)
+            if (queued_at[p] > queued_at[s] && strcmp(names[p], opponents[s]) == 0 && strcmp(opponents[p], names[s]) == 0)
+            {
+                partners[s] = p;
+                break;
+            }
+    free(names);
+    free(opponents);
+    free(queued_at);
+    return 0;
+}
+
+/*
+Prints every session as the README's transcripts do, with the time of each
+message since the session began.
+*/
+static void print_sessions(void)
+{
+    for (int i = 0; i < set.num_sessions; i++)
+    {
+        capture_session *s = &set.sessions[i];
+        time_t began = s->start / 1000000;
+        char when[64];
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&began));
+        printf("session %d, %s.%06llu%s%s\n", i + 1, when, (unsigned long long)(s->start % 1000000),
+               s->flags & CAPTURE_TLS ? ", TLS" : "", s->flags & CAPTURE_UNIX ? ", unix socket" : "");
+        for (int j = 0; j < s->num_records; j++)
+        {
+            capture_record *rec = &s->records[j];
+            int len = rec->len > 0 && rec->text[rec->len - 1] == '\n' ? rec->len - 1 : rec->len;
+            if (rec->len == 0)
+                printf("    %10.6f  %s closed\n", rec->at / 1e6, rec->from_server ? "server" : "client");
+            else
+                printf("    %10.6f  %s  %.*s\n", rec->at / 1e6, rec->from_server ? "out" : "inp", len, rec->text);
+        }
+    }
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-s speed] [-x copies] [-i copy_interval_ms] [-t timeout_ms] [-j] (-u socket_path | host port) capture...\n", prog);
+    fprintf(stderr, "       %s -p capture...\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    int opt, print = 0;
+    signal(SIGPIPE, SIG_IGN);
+    while ((opt = getopt(argc, argv, "s:x:i:t:jpu:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            speed = atof(optarg);
+            break;
+        case 'x':
+            copies = atoi(optarg);
+            break;
+        case 'i':
+            copy_interval = atof(optarg) / 1000;
+            break;
+        case 't':
+            timeout = atof(optarg) / 1000;
+            break;
+        case 'j':
+            json = 1;
+            break;
+        case 'p':
+            print = 1;
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!print && unix_path == NULL)
+    {
+        if (argc - optind < 2)
+            usage(argv[0]);
+        host = argv[optind++];
+        service = argv[optind++];
+    }
+    if (optind == argc || speed <= 0 || copies < 1 || copy_interval < 0 || timeout <= 0)
+        usage(argv[0]);
+    for (; optind < argc; optind++)
+        if (capture_load(&set, argv[optind]))
+            return EXIT_FAILURE;
+    if (print)
+    {
+        print_sessions();
+        capture_free(&set);
+        return EXIT_SUCCESS;
+    }
+    if (set.num_sessions == 0)
+    {
+        fprintf(stderr, "no sessions to play\n");
+        return EXIT_FAILURE;
+    }
+
+    // Every session may be open at once
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (copies > 1 && find_partners())
+    {
+        perror("playback");
+        return EXIT_FAILURE;
+    }
+    num_sessions = set.num_sessions * copies;
+    sessions = calloc(num_sessions, sizeof(replayed));
+    blocked = malloc(num_sessions * sizeof(int));
+    epfd = epoll_create1(0);
+    if (sessions == NULL || blocked == NULL || epfd < 0)
+    {
+        perror("playback");
+        return EXIT_FAILURE;
+    }
+    uint64_t first = set.sessions[0].start;
+    for (int j = 1; j < set.num_sessions; j++)
+        if (set.sessions[j].start < first)
+            first = set.sessions[j].start;
+    double t0 = now() + 0.01;
+    for (int c = 0; c < copies; c++)
+        for (int j = 0; j < set.num_sessions; j++)
+        {
+            int i = c * set.num_sessions + j;
+            replayed *r = &sessions[i];
+            r->cs = &set.sessions[j];
+            r->copy = c;
+            r->fd = -1;
+            r->start = t0 + ((set.sessions[j].start - first) / 1e6 + c * copy_interval) / speed;
+            for (int k = 0; k < r->cs->num_records; k++)
+                expected += r->cs->records[k].from_server && r->cs->records[k].len > 0;
+            schedule(i, r->start);
+        }
+
+    struct epoll_event events[256];
+    while (done < num_sessions)
+    {
+        double t = now();
+        while (num_timers > 0 && timers[0].at <= t)
+        {
+            timer due = pop_timer();
+            replayed *r = &sessions[due.session];
+            if (due.stamp != r->stamp)
+                continue;
+            if (r->state == NOT_STARTED)
+                start_session(due.session, t);
+            else
+                advance(due.session, t);
+        }
+        if (done == num_sessions)
+            break;
+        struct timespec wait = {1, 0};
+        if (num_timers > 0)
+        {
+            double d = timers[0].at - t;
+            d = d < 0 ? 0 : d > 1 ? 1 : d;
+            wait.tv_sec = (time_t)d;
+            wait.tv_nsec = (long)((d - wait.tv_sec) * 1e9);
+        }
+        int n = epoll_pwait2(epfd, events, 256, &wait, NULL);
+        if (n < 0 && errno != EINTR)
+        {
+            perror("epoll_pwait2");
+            break;
+        }
+        t = now();
+        for (int k = 0; k < n; k++)
+            if (sessions[events[k].data.u32].state == OPEN)
+                handle_input(events[k].data.u32, t);
+    }
+    double elapsed = now() - t0;
+
+    qsort(latencies, num_latencies, sizeof(double), compare_double);
+    qsort(lags, num_lags, sizeof(double), compare_double);
+    if (json)
+    {
+        char label[64];
+        snprintf(label, sizeof(label), "playback_s%g_x%d", speed, copies);
+        printf("{\"name\": \"%s_sessions_per_sec\", \"unit\": \"sessions/s\", \"value\": %.1f, \"better\": \"higher\"},\n", label, num_sessions / elapsed);
+        printf("{\"name\": \"%s_reply_p50\", \"unit\": \"us\", \"value\": %.1f, \"better\": \"lower\"},\n", label, percentile(latencies, num_latencies, 0.50));
+        printf("{\"name\": \"%s_reply_p99\", \"unit\": \"us\", \"value\": %.1f, \"better\": \"lower\"},\n", label, percentile(latencies, num_latencies, 0.99));
+        printf("{\"name\": \"%s_diverged\", \"unit\": \"count\", \"value\": %lu, \"better\": \"lower\"},\n", label, diverged);
+        printf("{\"name\": \"%s_errors\", \"unit\": \"count\", \"value\": %lu, \"better\": \"lower\"}\n", label, errors);
+    }
+    else
+    {
+        printf("sessions:     %d (%d captured x %d)\n", num_sessions, set.num_sessions, copies);
+        printf("speed:        %gx\n", speed);
+        printf("elapsed:      %.3f s\n", elapsed);
+        printf("peak open:    %d\n", peak_sessions);
+        printf("sent:         %lu messages, %.1f/sec\n", sent, sent / elapsed);
+        printf("received:     %lu messages of %lu captured\n", received, expected);
+        printf("reply p50:    %.1f us\n", percentile(latencies, num_latencies, 0.50));
+        printf("reply p99:    %.1f us\n", percentile(latencies, num_latencies, 0.99));
+        printf("late p50:     %.1f us\n", percentile(lags, num_lags, 0.50));
+        printf("late p99:     %.1f us\n", percentile(lags, num_lags, 0.99));
+        printf("diverged:     %lu replies\n", diverged);
+        printf("stalled:      %lu waits\n", stalls);
+        printf("closed early: %lu\n", closed_early);
+        printf("errors:       %lu\n", errors);
+    }
+    for (int i = 0; i < num_sessions; i++)
+        if (sessions[i].state == OPEN)
+            close(sessions[i].fd);
+    close(epfd);
+    free(sessions);
+    free(blocked);
+    free(partners);
+    free(timers);
+    free(swaps);
+    free(latencies);
+    free(lags);
+    capture_free(&set);
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Records a few games played by scripted clients with client -r, each player
+# taking a little longer to think than in the game before, then plays every
+# session back many times over at 1x, 10x and 100x speed against a fresh
+# server each time, so seats held for dropped players do not carry over.
+#
+# Usage: bench/playback.sh [copies] [games_to_record]
+SERVER=${SERVER:-./server}
+CLIENT=${CLIENT:-./client}
+PLAYBACK=${PLAYBACK:-./playback}
+COPIES=${1:-1000}
+GAMES=${2:-8}
+PORT=${PORT:-15997}
+CAPTURE=${CAPTURE:-build/capture.ttts}
+
+mkdir -p $(dirname $CAPTURE)
+rm -f $CAPTURE
+$SERVER $PORT > /dev/null 2>&1 &
+server=$!
+sleep 0.3
+# X takes the left column while O answers in the middle one
+clients=
+for i in $(seq 1 $GAMES); do
+    start=$(awk "BEGIN { print 0.3 * $i }")
+    think=$(awk "BEGIN { print 0.05 * $i }")
+    (sleep $start; echo "PLAY|5|X$(printf %03d $i)|"; sleep 0.2
+     for move in 1,1 2,1 3,1; do sleep $think; echo "MOVE|6|X|$move|"; sleep $think; done; sleep 0.2) |
+        $CLIENT -r $CAPTURE 127.0.0.1 $PORT > /dev/null &
+    clients="$clients $!"
+    (sleep $start; sleep 0.1; echo "PLAY|5|O$(printf %03d $i)|"; sleep 0.1
+     for move in 1,2 2,2; do sleep $think; sleep $think; echo "MOVE|6|O|$move|"; done; sleep 0.5) |
+        $CLIENT -r $CAPTURE 127.0.0.1 $PORT > /dev/null &
+    clients="$clients $!"
+done
+wait $clients
+kill -INT $server
+wait $server
+echo "Recorded $GAMES games in $(wc -c < $CAPTURE) bytes"
+
+for speed in 1 10 100; do
+    $SERVER $PORT > /dev/null 2>&1 &
+    server=$!
+    sleep 0.3
+    echo "== ${speed}x"
+    $PLAYBACK -s $speed -x $COPIES -i 10 127.0.0.1 $PORT $CAPTURE | grep -E "elapsed|peak|sent|received|reply|late|diverged|errors"
+    kill -INT $server
+    wait $server
+done
@@ -0,0 +1,590 @@
+// Replays the README's transcripts, written as scenarios in bench/scenarios.txt,
+// against a running server. Many copies of each scenario run at once, each
+// with its own player and room names, and every line the server sends must
+// match the script byte for byte. Reports per-scenario latency and the total
+// scenarios/sec, so one run checks both correctness and performance.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#define MAX_SCENARIOS 64
+#define MAX_STEPS 128
+#define MAX_CLIENTS 4
+#define MAX_CONCURRENCY 1024
+#define LINELEN 512
+#define NAME_LEN 4 // Same length as DORK and NERD, so the scripts' lengths hold
+#define ROOM_LEN 3 // Same length as den
+
+typedef enum
+{
+    STEP_PAIR,   // Wait for and take the pairing lock
+    STEP_UNPAIR, // Release it
+    STEP_SEND,   // Client sends a line
+    STEP_EXPECT, // Client must receive a line
+    STEP_CLOSED, // Server must close the client's connection
+    STEP_CLOSE   // Client closes its connection
+} step_kind;
+
+typedef struct step
+{
+    step_kind kind;
+    int client;
+    char *text;
+    int line; // Line in the scenario file, for reports
+} step;
+
+/*
+Stores a scenario and the results of every run of it
+*/
+typedef struct scenario
+{
+    char name[64];
+    step steps[MAX_STEPS];
+    int num_steps;
+    int runs, failures;
+    double *latencies;
+    int num_latencies;
+} scenario;
+
+typedef struct client
+{
+    int fd;
+    char buf[LINELEN * 4]; // Bytes received but not yet matched
+    int buf_len;
+    int eof;
+} client;
+
+/*
+Stores one run of a scenario in progress
+*/
+typedef struct run
+{
+    scenario *sc;
+    int step;
+    client clients[MAX_CLIENTS];
+    char names[3][NAME_LEN + 1];
+    char room[ROOM_LEN + 1];
+    double started, step_started;
+} run;
+
+static scenario scenarios[MAX_SCENARIOS];
+static int num_scenarios = 0;
+
+static char *host, *service, *unix_path;
+static char *script = "bench/scenarios.txt";
+static char *event_name; // Tournament the server was started with, for scenarios that need one
+static int total_runs = 0, concurrency = 32, timeout_ms = 2000, verbose_failures = 5;
+
+static run runs[MAX_CONCURRENCY];
+static int num_active = 0, started = 0, finished = 0, failures = 0;
+static run *pairing_owner = NULL;
+static unsigned long name_counter;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_inet(char *host, char *service)
+{
+    struct addrinfo hints, *info_list, *info;
+    int sock = -1, error;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    error = getaddrinfo(host, service, &hints, &info_list);
+    if (error)
+    {
+        fprintf(stderr, "error looking up %s:%s: %s\n", host, service, gai_strerror(error));
+        return -1;
+    }
+    for (info = info_list; info != NULL; info = info->ai_next)
+    {
+        sock = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        if (sock < 0)
+            continue;
+        if (connect(sock, info->ai_addr, info->ai_addrlen) == 0)
+        {
+            int one = 1;
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            break;
+        }
+        close(sock);
+    }
+    freeaddrinfo(info_list);
+    return info == NULL ? -1 : sock;
+}
+
+static int connect_unix(char *path)
+{
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/*
+Reads the scenario file. Returns -1 after reporting the first bad line.
+*/
+static int load_scenarios(const char *path)
+{
+    char line[LINELEN * 2];
+    int line_no = 0;
+    scenario *sc = NULL;
+    int skipping = 0;
+    FILE *in = fopen(path, "r");
+    if (in == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+        line_no++;
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '#' || line[0] == '\0')
+            continue;
+        if (strncmp(line, "scenario ", 9) == 0)
+        {
+            if (num_scenarios == MAX_SCENARIOS)
+                break;
+            sc = &scenarios[num_scenarios++];
+            snprintf(sc->name, sizeof(sc->name), "%.63s", line + 9);
+            skipping = 0;
+            continue;
+        }
+        if (strncmp(line, "event ", 6) == 0 && sc != NULL && sc->num_steps == 0)
+        {
+            // Left out unless the server has this tournament
+            if (event_name == NULL || strcmp(line + 6, event_name) != 0)
+            {
+                num_scenarios--;
+                sc = NULL;
+                skipping = 1;
+            }
+            continue;
+        }
+        if (skipping)
+            continue;
+        if (sc == NULL || sc->num_steps == MAX_STEPS)
+        {
+            fprintf(stderr, "%s:%d: step outside a scenario, or too many steps\n", path, line_no);
+            fclose(in);
+            return -1;
+        }
+        step *st = &sc->steps[sc->num_steps];
+        st->line = line_no;
+        st->text = NULL;
+        if (strcmp(line, "pair") == 0)
+            st->kind = STEP_PAIR;
+        else if (strcmp(line, "unpair") == 0)
+            st->kind = STEP_UNPAIR;
+        else if (line[0] >= '1' && line[0] < '1' + MAX_CLIENTS)
+        {
+            st->client = line[0] - '1';
+            if (strncmp(line + 1, "> ", 2) == 0 || strcmp(line + 1, ">") == 0)
+                st->kind = STEP_SEND;
+            else if (strncmp(line + 1, "< ", 2) == 0)
+                st->kind = STEP_EXPECT;
+            else if (strcmp(line + 1, " closed") == 0)
+                st->kind = STEP_CLOSED;
+            else if (strcmp(line + 1, " close") == 0)
+                st->kind = STEP_CLOSE;
+            else
+                st->client = -1;
+            if (st->kind == STEP_SEND || st->kind == STEP_EXPECT)
+                st->text = strdup(line[2] ? line + 3 : "");
+        }
+        else
+            st->client = -1;
+        if (st->client < 0 && st->kind != STEP_PAIR && st->kind != STEP_UNPAIR)
+        {
+            fprintf(stderr, "%s:%d: cannot understand \"%s\"\n", path, line_no, line);
+            fclose(in);
+            return -1;
+        }
+        sc->num_steps++;
+    }
+    fclose(in);
+    return 0;
+}
+
+static void make_id(char *out, int len)
+{
+    static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    unsigned long n = name_counter++;
+    for (int i = len - 1; i >= 0; i--)
+    {
+        out[i] = digits[n % 36];
+        n /= 36;
+    }
+    out[len] = '\0';
+}
+
+/*
+Replaces {A}, {B}, {C} and {R} with this run's names.
+*/
+static void expand(run *r, const char *text, char *out, int out_size)
+{
+    int used = 0;
+    for (; *text && used < out_size - 8; text++)
+    {
+        if (text[0] == '{' && text[1] && text[2] == '}')
+        {
+            const char *value = NULL;
+            if (text[1] >= 'A' && text[1] <= 'C')
+                value = r->names[text[1] - 'A'];
+            else if (text[1] == 'R')
+                value = r->room;
+            if (value != NULL)
+            {
+                used += snprintf(out + used, out_size - used, "%s", value);
+                text += 2;
+                continue;
+            }
+        }
+        out[used++] = *text;
+    }
+    out[used] = '\0';
+}
+
+/*
+Takes the next line the client received, skipping random session tokens.
+Returns 1 if there was a complete line.
+*/
+static int next_line(client *c, char *line, int size)
+{
+    while (1)
+    {
+        char *end = memchr(c->buf, '\n', c->buf_len);
+        if (end == NULL)
+            return 0;
+        int len = end - c->buf;
+        int copy = len < size - 1 ? len : size - 1;
+        memcpy(line, c->buf, copy);
+        line[copy] = '\0';
+        c->buf_len -= len + 1;
+        memmove(c->buf, end + 1, c->buf_len);
+        if (strncmp(line, "TOKN|", 5) != 0)
+            return 1;
+    }
+}
+
+static void start_run(run *r, scenario *sc)
+{
+    memset(r, 0, sizeof(run));
+    r->sc = sc;
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        r->clients[i].fd = -1;
+    for (int i = 0; i < 3; i++)
+        make_id(r->names[i], NAME_LEN);
+    make_id(r->room, ROOM_LEN);
+    r->started = r->step_started = now();
+    sc->runs++;
+}
+
+static void end_run(run *r, const char *error, const char *got)
+{
+    scenario *sc = r->sc;
+    if (error == NULL)
+    {
+        // Lines nobody expected are a failure too
+        for (int i = 0; i < MAX_CLIENTS && error == NULL; i++)
+        {
+            static char extra[LINELEN];
+            if (r->clients[i].fd >= 0 && next_line(&r->clients[i], extra, sizeof(extra)))
+            {
+                error = "unexpected line after the last step";
+                got = extra;
+            }
+        }
+    }
+    if (error == NULL)
+    {
+        if (sc->num_latencies % 1024 == 0)
+            sc->latencies = realloc(sc->latencies, (sc->num_latencies + 1024) * sizeof(double));
+        sc->latencies[sc->num_latencies++] = now() - r->started;
+    }
+    else
+    {
+        sc->failures++;
+        failures++;
+        if (verbose_failures-- > 0)
+        {
+            int at = r->step < sc->num_steps ? r->step : sc->num_steps - 1;
+            step *st = &sc->steps[at];
+            char want[LINELEN];
+            expand(r, st->text ? st->text : "", want, sizeof(want));
+            fprintf(stderr, "%s, line %d: %s\n", sc->name, st->line, error);
+            if (st->kind == STEP_EXPECT)
+                fprintf(stderr, "  expected: %s\n", want);
+            if (got != NULL)
+                fprintf(stderr, "  got:      %s\n", got);
+        }
+    }
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        if (r->clients[i].fd >= 0)
+            close(r->clients[i].fd);
+    if (pairing_owner == r)
+        pairing_owner = NULL;
+    r->sc = NULL;
+    finished++;
+}
+
+/*
+Runs steps until one has to wait for the server. Returns 1 when the run is over.
+*/
+static int advance(run *r)
+{
+    char text[LINELEN], line[LINELEN];
+    scenario *sc = r->sc;
+
+    while (r->step < sc->num_steps)
+    {
+        step *st = &sc->steps[r->step];
+        client *c = &r->clients[st->client];
+        switch (st->kind)
+        {
+        case STEP_PAIR:
+            if (pairing_owner != NULL && pairing_owner != r)
+                return 0;
+            pairing_owner = r;
+            break;
+        case STEP_UNPAIR:
+            if (pairing_owner == r)
+                pairing_owner = NULL;
+            break;
+        case STEP_SEND:
+        {
+            if (c->fd < 0)
+            {
+                c->fd = unix_path ? connect_unix(unix_path) : connect_inet(host, service);
+                if (c->fd < 0)
+                {
+                    end_run(r, "could not connect", NULL);
+                    return 1;
+                }
+            }
+            expand(r, st->text, text, sizeof(text) - 1);
+            strcat(text, "\n");
+            int len = strlen(text);
+            if (write(c->fd, text, len) != len)
+            {
+                end_run(r, "write failed", strerror(errno));
+                return 1;
+            }
+            break;
+        }
+        case STEP_EXPECT:
+            if (c->fd < 0)
+            {
+                end_run(r, "expected a line on a client that never connected", NULL);
+                return 1;
+            }
+            if (!next_line(c, line, sizeof(line)))
+            {
+                if (c->eof)
+                {
+                    end_run(r, "connection closed", NULL);
+                    return 1;
+                }
+                return 0;
+            }
+            expand(r, st->text, text, sizeof(text));
+            if (strcmp(line, text) != 0)
+            {
+                end_run(r, "output differs", line);
+                return 1;
+            }
+            break;
+        case STEP_CLOSED:
+            if (c->fd >= 0 && next_line(c, line, sizeof(line)))
+            {
+                end_run(r, "expected the connection to close", line);
+                return 1;
+            }
+            if (c->fd >= 0 && !c->eof)
+                return 0;
+            break;
+        case STEP_CLOSE:
+            if (c->fd >= 0)
+                close(c->fd);
+            c->fd = -1;
+            break;
+        }
+        r->step++;
+        r->step_started = now();
+    }
+    end_run(r, NULL, NULL);
+    return 1;
+}
+
+static void read_client(client *c)
+{
+    int bytes = read(c->fd, c->buf + c->buf_len, sizeof(c->buf) - c->buf_len);
+    if (bytes <= 0)
+        c->eof = 1;
+    else
+        c->buf_len += bytes;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-f scenario_file] [-n runs] [-c concurrent_runs] [-t timeout_ms] [-E tournament] (-u socket_path | host port)\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "f:n:c:t:u:E:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            script = optarg;
+            break;
+        case 'n':
+            total_runs = atoi(optarg);
+            break;
+        case 'c':
+            concurrency = atoi(optarg);
+            break;
+        case 't':
+            timeout_ms = atoi(optarg);
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 'E':
+            event_name = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (unix_path == NULL)
+    {
+        if (argc - optind != 2)
+            usage(argv[0]);
+        host = argv[optind];
+        service = argv[optind + 1];
+    }
+    if (concurrency < 1 || concurrency > MAX_CONCURRENCY || load_scenarios(script))
+        usage(argv[0]);
+    if (num_scenarios == 0)
+    {
+        fprintf(stderr, "%s has no scenarios\n", script);
+        return EXIT_FAILURE;
+    }
+    if (total_runs <= 0)
+        total_runs = num_scenarios * 10;
+    // Keep names apart from another replay running at the same time
+    name_counter = (unsigned long)getpid() * 7919;
+
+    static struct pollfd fds[MAX_CONCURRENCY * MAX_CLIENTS];
+    static client *owners[MAX_CONCURRENCY * MAX_CLIENTS];
+    double start = now();
+
+    while (finished < total_runs)
+    {
+        // Keep the requested number of runs going, cycling through the scenarios
+        for (int i = 0; i < concurrency && started < total_runs; i++)
+        {
+            if (runs[i].sc != NULL)
+                continue;
+            start_run(&runs[i], &scenarios[started++ % num_scenarios]);
+            num_active++;
+        }
+
+        // Every run moves as far as it can; a run waiting for the pairing lock
+        // may get it because another one finished
+        int nfds = 0;
+        double t = now();
+        for (int i = 0; i < concurrency; i++)
+        {
+            run *r = &runs[i];
+            if (r->sc == NULL)
+                continue;
+            if (advance(r))
+            {
+                num_active--;
+                continue;
+            }
+            if ((t - r->step_started) * 1000 > timeout_ms)
+            {
+                end_run(r, "timed out", NULL);
+                num_active--;
+                continue;
+            }
+            for (int j = 0; j < MAX_CLIENTS; j++)
+            {
+                client *c = &r->clients[j];
+                if (c->fd >= 0 && !c->eof)
+                {
+                    fds[nfds].fd = c->fd;
+                    fds[nfds].events = POLLIN;
+                    owners[nfds++] = c;
+                }
+            }
+        }
+        if (nfds == 0)
+            continue;
+        if (poll(fds, nfds, 100) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+        for (int i = 0; i < nfds; i++)
+            if (fds[i].revents)
+                read_client(owners[i]);
+    }
+    double elapsed = now() - start;
+
+    printf("%-16s %6s %6s %10s %10s\n", "scenario", "runs", "failed", "p50 us", "p99 us");
+    for (int i = 0; i < num_scenarios; i++)
+    {
+        scenario *sc = &scenarios[i];
+        double p50 = 0, p99 = 0;
+        if (sc->num_latencies > 0)
+        {
+            qsort(sc->latencies, sc->num_latencies, sizeof(double), compare_double);
+            p50 = sc->latencies[(int)(0.50 * (sc->num_latencies - 1))] * 1e6;
+            p99 = sc->latencies[(int)(0.99 * (sc->num_latencies - 1))] * 1e6;
+        }
+        printf("%-16s %6d %6d %10.0f %10.0f\n", sc->name, sc->runs, sc->failures, p50, p99);
+        free(sc->latencies);
+    }
+    printf("transport:       %s\n", unix_path ? "unix" : "tcp");
+    printf("scenarios:       %d in %.3f s\n", finished, elapsed);
+    printf("scenarios/sec:   %.1f\n", finished / elapsed);
+    printf("failures:        %d\n", failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
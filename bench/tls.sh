@@ -0,0 +1,42 @@
+#!/bin/sh
+# Makes a self-signed certificate for local testing, then runs the same load
+# over plain TCP, over TLS resuming sessions, and over TLS with a full
+# handshake for every connection. The server's shutdown line says how many
+# connections the kernel encrypted (kTLS); without the kernel's tls module
+# OpenSSL does the work in userspace.
+#
+# Usage: bench/tls.sh [games] [concurrent_games] [games_per_connection]
+SERVER=${SERVER:-./server}
+LOADGEN=${LOADGEN:-./loadgen}
+GAMES=${1:-5000}
+CONCURRENCY=${2:-50}
+PER_CONNECTION=${3:-1}
+PORT=${PORT:-15995}
+TLS_PORT=${TLS_PORT:-15996}
+CERT_DIR=${CERT_DIR:-build/tls}
+
+if [ ! -f $CERT_DIR/cert.pem ]; then
+    mkdir -p $CERT_DIR
+    openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -days 365 \
+        -subj /CN=localhost -keyout $CERT_DIR/key.pem -out $CERT_DIR/cert.pem 2> /dev/null || exit 1
+    echo "Wrote a self-signed certificate to $CERT_DIR"
+fi
+if ! grep -qw tls /proc/sys/net/ipv4/tcp_available_ulp 2> /dev/null; then
+    echo "The kernel's tls module is not loaded (modprobe tls), so kTLS will not be used"
+fi
+
+$SERVER -t $TLS_PORT -c $CERT_DIR/cert.pem -k $CERT_DIR/key.pem $PORT > build/tls/server.log 2>&1 &
+server=$!
+sleep 0.5
+for mode in tcp tls tlsfull; do
+    case $mode in
+    tcp) flags= port=$PORT ;;
+    tls) flags=-t port=$TLS_PORT ;;
+    tlsfull) flags=-T port=$TLS_PORT ;;
+    esac
+    echo "== $mode"
+    $LOADGEN -n $GAMES -c $CONCURRENCY -r $PER_CONNECTION $flags 127.0.0.1 $port | grep -E "games/sec|p50|p99|handshakes|errors"
+done
+kill -INT $server
+wait $server
+grep "^TLS" build/tls/server.log
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Times a whole tournament end to end: a server with one tournament, and one
+# load generator entering every player at once and playing each round's
+# games until every player has its place. Prints the load generator's
+# results and the server's own account of the tournament. Every player holds
+# a connection for the whole tournament, so the open file limit is raised as
+# far as it goes.
+#
+# Usage: bench/tournament.sh [entrants] [single|swiss]
+SERVER=${SERVER:-./server}
+LOADGEN=${LOADGEN:-./loadgen}
+ENTRANTS=${1:-16384}
+FORMAT=${2:-single}
+BACKEND=${BACKEND:-epoll}
+PORT=${PORT:-15980}
+LOG=${LOG:-build/tournament.log}
+
+ulimit -n "$(ulimit -Hn)"
+mkdir -p "$(dirname "$LOG")"
+$SERVER -b $BACKEND -E bench:$FORMAT:$ENTRANTS $PORT > $LOG 2>&1 &
+server=$!
+sleep 0.3
+$LOADGEN -E bench -n $ENTRANTS 127.0.0.1 $PORT | grep -E "entrants|games|elapsed|p50|p99|errors"
+kill -INT $server
+wait $server
+grep "^Tournament bench:.*won by" $LOG
@@ -0,0 +1,291 @@
+// Records client sessions into capture files and loads them back for
+// replay. The format is described in capture.h.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "capture.h"
+
+static double monotonic(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+Makes room for n more bytes. Once memory runs out the session stops growing
+and keeps what it has.
+*/
+static int reserve(capture_writer *w, uint32_t n)
+{
+    if (w->buf == NULL)
+        return -1;
+    if (w->len + n <= w->size)
+        return 0;
+    uint32_t size = w->size * 2 > w->len + n ? w->size * 2 : w->len + n;
+    unsigned char *buf = realloc(w->buf, size);
+    if (buf == NULL)
+        return -1;
+    w->buf = buf;
+    w->size = size;
+    return 0;
+}
+
+static void put_le(unsigned char *p, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        p[i] = value >> (8 * i);
+}
+
+static uint64_t get_le(const unsigned char *p, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++)
+        value |= (uint64_t)p[i] << (8 * i);
+    return value;
+}
+
+static int put_varint(unsigned char *p, uint64_t value)
+{
+    int n = 0;
+    while (value >= 0x80)
+    {
+        p[n++] = value | 0x80;
+        value >>= 7;
+    }
+    p[n++] = value;
+    return n;
+}
+
+/*
+Reads a varint from p, not past end. Returns the bytes it took, or 0 if it
+runs past end.
+*/
+static int get_varint(const unsigned char *p, const unsigned char *end, uint64_t *value)
+{
+    *value = 0;
+    for (int n = 0; n < 10 && p + n < end; n++)
+    {
+        *value |= (uint64_t)(p[n] & 0x7F) << (7 * n);
+        if (!(p[n] & 0x80))
+            return n + 1;
+    }
+    return 0;
+}
+
+static void add_record(capture_writer *w, int from_server, const char *text, int len)
+{
+    double t = monotonic();
+    uint64_t gap = t > w->last ? (uint64_t)((t - w->last) * 1e6) : 0;
+    if (reserve(w, 20 + len))
+        return;
+    // The gap is rounded down, so carry the rest over to the next record
+    w->last += gap / 1e6;
+    w->len += put_varint(w->buf + w->len, gap);
+    w->len += put_varint(w->buf + w->len, (uint64_t)len << 1 | from_server);
+    if (len > 0)
+        memcpy(w->buf + w->len, text, len);
+    w->len += len;
+}
+
+void capture_begin(capture_writer *w, int flags)
+{
+    struct timespec wall;
+    memset(w, 0, sizeof(*w));
+    w->size = 4096;
+    w->buf = malloc(w->size);
+    if (w->buf == NULL)
+        return;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    w->last = monotonic();
+    memcpy(w->buf, CAPTURE_MAGIC, 4);
+    w->buf[4] = CAPTURE_VERSION;
+    w->buf[5] = flags;
+    put_le(w->buf + 6, (uint64_t)wall.tv_sec * 1000000 + wall.tv_nsec / 1000, 8);
+    w->len = CAPTURE_HEADER_SIZE;
+}
+
+void capture_data(capture_writer *w, int from_server, const char *bytes, int len)
+{
+    char *line = w->line[from_server];
+    int *line_len = &w->line_len[from_server];
+    for (int i = 0; i < len; i++)
+    {
+        line[(*line_len)++] = bytes[i];
+        if (bytes[i] == '\n' || *line_len == CAPTURE_LINE)
+        {
+            add_record(w, from_server, line, *line_len);
+            *line_len = 0;
+        }
+    }
+}
+
+void capture_close(capture_writer *w, int from_server)
+{
+    if (w->closed)
+        return;
+    w->closed = 1;
+    // A message cut short by the close is kept as it was
+    for (int side = 0; side < 2; side++)
+        if (w->line_len[side] > 0)
+            add_record(w, side, w->line[side], w->line_len[side]);
+    add_record(w, from_server, NULL, 0);
+}
+
+int capture_save(capture_writer *w, const char *path)
+{
+    int result = -1;
+    if (w->buf == NULL)
+    {
+        fprintf(stderr, "Out of memory recording the session\n");
+        return -1;
+    }
+    put_le(w->buf + 14, w->len - CAPTURE_HEADER_SIZE, 4);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+        perror(path);
+    else if (write(fd, w->buf, w->len) != (ssize_t)w->len)
+        perror(path);
+    else
+        result = 0;
+    if (fd >= 0)
+        close(fd);
+    free(w->buf);
+    w->buf = NULL;
+    return result;
+}
+
+/*
+Reads a whole file into memory. Returns NULL and prints why if it cannot.
+*/
+static char *read_file(const char *path, size_t *size)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st))
+    {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    char *data = malloc(st.st_size + 1);
+    size_t got = 0;
+    while (data != NULL && got < (size_t)st.st_size)
+    {
+        ssize_t n = read(fd, data + got, st.st_size - got);
+        if (n <= 0)
+        {
+            perror(path);
+            free(data);
+            data = NULL;
+        }
+        else
+            got += n;
+    }
+    close(fd);
+    *size = got;
+    return data;
+}
+
+/*
+Splits the records of one session. Returns -1 if they do not fill exactly
+the bytes given.
+*/
+static int load_records(capture_session *s, const unsigned char *p, const unsigned char *end)
+{
+    int size = 0;
+    uint64_t at = 0;
+    s->records = NULL;
+    s->num_records = 0;
+    while (p < end)
+    {
+        uint64_t gap, len;
+        int n = get_varint(p, end, &gap);
+        int m = n ? get_varint(p + n, end, &len) : 0;
+        if (m == 0 || (len >> 1) > (uint64_t)(end - p - n - m) || (len >> 1) > CAPTURE_LINE)
+            return -1;
+        if (s->num_records == size)
+        {
+            size = size ? size * 2 : 16;
+            capture_record *records = realloc(s->records, size * sizeof(capture_record));
+            if (records == NULL)
+                return -1;
+            s->records = records;
+        }
+        at += gap;
+        p += n + m;
+        capture_record *r = &s->records[s->num_records++];
+        r->at = at;
+        r->text = (const char *)p;
+        r->len = len >> 1;
+        r->from_server = len & 1;
+        p += r->len;
+    }
+    return 0;
+}
+
+int capture_load(capture_set *set, const char *path)
+{
+    size_t size;
+    char *data = read_file(path, &size);
+    if (data == NULL)
+        return -1;
+    char **files = realloc(set->files, (set->num_files + 1) * sizeof(char *));
+    if (files == NULL)
+    {
+        free(data);
+        return -1;
+    }
+    set->files = files;
+    set->files[set->num_files++] = data;
+
+    const unsigned char *p = (const unsigned char *)data, *end = p + size;
+    while (p < end)
+    {
+        if (end - p < CAPTURE_HEADER_SIZE || memcmp(p, CAPTURE_MAGIC, 4) || p[4] != CAPTURE_VERSION ||
+            get_le(p + 14, 4) > (uint64_t)(end - p - CAPTURE_HEADER_SIZE))
+        {
+            fprintf(stderr, "%s: not a capture, or cut short, at byte %zu\n", path, (size_t)(p - (const unsigned char *)data));
+            return -1;
+        }
+        if (set->num_sessions == set->size)
+        {
+            int grown = set->size ? set->size * 2 : 64;
+            capture_session *sessions = realloc(set->sessions, grown * sizeof(capture_session));
+            if (sessions == NULL)
+                return -1;
+            set->sessions = sessions;
+            set->size = grown;
+        }
+        capture_session *s = &set->sessions[set->num_sessions];
+        const unsigned char *records_end = p + CAPTURE_HEADER_SIZE + get_le(p + 14, 4);
+        s->flags = p[5];
+        s->start = get_le(p + 6, 8);
+        if (load_records(s, p + CAPTURE_HEADER_SIZE, records_end))
+        {
+            free(s->records);
+            fprintf(stderr, "%s: damaged session at byte %zu\n", path, (size_t)(p - (const unsigned char *)data));
+            return -1;
+        }
+        set->num_sessions++;
+        p = records_end;
+    }
+    return 0;
+}
+
+void capture_free(capture_set *set)
+{
+    for (int i = 0; i < set->num_sessions; i++)
+        free(set->sessions[i].records);
+    for (int i = 0; i < set->num_files; i++)
+        free(set->files[i]);
+    free(set->sessions);
+    free(set->files);
+    memset(set, 0, sizeof(*set));
+}
@@ -0,0 +1,104 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "TTTS"
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_SIZE 18
+#define CAPTURE_LINE 512 // Longest message kept whole; longer ones are split
+
+// Session flags
+#define CAPTURE_TLS 1
+#define CAPTURE_UNIX 2
+
+/*
+A capture file is a run of sessions, each written in one piece when its
+connection ends, so clients recording at once can share a file. A session
+is an 18 byte header: CAPTURE_MAGIC, the version, the flags, the wall clock
+time the session began in microseconds since 1970 (8 bytes) and the number
+of bytes of records that follow (4 bytes), all little-endian. Each record
+is one message as it crossed the connection, newline included: the
+microseconds since the record before it (or since the start) as a varint,
+then the message's length shifted left once, with the low bit set for
+messages from the server, as a varint, then the message. A record of length
+0 marks the side that closed the connection. Varints are 7 bits a byte, low
+bits first, with the high bit set on every byte but the last, so a record
+is usually 2 to 5 bytes longer than its message.
+*/
+
+/*
+A session being recorded, kept in memory until it is saved
+*/
+typedef struct capture_writer
+{
+    unsigned char *buf;  // Header and records
+    uint32_t len, size;
+    double last;         // Monotonic seconds at the last record
+    char line[2][CAPTURE_LINE]; // Part of a message from the client, and from the server
+    int line_len[2];
+    int closed;
+} capture_writer;
+
+/*
+Starts recording a session that begins now.
+*/
+void capture_begin(capture_writer *w, int flags);
+
+/*
+Records bytes that crossed the connection, from_server or from the client,
+one record for each message they complete.
+*/
+void capture_data(capture_writer *w, int from_server, const char *bytes, int len);
+
+/*
+Records that one side closed the connection. Only the first call counts.
+*/
+void capture_close(capture_writer *w, int from_server);
+
+/*
+Appends the session to the file at path, creating it if needed, in a single
+write. Returns -1 and prints why if it cannot. Frees the session either way.
+*/
+int capture_save(capture_writer *w, const char *path);
+
+/*
+One message of a session loaded for replay, or a close if len is 0
+*/
+typedef struct capture_record
+{
+    uint64_t at;         // Microseconds since the session began
+    const char *text;    // Points into the loaded file
+    uint16_t len;
+    uint8_t from_server;
+} capture_record;
+
+typedef struct capture_session
+{
+    uint64_t start;      // Wall clock microseconds since 1970
+    int flags;
+    capture_record *records;
+    int num_records;
+} capture_session;
+
+/*
+Every session of the files loaded so far
+*/
+typedef struct capture_set
+{
+    capture_session *sessions;
+    int num_sessions, size;
+    char **files;        // Contents, which the records point into
+    int num_files;
+} capture_set;
+
+/*
+Adds the sessions in the file at path to set, which starts zeroed. Returns
+-1 and prints why if the file cannot be read or is not a capture; sessions
+before the damage are kept.
+*/
+int capture_load(capture_set *set, const char *path);
+
+void capture_free(capture_set *set);
+
+#endif
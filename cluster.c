@@ -0,0 +1,253 @@
+// What game servers and the coordinator share to run as a cluster: the
+// connection between them, its message format, and a node's table of the
+// players it has asked the coordinator about.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "cluster.h"
+#include "hashtable.h"
+
+#define INITIAL_BUCKETS 1024
+
+typedef struct tracked
+{
+    unsigned long id;
+    void *player;
+    struct tracked *next;
+} tracked;
+
+static tracked **buckets = NULL;
+static size_t num_buckets = 0;
+static size_t num_tracked = 0;
+static cluster_link *backlog = NULL;
+
+int cluster_connect(const char *addr)
+{
+    char host[CLUSTER_ADDR_SIZE];
+    const char *colon = strrchr(addr, ':');
+    if (colon == NULL || colon - addr >= CLUSTER_ADDR_SIZE)
+    {
+        fprintf(stderr, "Expected host:port, not %s\n", addr);
+        return -1;
+    }
+    memcpy(host, addr, colon - addr);
+    host[colon - addr] = '\0';
+
+    struct addrinfo hint, *info_list, *info;
+    memset(&hint, 0, sizeof(hint));
+    hint.ai_family = AF_UNSPEC;
+    hint.ai_socktype = SOCK_STREAM;
+    int error = getaddrinfo(host, colon + 1, &hint, &info_list);
+    if (error)
+    {
+        fprintf(stderr, "%s: %s\n", addr, gai_strerror(error));
+        return -1;
+    }
+    int sock = -1;
+    for (info = info_list; info != NULL; info = info->ai_next)
+    {
+        sock = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        if (sock == -1)
+            continue;
+        if (connect(sock, info->ai_addr, info->ai_addrlen) == 0)
+            break;
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(info_list);
+    if (sock == -1)
+    {
+        fprintf(stderr, "Could not connect to %s\n", addr);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+void cluster_link_init(cluster_link *link, io_conn *io)
+{
+    memset(link, 0, sizeof(*link));
+    link->io = io;
+}
+
+/*
+Keeps bytes that did not fit for cluster_flush(). A peer that falls too far
+behind has its socket shut down, so the loop reports it as hung up.
+*/
+static void hold(cluster_link *link, const char *buf, int len)
+{
+    if (link->outbox_len + len > CLUSTER_OUTBOX_MAX)
+    {
+        shutdown(link->io->fd, SHUT_RDWR);
+        return;
+    }
+    if (link->outbox_len + len > link->outbox_size)
+    {
+        int size = link->outbox_size ? link->outbox_size : IO_OUTBUF;
+        while (size < link->outbox_len + len)
+            size *= 2;
+        char *outbox = realloc(link->outbox, size);
+        if (outbox == NULL)
+        {
+            shutdown(link->io->fd, SHUT_RDWR);
+            return;
+        }
+        link->outbox = outbox;
+        link->outbox_size = size;
+    }
+    memcpy(link->outbox + link->outbox_len, buf, len);
+    link->outbox_len += len;
+    if (!link->backlogged)
+    {
+        link->backlogged = 1;
+        link->next_backlog = backlog;
+        backlog = link;
+    }
+}
+
+void cluster_send(io_loop *loop, cluster_link *link, const char *cmd, const char *fmt, ...)
+{
+    char fields[256], msg[300];
+    va_list args;
+    va_start(args, fmt);
+    int fields_len = vsnprintf(fields, sizeof(fields), fmt, args);
+    va_end(args);
+    if (fields_len < 0 || fields_len >= (int)sizeof(fields))
+        return;
+    int len = snprintf(msg, sizeof(msg), "%s|%d|%s\n", cmd, fields_len, fields);
+
+    // Messages stay in order, so once some are waiting the rest wait too
+    if (link->outbox_len == 0 && link->io->out_len + len <= IO_OUTBUF)
+        io_send(loop, link->io, msg, len);
+    else
+        hold(link, msg, len);
+}
+
+int cluster_flush(io_loop *loop)
+{
+    cluster_link **prev = &backlog, *link;
+    while ((link = *prev) != NULL)
+    {
+        int space = IO_OUTBUF - link->io->out_len;
+        int len = link->outbox_len < space ? link->outbox_len : space;
+        if (len > 0 && !link->io->closing)
+        {
+            io_send(loop, link->io, link->outbox, len);
+            link->outbox_len -= len;
+            memmove(link->outbox, link->outbox + len, link->outbox_len);
+        }
+        if (link->outbox_len == 0 || link->io->closing)
+        {
+            *prev = link->next_backlog;
+            link->backlogged = 0;
+            link->outbox_len = 0;
+        }
+        else
+            prev = &link->next_backlog;
+    }
+    return backlog != NULL;
+}
+
+void cluster_link_drop(cluster_link *link)
+{
+    for (cluster_link **prev = &backlog; *prev != NULL; prev = &(*prev)->next_backlog)
+    {
+        if (*prev == link)
+        {
+            *prev = link->next_backlog;
+            break;
+        }
+    }
+    free(link->outbox);
+    cluster_link_init(link, link->io);
+}
+
+int cluster_split(char *line, char **fields, int max)
+{
+    int count = 0;
+    char *p = line, *bar;
+    while (count < max && (bar = strchr(p, '|')) != NULL)
+    {
+        *bar = '\0';
+        fields[count++] = p;
+        p = bar + 1;
+    }
+    // The length covers everything after its own bar
+    if (count < 2 || *p != '\0' || atoi(fields[1]) != (int)(p - (fields[1] + strlen(fields[1]) + 1)))
+        return -1;
+    fields[1] = fields[0];
+    for (int i = 2; i < count; i++)
+        fields[i - 1] = fields[i];
+    return count - 1;
+}
+
+static uint32_t hash_id(unsigned long id)
+{
+    return (id * 0x9E3779B97F4A7C15ul) >> 32;
+}
+
+static tracked **bucket(unsigned long id)
+{
+    return &buckets[hash_id(id) & (num_buckets - 1)];
+}
+
+// Doubles the bucket array once players outnumber buckets
+HASH_GROW(grow, tracked, next, id, hash_id, INITIAL_BUCKETS)
+
+int cluster_track(unsigned long id, void *player)
+{
+    if (num_tracked >= num_buckets && grow(&buckets, &num_buckets))
+        return -1;
+    tracked *t = malloc(sizeof(tracked));
+    if (t == NULL)
+        return -1;
+    tracked **b = bucket(id);
+    t->id = id;
+    t->player = player;
+    t->next = *b;
+    *b = t;
+    num_tracked++;
+    return 0;
+}
+
+void *cluster_find(unsigned long id)
+{
+    if (num_buckets == 0)
+        return NULL;
+    for (tracked *t = *bucket(id); t != NULL; t = t->next)
+        if (t->id == id)
+            return t->player;
+    return NULL;
+}
+
+void cluster_forget(unsigned long id)
+{
+    if (num_buckets == 0)
+        return;
+    for (tracked **prev = bucket(id); *prev != NULL; prev = &(*prev)->next)
+    {
+        if ((*prev)->id == id)
+        {
+            tracked *t = *prev;
+            *prev = t->next;
+            free(t);
+            num_tracked--;
+            return;
+        }
+    }
+}
+
+void cluster_each(void (*fn)(void *player))
+{
+    for (size_t i = 0; i < num_buckets; i++)
+        for (tracked *t = buckets[i]; t != NULL; t = t->next)
+            fn(t->player);
+}
@@ -0,0 +1,95 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include "ioloop.h"
+
+#define CLUSTER_ADDR_SIZE 64      // host:port a node tells the coordinator players can reach it on
+#define CLUSTER_MAX_FIELDS 8
+#define CLUSTER_OUTBOX_MAX (1 << 20) // A peer this far behind is treated as gone
+#define CLUSTER_SEAT_SECONDS 5    // How long a node keeps a room open for a player from another node
+#define CLUSTER_ROOM_PREFIX "c-"  // Starts the names of those rooms; player tokens are hex digits
+
+/*
+Messages between game servers (nodes) and the coordinator use the players'
+framing, CMD|len|fields|, one per line. A node asks:
+
+    NODE|addr|         register, with the address other nodes proxy players to
+    NAME|id|name|      reserve a name for player id across the cluster
+    FREE|name|         give a name back
+    QUEU|id|name|      put a player in the cluster's waiting queue
+    GONE|id|           a queued player left
+    OPEN|room|         the room asked for with HOST is open
+    SHUT|room|         it could not be, the player left
+
+and the coordinator answers:
+
+    OKAY|id|name|      the name is the player's
+    TAKN|id|           another player holds the name
+    PAIR|id|id|        both players are on this node, start a game, first is X
+    HOST|id|room|name| open a private room for the player from another node
+    SEND|id|addr|room| relay this player to the node at addr, to JOIN room,
+                       once the room is open
+
+Each side only queues messages with io_send(), so everything one pass of the
+loop produces for a peer goes out in one write.
+*/
+
+/*
+One end of a connection between a node and the coordinator. Messages that
+do not fit in the connection's output buffer wait in an outbox until
+cluster_flush() can move them over.
+*/
+typedef struct cluster_link
+{
+    io_conn *io;
+    char *outbox;
+    int outbox_len;
+    int outbox_size;
+    struct cluster_link *next_backlog; // Links whose outbox is not empty
+    int backlogged;
+} cluster_link;
+
+/*
+Connects to host:port, blocking until it succeeds. Nodes are expected to be
+on the same host or a fast local network. Returns the socket, or -1 and
+prints why.
+*/
+int cluster_connect(const char *addr);
+
+void cluster_link_init(cluster_link *link, io_conn *io);
+
+/*
+Queues a message. fmt formats the fields, each followed by |; the command
+and length are added around them.
+*/
+void cluster_send(io_loop *loop, cluster_link *link, const char *cmd, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+/*
+Moves waiting messages into their connections' output. Call before each pass
+of the loop; returns 1 if some are still waiting, so the next pass should
+not block.
+*/
+int cluster_flush(io_loop *loop);
+
+/*
+Drops a link's outbox once its connection is closed.
+*/
+void cluster_link_drop(cluster_link *link);
+
+/*
+Splits a message in place into its command and fields. Returns how many
+there are, command included, or -1 if the length does not match.
+*/
+int cluster_split(char *line, char **fields, int max);
+
+/*
+The players a node has asked the coordinator about, by the id it gave them.
+cluster_track() returns -1 if memory runs out. fn must not forget players.
+*/
+int cluster_track(unsigned long id, void *player);
+void *cluster_find(unsigned long id);
+void cluster_forget(unsigned long id);
+void cluster_each(void (*fn)(void *player));
+
+#endif
@@ -0,0 +1,464 @@
+// NOTE: must use option -pthread when compiling, together with cluster.c, ioloop.c, trace.c, lockprof.c, tls.c and websocket.c, linked with -lssl -lcrypto!
+// The cluster coordinator. Game servers started with -C register here and
+// hand it the two things players on different nodes must agree on: which
+// names are taken, and who is next in the queue for an opponent. It runs on
+// the same event loop as the game servers, one thread with no locks.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include "ioloop.h"
+#include "cluster.h"
+#include "parse.h"
+#include "hashtable.h"
+
+#define QUEUE_SIZE SOMAXCONN
+#define INITIAL_BUCKETS 1024
+
+/*
+A game server connected to the coordinator
+*/
+typedef struct node
+{
+    io_conn io;                     // Socket and its buffers, must be first
+    cluster_link link;
+    char addr[CLUSTER_ADDR_SIZE];   // Where other nodes send its players, empty until NODE
+    unsigned long players;          // Names it holds
+} node;
+
+/*
+A name taken somewhere in the cluster, and the node whose player holds it
+*/
+typedef struct name_entry
+{
+    char *name;
+    node *owner;
+    struct name_entry *next;
+} name_entry;
+
+/*
+The player waiting for an opponent. Players are paired as soon as a second
+one arrives, so the cluster's queue never holds more than one.
+*/
+struct
+{
+    node *node;
+    unsigned long id;
+} waiting;
+
+/*
+A game between two nodes whose host has not opened the room yet. The guest
+is only sent once it has, so its JOIN cannot arrive first.
+*/
+typedef struct opening
+{
+    char room[17];
+    node *host;
+    node *guest;
+    unsigned long guest_id;
+    char guest_name[128];
+    struct opening *next;
+} opening;
+
+io_loop *loop;
+int active = 1;
+opening *openings = NULL;
+name_entry **names = NULL;
+size_t num_buckets = 0, num_names = 0;
+unsigned long local_pairs = 0, remote_pairs = 0, refused = 0;
+
+static name_entry **find_name(const char *name)
+{
+    name_entry **entry = &names[hash_string(name) & (num_buckets - 1)];
+    while (*entry != NULL && strcmp((*entry)->name, name) != 0)
+        entry = &(*entry)->next;
+    return entry;
+}
+
+// Doubles the bucket array once names outnumber buckets
+HASH_GROW(grow, name_entry, next, name, hash_string, INITIAL_BUCKETS)
+
+/*
+Reserves a name for a node's player. Returns 0, or -1 if it is taken.
+*/
+int reserve(node *n, const char *name)
+{
+    if (num_names >= num_buckets && grow(&names, &num_buckets))
+        return -1;
+    name_entry **entry = find_name(name);
+    if (*entry != NULL)
+        return -1;
+    name_entry *e = malloc(sizeof(name_entry));
+    if (e == NULL)
+        return -1;
+    e->name = strdup(name);
+    e->owner = n;
+    e->next = NULL;
+    *entry = e;
+    num_names++;
+    n->players++;
+    return 0;
+}
+
+static void remove_entry(name_entry **entry)
+{
+    name_entry *e = *entry;
+    *entry = e->next;
+    e->owner->players--;
+    free(e->name);
+    free(e);
+    num_names--;
+}
+
+/*
+Frees a name, if the node asking is the one holding it.
+*/
+void release(node *n, const char *name)
+{
+    if (num_buckets == 0)
+        return;
+    name_entry **entry = find_name(name);
+    if (*entry != NULL && (*entry)->owner == n)
+        remove_entry(entry);
+}
+
+/*
+Writes the name of a room for a game between two nodes.
+*/
+void new_room(char room[17])
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char bytes[7];
+    if (getrandom(bytes, sizeof(bytes), 0) != sizeof(bytes))
+    {
+        perror("getrandom");
+        exit(EXIT_FAILURE);
+    }
+    int prefix = strlen(CLUSTER_ROOM_PREFIX);
+    memcpy(room, CLUSTER_ROOM_PREFIX, prefix);
+    for (int i = 0; i < 7; i++)
+    {
+        room[prefix + i * 2] = hex[bytes[i] >> 4];
+        room[prefix + i * 2 + 1] = hex[bytes[i] & 15];
+    }
+    room[prefix + 14] = '\0';
+}
+
+/*
+Queues a player, or pairs them with the one already waiting. The player who
+waited plays X, as on a single server. When the two are on different nodes,
+the waiting player's node hosts the game in a private room, and the other
+node relays its player there.
+*/
+void enqueue(node *n, unsigned long id, const char *name)
+{
+    if (waiting.node == NULL)
+    {
+        waiting.node = n;
+        waiting.id = id;
+        return;
+    }
+    if (waiting.node == n && waiting.id == id)
+        return;
+    node *host = waiting.node;
+    waiting.node = NULL;
+    if (host == n)
+    {
+        cluster_send(loop, &n->link, "PAIR", "%lu|%lu|", waiting.id, id);
+        local_pairs++;
+        return;
+    }
+    opening *o = malloc(sizeof(opening));
+    if (o == NULL)
+    {
+        // Put the host's player back; this one will be paired with the next
+        waiting.node = host;
+        return;
+    }
+    new_room(o->room);
+    o->host = host;
+    o->guest = n;
+    o->guest_id = id;
+    snprintf(o->guest_name, sizeof(o->guest_name), "%s", name);
+    o->next = openings;
+    openings = o;
+    cluster_send(loop, &host->link, "HOST", "%lu|%s|%s|", waiting.id, o->room, name);
+}
+
+/*
+The host node answered about a room: OPEN sends the guest, SHUT means its
+player left, so the guest goes back to the queue.
+*/
+void room_answer(node *host, const char *room, int open)
+{
+    opening **prev = &openings, *o;
+    while ((o = *prev) != NULL && (o->host != host || strcmp(o->room, room) != 0))
+        prev = &o->next;
+    if (o == NULL)
+        return;
+    *prev = o->next;
+    if (o->guest != NULL && open)
+    {
+        cluster_send(loop, &o->guest->link, "SEND", "%lu|%s|%s|", o->guest_id, host->addr, room);
+        remote_pairs++;
+    }
+    else if (o->guest != NULL)
+        enqueue(o->guest, o->guest_id, o->guest_name);
+    free(o);
+}
+
+/*
+Handles one message from a node.
+*/
+void handle_message(node *n, char *line)
+{
+    char *f[CLUSTER_MAX_FIELDS];
+    int count = cluster_split(line, f, CLUSTER_MAX_FIELDS);
+    if (count < 0)
+    {
+        fprintf(stderr, "Bad message from node %s\n", n->addr);
+        return;
+    }
+    if (strcmp(f[0], "NODE") == 0 && count == 2)
+    {
+        snprintf(n->addr, sizeof(n->addr), "%s", f[1]);
+        printf("Node %s registered\n", n->addr);
+    }
+    else if (strcmp(f[0], "NAME") == 0 && count == 3)
+    {
+        if (reserve(n, f[2]) == 0)
+            cluster_send(loop, &n->link, "OKAY", "%s|%s|", f[1], f[2]);
+        else
+        {
+            cluster_send(loop, &n->link, "TAKN", "%s|", f[1]);
+            refused++;
+        }
+    }
+    else if (strcmp(f[0], "FREE") == 0 && count == 2)
+        release(n, f[1]);
+    else if (strcmp(f[0], "QUEU") == 0 && count == 3)
+        enqueue(n, strtoul(f[1], NULL, 10), f[2]);
+    else if ((strcmp(f[0], "OPEN") == 0 || strcmp(f[0], "SHUT") == 0) && count == 2)
+        room_answer(n, f[1], f[0][0] == 'O');
+    else if (strcmp(f[0], "GONE") == 0 && count == 2)
+    {
+        if (waiting.node == n && waiting.id == strtoul(f[1], NULL, 10))
+            waiting.node = NULL;
+    }
+    else
+        fprintf(stderr, "Unknown message %s from node %s\n", f[0], n->addr);
+}
+
+void on_hangup(io_loop *loop, io_conn *c);
+
+void on_read(io_loop *loop, io_conn *c)
+{
+    node *n = (node *)c;
+    char buf[BUFSIZE];
+    while (!c->closing && c->in_len > 0)
+    {
+        char *end = memchr(c->in, '\n', c->in_len);
+        int len = end != NULL ? end - c->in : c->in_len;
+        if (len >= BUFSIZE)
+        {
+            fprintf(stderr, "Message too long from node %s\n", n->addr);
+            on_hangup(loop, c);
+            return;
+        }
+        if (end == NULL)
+            break; // Wait for the rest of the message
+        memcpy(buf, c->in, len);
+        buf[len] = '\0';
+        c->in_len -= len + 1;
+        memmove(c->in, end + 1, c->in_len);
+        handle_message(n, buf);
+    }
+}
+
+/*
+A node went away, and with it its players: their names are free again and
+the one that may have been waiting leaves the queue.
+*/
+void on_hangup(io_loop *loop, io_conn *c)
+{
+    node *n = (node *)c;
+    printf("Node %s left with %lu names\n", n->addr, n->players);
+    for (size_t i = 0; i < num_buckets && n->players > 0; i++)
+    {
+        name_entry **entry = &names[i];
+        while (*entry != NULL)
+        {
+            if ((*entry)->owner == n)
+                remove_entry(entry);
+            else
+                entry = &(*entry)->next;
+        }
+    }
+    if (waiting.node == n)
+        waiting.node = NULL;
+    // Games it was to host will not start, and its guests will not arrive
+    opening **prev = &openings, *o;
+    while ((o = *prev) != NULL)
+    {
+        if (o->host == n)
+        {
+            *prev = o->next;
+            if (o->guest != NULL && o->guest != n)
+                enqueue(o->guest, o->guest_id, o->guest_name);
+            free(o);
+            continue;
+        }
+        if (o->guest == n)
+            o->guest = NULL;
+        prev = &o->next;
+    }
+    cluster_link_drop(&n->link);
+    io_close(loop, c);
+}
+
+void on_release(io_loop *loop, io_conn *c)
+{
+    free(c);
+}
+
+void on_accept(io_loop *loop, int fd, int listener, struct sockaddr *addr, socklen_t addr_len)
+{
+    node *n = aligned_alloc(64, sizeof(node));
+    if (n == NULL)
+    {
+        close(fd);
+        return;
+    }
+    n->addr[0] = '\0';
+    n->players = 0;
+    if (io_add(loop, &n->io, fd))
+    {
+        close(fd);
+        free(n);
+        return;
+    }
+    cluster_link_init(&n->link, &n->io);
+}
+
+void shut_down(io_loop *loop, void *arg)
+{
+    active = 0;
+}
+
+io_task shutdown_task = {shut_down, NULL, NULL, 0};
+
+void handler(int signum)
+{
+    io_post(loop, &shutdown_task);
+}
+
+/*
+Used to open a port for nodes to connect to.
+*/
+int open_listener(char *service, int queue_size)
+{
+    struct addrinfo hint, *info_list, *info;
+    int error, sock = -1;
+    memset(&hint, 0, sizeof(struct addrinfo));
+    hint.ai_family = AF_UNSPEC;
+    hint.ai_socktype = SOCK_STREAM;
+    hint.ai_flags = AI_PASSIVE;
+    error = getaddrinfo(NULL, service, &hint, &info_list);
+    if (error)
+    {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(error));
+        return -1;
+    }
+    for (info = info_list; info != NULL; info = info->ai_next)
+    {
+        sock = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        if (sock == -1)
+            continue;
+        int one = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(sock, info->ai_addr, info->ai_addrlen) == 0 && listen(sock, queue_size) == 0)
+            break;
+        close(sock);
+    }
+    freeaddrinfo(info_list);
+    if (info == NULL)
+    {
+        fprintf(stderr, "Could not bind\n");
+        return -1;
+    }
+    return sock;
+}
+
+int main(int argc, char **argv)
+{
+    io_callbacks callbacks = {on_accept, on_read, on_hangup, on_release};
+    char *service = "15100";
+    char *backend = "epoll";
+    int opt;
+    while ((opt = getopt(argc, argv, "b:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            backend = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-b epoll|uring] [port]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (optind < argc)
+        service = argv[optind];
+
+    loop = io_loop_create(backend, &callbacks);
+    if (loop == NULL)
+        exit(EXIT_FAILURE);
+    struct sigaction act;
+    act.sa_handler = handler;
+    act.sa_flags = 0;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+    act.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &act, NULL);
+
+    int listener = open_listener(service, QUEUE_SIZE);
+    if (listener < 0)
+        exit(EXIT_FAILURE);
+    io_add_listener(loop, listener);
+    printf("Coordinating nodes on %s, using the %s backend\n", service, io_loop_backend(loop));
+
+    while (active)
+    {
+        int backlog = cluster_flush(loop);
+        if (io_run_once(loop, backlog ? 0 : -1) < 0)
+        {
+            perror("event loop");
+            break;
+        }
+    }
+
+    puts("Shutting down");
+    printf("coordinator: %lu games on one node, %lu across nodes, %lu names refused, %lu syscalls\n",
+           local_pairs, remote_pairs, refused, io_syscalls(loop));
+    for (size_t i = 0; i < num_buckets; i++)
+    {
+        name_entry *e = names[i], *next;
+        for (; e != NULL; e = next)
+        {
+            next = e->next;
+            free(e->name);
+            free(e);
+        }
+    }
+    free(names);
+    close(listener);
+    io_loop_destroy(loop);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,113 @@
+// Table of games in progress. Games live in fixed-size slots, grouped into
+// shards of GAME_SHARD_SLOTS that are added as the table grows and never
+// moved, so lookups by handle are two indexes and a compare. Freed slots are
+// reused most recent first, while they are still in cache. Each shard keeps a
+// bitmap of the slots in use, so a sweep skips empty stretches 64 slots at a
+// time and reads the games it visits in memory order. Only the event loop
+// uses the table, so it needs no locking.
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include "gametable.h"
+
+#define NO_SLOT UINT32_MAX
+
+typedef struct shard
+{
+    unsigned char slots[GAME_SHARD_SLOTS][GAME_SLOT_SIZE];
+    uint32_t generation[GAME_SHARD_SLOTS]; // Odd while the slot holds a game
+    uint32_t next_free[GAME_SHARD_SLOTS];  // Next slot in the free list, by index
+    uint64_t live[GAME_SHARD_SLOTS / 64];  // Slots holding a game
+} shard;
+
+static shard *shards[GAME_MAX_SHARDS];
+static uint32_t num_shards = 0;
+static uint32_t free_head = NO_SLOT;
+static int num_games = 0;
+
+/*
+Adds a shard and puts its slots on the free list, lowest first.
+*/
+static int grow(void)
+{
+    if (num_shards == GAME_MAX_SHARDS)
+        return -1;
+    shard *s = aligned_alloc(64, sizeof(shard));
+    if (s == NULL)
+        return -1;
+    memset(s->generation, 0, sizeof(s->generation));
+    memset(s->live, 0, sizeof(s->live));
+    uint32_t base = num_shards << GAME_SHARD_BITS;
+    for (uint32_t i = 0; i < GAME_SHARD_SLOTS; i++)
+        s->next_free[i] = i + 1 < GAME_SHARD_SLOTS ? base + i + 1 : free_head;
+    free_head = base;
+    shards[num_shards++] = s;
+    return 0;
+}
+
+void *game_alloc(game_handle *handle)
+{
+    if (free_head == NO_SLOT && grow())
+        return NULL;
+    uint32_t index = free_head;
+    shard *s = shards[index >> GAME_SHARD_BITS];
+    uint32_t i = index & (GAME_SHARD_SLOTS - 1);
+    free_head = s->next_free[i];
+    s->generation[i]++;
+    s->live[i / 64] |= 1ull << (i % 64);
+    num_games++;
+    *handle = (uint64_t)s->generation[i] << 32 | index;
+    return s->slots[i];
+}
+
+void *game_get(game_handle handle)
+{
+    uint32_t index = (uint32_t)handle, generation = handle >> 32;
+    if (index >> GAME_SHARD_BITS >= num_shards || !(generation & 1))
+        return NULL;
+    shard *s = shards[index >> GAME_SHARD_BITS];
+    uint32_t i = index & (GAME_SHARD_SLOTS - 1);
+    return s->generation[i] == generation ? s->slots[i] : NULL;
+}
+
+void game_free(game_handle handle)
+{
+    if (game_get(handle) == NULL)
+        return;
+    uint32_t index = (uint32_t)handle;
+    shard *s = shards[index >> GAME_SHARD_BITS];
+    uint32_t i = index & (GAME_SHARD_SLOTS - 1);
+    s->generation[i]++;
+    s->live[i / 64] &= ~(1ull << (i % 64));
+    s->next_free[i] = free_head;
+    free_head = index;
+    num_games--;
+}
+
+void game_each(void (*visit)(game_handle handle, void *slot, void *arg), void *arg)
+{
+    for (uint32_t n = 0; n < num_shards; n++)
+    {
+        shard *s = shards[n];
+        for (uint32_t w = 0; w < GAME_SHARD_SLOTS / 64; w++)
+        {
+            // Taken before visiting, so freeing the game being visited is safe
+            uint64_t word = s->live[w];
+            while (word != 0)
+            {
+                uint32_t i = w * 64 + __builtin_ctzll(word);
+                word &= word - 1;
+                if (!(s->generation[i] & 1))
+                    continue;
+                visit((uint64_t)s->generation[i] << 32 | n << GAME_SHARD_BITS | i, s->slots[i], arg);
+            }
+        }
+    }
+}
+
+int game_count(int *capacity)
+{
+    if (capacity != NULL)
+        *capacity = num_shards * GAME_SHARD_SLOTS;
+    return num_games;
+}
@@ -0,0 +1,51 @@
+#ifndef GAMETABLE_H
+#define GAMETABLE_H
+
+#include <stdint.h>
+
+#define GAME_SLOT_SIZE 64                      // Every game is one cache line
+#define GAME_SHARD_BITS 10
+#define GAME_SHARD_SLOTS (1 << GAME_SHARD_BITS) // Slots added at a time
+#ifndef GAME_MAX_SHARDS
+#define GAME_MAX_SHARDS 4096                   // Up to 4M games at once
+#endif
+
+/*
+Names a game: its slot's index in the low 32 bits and the slot's generation
+in the high 32. The generation changes when the game is freed, so a handle
+kept after its game ended finds nothing, even once the slot holds another
+game. GAME_NONE is never a handle.
+*/
+typedef uint64_t game_handle;
+#define GAME_NONE 0
+
+/*
+Takes a slot of GAME_SLOT_SIZE bytes, aligned to a cache line, and writes
+its handle. Slots never move, so a pointer to one stays good until it is
+freed. Returns NULL if memory runs out or the table is full.
+*/
+void *game_alloc(game_handle *handle);
+
+/*
+Gives a game's slot back. A stale handle is ignored.
+*/
+void game_free(game_handle handle);
+
+/*
+Returns the slot of a game, or NULL if the handle is stale or was never
+given out.
+*/
+void *game_get(game_handle handle);
+
+/*
+Calls visit for every game, in slot order. visit may free the game it was
+given; games taken during the sweep may or may not be visited.
+*/
+void game_each(void (*visit)(game_handle handle, void *slot, void *arg), void *arg);
+
+/*
+Returns the number of games, and through capacity the number of slots.
+*/
+int game_count(int *capacity);
+
+#endif
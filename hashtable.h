@@ -0,0 +1,52 @@
+#ifndef HASHTABLE_H
+#define HASHTABLE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+FNV-1a hash of a string, shared by every table keyed by a name or token.
+*/
+static inline uint32_t hash_string(const char *s)
+{
+    uint32_t hash = 2166136261u;
+    for (; *s; s++)
+    {
+        hash ^= (unsigned char)*s;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+Defines static int name(type ***buckets, size_t *num_buckets), which doubles
+the bucket array of a chained table whose size is a power of two, or makes
+the first one with initial buckets. Entries are chained through their next
+member and go in the bucket hash(entry->key) picks. Returns 0, or -1 if
+memory runs out, in which case the table is left as it was.
+*/
+#define HASH_GROW(name, type, next, key, hash, initial)                 \
+    static int name(type ***buckets, size_t *num_buckets)               \
+    {                                                                   \
+        size_t size = *num_buckets ? *num_buckets * 2 : (initial);      \
+        type **table = calloc(size, sizeof(type *));                    \
+        if (table == NULL)                                              \
+            return -1;                                                  \
+        for (size_t i = 0; i < *num_buckets; i++)                       \
+        {                                                               \
+            type *entry = (*buckets)[i], *following;                    \
+            for (; entry != NULL; entry = following)                    \
+            {                                                           \
+                following = entry->next;                                \
+                type **bucket = &table[hash(entry->key) & (size - 1)];  \
+                entry->next = *bucket;                                  \
+                *bucket = entry;                                        \
+            }                                                           \
+        }                                                               \
+        free(*buckets);                                                 \
+        *buckets = table;                                               \
+        *num_buckets = size;                                            \
+        return 0;                                                       \
+    }
+
+#endif
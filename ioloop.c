@@ -0,0 +1,1690 @@
+// Event loop backends for ttts: epoll, and io_uring driven through the raw
+// system calls so there is no dependency on liburing.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "ioloop.h"
+#include "trace.h"
+
+#define IO_KIND_CONN 1
+#define IO_KIND_LISTENER 2
+#define IO_KIND_WAKE 3
+#define MAX_LISTENERS 8
+#define MAX_EVENTS 256
+#define ACCEPT_BATCH 64 // Connections accepted per pass, so a rush of them cannot hold up games in progress
+
+#define URING_ENTRIES 1024
+#define URING_BUFS 1024 // Provided receive buffers, must be a power of 2
+#define URING_BUF_SIZE 512
+#define URING_BGID 0
+
+// Operation stored in the low bits of an io_uring user_data pointer
+#define OP_ACCEPT 1
+#define OP_RECV 2
+#define OP_SEND 3
+#define OP_WAKE 4
+#define OP_POLL 5 // Waits for a TLS handshake's socket to be readable or writable
+#define OP_MASK 7
+
+// tls_mode bits
+#define TLS_HANDSHAKING 1
+#define TLS_USER_RECV 2 // OpenSSL decrypts what arrives
+#define TLS_USER_SEND 4 // OpenSSL encrypts what is queued
+
+_Static_assert(offsetof(io_conn, in) == 64, "io_conn's fields must fit in one cache line");
+
+// Aligned so the low bits of its address are free to tag io_uring operations
+typedef struct io_listener
+{
+    int kind;
+    int fd;
+    int index;
+} __attribute__((aligned(8))) io_listener;
+
+typedef struct io_backend
+{
+    const char *name;
+    int (*add_listener)(io_loop *loop, io_listener *l);
+    int (*add_wake)(io_loop *loop);
+    int (*add)(io_loop *loop, io_conn *c);
+    void (*handshake_wait)(io_loop *loop, io_conn *c, int want_write);
+    void (*handshake_done)(io_loop *loop, io_conn *c);
+    void (*stall)(io_loop *loop, io_conn *c);  // Stops reading c until resume
+    void (*resume)(io_loop *loop, io_conn *c); // Reads again once nothing kept is left
+    void (*flush)(io_loop *loop, io_conn *c);
+    int (*finish_close)(io_loop *loop, io_conn *c); // Returns 1 once c can be released
+    int (*wait)(io_loop *loop, int timeout_ms);
+    void (*destroy)(io_loop *loop);
+} io_backend;
+
+struct io_loop
+{
+    const io_backend *backend;
+    io_callbacks cb;
+    io_listener listeners[MAX_LISTENERS];
+    int num_listeners;
+    io_conn *dirty;
+    io_conn *closing;
+    io_conn *resuming;  // Handing over input kept while stalled, a buffer a pass
+    unsigned long syscalls;
+
+    // Mailbox: tasks are pushed onto a lock-free stack, and the eventfd wakes
+    // the loop when a push finds it empty
+    io_task *mailbox;
+    io_listener wake;
+    uint64_t wake_count;
+    int wake_error;     // errno of a failed wakeup, for the loop's thread to report
+
+    io_tls_stats tls;
+
+    // epoll
+    int epfd;
+
+    // io_uring
+    int ring_fd;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned sqe_tail;
+    unsigned to_submit;
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *bufs;
+    unsigned short buf_tail;
+};
+
+static __thread io_loop *running = NULL; // Loop this thread is handling events for, NULL while it blocks
+
+static void release(io_loop *loop, io_conn *c)
+{
+    loop->cb.on_release(loop, c);
+}
+
+/*
+Called just before the loop blocks: returns the timeout to block with, 0 if a
+task is already waiting. From here until idle_end() a post on this thread,
+which can only come from a signal handler, wakes the loop like any other.
+*/
+static int idle_begin(io_loop *loop, int timeout_ms)
+{
+    __atomic_store_n(&running, NULL, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&loop->mailbox, __ATOMIC_SEQ_CST) != NULL || loop->resuming != NULL)
+        return 0;
+    return timeout_ms;
+}
+
+static void idle_end(io_loop *loop)
+{
+    __atomic_store_n(&running, loop, __ATOMIC_SEQ_CST);
+}
+
+/*
+Checks how long a traced move took once all of its output has left the server.
+*/
+static void traced_write(io_conn *c)
+{
+    if (c->trace_since && c->out_len == 0)
+    {
+        trace_move_done(c->fd, c->trace_since);
+        c->trace_since = 0;
+    }
+}
+
+/*
+Bytes at the front of out that may be written to the socket: everything,
+unless OpenSSL has not encrypted the end of it yet.
+*/
+static int sendable(io_conn *c)
+{
+    return c->tls_mode & TLS_USER_SEND ? c->sealed : c->out_len;
+}
+
+/*
+Moves as much of the backlog into out as fits, to go out with the next send.
+*/
+static void refill(io_conn *c)
+{
+    int space = IO_OUTBUF - c->out_len;
+    int bytes = c->backlog_len < space ? c->backlog_len : space;
+    if (bytes == 0)
+        return;
+    memcpy(c->out + c->out_len, c->backlog + c->backlog_start, bytes);
+    c->out_len += bytes;
+    c->backlog_start += bytes;
+    c->backlog_len -= bytes;
+    if (c->backlog_len == 0)
+        c->backlog_start = 0;
+}
+
+/*
+Drops all output after a failed send.
+*/
+static void send_failed(io_conn *c)
+{
+    c->out_len = c->sealed = 0;
+    c->backlog_start = c->backlog_len = 0;
+}
+
+static void sent(io_conn *c, int bytes)
+{
+    c->out_len -= bytes;
+    memmove(c->out, c->out + bytes, c->out_len);
+    if (c->tls_mode & TLS_USER_SEND)
+        c->sealed -= bytes;
+}
+
+/*
+Encrypts what was queued since the last flush, in place after the bytes that
+are already encrypted, and takes as much of OpenSSL's output as fits. The
+rest waits in OpenSSL until a send makes room.
+*/
+static void tls_seal(io_conn *c)
+{
+    if (!(c->tls_mode & TLS_USER_SEND))
+        return;
+    if (c->out_len > c->sealed)
+    {
+        tls_write(c->tls, c->out + c->sealed, c->out_len - c->sealed);
+        c->out_len = c->sealed;
+    }
+    c->out_len += tls_take(c->tls, c->out + c->out_len, IO_OUTBUF - c->out_len);
+    c->sealed = c->out_len;
+}
+
+static void mark_dirty(io_loop *loop, io_conn *c);
+
+/*
+Appends to a connection's backlog, growing it up to its limit. Returns -1 if
+the bytes do not fit.
+*/
+static int defer(io_conn *c, const char *header, int header_len, const char *buf, int len)
+{
+    int end = c->backlog_start + c->backlog_len;
+    if (c->backlog_len + header_len + len > c->backlog_max)
+        return -1;
+    if (end + header_len + len > c->backlog_size)
+    {
+        // Slide what is left to the front before growing
+        if (c->backlog_len > 0)
+            memmove(c->backlog, c->backlog + c->backlog_start, c->backlog_len);
+        c->backlog_start = 0;
+        end = c->backlog_len;
+        int size = c->backlog_size ? c->backlog_size : IO_OUTBUF;
+        while (end + header_len + len > size)
+            size *= 2;
+        if (size != c->backlog_size)
+        {
+            char *grown = realloc(c->backlog, size);
+            if (grown == NULL)
+                return -1;
+            c->backlog = grown;
+            c->backlog_size = size;
+        }
+    }
+    memcpy(c->backlog + end, header, header_len);
+    memcpy(c->backlog + end + header_len, buf, len);
+    c->backlog_len += header_len + len;
+    return 0;
+}
+
+/*
+Appends a header, which may be empty, and a message to a connection's output.
+*/
+static void enqueue(io_loop *loop, io_conn *c, const char *header, int header_len, const char *buf, int len)
+{
+    if (c->closing || c->overflow)
+        return;
+    if (c->backlog_max > 0 && (c->backlog_len > 0 || c->out_len + header_len + len > IO_OUTBUF))
+    {
+        // Behind whatever already waits, so messages keep their order
+        if (defer(c, header, header_len, buf, len) == 0)
+        {
+            mark_dirty(loop, c);
+            return;
+        }
+    }
+    if (c->backlog_len > 0 || c->out_len + header_len + len > IO_OUTBUF)
+    {
+        // The peer stopped reading. The server hears about it once the
+        // current pass is over, never from inside one of its own calls.
+        c->overflow = 1;
+        mark_dirty(loop, c);
+        return;
+    }
+    memcpy(c->out + c->out_len, header, header_len);
+    memcpy(c->out + c->out_len + header_len, buf, len);
+    c->out_len += header_len + len;
+    mark_dirty(loop, c);
+}
+
+/*
+Where the next received bytes go, and how many fit: after the server's unread
+input, leaving room for an incomplete WebSocket frame waiting at the end.
+*/
+static char *input_tail(io_conn *c, int *space)
+{
+    *space = IO_INBUF - 1 - c->in_len - (c->ws ? c->ws_held : 0);
+    return c->in + c->in_len;
+}
+
+/*
+Sends a close frame with a status code and treats the connection as hung up.
+*/
+static void ws_fail(io_loop *loop, io_conn *c, int status)
+{
+    char header[4], code[2] = {status >> 8, status & 0xFF};
+    enqueue(loop, c, header, ws_frame_header(header, WS_CLOSE, 2), code, 2);
+    c->ws = WS_CLOSED;
+    loop->cb.on_hangup(loop, c);
+}
+
+/*
+Finishes the upgrade request and turns WebSocket frames into input for the
+server. Payloads are unmasked where they landed and moved down over the frame
+headers, each message ending in a newline like a line from a raw socket, so
+the server's parser sees the same bytes either way. An incomplete frame moves
+to the end of the buffer until the rest arrives. Returns -1 once the
+connection failed or closed.
+*/
+static int ws_received(io_loop *loop, io_conn *c, int bytes)
+{
+    char *raw = c->in + c->in_len;
+    int raw_len = bytes, used = 0;
+    if (c->ws_held > 0)
+    {
+        // The start of the frame goes back in front of the rest of it
+        char held[IO_INBUF];
+        memcpy(held, c->in + IO_INBUF - c->ws_held, c->ws_held);
+        memmove(raw + c->ws_held, raw, bytes);
+        memcpy(raw, held, c->ws_held);
+        raw_len += c->ws_held;
+        c->ws_held = 0;
+    }
+
+    if (c->ws < WS_UPGRADED)
+    {
+        used = ws_read_request(raw, raw_len, c->in_len + raw_len >= IO_INBUF - 1, &c->ws, c->ws_accept);
+        if (used < 0)
+        {
+            static const char bad_request[] = "HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n";
+            c->ws = WS_CLOSED;
+            enqueue(loop, c, "", 0, bad_request, sizeof(bad_request) - 1);
+            loop->cb.on_hangup(loop, c);
+            return -1;
+        }
+        if (c->ws == WS_UPGRADED)
+        {
+            char reply[160];
+            enqueue(loop, c, "", 0, reply, ws_upgrade_reply(reply, sizeof(reply), c->ws_accept));
+        }
+    }
+
+    char *decoded = raw;
+    while (c->ws == WS_UPGRADED)
+    {
+        ws_frame f;
+        int ret = ws_parse_frame(raw + used, raw_len - used, IO_INBUF - 2 - WS_MAX_HEADER, &f);
+        if (ret == 0)
+            break;
+        if (ret < 0)
+        {
+            ws_fail(loop, c, 1002);
+            return -1;
+        }
+        char *payload = raw + used + f.header;
+        ws_unmask(payload, f.payload, f.mask);
+        used += f.header + f.payload;
+        switch (f.opcode)
+        {
+        case WS_TEXT:
+        case WS_BINARY:
+        case WS_CONTINUATION:
+            // The frame's header is at least 6 bytes, so the newline fits
+            memmove(decoded, payload, f.payload);
+            decoded += f.payload;
+            if (f.fin && (decoded == c->in || decoded[-1] != '\n'))
+                *decoded++ = '\n';
+            break;
+        case WS_PING:
+        {
+            char header[4];
+            enqueue(loop, c, header, ws_frame_header(header, WS_PONG, f.payload), payload, f.payload);
+            break;
+        }
+        case WS_PONG:
+            break;
+        case WS_CLOSE:
+        {
+            // Echo the status code, as the protocol asks, then hang up
+            char header[4];
+            int len = f.payload < 2 ? f.payload : 2;
+            enqueue(loop, c, header, ws_frame_header(header, WS_CLOSE, len), payload, len);
+            c->ws = WS_CLOSED;
+            loop->cb.on_hangup(loop, c);
+            return -1;
+        }
+        default:
+            ws_fail(loop, c, 1002);
+            return -1;
+        }
+    }
+
+    c->in_len = decoded - c->in;
+    c->ws_held = raw_len - used;
+    memmove(c->in + IO_INBUF - c->ws_held, raw + used, c->ws_held);
+    return 0;
+}
+
+/*
+Stops reading a connection the server left with a full input buffer. Left
+armed, the socket would stay readable with nowhere to put the bytes.
+*/
+static void stall(io_loop *loop, io_conn *c)
+{
+    if (c->stalled)
+        return;
+    c->stalled = 1;
+    loop->backend->stall(loop, c);
+}
+
+/*
+Hands the server bytes that were just written at input_tail().
+*/
+static void received(io_loop *loop, io_conn *c, int bytes)
+{
+    int space;
+    if (!c->ws)
+        c->in_len += bytes;
+    else if (ws_received(loop, c, bytes))
+        return;
+    loop->cb.on_read(loop, c);
+    input_tail(c, &space);
+    if (space <= 0 && !c->closing)
+        stall(loop, c);
+}
+
+/*
+Decrypts received bytes into the input buffer, handing the server each batch
+that fits. The rest waits in OpenSSL while the server holds its input.
+*/
+static void tls_received(io_loop *loop, io_conn *c, const char *buf, int len)
+{
+    if (tls_feed(c->tls, buf, len) != len)
+    {
+        loop->cb.on_hangup(loop, c);
+        return;
+    }
+    while (!c->closing)
+    {
+        int space;
+        char *tail = input_tail(c, &space);
+        int bytes = space > 0 ? tls_read(c->tls, tail, space) : TLS_WANT_READ;
+        if (bytes == TLS_WANT_READ)
+            break;
+        if (bytes <= 0)
+        {
+            loop->cb.on_hangup(loop, c); // Closed, or the records did not decrypt
+            return;
+        }
+        received(loop, c, bytes);
+    }
+    // Reading can make OpenSSL answer, such as to a key update
+    if (c->tls_mode & TLS_USER_SEND && tls_pending(c->tls) > 0)
+        mark_dirty(loop, c);
+}
+
+/*
+Continues a TLS handshake once its socket is ready. When it is done, the
+directions the kernel took over become plain socket I/O and the rest moves
+onto memory buffers, so both backends go back to moving bytes as they do for
+any other connection.
+*/
+static void handshake_step(io_loop *loop, io_conn *c)
+{
+    int ret = tls_handshake(c->tls);
+    loop->syscalls++;
+    if (ret == TLS_WANT_READ || ret == TLS_WANT_WRITE)
+    {
+        loop->backend->handshake_wait(loop, c, ret == TLS_WANT_WRITE);
+        return;
+    }
+    if (ret == 0)
+    {
+        int kernel_send = tls_kernel_send(c->tls), kernel_recv = tls_kernel_recv(c->tls);
+        loop->tls.handshakes++;
+        loop->tls.resumed += tls_resumed(c->tls);
+        loop->tls.kernel_send += kernel_send;
+        loop->tls.kernel_recv += kernel_recv;
+        c->tls_mode = (kernel_recv ? 0 : TLS_USER_RECV) | (kernel_send ? 0 : TLS_USER_SEND);
+        if (c->tls_mode == 0)
+        {
+            // The kernel does everything, the session is no longer needed
+            tls_free(c->tls);
+            c->tls = NULL;
+        }
+        else if (tls_use_memory(c->tls))
+            ret = TLS_ERROR;
+    }
+    if (ret != 0)
+    {
+        loop->tls.failed++;
+        c->tls_mode = 0;
+        loop->cb.on_hangup(loop, c);
+        return;
+    }
+    loop->backend->handshake_done(loop, c);
+}
+
+/*
+Epoll backend
+*/
+
+static int epoll_add_listener(io_loop *loop, io_listener *l)
+{
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = l};
+    fcntl(l->fd, F_SETFL, fcntl(l->fd, F_GETFL) | O_NONBLOCK);
+    loop->syscalls += 3;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, l->fd, &ev);
+}
+
+static int epoll_add_wake(io_loop *loop)
+{
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &loop->wake};
+    loop->syscalls++;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wake.fd, &ev);
+}
+
+static int epoll_add(io_loop *loop, io_conn *c)
+{
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = c};
+    loop->syscalls++;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+/*
+Registers the events to watch for: a stalled connection only for a hangup.
+*/
+static void epoll_set_events(io_loop *loop, io_conn *c, int want_write)
+{
+    struct epoll_event ev = {.events = (c->stalled ? 0 : EPOLLIN) | EPOLLRDHUP | (want_write ? EPOLLOUT : 0),
+                             .data.ptr = c};
+    epoll_ctl(loop->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    loop->syscalls++;
+    c->want_write = want_write;
+}
+
+static void epoll_watch(io_loop *loop, io_conn *c, int want_write)
+{
+    if (want_write != c->want_write && !c->closing)
+        epoll_set_events(loop, c, want_write);
+}
+
+static void epoll_stall(io_loop *loop, io_conn *c)
+{
+    epoll_set_events(loop, c, c->want_write);
+}
+
+static void epoll_resume(io_loop *loop, io_conn *c)
+{
+    // What is still in the socket is reported by the next wait
+    epoll_set_events(loop, c, c->want_write);
+}
+
+static void epoll_flush(io_loop *loop, io_conn *c)
+{
+    int bytes, wanted;
+    do
+    {
+        refill(c);
+        tls_seal(c);
+        if ((wanted = sendable(c)) == 0)
+            return;
+        bytes = send(c->fd, c->out, wanted, MSG_NOSIGNAL);
+        loop->syscalls++;
+        if (bytes < 0)
+        {
+            if (errno != EAGAIN)
+                send_failed(c); // The read side reports the failure
+            bytes = 0;
+        }
+        trace_mark(TRACE_WRITE, c->fd, bytes);
+        sent(c, bytes);
+        traced_write(c);
+        // A backlog goes on while the socket takes everything
+    } while (bytes == wanted && c->backlog_len > 0);
+
+    // Output left in OpenSSL goes out once the socket has room
+    epoll_watch(loop, c, c->out_len > 0 || c->backlog_len > 0 || (c->tls_mode & TLS_USER_SEND && tls_pending(c->tls) > 0));
+}
+
+static void epoll_handshake_wait(io_loop *loop, io_conn *c, int want_write)
+{
+    epoll_watch(loop, c, want_write);
+}
+
+static void epoll_handshake_done(io_loop *loop, io_conn *c)
+{
+    epoll_watch(loop, c, 0);
+}
+
+static int epoll_finish_close(io_loop *loop, io_conn *c)
+{
+    // Closing the descriptor also removes it from the epoll set
+    close(c->fd);
+    loop->syscalls++;
+    return 1;
+}
+
+static void epoll_accept(io_loop *loop, io_listener *l)
+{
+    // The listener is level triggered, so any left over are accepted next pass
+    for (int n = 0; n < ACCEPT_BATCH; n++)
+    {
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        int fd = accept4(l->fd, (struct sockaddr *)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        loop->syscalls++;
+        if (fd < 0)
+        {
+            if (errno != EAGAIN && errno != EINTR)
+                perror("accept");
+            return;
+        }
+        loop->cb.on_accept(loop, fd, l->index, (struct sockaddr *)&addr, addr_len);
+    }
+}
+
+static void epoll_read(io_loop *loop, io_conn *c)
+{
+    if (c->tls_mode & TLS_HANDSHAKING)
+    {
+        handshake_step(loop, c);
+        return;
+    }
+    int space, bytes = 0;
+    char *tail = input_tail(c, &space);
+    if (space <= 0)
+    {
+        // Only a hangup is watched for once reading stalled
+        if (c->stalled)
+            loop->cb.on_hangup(loop, c);
+        else
+            stall(loop, c);
+        return;
+    }
+    if (c->tls_mode & TLS_USER_RECV)
+    {
+        char buf[IO_INBUF];
+        bytes = read(c->fd, buf, sizeof(buf));
+        loop->syscalls++;
+        if (bytes < 0 && errno == EAGAIN)
+            return;
+        if (bytes <= 0)
+            loop->cb.on_hangup(loop, c);
+        else
+        {
+            trace_mark(TRACE_READ, c->fd, bytes);
+            tls_received(loop, c, buf, bytes);
+        }
+        return;
+    }
+    bytes = read(c->fd, tail, space);
+    loop->syscalls++;
+    if (bytes < 0 && errno == EAGAIN)
+        return;
+    if (bytes <= 0)
+    {
+        loop->cb.on_hangup(loop, c);
+        return;
+    }
+    trace_mark(TRACE_READ, c->fd, bytes);
+    received(loop, c, bytes);
+}
+
+static int epoll_wait_events(io_loop *loop, int timeout_ms)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(loop->epfd, events, MAX_EVENTS, idle_begin(loop, timeout_ms));
+    idle_end(loop);
+    loop->syscalls++;
+    if (n < 0)
+        return errno == EINTR ? 0 : -1;
+    if (n > 0)
+        trace_mark(TRACE_WAKE, -1, n);
+
+    for (int i = 0; i < n; i++)
+    {
+        int kind = *(int *)events[i].data.ptr;
+        if (kind == IO_KIND_LISTENER)
+        {
+            epoll_accept(loop, events[i].data.ptr);
+            continue;
+        }
+        if (kind == IO_KIND_WAKE)
+        {
+            // The tasks themselves run once the events are handled
+            if (read(loop->wake.fd, &loop->wake_count, sizeof(loop->wake_count)) < 0)
+                perror("eventfd");
+            loop->syscalls++;
+            continue;
+        }
+        io_conn *c = events[i].data.ptr;
+        if (c->closing)
+            continue;
+        if (events[i].events & EPOLLOUT && c->tls_mode & TLS_HANDSHAKING)
+            handshake_step(loop, c);
+        else if (events[i].events & EPOLLOUT)
+            epoll_flush(loop, c);
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR) && !c->closing)
+            epoll_read(loop, c);
+    }
+    return 0;
+}
+
+static void epoll_destroy(io_loop *loop)
+{
+    close(loop->epfd);
+}
+
+static const io_backend epoll_backend = {
+    "epoll",
+    epoll_add_listener,
+    epoll_add_wake,
+    epoll_add,
+    epoll_handshake_wait,
+    epoll_handshake_done,
+    epoll_stall,
+    epoll_resume,
+    epoll_flush,
+    epoll_finish_close,
+    epoll_wait_events,
+    epoll_destroy,
+};
+
+static int epoll_init(io_loop *loop)
+{
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->syscalls++;
+    if (loop->epfd < 0)
+        return -1;
+    loop->backend = &epoll_backend;
+    return 0;
+}
+
+/*
+io_uring backend
+*/
+
+static int uring_enter(io_loop *loop, unsigned min_complete, int timeout_ms)
+{
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+    if (min_complete && timeout_ms >= 0)
+    {
+        // Linux 5.11 and later take the wait timeout directly
+        struct __kernel_timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+        struct io_uring_getevents_arg arg = {0};
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        ret = syscall(__NR_io_uring_enter, loop->ring_fd, loop->to_submit, min_complete,
+                      flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    }
+    else
+        ret = syscall(__NR_io_uring_enter, loop->ring_fd, loop->to_submit, min_complete, flags, NULL, 0);
+    loop->syscalls++;
+    if (ret >= 0)
+        loop->to_submit -= ret;
+    return ret;
+}
+
+/*
+Makes sure n submission entries are free, submitting queued ones if there are
+fewer. Returns -1 if they cannot be freed. The next n entries taken are then
+queued together, with nothing submitted between them.
+*/
+static int uring_reserve(io_loop *loop, unsigned n)
+{
+    unsigned head = __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+    if (loop->sq_entries - (loop->sqe_tail - head) >= n)
+        return 0;
+    uring_enter(loop, 0, -1);
+    head = __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+    return loop->sq_entries - (loop->sqe_tail - head) >= n ? 0 : -1;
+}
+
+/*
+Returns the next free submission entry, submitting queued ones if the ring is full.
+*/
+static struct io_uring_sqe *uring_get_sqe(io_loop *loop)
+{
+    if (uring_reserve(loop, 1))
+        return NULL;
+    unsigned idx = loop->sqe_tail & *loop->sq_mask;
+    struct io_uring_sqe *sqe = &loop->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    loop->sq_array[idx] = idx;
+    loop->sqe_tail++;
+    loop->to_submit++;
+    __atomic_store_n(loop->sq_tail, loop->sqe_tail, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+static void uring_recycle_buffer(io_loop *loop, unsigned short bid)
+{
+    struct io_uring_buf *buf = &loop->buf_ring->bufs[loop->buf_tail & (URING_BUFS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(loop->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    loop->buf_tail++;
+    __atomic_store_n(&loop->buf_ring->tail, loop->buf_tail, __ATOMIC_RELEASE);
+}
+
+static int uring_arm_accept(io_loop *loop, io_listener *l)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = l->fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = (uint64_t)(uintptr_t)l | OP_ACCEPT;
+    return 0;
+}
+
+static int uring_arm_recv(io_loop *loop, io_conn *c)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = (uint64_t)(uintptr_t)c | OP_RECV;
+    c->recv_armed = 1;
+    c->cancel_sent = 0;
+    return 0;
+}
+
+static int uring_arm_poll(io_loop *loop, io_conn *c, int want_write)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->fd;
+    sqe->poll32_events = want_write ? POLLOUT : POLLIN;
+    sqe->user_data = (uint64_t)(uintptr_t)c | OP_POLL;
+    c->recv_armed = 1;
+    return 0;
+}
+
+/*
+Waits for the peer of a stalled connection to hang up, reading nothing.
+*/
+static int uring_watch_hangup(io_loop *loop, io_conn *c)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->fd;
+    sqe->poll32_events = POLLRDHUP;
+    sqe->user_data = (uint64_t)(uintptr_t)c | OP_POLL;
+    c->recv_armed = 1;
+    c->cancel_sent = 0;
+    c->hangup_watch = 1;
+    return 0;
+}
+
+static void uring_handshake_wait(io_loop *loop, io_conn *c, int want_write)
+{
+    if (uring_arm_poll(loop, c, want_write))
+        loop->cb.on_hangup(loop, c);
+}
+
+static void uring_handshake_done(io_loop *loop, io_conn *c)
+{
+    // OpenSSL needed a non-blocking socket, but io_uring would fail a receive
+    // on one with EAGAIN instead of waiting for data
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_NONBLOCK);
+    loop->syscalls += 2;
+    uring_arm_recv(loop, c);
+}
+
+static void uring_poll_done(io_loop *loop, io_conn *c, int res)
+{
+    c->recv_armed = 0;
+    if (c->closing)
+        return;
+    if (!c->hangup_watch)
+    {
+        handshake_step(loop, c);
+        return;
+    }
+    // Either the poll was cancelled to read again, or the peer hung up
+    c->hangup_watch = 0;
+    if (res == -ECANCELED)
+        uring_arm_recv(loop, c);
+    else
+        loop->cb.on_hangup(loop, c);
+}
+
+static int uring_add_wake(io_loop *loop)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop->wake.fd;
+    sqe->addr = (uint64_t)(uintptr_t)&loop->wake_count;
+    sqe->len = sizeof(loop->wake_count);
+    sqe->user_data = (uint64_t)(uintptr_t)&loop->wake | OP_WAKE;
+    return 0;
+}
+
+static int uring_add_listener(io_loop *loop, io_listener *l)
+{
+    return uring_arm_accept(loop, l);
+}
+
+static int uring_add(io_loop *loop, io_conn *c)
+{
+    if (c->tls_mode & TLS_HANDSHAKING)
+        return uring_arm_poll(loop, c, 0);
+    return uring_arm_recv(loop, c);
+}
+
+static struct io_uring_sqe *uring_prep_send(io_loop *loop, io_conn *c)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    if (sqe == NULL)
+        return NULL;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t)(uintptr_t)c->out;
+    sqe->len = sendable(c);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)c | OP_SEND;
+    c->out_inflight = sqe->len;
+    trace_mark(TRACE_WRITE, c->fd, sqe->len);
+    return sqe;
+}
+
+static void uring_flush(io_loop *loop, io_conn *c)
+{
+    if (c->out_inflight)
+        return;
+    refill(c);
+    tls_seal(c);
+    if (sendable(c) == 0)
+        return;
+    io_conn *peer = c->link;
+    c->link = NULL;
+    if (peer != NULL)
+    {
+        peer->link = NULL;
+        if (!peer->out_inflight)
+        {
+            refill(peer);
+            tls_seal(peer);
+        }
+        if (peer->out_inflight || sendable(peer) == 0)
+            peer = NULL;
+    }
+
+    // Hard link the peer's write so both players' copies go out back to back,
+    // even if the first one fails. The link is only set once both entries are
+    // sure to be queued together; otherwise the two go out unlinked.
+    int linked = peer != NULL && uring_reserve(loop, 2) == 0;
+    struct io_uring_sqe *sqe = uring_prep_send(loop, c);
+    if (sqe == NULL || peer == NULL)
+        return;
+    if (linked)
+        sqe->flags |= IOSQE_IO_HARDLINK;
+    uring_prep_send(loop, peer);
+}
+
+static void uring_send_done(io_loop *loop, io_conn *c, int res)
+{
+    if (res < 0)
+        send_failed(c); // The read side reports the failure
+    else
+        sent(c, res);
+    c->out_inflight = 0;
+    trace_mark(TRACE_SENT, c->fd, res < 0 ? 0 : res);
+    traced_write(c);
+    uring_flush(loop, c);
+}
+
+static int uring_finish_close(io_loop *loop, io_conn *c)
+{
+    if (c->out_len > 0 || c->backlog_len > 0 || c->out_inflight)
+    {
+        uring_flush(loop, c);
+        return 0;
+    }
+    if (c->recv_armed)
+    {
+        if (!c->cancel_sent)
+        {
+            struct io_uring_sqe *sqe = uring_get_sqe(loop);
+            if (sqe == NULL)
+                return 0;
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = (uint64_t)(uintptr_t)c | (c->tls_mode & TLS_HANDSHAKING || c->hangup_watch ? OP_POLL : OP_RECV);
+            c->cancel_sent = 1;
+        }
+        return 0;
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    if (sqe == NULL)
+        return 0;
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = c->fd;
+    return 1;
+}
+
+/*
+Cancels the multishot receive of a connection whose reading stalled, to be
+replaced by a poll for the peer hanging up once it ends. Completions already
+on their way are still handled, keeping their bytes.
+*/
+static void uring_stall(io_loop *loop, io_conn *c)
+{
+    if (!c->recv_armed)
+    {
+        uring_watch_hangup(loop, c);
+        return;
+    }
+    if (c->cancel_sent || c->hangup_watch)
+        return;
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    if (sqe == NULL)
+        return; // Whatever still arrives is kept
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t)(uintptr_t)c | OP_RECV;
+    c->cancel_sent = 1;
+}
+
+/*
+Keeps received bytes that do not fit in the input buffer until it has room.
+*/
+static void uring_keep(io_loop *loop, io_conn *c, const char *data, int len)
+{
+    char *spill = realloc(c->spill, c->spill_len + len);
+    if (spill == NULL)
+    {
+        loop->cb.on_hangup(loop, c);
+        return;
+    }
+    memcpy(spill + c->spill_len, data, len);
+    c->spill = spill;
+    c->spill_len += len;
+}
+
+static void uring_resume(io_loop *loop, io_conn *c)
+{
+    if (!c->recv_armed)
+        uring_arm_recv(loop, c);
+    else if (c->hangup_watch && !c->cancel_sent)
+    {
+        // The receive is armed again once the poll ends
+        struct io_uring_sqe *sqe = uring_get_sqe(loop);
+        if (sqe == NULL)
+            return;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (uint64_t)(uintptr_t)c | OP_POLL;
+        c->cancel_sent = 1;
+    }
+    // A receive still being cancelled is re-armed when its last completion arrives
+}
+
+static void uring_recv_done(io_loop *loop, io_conn *c, struct io_uring_cqe *cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        c->recv_armed = 0;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        char *data = loop->bufs + (size_t)bid * URING_BUF_SIZE;
+        if (cqe->res > 0 && !c->closing && (c->stalled || c->spill_len > 0) && !(c->tls_mode & TLS_USER_RECV))
+        {
+            // Arrived before the cancel took effect, behind bytes already kept
+            trace_mark(TRACE_READ, c->fd, cqe->res);
+            uring_keep(loop, c, data, cqe->res);
+        }
+        else if (cqe->res > 0 && !c->closing && c->tls_mode & TLS_USER_RECV)
+        {
+            trace_mark(TRACE_READ, c->fd, cqe->res);
+            tls_received(loop, c, data, cqe->res);
+        }
+        else if (cqe->res > 0 && !c->closing)
+        {
+            // After part of a message, a whole buffer does not fit at once,
+            // so the rest follows once the server has taken what it could
+            int done = 0, space;
+            trace_mark(TRACE_READ, c->fd, cqe->res);
+            while (done < cqe->res && !c->closing)
+            {
+                char *tail = input_tail(c, &space);
+                int bytes = cqe->res - done < space ? cqe->res - done : space;
+                if (bytes <= 0)
+                {
+                    // The server is holding its input
+                    uring_keep(loop, c, data + done, cqe->res - done);
+                    break;
+                }
+                memcpy(tail, data + done, bytes);
+                done += bytes;
+                received(loop, c, bytes);
+            }
+        }
+        uring_recycle_buffer(loop, bid);
+    }
+    if (c->closing)
+        return;
+
+    // Buffers are recycled as they are copied out, so after ENOBUFS just re-arm,
+    // and a receive cancelled by a stall is re-armed once it ends
+    if (cqe->res <= 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)
+    {
+        loop->cb.on_hangup(loop, c);
+        return;
+    }
+    if (!c->recv_armed && (c->stalled || c->spill_len > 0))
+        uring_watch_hangup(loop, c);
+    else if (!c->recv_armed)
+        uring_arm_recv(loop, c);
+}
+
+static void uring_accept_done(io_loop *loop, io_listener *l, struct io_uring_cqe *cqe)
+{
+    if (cqe->res >= 0)
+    {
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        // Multishot accept does not report the peer address
+        if (getpeername(cqe->res, (struct sockaddr *)&addr, &addr_len))
+            addr_len = 0;
+        loop->syscalls++;
+        loop->cb.on_accept(loop, cqe->res, l->index, (struct sockaddr *)&addr, addr_len);
+    }
+    else if (cqe->res != -EINTR)
+        fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        uring_arm_accept(loop, l);
+}
+
+static int uring_wait(io_loop *loop, int timeout_ms)
+{
+    int ret = uring_enter(loop, 1, idle_begin(loop, timeout_ms));
+    idle_end(loop);
+    if (ret < 0 && errno != ETIME)
+        return errno == EINTR ? 0 : -1;
+
+    unsigned head = *loop->cq_head;
+    unsigned tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+    if (head != tail)
+        trace_mark(TRACE_WAKE, -1, tail - head);
+    for (; head != tail; head++)
+    {
+        struct io_uring_cqe *cqe = &loop->cqes[head & *loop->cq_mask];
+        uint64_t data = cqe->user_data;
+        void *ptr = (void *)(uintptr_t)(data & ~(uint64_t)OP_MASK);
+        switch (data & OP_MASK)
+        {
+        case OP_ACCEPT:
+            uring_accept_done(loop, ptr, cqe);
+            break;
+        case OP_RECV:
+            uring_recv_done(loop, ptr, cqe);
+            break;
+        case OP_SEND:
+            uring_send_done(loop, ptr, cqe->res);
+            break;
+        case OP_WAKE:
+            uring_add_wake(loop); // The tasks themselves run once the events are handled
+            break;
+        case OP_POLL:
+            uring_poll_done(loop, ptr, cqe->res);
+            break;
+        default:
+            break; // Cancel and close results need no handling
+        }
+    }
+    __atomic_store_n(loop->cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void uring_destroy(io_loop *loop)
+{
+    if (loop->buf_ring != NULL)
+        munmap(loop->buf_ring, loop->buf_ring_size);
+    free(loop->bufs);
+    if (loop->sqes != NULL)
+        munmap(loop->sqes, loop->sqes_size);
+    if (loop->cq_ptr != NULL && loop->cq_ptr != loop->sq_ptr)
+        munmap(loop->cq_ptr, loop->cq_size);
+    if (loop->sq_ptr != NULL)
+        munmap(loop->sq_ptr, loop->sq_size);
+    close(loop->ring_fd);
+}
+
+static const io_backend uring_backend = {
+    "uring",
+    uring_add_listener,
+    uring_add_wake,
+    uring_add,
+    uring_handshake_wait,
+    uring_handshake_done,
+    uring_stall,
+    uring_resume,
+    uring_flush,
+    uring_finish_close,
+    uring_wait,
+    uring_destroy,
+};
+
+/*
+Maps the submission and completion rings and registers the provided buffer
+ring used by multishot receives. Requires Linux 6.0 or later.
+*/
+static int uring_init(io_loop *loop)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    loop->ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    loop->syscalls++;
+    if (loop->ring_fd < 0)
+        return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        close(loop->ring_fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    loop->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    loop->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (loop->cq_size > loop->sq_size)
+        loop->sq_size = loop->cq_size;
+    loop->sq_ptr = mmap(NULL, loop->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        loop->ring_fd, IORING_OFF_SQ_RING);
+    loop->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    loop->sqes = mmap(NULL, loop->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      loop->ring_fd, IORING_OFF_SQES);
+    if (loop->sq_ptr == MAP_FAILED || loop->sqes == MAP_FAILED)
+    {
+        loop->sq_ptr = loop->sq_ptr == MAP_FAILED ? NULL : loop->sq_ptr;
+        loop->sqes = loop->sqes == MAP_FAILED ? NULL : loop->sqes;
+        uring_destroy(loop);
+        return -1;
+    }
+    loop->cq_ptr = loop->sq_ptr;
+
+    char *sq = loop->sq_ptr;
+    loop->sq_head = (unsigned *)(sq + p.sq_off.head);
+    loop->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    loop->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    loop->sq_array = (unsigned *)(sq + p.sq_off.array);
+    loop->sq_entries = p.sq_entries;
+    loop->sqe_tail = *loop->sq_tail;
+    loop->cq_head = (unsigned *)(sq + p.cq_off.head);
+    loop->cq_tail = (unsigned *)(sq + p.cq_off.tail);
+    loop->cq_mask = (unsigned *)(sq + p.cq_off.ring_mask);
+    loop->cqes = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+
+    // Provided buffer ring for receives
+    loop->buf_ring_size = URING_BUFS * sizeof(struct io_uring_buf);
+    loop->buf_ring = mmap(NULL, loop->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    loop->bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+    if (loop->buf_ring == MAP_FAILED || loop->bufs == NULL)
+    {
+        loop->buf_ring = loop->buf_ring == MAP_FAILED ? NULL : loop->buf_ring;
+        uring_destroy(loop);
+        return -1;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)loop->buf_ring;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_BGID;
+    loop->syscalls++;
+    if (syscall(__NR_io_uring_register, loop->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        uring_destroy(loop);
+        return -1;
+    }
+    loop->buf_tail = 0;
+    for (unsigned short bid = 0; bid < URING_BUFS; bid++)
+        uring_recycle_buffer(loop, bid);
+
+    loop->backend = &uring_backend;
+    return 0;
+}
+
+/*
+Shared loop logic
+*/
+
+io_loop *io_loop_create(const char *backend, const io_callbacks *callbacks)
+{
+    io_loop *loop = calloc(1, sizeof(io_loop));
+    if (loop == NULL)
+        return NULL;
+    loop->cb = *callbacks;
+    loop->wake.kind = IO_KIND_WAKE;
+    // Blocking, so io_uring waits for the read instead of failing it; epoll
+    // only reads once the counter is set
+    loop->wake.fd = eventfd(0, EFD_CLOEXEC);
+    loop->syscalls++;
+    if (loop->wake.fd < 0)
+    {
+        perror("eventfd");
+        free(loop);
+        return NULL;
+    }
+    if (backend != NULL && strcmp(backend, "uring") == 0)
+    {
+        if (uring_init(loop) == 0 && uring_add_wake(loop) == 0)
+            return loop;
+        fprintf(stderr, "io_uring unavailable (%s), falling back to epoll\n", strerror(errno));
+    }
+    if (epoll_init(loop) == 0 && epoll_add_wake(loop) == 0)
+        return loop;
+    perror("epoll_create1");
+    close(loop->wake.fd);
+    free(loop);
+    return NULL;
+}
+
+void io_loop_destroy(io_loop *loop)
+{
+    loop->backend->destroy(loop);
+    close(loop->wake.fd);
+    free(loop);
+}
+
+const char *io_loop_backend(io_loop *loop)
+{
+    return loop->backend->name;
+}
+
+unsigned long io_syscalls(io_loop *loop)
+{
+    return loop->syscalls;
+}
+
+int io_add_listener(io_loop *loop, int fd)
+{
+    if (loop->num_listeners == MAX_LISTENERS)
+        return -1;
+    io_listener *l = &loop->listeners[loop->num_listeners];
+    l->kind = IO_KIND_LISTENER;
+    l->fd = fd;
+    l->index = loop->num_listeners++;
+    return loop->backend->add_listener(loop, l);
+}
+
+static void init_conn(io_conn *c, int fd, tls_session *tls)
+{
+    // The buffers are written before they are read, so only the header is cleared
+    memset(c, 0, offsetof(io_conn, in));
+    c->kind = IO_KIND_CONN;
+    c->fd = fd;
+    c->tls = tls;
+    c->backlog = NULL;
+    c->backlog_start = c->backlog_len = c->backlog_size = c->backlog_max = 0;
+    c->spill = NULL;
+    c->spill_len = 0;
+    c->stalled = c->hangup_watch = c->resuming = 0;
+    c->next_resuming = NULL;
+}
+
+int io_add(io_loop *loop, io_conn *c, int fd)
+{
+    init_conn(c, fd, NULL);
+    return loop->backend->add(loop, c);
+}
+
+int io_add_virtual(io_loop *loop, io_conn *c)
+{
+    init_conn(c, -1, NULL);
+    return 0;
+}
+
+/*
+Hands the server one buffer's worth of the input kept while reading was
+stalled: bytes io_uring received, or what OpenSSL decrypted. Returns 1 if
+more may be kept. Like a read, it is one batch a pass, so replies to a long
+run of held messages go out as they are made instead of piling up.
+*/
+static int take_kept(io_loop *loop, io_conn *c)
+{
+    int space, bytes;
+    char *tail = input_tail(c, &space);
+    if (c->tls_mode & TLS_USER_RECV)
+    {
+        bytes = tls_read(c->tls, tail, space);
+        if (bytes == TLS_WANT_READ)
+        {
+            if (c->tls_mode & TLS_USER_SEND && tls_pending(c->tls) > 0)
+                mark_dirty(loop, c);
+            return 0;
+        }
+        if (bytes <= 0)
+        {
+            loop->cb.on_hangup(loop, c);
+            return 0;
+        }
+        received(loop, c, bytes);
+        return 1;
+    }
+    if (c->spill_len == 0)
+        return 0;
+    bytes = c->spill_len < space ? c->spill_len : space;
+    memcpy(tail, c->spill, bytes);
+    c->spill_len -= bytes;
+    memmove(c->spill, c->spill + bytes, c->spill_len);
+    if (c->spill_len == 0)
+    {
+        free(c->spill);
+        c->spill = NULL;
+    }
+    received(loop, c, bytes);
+    return c->spill_len > 0;
+}
+
+/*
+Queues a connection to take its next batch of kept input in the next pass,
+once the output of the last one has been written.
+*/
+static void add_resuming(io_loop *loop, io_conn *c)
+{
+    if (c->resuming)
+        return;
+    c->resuming = 1;
+    c->next_resuming = loop->resuming;
+    loop->resuming = c;
+}
+
+void io_resume(io_loop *loop, io_conn *c)
+{
+    int space;
+    input_tail(c, &space);
+    // Still full, so the server has not handled anything yet
+    if (!c->stalled || c->closing || space <= 0)
+        return;
+    c->stalled = 0;
+    add_resuming(loop, c);
+}
+
+void io_allow_backlog(io_conn *c, int max)
+{
+    c->backlog_max = max;
+}
+
+int io_add_tls(io_loop *loop, io_conn *c, int fd, tls_session *tls)
+{
+    init_conn(c, fd, tls);
+    c->tls_mode = TLS_HANDSHAKING;
+
+    // OpenSSL reads and writes the socket itself during the handshake
+    int flags = fcntl(fd, F_GETFL);
+    loop->syscalls++;
+    if (!(flags & O_NONBLOCK))
+    {
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        loop->syscalls++;
+    }
+    return loop->backend->add(loop, c);
+}
+
+int io_add_websocket(io_loop *loop, io_conn *c, int fd, tls_session *tls)
+{
+    if (tls != NULL ? io_add_tls(loop, c, fd, tls) : io_add(loop, c, fd))
+        return -1;
+    // Nothing is read before the loop's next wait, so this is in time
+    c->ws = WS_REQUEST_LINE;
+    c->ws_held = 0;
+    c->ws_accept[0] = '\0';
+    return 0;
+}
+
+const io_tls_stats *io_tls_counts(io_loop *loop)
+{
+    return &loop->tls;
+}
+
+static void mark_dirty(io_loop *loop, io_conn *c)
+{
+    if (c->dirty)
+        return;
+    c->dirty = 1;
+    c->next_dirty = loop->dirty;
+    loop->dirty = c;
+}
+
+void io_send(io_loop *loop, io_conn *c, const char *buf, int len)
+{
+    char header[4];
+    int header_len = 0;
+    if (c->ws)
+    {
+        if (c->ws != WS_UPGRADED)
+            return;
+        // One text frame per message, without the newline a raw socket gets
+        if (len > 0 && buf[len - 1] == '\n')
+            len--;
+        header_len = ws_frame_header(header, WS_TEXT, len);
+    }
+    enqueue(loop, c, header, header_len, buf, len);
+}
+
+void io_send_pair(io_loop *loop, io_conn *a, io_conn *b, const char *buf, int len)
+{
+    io_send(loop, a, buf, len);
+    io_send(loop, b, buf, len);
+    // Whichever of the two is flushed first links the other's write to its own
+    if (a->dirty && b->dirty && !a->overflow && !b->overflow)
+    {
+        a->link = b;
+        b->link = a;
+    }
+}
+
+void io_close(io_loop *loop, io_conn *c)
+{
+    if (c->closing)
+        return;
+    if (c->ws == WS_UPGRADED)
+    {
+        // A normal closure, so browsers do not report the connection as lost
+        char header[4], code[2] = {1000 >> 8, 1000 & 0xFF};
+        enqueue(loop, c, header, ws_frame_header(header, WS_CLOSE, 2), code, 2);
+        c->ws = WS_CLOSED;
+    }
+    c->closing = 1;
+    c->next_closing = loop->closing;
+    loop->closing = c;
+}
+
+void io_post(io_loop *loop, io_task *task)
+{
+    if (__atomic_exchange_n(&task->queued, 1, __ATOMIC_ACQ_REL))
+        return;
+    io_task *head = __atomic_load_n(&loop->mailbox, __ATOMIC_RELAXED);
+    do
+        task->next = head;
+    while (!__atomic_compare_exchange_n(&loop->mailbox, &head, task, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // The loop's own thread drains the mailbox before it next waits, and a
+    // mailbox that was not empty already has a wakeup on the way
+    if (head == NULL && __atomic_load_n(&running, __ATOMIC_SEQ_CST) != loop)
+    {
+        uint64_t one = 1;
+        ssize_t written;
+        int saved = errno;
+        do
+            written = write(loop->wake.fd, &one, sizeof(one));
+        while (written < 0 && errno == EINTR);
+        // EAGAIN means the counter is saturated, so the loop is being woken
+        // anyway. Anything else is reported by the loop's thread, since this
+        // may be a signal handler; the task still runs on the next event.
+        if (written < 0 && errno != EAGAIN)
+            __atomic_store_n(&loop->wake_error, errno, __ATOMIC_RELAXED);
+        errno = saved;
+    }
+}
+
+/*
+Runs every posted task in the order it was posted, including tasks posted by
+the tasks themselves.
+*/
+static void run_mailbox(io_loop *loop)
+{
+    io_task *list;
+    int error = __atomic_exchange_n(&loop->wake_error, 0, __ATOMIC_RELAXED);
+    if (error)
+        fprintf(stderr, "eventfd: %s\n", strerror(error));
+    while ((list = __atomic_exchange_n(&loop->mailbox, NULL, __ATOMIC_ACQUIRE)) != NULL)
+    {
+        // The stack holds the newest task first
+        io_task *ordered = NULL;
+        while (list != NULL)
+        {
+            io_task *next = list->next;
+            list->next = ordered;
+            ordered = list;
+            list = next;
+        }
+        while (ordered != NULL)
+        {
+            io_task *task = ordered;
+            ordered = task->next;
+            __atomic_store_n(&task->queued, 0, __ATOMIC_RELEASE);
+            task->run(loop, task->arg);
+        }
+    }
+}
+
+/*
+Takes one more batch of kept input for each connection resuming, in the
+order they resumed, and reads the socket again once none is left.
+*/
+static void run_resuming(io_loop *loop)
+{
+    io_conn *list = loop->resuming, *ordered = NULL, *c;
+    loop->resuming = NULL;
+    while (list != NULL)
+    {
+        c = list;
+        list = c->next_resuming;
+        c->next_resuming = ordered;
+        ordered = c;
+    }
+    while ((c = ordered) != NULL)
+    {
+        ordered = c->next_resuming;
+        c->resuming = 0;
+        if (c->closing || c->stalled)
+            continue;
+        if (take_kept(loop, c))
+        {
+            if (!c->closing && !c->stalled)
+                add_resuming(loop, c);
+        }
+        else if (!c->closing && !c->stalled)
+            loop->backend->resume(loop, c);
+    }
+}
+
+/*
+Writes everything queued while handling a batch of events, then releases
+connections that finished closing.
+*/
+static void end_pass(io_loop *loop)
+{
+    io_conn *c;
+    while ((c = loop->dirty) != NULL)
+    {
+        loop->dirty = c->next_dirty;
+        c->dirty = 0;
+        if (c->overflow && !c->closing)
+            loop->cb.on_hangup(loop, c);
+        else
+            loop->backend->flush(loop, c);
+        // A peer that was not linked is flushed later in this pass, or closes
+        c->link = NULL;
+    }
+
+    // Connections are only released here, so a batch never sees freed memory
+    io_conn **link = &loop->closing;
+    while ((c = *link) != NULL)
+    {
+        // A virtual connection has nothing to finish
+        if (c->fd < 0 || loop->backend->finish_close(loop, c))
+        {
+            *link = c->next_closing;
+            if (c->tls != NULL)
+                tls_free(c->tls);
+            c->tls = NULL;
+            free(c->backlog);
+            c->backlog = NULL;
+            free(c->spill);
+            c->spill = NULL;
+            if (c->resuming)
+            {
+                io_conn **r = &loop->resuming;
+                while (*r != c)
+                    r = &(*r)->next_resuming;
+                *r = c->next_resuming;
+            }
+            release(loop, c);
+        }
+        else
+            link = &c->next_closing;
+    }
+}
+
+int io_run_once(io_loop *loop, int timeout_ms)
+{
+    int ret = 0;
+    running = loop;
+    // Tasks and output the server queued between calls, such as from a
+    // timer, are handled before waiting
+    run_mailbox(loop);
+    if (loop->dirty != NULL || loop->closing != NULL)
+        end_pass(loop);
+    if (loop->backend->wait(loop, timeout_ms) < 0)
+        ret = -1;
+    else
+    {
+        run_resuming(loop);
+        run_mailbox(loop);
+        end_pass(loop);
+    }
+    running = NULL;
+    return ret;
+}
@@ -0,0 +1,171 @@
+#ifndef IOLOOP_H
+#define IOLOOP_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include "tls.h"
+#include "websocket.h"
+
+#define IO_INBUF 512
+#define IO_OUTBUF 4096
+
+typedef struct io_loop io_loop;
+
+/*
+Stores the I/O state of one connected socket. The server embeds this at
+the start of its own per-connection data, so the backend never allocates
+anything per connection. Everything but the buffers fits in the first cache
+line, which is all most events touch; the size is a multiple of the line so
+whatever the server puts after it starts on a line of its own.
+*/
+typedef struct io_conn
+{
+    int kind;                  // Tells connections and listeners apart in event data
+    int fd;                    // File Descriptor for the socket
+    int in_len;
+    int out_len;
+    int out_inflight;          // Bytes at the front of out owned by a pending send
+    unsigned char recv_armed;  // A multishot receive is outstanding (io_uring only)
+    unsigned char cancel_sent;
+    unsigned char want_write;  // EPOLLOUT is registered (epoll only)
+    unsigned char closing;     // io_close() was called, ignore further input
+    unsigned char overflow;    // Output did not fit, the peer is not reading
+    unsigned char dirty;       // Has output waiting for the end of this pass
+    unsigned char tls_mode;    // Which directions OpenSSL handles, 0 for plain sockets and kTLS
+    unsigned char ws;          // Where a WebSocket is in its upgrade, 0 for the raw protocol
+    int sealed;                // Bytes at the front of out already encrypted, with tls_mode
+    uint64_t trace_since;      // When the move whose reply is queued arrived, for the flight recorder
+    struct io_conn *link;      // Peer whose next send is linked to ours
+    struct io_conn *next_dirty;
+    struct io_conn *next_closing;
+    char in[IO_INBUF] __attribute__((aligned(64))); // Received bytes the server has not consumed yet
+    char out[IO_OUTBUF];       // Bytes queued for the socket
+    tls_session *tls;          // Set for TLS connections until the kernel takes over both directions
+    int ws_held;               // Bytes of an incomplete WebSocket frame, kept at the end of in
+    char ws_accept[WS_ACCEPT_SIZE];
+    char *backlog;             // Output queued behind out, for connections allowed one
+    int backlog_start, backlog_len, backlog_size, backlog_max;
+    char *spill;               // Received bytes that did not fit in in, kept while reading is stalled (io_uring only)
+    int spill_len;
+    unsigned char stalled;     // in is full and the server is holding it, so reading stopped
+    unsigned char hangup_watch; // A poll for the peer hanging up replaces the receive while stalled (io_uring only)
+    unsigned char resuming;    // Kept input is handed over a buffer a pass before reading again
+    struct io_conn *next_resuming;
+} __attribute__((aligned(64))) io_conn;
+
+/*
+Functions the server provides to react to socket events
+*/
+typedef struct io_callbacks
+{
+    void (*on_accept)(io_loop *loop, int fd, int listener, struct sockaddr *addr, socklen_t addr_len);
+    void (*on_read)(io_loop *loop, io_conn *c);    // New bytes were appended to c->in
+    void (*on_hangup)(io_loop *loop, io_conn *c);  // Peer closed the connection or it failed
+    void (*on_release)(io_loop *loop, io_conn *c); // A closed connection may be freed
+} io_callbacks;
+
+/*
+Work handed to the loop's thread. The loop owns every connection and game, so
+anything another thread, or a signal handler, wants done to them is posted
+here instead of taking a lock. run is called on the loop's thread in posting
+order, within the pass that sees the task, before that pass's output is
+written and before connections closed in it are released.
+*/
+typedef struct io_task
+{
+    void (*run)(io_loop *loop, void *arg);
+    void *arg;
+    struct io_task *next;
+    int queued;                // Posted and not started yet
+} io_task;
+
+/*
+Creates an event loop. backend is "epoll" or "uring"; if io_uring cannot be
+set up the loop falls back to epoll.
+*/
+io_loop *io_loop_create(const char *backend, const io_callbacks *callbacks);
+void io_loop_destroy(io_loop *loop);
+const char *io_loop_backend(io_loop *loop);
+
+int io_add_listener(io_loop *loop, int fd);
+int io_add(io_loop *loop, io_conn *c, int fd);
+
+/*
+Adds a connection without a socket of its own, whose messages the server
+carries over another connection. The loop never reads or writes it, but
+closes and releases it like any other, so the server can treat it as one.
+*/
+int io_add_virtual(io_loop *loop, io_conn *c);
+
+/*
+Starts reading a connection again. The loop stops reading a connection whose
+input buffer fills while the server holds its input, such as a player's while
+it waits for an opponent, watching only for a hangup; the server calls this
+once it has handled what it held.
+*/
+void io_resume(io_loop *loop, io_conn *c);
+
+/*
+Lets up to max bytes of output wait in memory behind a connection's buffer,
+for a connection that carries many players' messages. Without this, output
+that does not fit in the buffer means the peer stopped reading.
+*/
+void io_allow_backlog(io_conn *c, int max);
+
+/*
+Adds a connection that speaks TLS. The loop runs the handshake, then passes
+on decrypted bytes and encrypts what is sent; on_read is not called until the
+handshake is done, and on_hangup is called if it fails. The loop frees tls.
+*/
+int io_add_tls(io_loop *loop, io_conn *c, int fd, tls_session *tls);
+
+/*
+Adds a connection that speaks WebSocket, over TLS when tls is set. The loop
+answers the upgrade request, then hands the server each message's payload as
+one line of input, unmasked in place, and sends each io_send() as one text
+frame without its newline. Requests that are not an upgrade get a 400.
+*/
+int io_add_websocket(io_loop *loop, io_conn *c, int fd, tls_session *tls);
+
+typedef struct io_tls_stats
+{
+    unsigned long handshakes;
+    unsigned long resumed;     // Abbreviated handshakes from a session ticket
+    unsigned long kernel_send; // Connections whose sends the kernel encrypts
+    unsigned long kernel_recv; // Connections whose receives the kernel decrypts
+    unsigned long failed;
+} io_tls_stats;
+
+const io_tls_stats *io_tls_counts(io_loop *loop);
+
+/*
+Queue output for a connection. Everything queued during one pass of the loop
+is written together when the pass ends. io_send_pair() sends the same message
+to two connections, which io_uring submits as a pair of linked writes.
+*/
+void io_send(io_loop *loop, io_conn *c, const char *buf, int len);
+void io_send_pair(io_loop *loop, io_conn *a, io_conn *b, const char *buf, int len);
+
+/*
+Queues a task for the loop's thread and wakes the loop if it is waiting. Safe
+from any thread and from signal handlers. Posting a task that is already
+queued does nothing; once it starts running it may be posted again.
+*/
+void io_post(io_loop *loop, io_task *task);
+
+/*
+Closes a connection once its queued output is written. The connection must not
+be used afterwards; on_release is called when its memory may be freed.
+*/
+void io_close(io_loop *loop, io_conn *c);
+
+/*
+Waits for one batch of events and dispatches it, or until timeout_ms passes
+(-1 waits forever). Returns -1 on a fatal error, 0 otherwise (including when
+interrupted by a signal or timed out).
+*/
+int io_run_once(io_loop *loop, int timeout_ms);
+
+unsigned long io_syscalls(io_loop *loop);
+
+#endif
@@ -0,0 +1,174 @@
+// Room index for the lobby. Rooms are found by name through a chained hash
+// table. Public rooms are also kept in opening order on a skip list, so LIST
+// can find where to continue from in O(log n), even when the room it stopped
+// at has since closed, and page on without scanning the rooms before it.
+// Only the event loop's thread uses the index, so nothing here takes a lock.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "lobby.h"
+#include "hashtable.h"
+
+#define INITIAL_BUCKETS 1024
+
+static room **buckets = NULL;
+static size_t num_buckets = 0;
+static size_t num_rooms = 0;
+static room *open_rooms[LOBBY_LEVELS]; // First public room on each skip list
+static unsigned long last_seq = 0;
+static uint64_t level_state = 0x9E3779B97F4A7C15ull;
+
+// Doubles the bucket array once rooms outnumber buckets
+HASH_GROW(grow, room, hash_next, name, hash_string, INITIAL_BUCKETS)
+
+static room **find_slot(const char *name)
+{
+    room **slot = &buckets[hash_string(name) & (num_buckets - 1)];
+    while (*slot != NULL && strcmp((*slot)->name, name) != 0)
+        slot = &(*slot)->hash_next;
+    return slot;
+}
+
+static room *find(const char *name)
+{
+    return num_buckets ? *find_slot(name) : NULL;
+}
+
+/*
+Picks how many skip lists a new public room goes on: one, and each further
+one with a chance of 1 in 4.
+*/
+static int random_levels(void)
+{
+    // xorshift64
+    level_state ^= level_state << 13;
+    level_state ^= level_state >> 7;
+    level_state ^= level_state << 17;
+    uint64_t bits = level_state;
+    int levels = 1;
+    while (levels < LOBBY_LEVELS && (bits & 3) == 0)
+    {
+        levels++;
+        bits >>= 2;
+    }
+    return levels;
+}
+
+/*
+Sets links[level] to the link on each skip list that points at the first
+public room numbered seq or later.
+*/
+static void find_links(unsigned long seq, room ***links)
+{
+    room **next = open_rooms;
+    for (int level = LOBBY_LEVELS - 1; level >= 0; level--)
+    {
+        while (next[level] != NULL && next[level]->seq < seq)
+            next = next[level]->next;
+        links[level] = &next[level];
+    }
+}
+
+/*
+Unlinks a room from the table and the skip lists, then frees it.
+*/
+static void remove_room(room *r)
+{
+    room **slot = find_slot(r->name);
+    *slot = r->hash_next;
+    if (r->levels > 0)
+    {
+        room **links[LOBBY_LEVELS];
+        find_links(r->seq, links);
+        for (int level = 0; level < r->levels; level++)
+            *links[level] = r->next[level];
+    }
+    num_rooms--;
+    free(r);
+}
+
+int lobby_valid_name(const char *name)
+{
+    int len = 0;
+    for (; name[len]; len++)
+    {
+        char c = name[len];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-'))
+            return 0;
+    }
+    return len > 0 && len < ROOM_NAME_SIZE;
+}
+
+room *lobby_create(const char *name, const char *invitee, void *owner)
+{
+    if ((num_rooms >= num_buckets && grow(&buckets, &num_buckets)) || find(name) != NULL)
+        return NULL;
+    int levels = invitee[0] == '\0' ? random_levels() : 0;
+    room *r = calloc(1, sizeof(room) + levels * sizeof(room *));
+    if (r == NULL)
+        return NULL;
+    strcpy(r->name, name);
+    strncpy(r->invitee, invitee, sizeof(r->invitee) - 1);
+    r->owner = owner;
+    r->seq = ++last_seq;
+    r->levels = levels;
+
+    room **slot = find_slot(name);
+    r->hash_next = *slot;
+    *slot = r;
+    if (levels > 0)
+    {
+        // The newest room goes at the end of every list it is on
+        room **links[LOBBY_LEVELS];
+        find_links(r->seq, links);
+        for (int level = 0; level < levels; level++)
+            *links[level] = r;
+    }
+    num_rooms++;
+    return r;
+}
+
+room *lobby_find(const char *name, const char *player, int *error)
+{
+    room *r = find(name);
+    if (r == NULL)
+        *error = LOBBY_NO_ROOM;
+    else if (r->invitee[0] != '\0' && strcmp(r->invitee, player) != 0)
+    {
+        *error = LOBBY_PRIVATE;
+        r = NULL;
+    }
+    return r;
+}
+
+void lobby_cancel(room *r)
+{
+    remove_room(r);
+}
+
+int lobby_count(void)
+{
+    return num_rooms;
+}
+
+int lobby_list(unsigned long after, char *out, int out_size, unsigned long *last)
+{
+    int count = 0, used = 0;
+    room **links[LOBBY_LEVELS];
+    out[0] = '\0';
+    if (after >= last_seq)
+        return 0;
+    find_links(after + 1, links);
+    for (room *r = *links[0]; r != NULL && count < LOBBY_PAGE; r = r->next[0])
+    {
+        int len = strlen(r->name) + (count > 0);
+        if (used + len >= out_size)
+            break;
+        used += snprintf(out + used, out_size - used, "%s%s", count > 0 ? "," : "", r->name);
+        *last = r->seq;
+        count++;
+    }
+    return count;
+}
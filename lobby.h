@@ -0,0 +1,62 @@
+#ifndef LOBBY_H
+#define LOBBY_H
+
+#define ROOM_NAME_SIZE 17 // Up to 16 characters
+#define LOBBY_PAGE 10     // Rooms returned by one LIST
+#define LOBBY_LEVELS 16   // Lists in the skip list of public rooms, enough for 4^16 rooms
+
+#define LOBBY_NO_ROOM 1
+#define LOBBY_PRIVATE 2
+
+/*
+A named room waiting for a second player
+*/
+typedef struct room
+{
+    char name[ROOM_NAME_SIZE];
+    char invitee[128];        // Only this player may join, empty for a public room
+    void *owner;              // The waiting player who created the room
+    unsigned long seq;        // Order the room was opened in, from 1
+    struct room *hash_next;   // Next room in the same hash bucket
+    int levels;               // Skip lists the room is on, 0 for a private room
+    struct room *next[];      // Next public room on each of them, oldest first
+} room;
+
+/*
+Returns 1 if name can be used for a room: 1-16 letters, digits, _ or -.
+*/
+int lobby_valid_name(const char *name);
+
+/*
+Opens a room. An empty invitee makes a public room that LIST shows.
+Returns NULL if the name is already in use.
+*/
+room *lobby_create(const char *name, const char *invitee, void *owner);
+
+/*
+Returns the room player may join, or NULL with *error set to LOBBY_NO_ROOM
+or LOBBY_PRIVATE. The room stays open until lobby_cancel closes it, once
+the game in it has started.
+*/
+room *lobby_find(const char *name, const char *player, int *error);
+
+/*
+Closes a room once its game starts, or when its owner leaves before anyone
+joins.
+*/
+void lobby_cancel(room *r);
+
+/*
+Returns the number of open rooms, public and private.
+*/
+int lobby_count(void);
+
+/*
+Writes up to LOBBY_PAGE public room names, separated by commas, starting with
+the oldest room opened after the one numbered after (from the oldest room if
+after is 0), and sets *last to the number of the last room written. The room
+numbered after need not still be open. Returns the number of names.
+*/
+int lobby_list(unsigned long after, char *out, int out_size, unsigned long *last);
+
+#endif
@@ -0,0 +1,141 @@
+// Lock contention profiling. Every prof_mutex taken at least once is on a
+// list, and its counters are only updated by the thread holding it, so the
+// profile needs no atomics beyond the flag that says it is on the list.
+#define _POSIX_C_SOURCE 200809L
+#include <string.h>
+#include "lockprof.h"
+
+#ifdef LOCK_PROFILE
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static prof_mutex *registry = NULL;
+
+static int bucket(uint64_t ns)
+{
+    int b = 0;
+    for (ns >>= 8; ns > 0 && b < LOCKPROF_BUCKETS - 1; ns >>= 1)
+        b++;
+    return b;
+}
+
+/*
+Puts a mutex on the report's list the first time it is used. This happens
+before the mutex is taken, since the report takes the list lock first.
+*/
+static void register_mutex(prof_mutex *m)
+{
+    pthread_mutex_lock(&registry_mutex);
+    if (!m->registered)
+    {
+        m->next = registry;
+        registry = m;
+        __atomic_store_n(&m->registered, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+void prof_lock(prof_mutex *m)
+{
+    uint64_t wait = 0;
+    if (!__atomic_load_n(&m->registered, __ATOMIC_ACQUIRE))
+        register_mutex(m);
+    if (pthread_mutex_trylock(&m->mutex) != 0)
+    {
+        uint64_t start = trace_now();
+        pthread_mutex_lock(&m->mutex);
+        wait = trace_now() - start;
+        trace_mark(TRACE_LOCK, -1, wait / 1000);
+        m->contended++;
+    }
+    m->acquisitions++;
+    m->wait_ns += wait;
+    if (wait > m->max_wait_ns)
+        m->max_wait_ns = wait;
+    m->wait_hist[bucket(wait)]++;
+    m->locked_at = trace_now();
+}
+
+void prof_unlock(prof_mutex *m)
+{
+    uint64_t held = trace_now() - m->locked_at;
+    m->hold_ns += held;
+    if (held > m->max_hold_ns)
+        m->max_hold_ns = held;
+    pthread_mutex_unlock(&m->mutex);
+}
+
+/*
+Copies a mutex's counters while holding it, so they agree with each other.
+The copy is taken with the plain mutex, and does not count as an acquisition.
+*/
+static void snapshot(prof_mutex *m, prof_mutex *copy)
+{
+    pthread_mutex_lock(&m->mutex);
+    memcpy(copy, m, sizeof(prof_mutex));
+    pthread_mutex_unlock(&m->mutex);
+}
+
+void lockprof_report(FILE *out)
+{
+    prof_mutex s;
+    fprintf(out, "%-24s %10s %10s %10s %12s %10s %12s\n", "lock", "acquired", "contended", "wait ms",
+            "max wait us", "hold ms", "max hold us");
+    pthread_mutex_lock(&registry_mutex);
+    for (prof_mutex *m = registry; m != NULL; m = m->next)
+    {
+        snapshot(m, &s);
+        fprintf(out, "%-24s %10lu %10lu %10.3f %12.1f %10.3f %12.1f\n", s.name, (unsigned long)s.acquisitions,
+                (unsigned long)s.contended, s.wait_ns / 1e6, s.max_wait_ns / 1e3, s.hold_ns / 1e6, s.max_hold_ns / 1e3);
+        if (s.contended == 0)
+            continue;
+        fprintf(out, "  waits:");
+        for (int b = 0; b < LOCKPROF_BUCKETS; b++)
+        {
+            if (s.wait_hist[b] == 0)
+                continue;
+            if (b == 0)
+                fprintf(out, " <256ns %lu", (unsigned long)s.wait_hist[b]);
+            else
+                fprintf(out, " <%luns %lu", 256ul << b, (unsigned long)s.wait_hist[b]);
+        }
+        fprintf(out, "\n");
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    fflush(out);
+}
+
+void lockprof_export_json(FILE *out)
+{
+    prof_mutex s;
+    int first = 1;
+    fprintf(out, "[\n");
+    pthread_mutex_lock(&registry_mutex);
+    for (prof_mutex *m = registry; m != NULL; m = m->next)
+    {
+        snapshot(m, &s);
+        fprintf(out, "%s{\"name\": \"lock_%s_acquired\", \"unit\": \"count\", \"value\": %lu, \"better\": \"lower\"},\n",
+                first ? "" : ",\n", s.name, (unsigned long)s.acquisitions);
+        fprintf(out, "{\"name\": \"lock_%s_contended\", \"unit\": \"count\", \"value\": %lu, \"better\": \"lower\"},\n",
+                s.name, (unsigned long)s.contended);
+        fprintf(out, "{\"name\": \"lock_%s_wait\", \"unit\": \"ns\", \"value\": %lu, \"better\": \"lower\"},\n",
+                s.name, (unsigned long)s.wait_ns);
+        fprintf(out, "{\"name\": \"lock_%s_hold\", \"unit\": \"ns\", \"value\": %lu, \"better\": \"lower\"}",
+                s.name, (unsigned long)s.hold_ns);
+        first = 0;
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    fprintf(out, "\n]\n");
+}
+
+#else
+
+void lockprof_report(FILE *out)
+{
+}
+
+void lockprof_export_json(FILE *out)
+{
+    fprintf(out, "[\n]\n");
+}
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "trace.h"
+
+#define LOCKPROF_BUCKETS 16 // Wait histogram: under 256 ns, then one bucket per doubling
+
+/*
+A named mutex. When built with -DLOCK_PROFILE it also counts how often it is
+taken, how long threads waited for it and how long they held it; otherwise it
+is a plain mutex and the counters do not exist.
+*/
+typedef struct prof_mutex
+{
+    pthread_mutex_t mutex;
+    const char *name;
+#ifdef LOCK_PROFILE
+    uint64_t acquisitions;
+    uint64_t contended;    // Acquisitions that found the mutex held
+    uint64_t wait_ns, max_wait_ns;
+    uint64_t hold_ns, max_hold_ns;
+    uint64_t locked_at;    // When the current holder took it
+    uint64_t wait_hist[LOCKPROF_BUCKETS];
+    int registered;        // On the list the report walks
+    struct prof_mutex *next;
+#endif
+} prof_mutex;
+
+#define PROF_MUTEX_INITIALIZER(lock_name) {.mutex = PTHREAD_MUTEX_INITIALIZER, .name = lock_name}
+
+#ifdef LOCK_PROFILE
+void prof_lock(prof_mutex *m);
+void prof_unlock(prof_mutex *m);
+#else
+static inline void prof_lock(prof_mutex *m)
+{
+    // Contended waits still reach the flight recorder
+    trace_lock(&m->mutex, -1);
+}
+
+static inline void prof_unlock(prof_mutex *m)
+{
+    pthread_mutex_unlock(&m->mutex);
+}
+#endif
+
+/*
+Prints a table of every mutex taken so far, with its wait histogram.
+Prints nothing unless built with -DLOCK_PROFILE.
+*/
+void lockprof_report(FILE *out);
+
+/*
+Writes the same numbers as JSON, one result per line in the format of
+bench/bench.sh, so runs before and after a change can be compared.
+*/
+void lockprof_export_json(FILE *out);
+
+#endif
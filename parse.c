@@ -0,0 +1,280 @@
+// Parser for the messages players send to the server. Kept apart from ttts.c
+// so the fuzzing and benchmark harness in bench/ can link it on its own.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "parse.h"
+
+player_input error_bad_command(char *error_msg)
+{
+    player_input ret;
+    int error_msg_len = strlen(error_msg) + 23;
+    
+    memset(&ret, 0, sizeof(player_input));
+    strcpy((char *)ret.client_response_msg, "OVER|");
+    sprintf((char*)(ret.client_response_msg + 5), "%d", error_msg_len);
+    strcat((char *)ret.client_response_msg, "|L|You gave bad input. ");
+    strcat((char *)ret.client_response_msg, error_msg);
+    strcat((char *)ret.client_response_msg, "|\n");
+    ret.type = BAD_COMMAND;
+    return ret;
+}
+
+int count_delimiters(char *str)
+{
+    int count = 0;
+
+    for (int i = 0; str[i]; i++)
+    {
+        if (str[i] == '|')
+            count++;
+    }
+
+    return count;
+}
+
+player_input parse(char *unparsed_input)
+{
+    if (unparsed_input == NULL)
+    {
+        return error_bad_command("Error, null input string.");
+    }
+    char *state;
+    char input[BUFSIZE];
+    size_t input_len = strlen(unparsed_input);
+    if (input_len >= BUFSIZE)
+    {
+        return error_bad_command("Error, message too long.");
+    }
+    memcpy(input, unparsed_input, input_len + 1);
+
+    player_input ret;
+    memset(&ret, 0, sizeof(player_input));
+
+    /*
+    Parse protocol type & number of bytes
+    */
+    char *protocol = strtok_r(input, "|", &state);
+    if (protocol == NULL)
+    {
+        return error_bad_command("Error, protocol is null.");
+    }
+    char *bytes = strtok_r(NULL, "|", &state);
+    if (bytes == NULL || protocol != input || bytes != protocol + strlen(protocol) + 1 || bytes + strlen(bytes) == input + input_len)
+    {
+        // Leading or doubled '|', or missing | after length
+        return error_bad_command("Error, bad format");
+    }
+    int first_msg_char = strlen(bytes) + strlen(protocol) + 2;
+    int msg_len = strlen(input + first_msg_char);
+
+    if (atoi(bytes) != msg_len || msg_len > 256)
+    {
+        return error_bad_command("Error, bad length");
+    }
+
+    char *field_1;
+    char *field_2;
+    if (strcmp(protocol, "WAIT") == 0 || strcmp(protocol, "BEGN") == 0 || strcmp(protocol, "MOVD") == 0 || strcmp(protocol, "INVL") == 0 || strcmp(protocol, "OVER") == 0 || strcmp(protocol, "ROOM") == 0 || strcmp(protocol, "TOKN") == 0 || strcmp(protocol, "BORD") == 0 || strcmp(protocol, "RANK") == 0 || strcmp(protocol, "BUSY") == 0)
+    {
+        ret.type = INVALID;
+        strcpy(ret.client_response_msg, "INVL|39|User command contains server protocol.|\n");
+        return ret;
+    }
+    else if (strcmp(protocol, "PLAY") == 0)
+    {
+        if (count_delimiters(unparsed_input) != 3) // Expecting 3 '|' characters for PLAY
+            return error_bad_command("Error, incorrect number of fields for PLAY.");
+
+        field_1 = strtok_r(NULL, "|", &state);
+        ret.type = PLAY;
+
+        // Conditionals to verify format of the PLAY input
+        if (field_1 == NULL)
+            return error_bad_command("Error, no name given");
+        else
+        {
+            field_2 = strtok_r(NULL, "|", &state);
+            if (field_2 != NULL)
+            {
+                return error_bad_command("Error, unexpected data past the last delimiter.");
+            }
+        }
+        if (strlen(field_1) >= sizeof(ret.name))
+            return error_bad_command("Error, name too long.");
+        strcpy((char *)&ret.name, field_1);
+    }
+    else if (strcmp(protocol, "DRAW") == 0)
+    {
+        if (count_delimiters(unparsed_input) != 3) // Expecting 3 '|' characters for DRAW
+            return error_bad_command("Error, incorrect number of fields for DRAW.");
+
+        field_1 = strtok_r(NULL, "|", &state);
+
+        // Conditionals to verify format of the DRAW input
+        if (field_1 == NULL)
+            return error_bad_command("Error, no message in requested draw.");
+        else
+        {
+            field_2 = strtok_r(NULL, "|", &state);
+            if (field_2 != NULL)
+                return error_bad_command("Error, unexpected data past the last delimiter.");
+        }
+
+        switch (field_1[0])
+        {
+        case 'R':
+            ret.type = REJDRAW;
+            break;
+        case 'S':
+            ret.type = SUGDRAW;
+            break;
+        case 'A':
+            ret.type = ACCDRAW;
+            break;
+        default:
+            ret.type = INVALID;
+            strcpy((char *)&ret.client_response_msg,
+                   "INVL|44|S to suggest draw, A to accept, R to reject|\n");
+        }
+    }
+    else if (strcmp(protocol, "RSGN") == 0)
+    {
+        if (count_delimiters(unparsed_input) != 2) // Expecting 2 '|' characters for RSGN
+            return error_bad_command("Error, incorrect number of fields for RSGN.");
+
+        field_1 = strtok_r(NULL, "|", &state);
+        if (field_1 != NULL)
+            return error_bad_command("Error, unexpected data past the last delimiter.");
+
+        ret.type = RESIGN; // the command RSGN is always correct at this point
+    }
+    else if (strcmp(protocol, "REMT") == 0)
+    {
+        if (count_delimiters(unparsed_input) != 2) // Expecting 2 '|' characters for REMT
+            return error_bad_command("Error, incorrect number of fields for REMT.");
+
+        field_1 = strtok_r(NULL, "|", &state);
+        if (field_1 != NULL)
+            return error_bad_command("Error, unexpected data past the last delimiter.");
+
+        ret.type = REMATCH;
+    }
+    else if (strcmp(protocol, "CHAN") == 0)
+    {
+        if (count_delimiters(unparsed_input) != 2) // Expecting 2 '|' characters for CHAN
+            return error_bad_command("Error, incorrect number of fields for CHAN.");
+
+        field_1 = strtok_r(NULL, "|", &state);
+        if (field_1 != NULL)
+            return error_bad_command("Error, unexpected data past the last delimiter.");
+
+        ret.type = CHANNELS;
+    }
+    else if (strcmp(protocol, "RCON") == 0)
+    {
+        if (count_delimiters(unparsed_input) != 3) // Expecting 3 '|' characters for RCON
+            return error_bad_command("Error, incorrect number of fields for RCON.");
+
+        field_1 = strtok_r(NULL, "|", &state);
+        ret.type = RECONNECT;
+        if (field_1 == NULL)
+            return error_bad_command("Error, no session token given.");
+        if (strtok_r(NULL, "|", &state) != NULL)
+            return error_bad_command("Error, unexpected data past the last delimiter.");
+        snprintf(ret.token, sizeof(ret.token), "%s", field_1);
+    }
+    else if (strcmp(protocol, "MOVE") == 0)
+    {
+        if (count_delimiters(unparsed_input) != 4) // Expecting 4 '|' characters for MOVE
+            return error_bad_command("Error, incorrect number of fields for MOVE.");
+
+        field_1 = strtok_r(NULL, "|", &state);
+        field_2 = strtok_r(NULL, "|", &state);
+        ret.type = MOVE;
+        if (field_1 == NULL || field_2 == NULL)
+            return error_bad_command("Error, incomplete message.");
+        if (field_1[0] == 'X')
+            ret.x_or_o = 'X';
+        else if (field_1[0] == 'O')
+            ret.x_or_o = 'O';
+        else
+            return error_bad_command("Error, selected role other than X or O.");
+
+        if (strlen(field_2) != 3 || field_2[1] != ',' || (field_2[0] < '1' || field_2[0] > '3') || (field_2[2] < '1' || field_2[2] > '3'))
+        {
+            strcpy((char *)&ret.client_response_msg,
+                   "INVL|55|Position must be in the form x,y with {1,2,3} for each|\n");
+            ret.type = INVALID;
+        }
+        else
+        {
+            ret.horizontal_pos = field_2[0];
+            ret.vertical_pos = field_2[2];
+        }
+
+        char *field_3 = strtok_r(NULL, "|", &state);
+        if (field_3 != NULL)
+            return error_bad_command("Error, unexpected data past the last delimiter.");
+    }
+    else if (strcmp(protocol, "CREA") == 0 || strcmp(protocol, "JOIN") == 0)
+    {
+        int create = protocol[0] == 'C';
+        int delimiters = count_delimiters(unparsed_input);
+        // Expecting 4 '|' characters, or 5 when CREA names an invitee
+        if (delimiters != 4 && !(create && delimiters == 5))
+            return error_bad_command(create ? "Error, incorrect number of fields for CREA." : "Error, incorrect number of fields for JOIN.");
+
+        field_1 = strtok_r(NULL, "|", &state);
+        field_2 = strtok_r(NULL, "|", &state);
+        char *field_3 = strtok_r(NULL, "|", &state);
+        ret.type = create ? CREATE : JOIN;
+        if (field_1 == NULL || field_2 == NULL || (delimiters == 5 && field_3 == NULL))
+            return error_bad_command("Error, incomplete message.");
+        if ((delimiters == 4 && field_3 != NULL) || strtok_r(NULL, "|", &state) != NULL)
+            return error_bad_command("Error, unexpected data past the last delimiter.");
+
+        if (strlen(field_1) >= sizeof(ret.name) || (field_3 != NULL && strlen(field_3) >= sizeof(ret.invitee)))
+            return error_bad_command("Error, name too long.");
+        snprintf(ret.name, sizeof(ret.name), "%s", field_1);
+        snprintf(ret.room, sizeof(ret.room), "%s", field_2);
+        snprintf(ret.invitee, sizeof(ret.invitee), "%s", field_3 != NULL ? field_3 : "");
+    }
+    else if (strcmp(protocol, "LIST") == 0)
+    {
+        int delimiters = count_delimiters(unparsed_input);
+        if (delimiters != 2 && delimiters != 3) // Expecting 2 '|' characters, or 3 with a room to continue from
+            return error_bad_command("Error, incorrect number of fields for LIST.");
+
+        field_1 = strtok_r(NULL, "|", &state);
+        ret.type = LIST;
+        if (delimiters == 3 && field_1 == NULL)
+            return error_bad_command("Error, incomplete message.");
+        if ((delimiters == 2 && field_1 != NULL) || strtok_r(NULL, "|", &state) != NULL)
+            return error_bad_command("Error, unexpected data past the last delimiter.");
+        if (field_1 != NULL)
+            snprintf(ret.room, sizeof(ret.room), "%s", field_1);
+    }
+    else if (strcmp(protocol, "TRNY") == 0)
+    {
+        if (count_delimiters(unparsed_input) != 4) // Expecting 4 '|' characters for TRNY
+            return error_bad_command("Error, incorrect number of fields for TRNY.");
+
+        field_1 = strtok_r(NULL, "|", &state);
+        field_2 = strtok_r(NULL, "|", &state);
+        ret.type = TOURNAMENT;
+        if (field_1 == NULL || field_2 == NULL)
+            return error_bad_command("Error, incomplete message.");
+        if (strtok_r(NULL, "|", &state) != NULL)
+            return error_bad_command("Error, unexpected data past the last delimiter.");
+        if (strlen(field_1) >= sizeof(ret.name))
+            return error_bad_command("Error, name too long.");
+        snprintf(ret.name, sizeof(ret.name), "%s", field_1);
+        snprintf(ret.room, sizeof(ret.room), "%s", field_2);
+    }
+    else
+        return error_bad_command("Error, command not recognized.");
+
+    return ret;
+}
@@ -0,0 +1,53 @@
+#ifndef PARSE_H
+#define PARSE_H
+
+#define BUFSIZE 256
+
+typedef enum
+{
+    PLAY,
+    SUGDRAW,
+    ACCDRAW,
+    REJDRAW,
+    RESIGN,
+    MOVE,
+    CREATE,
+    JOIN,
+    LIST,
+    REMATCH,
+    RECONNECT,
+    TOURNAMENT,
+    CHANNELS,
+    INVALID,
+    BAD_COMMAND
+} command_type;
+
+/*
+Stores data about a player's input to the server
+*/
+typedef struct player_input
+{
+    command_type type;
+    char name[128];
+    char x_or_o;                   // X , 0
+    char vertical_pos;             //  1 , 2 , 3
+    char horizontal_pos;           // 1, 2 , 3
+    char client_response_msg[100]; //
+    char room[64];                 // Room to create, join or list from, or tournament to enter
+    char invitee[128];             // Only player allowed in a private room
+    char token[32];                // Session token of a dropped game to rejoin
+} player_input;
+
+/*
+Builds the reply for input that cannot be understood at all.
+*/
+player_input error_bad_command(char *error_msg);
+
+int count_delimiters(char *str);
+
+/*
+Parses one message from a player, without its newline.
+*/
+player_input parse(char *unparsed_input);
+
+#endif
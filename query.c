@@ -0,0 +1,370 @@
+// Answers questions about the games a server archived with -R. Every segment
+// file is mapped and its columns are scanned a block at a time, so a block of
+// each column a query reads stays in the cache while it is counted several
+// ways. The counting loops are simple enough for the compiler to turn into
+// vector compares and adds.
+//
+// Usage: query [-d dir] [summary | openings | lengths | player name | top [n]]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "archive.h"
+#include "hashtable.h"
+
+#define BLOCK 8192 // Games counted at a time, so a few columns of a block fit in L1
+
+static const char *results[] = {"X won", "O won", "drawn"};
+
+/*
+Games in a block whose byte, masked, equals value
+*/
+static uint32_t count_eq(const uint8_t *restrict col, uint8_t mask, uint8_t value, uint32_t n)
+{
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < n; i++)
+        count += (col[i] & mask) == value;
+    return count;
+}
+
+/*
+Games in a block whose byte in a equals va and whose result is result
+*/
+static uint32_t count_eq_result(const uint8_t *restrict a, uint8_t va, const uint8_t *restrict r, uint8_t result,
+                                uint32_t n)
+{
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < n; i++)
+        count += (a[i] == va) & ((r[i] & ARCHIVE_WINNER) == result);
+    return count;
+}
+
+/*
+Games in a block that player played on the side p is the column of and
+whose result is result
+*/
+static uint32_t count_player(const uint32_t *restrict p, uint32_t player, const uint8_t *restrict r, uint8_t result,
+                             uint32_t n)
+{
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < n; i++)
+        count += (p[i] == player) & ((r[i] & ARCHIVE_WINNER) == result);
+    return count;
+}
+
+static uint64_t sum(const uint8_t *restrict col, uint32_t n)
+{
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < n; i++)
+        total += col[i];
+    return total;
+}
+
+static void span(const uint32_t *restrict col, uint32_t n, uint32_t *first, uint32_t *last)
+{
+    uint32_t lo = *first, hi = *last;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        lo = col[i] < lo ? col[i] : lo;
+        hi = col[i] > hi ? col[i] : hi;
+    }
+    *first = lo;
+    *last = hi;
+}
+
+// What the queries add up over every segment
+static uint64_t games, by_result[3], on_board[3], total_moves;
+static uint64_t openings[9][3], lengths[10][3];
+static uint64_t as_x[3], as_o[3];
+static uint32_t first_time = UINT32_MAX, last_time = 0;
+
+static void summary(const archive_segment *s, uint32_t start, uint32_t n)
+{
+    for (uint8_t r = 0; r < 3; r++)
+    {
+        by_result[r] += count_eq(s->result + start, ARCHIVE_WINNER, r, n);
+        on_board[r] += count_eq(s->result + start, ARCHIVE_WINNER | ARCHIVE_ON_BOARD, r | ARCHIVE_ON_BOARD, n);
+    }
+    total_moves += sum(s->length + start, n);
+    span(s->time + start, n, &first_time, &last_time);
+}
+
+static void opening(const archive_segment *s, uint32_t start, uint32_t n)
+{
+    for (uint8_t cell = 0; cell < 9; cell++)
+        for (uint8_t r = 0; r < 3; r++)
+            openings[cell][r] += count_eq_result(s->moves[0] + start, cell, s->result + start, r, n);
+}
+
+static void length(const archive_segment *s, uint32_t start, uint32_t n)
+{
+    for (uint8_t len = 0; len <= 9; len++)
+        for (uint8_t r = 0; r < 3; r++)
+            lengths[len][r] += count_eq_result(s->length + start, len, s->result + start, r, n);
+}
+
+static void player(const archive_segment *s, uint32_t start, uint32_t n, uint32_t id)
+{
+    for (uint8_t r = 0; r < 3; r++)
+    {
+        as_x[r] += count_player(s->x + start, id, s->result + start, r, n);
+        as_o[r] += count_player(s->o + start, id, s->result + start, r, n);
+    }
+}
+
+/*
+Wins, losses and draws of every player, by name across segments
+*/
+typedef struct standing
+{
+    const char *name;
+    uint64_t won, lost, drawn;
+} standing;
+
+static standing *table = NULL;
+static size_t table_size = 0, table_count = 0;
+
+static standing *find_standing(const char *name)
+{
+    if (table_count >= table_size / 2)
+    {
+        size_t size = table_size ? table_size * 2 : 65536;
+        standing *grown = calloc(size, sizeof(standing));
+        if (grown == NULL)
+        {
+            perror("query");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < table_size; i++)
+        {
+            if (table[i].name == NULL)
+                continue;
+            size_t j = hash_string(table[i].name) & (size - 1);
+            while (grown[j].name != NULL)
+                j = (j + 1) & (size - 1);
+            grown[j] = table[i];
+        }
+        free(table);
+        table = grown;
+        table_size = size;
+    }
+    size_t j = hash_string(name) & (table_size - 1);
+    while (table[j].name != NULL && strcmp(table[j].name, name) != 0)
+        j = (j + 1) & (table_size - 1);
+    if (table[j].name == NULL)
+    {
+        table[j].name = strdup(name);
+        table_count++;
+    }
+    return &table[j];
+}
+
+/*
+Tallies a whole segment by player number, then adds the tallies to the
+standings by name, so each name is looked up once per segment rather than
+once per game.
+*/
+static void tally(const archive_segment *s)
+{
+    uint32_t num_names = s->header->num_names;
+    uint32_t (*counts)[3] = calloc(num_names ? num_names : 1, sizeof(*counts)); // Won, lost, drawn
+    if (counts == NULL)
+    {
+        perror("query");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < s->count; i++)
+    {
+        uint32_t x = s->x[i], o = s->o[i];
+        if (x >= num_names || o >= num_names)
+            continue;
+        switch (s->result[i] & ARCHIVE_WINNER)
+        {
+        case ARCHIVE_X_WON:
+            counts[x][0]++;
+            counts[o][1]++;
+            break;
+        case ARCHIVE_O_WON:
+            counts[o][0]++;
+            counts[x][1]++;
+            break;
+        default:
+            counts[x][2]++;
+            counts[o][2]++;
+        }
+    }
+    for (uint32_t id = 0; id < num_names; id++)
+    {
+        if (counts[id][0] + counts[id][1] + counts[id][2] == 0)
+            continue;
+        standing *st = find_standing(s->names[id]);
+        st->won += counts[id][0];
+        st->lost += counts[id][1];
+        st->drawn += counts[id][2];
+    }
+    free(counts);
+}
+
+static int by_wins(const void *a, const void *b)
+{
+    const standing *x = a, *y = b;
+    if (x->won != y->won)
+        return x->won < y->won ? 1 : -1;
+    if (x->lost != y->lost)
+        return x->lost > y->lost ? 1 : -1;
+    return strcmp(x->name, y->name);
+}
+
+static double percent(uint64_t part, uint64_t whole)
+{
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-d archive_dir] [summary | openings | lengths | player name | top [n]]\n", program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = "archive";
+    int opt;
+    while ((opt = getopt(argc, argv, "d:")) != -1)
+    {
+        if (opt == 'd')
+            dir = optarg;
+        else
+            usage(argv[0]);
+    }
+    const char *what = optind < argc ? argv[optind] : "summary";
+    const char *name = NULL;
+    int top = 10;
+    if (strcmp(what, "player") == 0)
+    {
+        if (optind + 1 >= argc)
+            usage(argv[0]);
+        name = argv[optind + 1];
+    }
+    else if (strcmp(what, "top") == 0)
+    {
+        if (optind + 1 < argc)
+            top = atoi(argv[optind + 1]);
+    }
+    else if (strcmp(what, "summary") != 0 && strcmp(what, "openings") != 0 && strcmp(what, "lengths") != 0)
+        usage(argv[0]);
+
+    char **paths;
+    int num_segments = archive_list(dir, &paths);
+    if (num_segments < 0)
+        exit(EXIT_FAILURE);
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int i = 0; i < num_segments; i++)
+    {
+        archive_segment s;
+        if (archive_map(paths[i], &s))
+            continue;
+        games += s.count;
+        int64_t id = -1;
+        if (name != NULL)
+            for (uint32_t p = 0; p < s.header->num_names && id < 0; p++)
+                if (strcmp(s.names[p], name) == 0)
+                    id = p;
+        if (what[0] == 't')
+            tally(&s);
+        else if (name == NULL || id >= 0)
+            for (uint32_t start = 0; start < s.count; start += BLOCK)
+            {
+                uint32_t n = s.count - start < BLOCK ? s.count - start : BLOCK;
+                switch (what[0])
+                {
+                case 's':
+                    summary(&s, start, n);
+                    break;
+                case 'o':
+                    opening(&s, start, n);
+                    break;
+                case 'l':
+                    length(&s, start, n);
+                    break;
+                case 'p':
+                    player(&s, start, n, id);
+                    break;
+                }
+            }
+        archive_unmap(&s);
+        free(paths[i]);
+    }
+    free(paths);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+
+    switch (what[0])
+    {
+    case 's':
+        printf("%lu games, %.1f moves on average\n", games, games ? (double)total_moves / games : 0.0);
+        for (int r = 0; r < 3; r++)
+            printf("%-6s %10lu  %5.1f%%  (%lu on the board)\n", results[r], by_result[r], percent(by_result[r], games),
+                   on_board[r]);
+        if (games > 0)
+        {
+            char from[32], to[32];
+            time_t t0 = first_time, t1 = last_time;
+            strftime(from, sizeof(from), "%F %T", localtime(&t0));
+            strftime(to, sizeof(to), "%F %T", localtime(&t1));
+            printf("From %s to %s\n", from, to);
+        }
+        break;
+    case 'o':
+        printf("First move     games   X won   O won   drawn\n");
+        for (int cell = 0; cell < 9; cell++)
+        {
+            uint64_t n = openings[cell][0] + openings[cell][1] + openings[cell][2];
+            printf("row %d col %d %10lu  %5.1f%%  %5.1f%%  %5.1f%%\n", cell / 3 + 1, cell % 3 + 1, n,
+                   percent(openings[cell][0], n), percent(openings[cell][1], n), percent(openings[cell][2], n));
+        }
+        break;
+    case 'l':
+        printf("Moves      games   X won   O won   drawn\n");
+        for (int len = 0; len <= 9; len++)
+        {
+            uint64_t n = lengths[len][0] + lengths[len][1] + lengths[len][2];
+            printf("%5d %10lu  %5.1f%%  %5.1f%%  %5.1f%%\n", len, n, percent(lengths[len][0], n),
+                   percent(lengths[len][1], n), percent(lengths[len][2], n));
+        }
+        break;
+    case 'p':
+    {
+        uint64_t won = as_x[ARCHIVE_X_WON] + as_o[ARCHIVE_O_WON], lost = as_x[ARCHIVE_O_WON] + as_o[ARCHIVE_X_WON];
+        uint64_t drawn = as_x[ARCHIVE_DRAW] + as_o[ARCHIVE_DRAW];
+        printf("%s: %lu games, %lu won, %lu lost, %lu drawn\n", name, won + lost + drawn, won, lost, drawn);
+        printf("As X: %lu won, %lu lost, %lu drawn\n", as_x[ARCHIVE_X_WON], as_x[ARCHIVE_O_WON], as_x[ARCHIVE_DRAW]);
+        printf("As O: %lu won, %lu lost, %lu drawn\n", as_o[ARCHIVE_O_WON], as_o[ARCHIVE_X_WON], as_o[ARCHIVE_DRAW]);
+        break;
+    }
+    case 't':
+    {
+        // Pack the standings to the front and sort them
+        size_t n = 0;
+        for (size_t i = 0; i < table_size; i++)
+            if (table[i].name != NULL)
+                table[n++] = table[i];
+        qsort(table, n, sizeof(standing), by_wins);
+        printf("Player                 won     lost    drawn\n");
+        for (size_t i = 0; i < n && i < (size_t)top; i++)
+            printf("%-16s %9lu %8lu %8lu\n", table[i].name, table[i].won, table[i].lost, table[i].drawn);
+        for (size_t i = 0; i < n; i++)
+            free((char *)table[i].name);
+        free(table);
+        break;
+    }
+    }
+    fprintf(stderr, "Scanned %lu games in %d segments in %.3f s, %.0f million games a minute\n", games, num_segments,
+            seconds, seconds > 0 ? games / seconds * 60 / 1e6 : 0.0);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,170 @@
+// Seats held for players whose connection dropped mid-game. Sessions are
+// found by token through a chained hash table, and expire through a timing
+// wheel with one slot per second, so each tick only looks at the sessions
+// that are due instead of every one that is held. Each kind of seat has a
+// table of its own. Only the event loop's thread uses them, so nothing here
+// takes a lock.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/random.h>
+#include "session.h"
+#include "hashtable.h"
+
+#define INITIAL_BUCKETS 1024
+#define RANDOM_POOL 4096
+
+static session *free_sessions = NULL; // Shared by every table
+
+static unsigned char random_pool[RANDOM_POOL];
+static int random_used = RANDOM_POOL;
+
+static long now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+// Doubles the bucket array once sessions outnumber buckets
+HASH_GROW(grow, session, hash_next, token, hash_string, INITIAL_BUCKETS)
+
+static session **find_slot(session_table *t, const char *token)
+{
+    session **slot = &t->buckets[hash_string(token) & (t->num_buckets - 1)];
+    while (*slot != NULL && strcmp((*slot)->token, token) != 0)
+        slot = &(*slot)->hash_next;
+    return slot;
+}
+
+/*
+Unlinks a session from the table and the wheel, and returns it to the pool.
+*/
+static void remove_session(session_table *t, session *s)
+{
+    session **slot = find_slot(t, s->token);
+    *slot = s->hash_next;
+
+    if (s->prev != NULL)
+        s->prev->next = s->next;
+    else
+        t->wheel[s->expires % SESSION_WHEEL_SLOTS] = s->next;
+    if (s->next != NULL)
+        s->next->prev = s->prev;
+
+    t->num_sessions--;
+    s->hash_next = free_sessions;
+    free_sessions = s;
+}
+
+void session_new_token(char *token)
+{
+    static const char hex[] = "0123456789abcdef";
+    if (random_used + 8 > RANDOM_POOL)
+    {
+        // One getrandom() call covers the tokens for hundreds of games
+        if (getrandom(random_pool, RANDOM_POOL, 0) != RANDOM_POOL)
+        {
+            perror("getrandom");
+            exit(EXIT_FAILURE);
+        }
+        random_used = 0;
+    }
+    for (int i = 0; i < 8; i++)
+    {
+        unsigned char byte = random_pool[random_used++];
+        token[i * 2] = hex[byte >> 4];
+        token[i * 2 + 1] = hex[byte & 15];
+    }
+    token[SESSION_TOKEN_SIZE - 1] = '\0';
+}
+
+int session_hold(session_table *t, const char *token, void *player, int seconds)
+{
+    if (t->num_sessions >= (int)t->num_buckets && grow(&t->buckets, &t->num_buckets))
+        return -1;
+    session *s = free_sessions;
+    if (s != NULL)
+        free_sessions = s->hash_next;
+    else if ((s = malloc(sizeof(session))) == NULL)
+        return -1;
+    strcpy(s->token, token);
+    s->player = player;
+
+    long now = now_seconds();
+    if (t->wheel_now < 0)
+        t->wheel_now = now;
+    s->expires = now + (seconds > 0 ? seconds : 1);
+
+    session **slot = find_slot(t, token);
+    s->hash_next = *slot;
+    *slot = s;
+
+    session **head = &t->wheel[s->expires % SESSION_WHEEL_SLOTS];
+    s->prev = NULL;
+    s->next = *head;
+    if (*head != NULL)
+        (*head)->prev = s;
+    *head = s;
+
+    t->num_sessions++;
+    return 0;
+}
+
+void *session_find(session_table *t, const char *token)
+{
+    session *s = t->num_buckets ? *find_slot(t, token) : NULL;
+    return s != NULL ? s->player : NULL;
+}
+
+void *session_take(session_table *t, const char *token)
+{
+    void *player = NULL;
+    session *s = t->num_buckets ? *find_slot(t, token) : NULL;
+    if (s != NULL)
+    {
+        player = s->player;
+        remove_session(t, s);
+    }
+    return player;
+}
+
+void session_expire(session_table *t, void (*expired)(void *player))
+{
+    long now = now_seconds();
+
+    if (t->wheel_now < 0)
+        t->wheel_now = now;
+    // Visit each slot that has come due since the last call, at most one full
+    // turn of the wheel. Sessions held for longer stay in their slot until the
+    // turn in which they expire.
+    long last = now - t->wheel_now < SESSION_WHEEL_SLOTS ? now : t->wheel_now + SESSION_WHEEL_SLOTS;
+    for (long second = t->wheel_now; second <= last; second++)
+    {
+        session *s = t->wheel[second % SESSION_WHEEL_SLOTS];
+        while (s != NULL)
+        {
+            if (s->expires > now)
+            {
+                s = s->next;
+                continue;
+            }
+            void *player = s->player;
+            remove_session(t, s);
+
+            // The callback may take other sessions, so the slot is walked
+            // again from the start afterwards
+            expired(player);
+            s = t->wheel[second % SESSION_WHEEL_SLOTS];
+        }
+    }
+    t->wheel_now = now;
+}
+
+int session_count(session_table *t)
+{
+    return t->num_sessions;
+}
@@ -0,0 +1,67 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stddef.h>
+
+#define SESSION_TOKEN_SIZE 17 // 16 hex digits
+#define SESSION_WHEEL_SLOTS 64 // One slot per second, longer holds wrap around
+
+/*
+A dropped player's seat, held until its token is used or it expires
+*/
+typedef struct session
+{
+    char token[SESSION_TOKEN_SIZE];
+    void *player;                   // Connection data of the player who dropped
+    long expires;                   // Second at which the hold ends
+    struct session *hash_next;      // Next session in the same hash bucket
+    struct session *prev, *next;    // Sessions in the same wheel slot
+} session;
+
+/*
+Holds of one kind, kept apart from other kinds so a key of one can never
+find a seat of another
+*/
+typedef struct session_table
+{
+    session **buckets;
+    size_t num_buckets;
+    int num_sessions;
+    session *wheel[SESSION_WHEEL_SLOTS];
+    long wheel_now;                 // Last second the wheel was advanced to, -1 before the first hold
+} session_table;
+
+#define SESSION_TABLE_INITIALIZER {NULL, 0, 0, {NULL}, -1}
+
+/*
+Writes a new random token, unguessable by other players.
+*/
+void session_new_token(char *token);
+
+/*
+Holds player under token for the given number of seconds. Returns -1 if
+memory runs out, in which case the seat cannot be held.
+*/
+int session_hold(session_table *table, const char *token, void *player, int seconds);
+
+/*
+Returns the player held under token, or NULL, leaving the hold in place.
+*/
+void *session_find(session_table *table, const char *token);
+
+/*
+Ends a hold early and returns its player, or NULL if token is not held.
+*/
+void *session_take(session_table *table, const char *token);
+
+/*
+Calls expired for every player whose hold has run out, after removing it.
+*/
+void session_expire(session_table *table, void (*expired)(void *player));
+
+/*
+Returns the number of seats being held.
+*/
+int session_count(session_table *table);
+
+#endif
@@ -0,0 +1,302 @@
+// Plays tic-tac-toe between bots without a server, for judging bots over far
+// more games than could be played through sockets. A thread plays a batch of
+// games in lockstep: every game makes its first move, then every game still
+// going makes its second, and so on. Each side of every board is a bit mask in
+// an array of its own, so after each move one loop checks the lines of the
+// whole batch, and the compiler turns it into vector ands and compares.
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "sim.h"
+
+static const uint16_t lines[8] = {0x007, 0x038, 0x1C0, 0x049, 0x092, 0x124, 0x111, 0x054};
+
+static uint8_t nth_cell[512][9];   // The nth cell of a set of cells, lowest first
+static uint8_t num_cells[512];     // Cells in a set
+static uint16_t threats[512];      // Cells that would complete a line of a side holding a set
+static int8_t score[1 << 18];      // Perfect play: the value of a position to the side to move
+static uint16_t best[1 << 18];     // and the moves that keep it, by X's cells << 9 | O's cells
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+/*
+Returns the value of a position to the side to move, and records it and the
+moves that reach it. A win is worth more the fewer cells are taken, so a bot
+playing by it wins as soon as it can and loses as late as it can.
+*/
+static int solve(uint16_t x, uint16_t o)
+{
+    uint32_t index = (uint32_t)x << 9 | o;
+    if (score[index] != INT8_MIN)
+        return score[index];
+    int x_to_move = num_cells[x] == num_cells[o];
+    uint16_t theirs = x_to_move ? o : x;
+    int taken = num_cells[x | o], value = INT8_MIN;
+    uint16_t moves = 0;
+    for (int l = 0; l < 8; l++)
+        if ((theirs & lines[l]) == lines[l])
+            value = taken - 10;
+    if (value == INT8_MIN && taken == 9)
+        value = 0;
+    if (value == INT8_MIN)
+    {
+        for (int cell = 0; cell < 9; cell++)
+        {
+            uint16_t bit = 1 << cell;
+            if ((x | o) & bit)
+                continue;
+            int v = -(x_to_move ? solve(x | bit, o) : solve(x, o | bit));
+            if (v > value)
+                value = v, moves = 0;
+            if (v == value)
+                moves |= bit;
+        }
+    }
+    score[index] = value;
+    best[index] = moves;
+    return value;
+}
+
+static void build_tables(void)
+{
+    for (int set = 0; set < 512; set++)
+    {
+        for (int cell = 0; cell < 9; cell++)
+            if (set & (1 << cell))
+                nth_cell[set][num_cells[set]++] = cell;
+        for (int l = 0; l < 8; l++)
+        {
+            uint16_t rest = lines[l] & ~set;
+            if (rest != 0 && (rest & (rest - 1)) == 0)
+                threats[set] |= rest;
+        }
+    }
+    memset(score, INT8_MIN, sizeof(score));
+    solve(0, 0);
+}
+
+uint64_t sim_next(uint64_t *rng)
+{
+    // xorshift64*
+    uint64_t r = *rng;
+    r ^= r >> 12;
+    r ^= r << 25;
+    r ^= r >> 27;
+    *rng = r;
+    return r * 0x2545F4914F6CDD1Dull;
+}
+
+static uint64_t splitmix(uint64_t z)
+{
+    z += 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+/*
+One of a set of cells, at random
+*/
+static int pick(uint16_t cells, uint64_t *rng)
+{
+    uint32_t n = num_cells[cells];
+    return nth_cell[cells][(uint32_t)((sim_next(rng) >> 32) * n >> 32)];
+}
+
+int sim_random(uint16_t mine, uint16_t theirs, uint64_t *rng)
+{
+    pthread_once(&tables_once, build_tables);
+    return pick(SIM_FULL & ~(mine | theirs), rng);
+}
+
+int sim_greedy(uint16_t mine, uint16_t theirs, uint64_t *rng)
+{
+    pthread_once(&tables_once, build_tables);
+    uint16_t empty = SIM_FULL & ~(mine | theirs);
+    uint16_t cells = threats[mine] & empty;
+    if (cells == 0)
+        cells = threats[theirs] & empty;
+    return pick(cells ? cells : empty, rng);
+}
+
+int sim_perfect(uint16_t mine, uint16_t theirs, uint64_t *rng)
+{
+    pthread_once(&tables_once, build_tables);
+    int x_to_move = num_cells[mine] == num_cells[theirs];
+    uint16_t x = x_to_move ? mine : theirs, o = x_to_move ? theirs : mine;
+    return pick(best[(uint32_t)x << 9 | o], rng);
+}
+
+sim_policy sim_find_policy(const char *name)
+{
+    if (strcmp(name, "random") == 0)
+        return sim_random;
+    if (strcmp(name, "greedy") == 0)
+        return sim_greedy;
+    if (strcmp(name, "perfect") == 0)
+        return sim_perfect;
+    return NULL;
+}
+
+/*
+A batch of boards, side by side
+*/
+typedef struct sim_batch
+{
+    uint16_t side[2][SIM_BATCH]; // X's cells, O's cells
+    uint8_t line[SIM_BATCH];     // The side that just moved has a line
+    uint8_t outcome[SIM_BATCH];  // 0 while playing, then 1 X won, 2 O won, 3 drawn
+    uint8_t length[SIM_BATCH];   // Moves played
+} sim_batch;
+
+/*
+Marks the boards where side has three in a row.
+*/
+static void find_lines(const uint16_t *restrict side, uint8_t *restrict line, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint16_t s = side[i];
+        uint8_t found = 0;
+        for (int l = 0; l < 8; l++)
+            found |= (s & lines[l]) == lines[l];
+        line[i] = found;
+    }
+}
+
+/*
+Ends the games still going that the last move won, and returns how many are
+still going.
+*/
+static uint32_t settle(uint8_t *restrict outcome, uint8_t *restrict length, const uint8_t *restrict line,
+                       uint8_t mark, uint8_t moves, uint32_t n)
+{
+    uint32_t going = 0;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint8_t ends = line[i] & (outcome[i] == 0);
+        outcome[i] |= ends * mark;
+        length[i] = ends ? moves : length[i];
+        going += outcome[i] == 0;
+    }
+    return going;
+}
+
+static void play_batch(sim_batch *b, uint32_t n, sim_policy policies[2], uint64_t rng, sim_result *result)
+{
+    memset(b->side, 0, sizeof(b->side));
+    memset(b->outcome, 0, n);
+    uint32_t going = n;
+    for (int move = 0; move < 9 && going > 0; move++)
+    {
+        int s = move & 1;
+        uint16_t *mine = b->side[s], *theirs = b->side[1 - s];
+        sim_policy policy = policies[s];
+        for (uint32_t i = 0; i < n; i++)
+            if (b->outcome[i] == 0)
+                mine[i] |= 1 << policy(mine[i], theirs[i], &rng);
+        find_lines(mine, b->line, n);
+        going = settle(b->outcome, b->length, b->line, s + 1, move + 1, n);
+    }
+    for (uint32_t i = 0; i < n; i++)
+    {
+        if (b->outcome[i] == 0)
+        {
+            b->outcome[i] = 3;
+            b->length[i] = 9;
+        }
+        result->by_length[b->length[i]][b->outcome[i] - 1]++;
+    }
+    result->games += n;
+}
+
+typedef struct sim_worker
+{
+    pthread_t thread;
+    int index, threads;
+    sim_policy policies[2];
+    uint64_t games, seed;
+    sim_result result;
+} sim_worker;
+
+/*
+Plays every threads-th batch, starting with its own index.
+*/
+static void *run_worker(void *arg)
+{
+    sim_worker *w = arg;
+    sim_batch *b = malloc(sizeof(sim_batch));
+    if (b == NULL)
+        return w;
+    uint64_t num_batches = (w->games + SIM_BATCH - 1) / SIM_BATCH;
+    for (uint64_t batch = w->index; batch < num_batches; batch += w->threads)
+    {
+        uint64_t start = batch * SIM_BATCH;
+        uint32_t n = w->games - start < SIM_BATCH ? w->games - start : SIM_BATCH;
+        uint64_t rng = splitmix(w->seed ^ splitmix(batch));
+        play_batch(b, n, w->policies, rng ? rng : 1, &w->result);
+    }
+    free(b);
+    return NULL;
+}
+
+int sim_run(sim_policy x, sim_policy o, uint64_t games, uint64_t seed, int threads, sim_result *result)
+{
+    pthread_once(&tables_once, build_tables);
+    if (threads < 1)
+        threads = 1;
+    sim_worker *workers = calloc(threads, sizeof(sim_worker));
+    if (workers == NULL)
+        return -1;
+    int started = 0, status = 0;
+    for (int t = 0; t < threads; t++)
+    {
+        sim_worker *w = &workers[t];
+        w->index = t;
+        w->threads = threads;
+        w->policies[0] = x;
+        w->policies[1] = o;
+        w->games = games;
+        w->seed = seed;
+        // The first share is played on the calling thread
+        if (t > 0)
+        {
+            if (pthread_create(&w->thread, NULL, run_worker, w))
+            {
+                status = -1;
+                break;
+            }
+            started++;
+        }
+    }
+    if (status == 0 && run_worker(&workers[0]) != NULL)
+        status = -1;
+    for (int t = 1; t <= started; t++)
+    {
+        void *failed;
+        pthread_join(workers[t].thread, &failed);
+        if (failed != NULL)
+            status = -1;
+    }
+    if (status == 0)
+        for (int t = 0; t < threads; t++)
+        {
+            sim_result *r = &workers[t].result;
+            result->games += r->games;
+            for (int len = 0; len <= 9; len++)
+                for (int k = 0; k < 3; k++)
+                    result->by_length[len][k] += r->by_length[len][k];
+        }
+    free(workers);
+    if (status == 0)
+    {
+        result->x_won = result->o_won = result->drawn = 0;
+        for (int len = 0; len <= 9; len++)
+        {
+            result->x_won += result->by_length[len][0];
+            result->o_won += result->by_length[len][1];
+            result->drawn += result->by_length[len][2];
+        }
+    }
+    return status;
+}
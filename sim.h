@@ -0,0 +1,54 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+
+#define SIM_BATCH 4096 // Games played in lockstep by one thread
+
+/*
+A board side is a bit for each cell it holds, cell 0 to 8 row by row as on
+the server's board.
+*/
+#define SIM_FULL 0x1FF
+
+/*
+A bot. Returns the cell, 0 to 8, to take next, given the cells the side to
+move holds, the cells the opponent holds and a random number generator the
+bot may advance. Only called while the board has an empty cell and no line.
+*/
+typedef int (*sim_policy)(uint16_t mine, uint16_t theirs, uint64_t *rng);
+
+int sim_random(uint16_t mine, uint16_t theirs, uint64_t *rng);  // Any empty cell
+int sim_greedy(uint16_t mine, uint16_t theirs, uint64_t *rng);  // Wins if it can, else blocks, else random
+int sim_perfect(uint16_t mine, uint16_t theirs, uint64_t *rng); // A random one of the best moves
+
+/*
+Returns the built in bot with this name, or NULL.
+*/
+sim_policy sim_find_policy(const char *name);
+
+/*
+Outcomes of a run
+*/
+typedef struct sim_result
+{
+    uint64_t games;
+    uint64_t x_won, o_won, drawn;
+    uint64_t by_length[10][3]; // Games by number of moves, then X won, O won, drawn
+} sim_result;
+
+/*
+Returns a random number from the generator and advances it.
+*/
+uint64_t sim_next(uint64_t *rng);
+
+/*
+Plays games between two bots on threads threads, X moving first, and adds
+the outcomes to result. Every batch of SIM_BATCH games has its own
+generator seeded from seed and the batch's number, so a seed gives the same
+outcomes whatever the number of threads. Returns -1 if a thread cannot be
+started.
+*/
+int sim_run(sim_policy x, sim_policy o, uint64_t games, uint64_t seed, int threads, sim_result *result);
+
+#endif
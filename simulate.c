@@ -0,0 +1,92 @@
+// Pits two bots against each other over many games without a server and
+// prints how they did. The games are split across threads, but a seed always
+// gives the same outcomes, so two bots can be compared on the same games.
+//
+// Usage: simulate [-n games] [-j threads] [-s seed] [-x bot] [-o bot] [-J]
+//        bots: random, greedy, perfect
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "sim.h"
+
+static double percent(uint64_t part, uint64_t whole)
+{
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-n games] [-j threads] [-s seed] [-x random|greedy|perfect] [-o random|greedy|perfect] [-J]\n",
+            program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t games = 10000000, seed = 1;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN), json = 0, opt;
+    const char *x_name = "random", *o_name = "random";
+    while ((opt = getopt(argc, argv, "n:j:s:x:o:J")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            games = strtoull(optarg, NULL, 10);
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'x':
+            x_name = optarg;
+            break;
+        case 'o':
+            o_name = optarg;
+            break;
+        case 'J':
+            json = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    sim_policy x = sim_find_policy(x_name), o = sim_find_policy(o_name);
+    if (x == NULL || o == NULL)
+        usage(argv[0]);
+
+    sim_result result = {0};
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    if (sim_run(x, o, games, seed, threads, &result))
+    {
+        fprintf(stderr, "Could not start %d threads\n", threads);
+        exit(EXIT_FAILURE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    double rate = seconds > 0 ? result.games / seconds : 0.0;
+
+    if (json)
+    {
+        printf("{\"name\": \"simulate_%s_%s\", \"unit\": \"games/s\", \"value\": %.0f, \"better\": \"higher\"},\n", x_name,
+               o_name, rate);
+        return EXIT_SUCCESS;
+    }
+    printf("X %s against O %s, seed %lu: %lu games in %.3f s on %d threads, %.1f million games/s\n", x_name, o_name,
+           seed, result.games, seconds, threads, rate / 1e6);
+    printf("X won  %12lu  %5.1f%%\n", result.x_won, percent(result.x_won, result.games));
+    printf("O won  %12lu  %5.1f%%\n", result.o_won, percent(result.o_won, result.games));
+    printf("drawn  %12lu  %5.1f%%\n", result.drawn, percent(result.drawn, result.games));
+    printf("Moves       games   X won   O won   drawn\n");
+    for (int len = 5; len <= 9; len++)
+    {
+        uint64_t n = result.by_length[len][0] + result.by_length[len][1] + result.by_length[len][2];
+        printf("%5d %11lu  %5.1f%%  %5.1f%%  %5.1f%%\n", len, n, percent(result.by_length[len][0], n),
+               percent(result.by_length[len][1], n), percent(result.by_length[len][2], n));
+    }
+    return EXIT_SUCCESS;
+}
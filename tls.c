@@ -0,0 +1,337 @@
+// TLS through OpenSSL. The server asks OpenSSL to hand each connection's
+// record layer to the kernel (kTLS) once the handshake is done, so moves are
+// encrypted by the kernel on their way through send() and recv() with no
+// copies in userspace. Where the kernel cannot, the event loop keeps moving
+// the bytes and OpenSSL encrypts them between two memory buffers.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <string.h>
+#include "tls.h"
+
+#ifndef NO_TLS
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+static SSL_CTX *server_ctx = NULL;
+static SSL_CTX *client_ctx = NULL;
+#define TICKETS 64 // Tickets the client holds for connections to come
+
+static SSL_SESSION *tickets[TICKETS]; // Each is offered once, newest first
+static int num_tickets = 0;
+static int client_resume = 0;
+
+static void print_errors(const char *what)
+{
+    fprintf(stderr, "%s: ", what);
+    ERR_print_errors_fp(stderr);
+}
+
+int tls_server_init(const char *cert_file, const char *key_file)
+{
+    server_ctx = SSL_CTX_new(TLS_server_method());
+    if (server_ctx == NULL)
+    {
+        print_errors("SSL_CTX_new");
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(server_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(server_ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+    // The loop moves unsent bytes to the front of its buffer between writes
+    SSL_CTX_set_mode(server_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                                     SSL_MODE_RELEASE_BUFFERS);
+    if (SSL_CTX_use_certificate_chain_file(server_ctx, cert_file) != 1)
+    {
+        print_errors(cert_file);
+        return -1;
+    }
+    if (SSL_CTX_use_PrivateKey_file(server_ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(server_ctx) != 1)
+    {
+        print_errors(key_file);
+        return -1;
+    }
+
+    // Stateless tickets for TLS 1.3, and the session cache for TLS 1.2. A
+    // TLS 1.3 ticket is used once, so each connection hands out two: one to
+    // replace the ticket it came with, and one to spare for a client that
+    // opens several connections at once.
+    SSL_CTX_set_session_id_context(server_ctx, (const unsigned char *)"ttts", 4);
+    SSL_CTX_set_session_cache_mode(server_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_num_tickets(server_ctx, 2);
+    return 0;
+}
+
+/*
+Keeps a ticket the server sent for a later connection, dropping the oldest
+when there are already enough.
+*/
+static int keep_ticket(SSL *ssl, SSL_SESSION *session)
+{
+    if (num_tickets == TICKETS)
+    {
+        SSL_SESSION_free(tickets[0]);
+        memmove(tickets, tickets + 1, (TICKETS - 1) * sizeof(tickets[0]));
+        num_tickets--;
+    }
+    tickets[num_tickets++] = session;
+    return 1; // The reference is ours now
+}
+
+int tls_client_init(int resume)
+{
+    client_ctx = SSL_CTX_new(TLS_client_method());
+    if (client_ctx == NULL)
+    {
+        print_errors("SSL_CTX_new");
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(client_ctx, TLS1_2_VERSION);
+    // Local testing uses self-signed certificates, so the server is not verified
+    SSL_CTX_set_verify(client_ctx, SSL_VERIFY_NONE, NULL);
+    // A read that only finds a session ticket returns instead of waiting for
+    // the next record, so clients polling the socket do not block in it
+    SSL_CTX_clear_mode(client_ctx, SSL_MODE_AUTO_RETRY);
+    client_resume = resume;
+    if (resume)
+    {
+        SSL_CTX_set_session_cache_mode(client_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(client_ctx, keep_ticket);
+    }
+    return 0;
+}
+
+static tls_session *new_session(SSL_CTX *ctx, int fd)
+{
+    if (ctx == NULL)
+        return NULL;
+    SSL *ssl = SSL_new(ctx);
+    if (ssl == NULL)
+        return NULL;
+    if (SSL_set_fd(ssl, fd) != 1)
+    {
+        SSL_free(ssl);
+        return NULL;
+    }
+    return ssl;
+}
+
+tls_session *tls_accept(int fd)
+{
+    SSL *ssl = new_session(server_ctx, fd);
+    if (ssl != NULL)
+        SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+tls_session *tls_connect(int fd)
+{
+    SSL *ssl = new_session(client_ctx, fd);
+    if (ssl == NULL)
+        return NULL;
+    if (client_resume && num_tickets > 0)
+    {
+        SSL_SESSION *ticket = tickets[--num_tickets];
+        SSL_set_session(ssl, ticket);
+        SSL_SESSION_free(ticket); // The session holds its own reference
+    }
+    SSL_set_connect_state(ssl);
+    return ssl;
+}
+
+/*
+Turns an OpenSSL failure into one of the results in tls.h.
+*/
+static int result(SSL *ssl, int ret)
+{
+    switch (SSL_get_error(ssl, ret))
+    {
+    case SSL_ERROR_WANT_READ:
+        return TLS_WANT_READ;
+    case SSL_ERROR_WANT_WRITE:
+        return TLS_WANT_WRITE;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    default:
+        ERR_clear_error(); // A peer that is not speaking TLS is not the server's error
+        return TLS_ERROR;
+    }
+}
+
+int tls_handshake(tls_session *t)
+{
+    int ret = SSL_do_handshake(t);
+    if (ret == 1)
+        return 0;
+    ret = result(t, ret);
+    return ret == 0 ? TLS_ERROR : ret;
+}
+
+int tls_kernel_send(tls_session *t)
+{
+    return BIO_get_ktls_send(SSL_get_wbio(t)) > 0;
+}
+
+int tls_kernel_recv(tls_session *t)
+{
+    return BIO_get_ktls_recv(SSL_get_rbio(t)) > 0;
+}
+
+int tls_resumed(tls_session *t)
+{
+    return SSL_session_reused(t);
+}
+
+const char *tls_describe(tls_session *t)
+{
+    static char description[64];
+    snprintf(description, sizeof(description), "%s %s", SSL_get_version(t), SSL_get_cipher(t));
+    return description;
+}
+
+int tls_use_memory(tls_session *t)
+{
+    BIO *rbio = SSL_get_rbio(t), *wbio = SSL_get_wbio(t);
+    if (!tls_kernel_recv(t) && (rbio = BIO_new(BIO_s_mem())) == NULL)
+        return -1;
+    if (!tls_kernel_send(t) && (wbio = BIO_new(BIO_s_mem())) == NULL)
+    {
+        if (rbio != SSL_get_rbio(t))
+            BIO_free(rbio);
+        return -1;
+    }
+    // Takes over the new BIOs, and frees the socket BIO once neither uses it
+    SSL_set_bio(t, rbio, wbio);
+    return 0;
+}
+
+int tls_feed(tls_session *t, const char *buf, int len)
+{
+    return BIO_write(SSL_get_rbio(t), buf, len);
+}
+
+int tls_take(tls_session *t, char *buf, int len)
+{
+    int bytes = BIO_read(SSL_get_wbio(t), buf, len);
+    return bytes < 0 ? 0 : bytes;
+}
+
+int tls_pending(tls_session *t)
+{
+    return BIO_ctrl_pending(SSL_get_wbio(t));
+}
+
+int tls_read(tls_session *t, char *buf, int len)
+{
+    int bytes = SSL_read(t, buf, len);
+    return bytes > 0 ? bytes : result(t, bytes);
+}
+
+int tls_write(tls_session *t, const char *buf, int len)
+{
+    int bytes = SSL_write(t, buf, len);
+    return bytes > 0 ? bytes : result(t, bytes);
+}
+
+int tls_buffered(tls_session *t)
+{
+    return SSL_pending(t);
+}
+
+void tls_free(tls_session *t)
+{
+    // Players hang up without a close_notify, and OpenSSL would otherwise
+    // treat that as a failure and spoil the ticket the session handed out
+    SSL_set_shutdown(t, SSL_SENT_SHUTDOWN);
+    SSL_free(t);
+}
+
+#else
+
+int tls_server_init(const char *cert_file, const char *key_file)
+{
+    fprintf(stderr, "Built without TLS\n");
+    return -1;
+}
+
+int tls_client_init(int resume)
+{
+    fprintf(stderr, "Built without TLS\n");
+    return -1;
+}
+
+tls_session *tls_accept(int fd)
+{
+    return NULL;
+}
+
+tls_session *tls_connect(int fd)
+{
+    return NULL;
+}
+
+int tls_handshake(tls_session *t)
+{
+    return TLS_ERROR;
+}
+
+int tls_kernel_send(tls_session *t)
+{
+    return 0;
+}
+
+int tls_kernel_recv(tls_session *t)
+{
+    return 0;
+}
+
+int tls_resumed(tls_session *t)
+{
+    return 0;
+}
+
+const char *tls_describe(tls_session *t)
+{
+    return "none";
+}
+
+int tls_use_memory(tls_session *t)
+{
+    return -1;
+}
+
+int tls_feed(tls_session *t, const char *buf, int len)
+{
+    return TLS_ERROR;
+}
+
+int tls_take(tls_session *t, char *buf, int len)
+{
+    return 0;
+}
+
+int tls_pending(tls_session *t)
+{
+    return 0;
+}
+
+int tls_read(tls_session *t, char *buf, int len)
+{
+    return TLS_ERROR;
+}
+
+int tls_write(tls_session *t, const char *buf, int len)
+{
+    return TLS_ERROR;
+}
+
+int tls_buffered(tls_session *t)
+{
+    return 0;
+}
+
+void tls_free(tls_session *t)
+{
+}
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef TLS_H
+#define TLS_H
+
+// Results of the handshake and of reads and writes, besides byte counts
+#define TLS_WANT_READ -1  // Needs more bytes from the peer
+#define TLS_WANT_WRITE -2 // The socket is full
+#define TLS_ERROR -3      // The connection failed or the peer is not speaking TLS
+
+/*
+One TLS connection, an OpenSSL SSL object. Built with -DNO_TLS every call
+fails and no OpenSSL is needed.
+*/
+typedef struct ssl_st tls_session;
+
+/*
+Loads the server's certificate chain and key (PEM files) and sets up session
+tickets so returning players skip the full handshake. Returns -1 and prints
+why on failure.
+*/
+int tls_server_init(const char *cert_file, const char *key_file);
+
+/*
+Sets up the client side. With resume set, connections offer tickets the
+server gave earlier ones, so reconnects are abbreviated handshakes.
+*/
+int tls_client_init(int resume);
+
+/*
+Starts a session on a connected socket; tls_handshake() then runs it to
+completion. The socket should be non-blocking on the server.
+*/
+tls_session *tls_accept(int fd);
+tls_session *tls_connect(int fd);
+
+/*
+Continues the handshake. Returns 0 once it is done, or TLS_WANT_READ,
+TLS_WANT_WRITE or TLS_ERROR.
+*/
+int tls_handshake(tls_session *t);
+
+/*
+After the handshake: whether the kernel took over encrypting what is sent
+(kTLS) or decrypting what is received. Those directions of the socket are
+then used with plain send() and recv().
+*/
+int tls_kernel_send(tls_session *t);
+int tls_kernel_recv(tls_session *t);
+
+int tls_resumed(tls_session *t);
+const char *tls_describe(tls_session *t); // Protocol version and cipher
+
+/*
+Moves the directions the kernel did not take over onto memory buffers, so
+the event loop moves the encrypted bytes and OpenSSL only transforms them:
+tls_feed() takes received bytes, tls_take() returns bytes to send.
+*/
+int tls_use_memory(tls_session *t);
+int tls_feed(tls_session *t, const char *buf, int len);
+int tls_take(tls_session *t, char *buf, int len);
+int tls_pending(tls_session *t); // Bytes tls_take() would return
+
+/*
+Reads decrypted bytes: returns how many, 0 once the peer closed, or one of
+the results above. tls_write() returns the bytes it took.
+*/
+int tls_read(tls_session *t, char *buf, int len);
+int tls_write(tls_session *t, const char *buf, int len);
+int tls_buffered(tls_session *t); // Decrypted bytes tls_read() returns without reading the socket
+
+void tls_free(tls_session *t);
+
+#endif
@@ -0,0 +1,264 @@
+// Tournament pairing and scoring, apart from the games themselves. The server
+// asks for a round, starts all of its games at once, and reports each result
+// as it comes in; this file decides who meets whom, who goes through and who
+// finishes where. Everything here runs on the event loop's thread.
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include "tournament.h"
+
+#define MAX_ROUNDS 32 // Enough Swiss rounds for any number of entrants that fits in memory
+
+int tournament_init(tournament *t, int format, int size, int rounds)
+{
+    memset(t, 0, sizeof(*t));
+    if (size < 2 || rounds < 0 || rounds > MAX_ROUNDS)
+        return -1;
+    if (rounds == 0)
+        while (1 << rounds < size && rounds < MAX_ROUNDS)
+            rounds++;
+    t->format = format;
+    t->size = size;
+    t->rounds = rounds;
+    t->matches = malloc(sizeof(tournament_match) * (size / 2));
+    t->players = malloc(sizeof(void *) * size);
+    t->score = malloc(sizeof(int) * size);
+    t->place = malloc(sizeof(int) * size);
+    t->match = malloc(sizeof(int) * size);
+    t->opponents = malloc(sizeof(int) * size * rounds);
+    t->order = malloc(sizeof(int) * size);
+    t->had_bye = malloc(size);
+    if (t->matches == NULL || t->players == NULL || t->score == NULL || t->place == NULL || t->match == NULL ||
+        t->opponents == NULL || t->order == NULL || t->had_bye == NULL)
+    {
+        tournament_free(t);
+        return -1;
+    }
+    tournament_reset(t);
+    return 0;
+}
+
+void tournament_free(tournament *t)
+{
+    free(t->matches);
+    free(t->players);
+    free(t->score);
+    free(t->place);
+    free(t->match);
+    free(t->opponents);
+    free(t->order);
+    free(t->had_bye);
+    memset(t, 0, sizeof(*t));
+}
+
+void tournament_reset(tournament *t)
+{
+    t->entered = 0;
+    t->round = 0;
+    t->active = 0;
+    t->num_matches = 0;
+    t->unfinished = 0;
+    memset(t->players, 0, sizeof(void *) * t->size);
+    memset(t->score, 0, sizeof(int) * t->size);
+    memset(t->place, 0, sizeof(int) * t->size);
+    memset(t->match, 0xff, sizeof(int) * t->size);
+    memset(t->had_bye, 0, t->size);
+}
+
+int tournament_enter(tournament *t, void *player)
+{
+    if (t->round > 0 || t->entered == t->size)
+        return -1;
+    t->players[t->entered] = player;
+    return t->entered++;
+}
+
+/*
+Entrants still in the tournament, in the order they entered.
+*/
+static int remaining(tournament *t)
+{
+    int n = 0;
+    for (int e = 0; e < t->entered; e++)
+        if (t->players[e] != NULL && t->place[e] == 0)
+            t->order[n++] = e;
+    return n;
+}
+
+void *tournament_withdraw(tournament *t, int entrant)
+{
+    if (t->round == 0)
+    {
+        int last = --t->entered;
+        t->players[entrant] = t->players[last];
+        t->players[last] = NULL;
+        return entrant != last ? t->players[entrant] : NULL;
+    }
+    t->players[entrant] = NULL;
+    // Out of a knockout at once, behind everyone still in it
+    if (t->format == TOURNAMENT_SINGLE && t->place[entrant] == 0)
+        t->place[entrant] = remaining(t) + 1;
+    return NULL;
+}
+
+/*
+Sorts the first n entrants of t->order by score, highest first, keeping
+entrants with equal scores in the order they entered. Scores are small, so
+this counts them rather than comparing.
+*/
+static void sort_by_score(tournament *t, int n)
+{
+    int starts[2 * MAX_ROUNDS + 2] = {0};
+    int *sorted = t->match; // Free between rounds
+    for (int i = 0; i < n; i++)
+        starts[2 * MAX_ROUNDS - t->score[t->order[i]] + 1]++;
+    for (int s = 1; s <= 2 * MAX_ROUNDS + 1; s++)
+        starts[s] += starts[s - 1];
+    for (int i = 0; i < n; i++)
+        sorted[starts[2 * MAX_ROUNDS - t->score[t->order[i]]]++] = t->order[i];
+    memcpy(t->order, sorted, sizeof(int) * n);
+}
+
+static int have_met(tournament *t, int a, int b)
+{
+    const int *met = t->opponents + a * t->rounds;
+    for (int r = 0; r < t->round; r++)
+        if (met[r] == b)
+            return 1;
+    return 0;
+}
+
+/*
+Pairs each entrant, from the top of the standings down, with the next one
+it has not met. If it has met all of them it plays the next one again.
+*/
+static int pair_swiss(tournament *t, int n)
+{
+    int count = 0;
+    for (int i = 0; i < n; i++)
+    {
+        int a = t->order[i];
+        if (t->match[a] >= 0)
+            continue;
+        int partner = -1;
+        for (int j = i + 1; j < n; j++)
+        {
+            int b = t->order[j];
+            if (t->match[b] >= 0)
+                continue;
+            if (partner < 0)
+                partner = j;
+            if (!have_met(t, a, b))
+            {
+                partner = j;
+                break;
+            }
+        }
+        int b = t->order[partner];
+        t->matches[count].first = a;
+        t->matches[count].second = b;
+        t->match[a] = t->match[b] = count++;
+    }
+    return count;
+}
+
+/*
+Gives the final places of a Swiss tournament, by score and then by order of
+entry, to everyone who played in it.
+*/
+static void place_swiss(tournament *t)
+{
+    for (int e = 0; e < t->entered; e++)
+        t->order[e] = e;
+    sort_by_score(t, t->entered);
+    for (int i = 0; i < t->entered; i++)
+        t->place[t->order[i]] = i + 1;
+}
+
+int tournament_next_round(tournament *t)
+{
+    int n = remaining(t);
+    if (t->format == TOURNAMENT_SWISS && (t->round == t->rounds || n < 2))
+    {
+        place_swiss(t);
+        return 0;
+    }
+    if (t->format == TOURNAMENT_SINGLE && n < 2)
+    {
+        if (n == 1)
+            t->place[t->order[0]] = 1;
+        return 0;
+    }
+    if (t->format == TOURNAMENT_SWISS)
+        sort_by_score(t, n);
+    memset(t->match, 0xff, sizeof(int) * t->entered);
+
+    if (t->format == TOURNAMENT_SWISS)
+    {
+        if (n % 2)
+        {
+            // The bye goes to the lowest player who has not had one yet
+            int i = n - 1;
+            while (i >= 0 && t->had_bye[t->order[i]])
+                i--;
+            if (i < 0)
+                i = n - 1;
+            int e = t->order[i];
+            t->had_bye[e] = 1;
+            t->score[e] += 2;
+            t->opponents[e * t->rounds + t->round] = -1;
+            memmove(t->order + i, t->order + i + 1, sizeof(int) * (n - 1 - i));
+            n--;
+        }
+        t->num_matches = pair_swiss(t, n);
+        for (int m = 0; m < t->num_matches; m++)
+        {
+            int a = t->matches[m].first, b = t->matches[m].second;
+            t->opponents[a * t->rounds + t->round] = b;
+            t->opponents[b * t->rounds + t->round] = a;
+        }
+    }
+    else
+    {
+        // Neighbours in the bracket meet, so winners stay next to the winners
+        // of the neighbouring game; with an odd number the last one goes through
+        t->num_matches = n / 2;
+        for (int m = 0; m < t->num_matches; m++)
+        {
+            int a = t->order[2 * m], b = t->order[2 * m + 1];
+            t->matches[m].first = a;
+            t->matches[m].second = b;
+            t->match[a] = t->match[b] = m;
+        }
+        if (n % 2)
+            t->score[t->order[n - 1]] += 2;
+    }
+    t->active = n;
+    t->unfinished = t->num_matches;
+    t->round++;
+    return t->num_matches;
+}
+
+int tournament_result(tournament *t, int match, int winner)
+{
+    tournament_match *m = &t->matches[match];
+    if (m->first < 0)
+        return 0; // Already reported
+    if (winner == TOURNAMENT_DRAW && t->format == TOURNAMENT_SINGLE)
+        winner = 1;
+    if (winner == TOURNAMENT_DRAW)
+    {
+        t->score[m->first]++;
+        t->score[m->second]++;
+    }
+    else
+    {
+        int won = winner ? m->second : m->first, lost = winner ? m->first : m->second;
+        t->score[won] += 2;
+        // Everyone knocked out in a round shares the place behind its winners
+        if (t->format == TOURNAMENT_SINGLE)
+            t->place[lost] = t->active - t->num_matches + 1;
+    }
+    m->first = m->second = -1;
+    return --t->unfinished == 0;
+}
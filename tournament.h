@@ -0,0 +1,85 @@
+#ifndef TOURNAMENT_H
+#define TOURNAMENT_H
+
+#define TOURNAMENT_SINGLE 1 // Single elimination, until one player is left
+#define TOURNAMENT_SWISS 2  // A fixed number of rounds, players with equal scores meet
+
+#define TOURNAMENT_DRAW -1  // Result of a drawn game
+
+/*
+One game of a round, between two entrants. The first plays X.
+*/
+typedef struct tournament_match
+{
+    int first, second;
+} tournament_match;
+
+/*
+A tournament's entrants and the current round. Entrants are numbered in the
+order they entered, which is also their seeding. What the server knows about
+each one is kept in arrays indexed by that number, so a round of thousands of
+games is paired and scored by walking a few flat arrays.
+*/
+typedef struct tournament
+{
+    int format;                 // TOURNAMENT_SINGLE or TOURNAMENT_SWISS
+    int size;                   // Entrants it starts with
+    int rounds;                 // Rounds of a Swiss tournament
+    int entered;
+    int round;                  // Rounds paired so far, 0 before the start
+    int active;                 // Entrants still playing
+    int num_matches;            // Games in this round
+    int unfinished;             // Games in this round without a result yet
+    tournament_match *matches;
+    void **players;             // The server's data for each entrant, NULL once it left or heard its place
+    int *score;                 // Two points for a win or a bye, one for a draw
+    int *place;                 // Final place, 0 while still playing
+    int *match;                 // Entrant's game in this round, -1 for none
+    int *opponents;             // Swiss: each entrant's opponents so far, rounds apiece
+    int *order;                 // Entrants in pairing order
+    char *had_bye;
+} tournament;
+
+/*
+Sets up a tournament for size entrants. rounds is only used for Swiss; 0
+picks enough rounds to leave one player with a perfect score. Returns -1 if
+memory runs out.
+*/
+int tournament_init(tournament *t, int format, int size, int rounds);
+
+void tournament_free(tournament *t);
+
+/*
+Makes the tournament ready for a new set of entrants.
+*/
+void tournament_reset(tournament *t);
+
+/*
+Adds an entrant and returns its number, or -1 if the tournament is full or
+has started.
+*/
+int tournament_enter(tournament *t, void *player);
+
+/*
+An entrant left. Before the start its place is given to the last entrant,
+who is returned so the caller can renumber it; afterwards it is simply not
+paired again. Returns NULL when no entrant was moved.
+*/
+void *tournament_withdraw(tournament *t, int entrant);
+
+/*
+Pairs the next round into t->matches. Byes are scored at once. Returns the
+number of games, or 0 once the tournament is over and every remaining
+entrant has its place.
+*/
+int tournament_next_round(tournament *t);
+
+/*
+Records the result of a game of this round: 0 if its first player won, 1
+if the second did, or TOURNAMENT_DRAW. In single elimination a draw sends
+the second player, who had to move second, through. Returns 1 once every
+game of the round has a result.
+*/
+int tournament_result(tournament *t, int match, int winner);
+
+#endif
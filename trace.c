@@ -0,0 +1,93 @@
+// Flight recorder for latency: every stage of handling a message leaves a
+// timestamp in a fixed ring per thread. Nothing is written out until a move
+// turns out slow or a dump is asked for, so recording costs one clock read and
+// a 16 byte store per event.
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <time.h>
+#include "trace.h"
+
+uint64_t trace_slow_ns = 0;
+
+static __thread trace_event *ring = NULL;
+static __thread uint64_t ring_next = 0;    // Events recorded so far
+static __thread uint64_t woke_ns = 0;
+static __thread uint64_t dumped_until = 0; // Events up to this time were already dumped
+
+static const char *stage_names[] = {"wake", "read", "parsed", "lock wait", "moved", "write", "sent"};
+
+uint64_t trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+uint64_t trace_mark(trace_stage stage, int id, unsigned arg)
+{
+    uint64_t now = trace_now();
+    if (ring == NULL && (ring = calloc(TRACE_RING, sizeof(trace_event))) == NULL)
+        return now;
+    trace_event *e = &ring[ring_next++ & (TRACE_RING - 1)];
+    e->ns = now;
+    e->id = id;
+    e->stage = stage;
+    e->arg = arg > UINT16_MAX ? UINT16_MAX : arg;
+    if (stage == TRACE_WAKE)
+        woke_ns = now;
+    return now;
+}
+
+uint64_t trace_woke(void)
+{
+    return woke_ns;
+}
+
+void trace_lock(pthread_mutex_t *mutex, int id)
+{
+    if (pthread_mutex_trylock(mutex) == 0)
+        return;
+    uint64_t start = trace_now();
+    pthread_mutex_lock(mutex);
+    trace_mark(TRACE_LOCK, id, (trace_now() - start) / 1000);
+}
+
+/*
+Writes the events recorded at or after from, with times relative to since.
+*/
+static void dump_since(FILE *out, uint64_t since, uint64_t from)
+{
+    if (ring == NULL)
+        return;
+    uint64_t first = ring_next > TRACE_RING ? ring_next - TRACE_RING : 0;
+    // Events are in time order, so skip to the first one that is recent enough
+    while (first < ring_next && ring[first & (TRACE_RING - 1)].ns < from)
+        first++;
+    for (uint64_t i = first; i < ring_next; i++)
+    {
+        trace_event *e = &ring[i & (TRACE_RING - 1)];
+        fprintf(out, "  %+10.1f us  fd %3d  %-9s %u\n", (double)(int64_t)(e->ns - since) / 1000, e->id,
+                stage_names[e->stage], e->arg);
+    }
+    if (ring_next > 0)
+        dumped_until = ring[(ring_next - 1) & (TRACE_RING - 1)].ns + 1;
+}
+
+void trace_move_done(int id, uint64_t started)
+{
+    uint64_t now = trace_now();
+    if (trace_slow_ns == 0 || now - started <= trace_slow_ns)
+        return;
+    // Both players' replies to one move can be slow; show the second only
+    // what the first dump did not already cover
+    fprintf(stderr, "slow move: fd %d took %.1f us\n", id, (double)(now - started) / 1000);
+    dump_since(stderr, started, started > dumped_until ? started : dumped_until);
+}
+
+void trace_dump_recent(FILE *out, int seconds)
+{
+    uint64_t now = trace_now(), window = (uint64_t)seconds * 1000000000u;
+    fprintf(out, "flight recorder: last %d s, times relative to now\n", seconds);
+    dump_since(out, now, now > window ? now - window : 0);
+    fflush(out);
+}
@@ -0,0 +1,66 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define TRACE_RING 65536 // Events kept per thread, a power of 2 (1 MB)
+
+/*
+Stages of handling a message, in the order a move passes through them
+*/
+typedef enum
+{
+    TRACE_WAKE,   // The event loop woke up with a batch of events
+    TRACE_READ,   // Bytes were read from a socket
+    TRACE_PARSED, // parse() returned
+    TRACE_LOCK,   // Waited for a mutex another thread held
+    TRACE_MOVED,  // A move was placed on the board and MOVD queued
+    TRACE_WRITE,  // Queued output was handed to the kernel
+    TRACE_SENT    // An io_uring send completed
+} trace_stage;
+
+/*
+One timestamped event in the flight recorder
+*/
+typedef struct trace_event
+{
+    uint64_t ns;    // CLOCK_MONOTONIC
+    int32_t id;     // Socket the event belongs to, -1 for the whole loop
+    uint16_t stage;
+    uint16_t arg;   // Bytes read or written, command type, events woken for, or microseconds waited
+} trace_event;
+
+extern uint64_t trace_slow_ns; // Moves slower than this are dumped to stderr, 0 for never
+
+uint64_t trace_now(void);
+
+/*
+Records an event in this thread's ring, overwriting the oldest, and returns its time.
+*/
+uint64_t trace_mark(trace_stage stage, int id, unsigned arg);
+
+/*
+Time this thread's event loop last woke up, which is when the messages it is
+handling now became visible to the server.
+*/
+uint64_t trace_woke(void);
+
+/*
+Locks a mutex, recording how long it waited if another thread held it.
+*/
+void trace_lock(pthread_mutex_t *mutex, int id);
+
+/*
+Called when the reply to a move is written. Dumps the events since started
+if the move took longer than trace_slow_ns.
+*/
+void trace_move_done(int id, uint64_t started);
+
+/*
+Writes this thread's events from the last given number of seconds.
+*/
+void trace_dump_recent(FILE *out, int seconds);
+
+#endif
@@ -1,42 +1,57 @@
-// NOTE: must use option -pthread when compiling!
+// NOTE: must use option -pthread when compiling, together with ioloop.c, cluster.c, lobby.c, session.c, tournament.c, archive.c, gametable.c, parse.c, trace.c, lockprof.c, affinity.c, tls.c and websocket.c, linked with -lssl -lcrypto!
 #define _POSIX_C_SOURCE 200809L
-#define BUFSIZE 256
 #define HOSTSIZE 100
 #define PORTSIZE 10
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <ctype.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/wait.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <signal.h>
-#include <pthread.h>
 #include <errno.h>
 #include <unistd.h>
-
-
-#define QUEUE_SIZE 8
-
-typedef enum
-{
-    PLAY,
-    SUGDRAW,
-    ACCDRAW,
-    REJDRAW,
-    RESIGN,
-    MOVE,
-    INVALID,
-    BAD_COMMAND
-} command_type;
-
-pthread_mutex_t connecting_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t connecting_cond = PTHREAD_COND_INITIALIZER;
+#include <fcntl.h>
+#include <time.h>
+#include "ioloop.h"
+#include "parse.h"
+#include "lobby.h"
+#include "session.h"
+#include "tournament.h"
+#include "archive.h"
+#include "gametable.h"
+#include "trace.h"
+#include "lockprof.h"
+#include "affinity.h"
+#include "hashtable.h"
+#include "tls.h"
+#include "cluster.h"
+
+
+#define QUEUE_SIZE SOMAXCONN
+#define MAX_LISTENERS 5
+
+// What clients of a listener speak on top of the socket
+#define TRANSPORT_TLS 1
+#define TRANSPORT_WS 2
+
+// Everything in this file belongs to the event loop's thread: it is the one
+// executor for every game, so its lists and games are used without locks.
+// Other threads hand it work with io_post().
 
 struct connection_data *waiting_client;
 
+#define NAME_BUCKETS 1024 // Initial size of the table of names in use
+
 /*
-LL of unique usernames
+Unique usernames, in a hash table of chains that doubles once names
+outnumber buckets, so a tournament's thousands of entrants register in
+constant time each.
 */
 typedef struct Node
 {
@@ -44,38 +59,82 @@ typedef struct Node
     struct Node *next;
 } Node;
 
-pthread_mutex_t names_mutex = PTHREAD_MUTEX_INITIALIZER;
-Node *unique_names = NULL;
+Node **unique_names = NULL;
+size_t num_name_buckets = 0;
+size_t num_names = 0;
+
+typedef struct client_pair_t client_pair_t;
+
+typedef struct event event;
+
+#define MAX_CHANNELS 65536       // Channels on a carrier are numbered 1 to 65535
+#define CARRIER_BACKLOG (4 << 20) // Output a carrier may have waiting for its socket
 
 /*
-Stores data about a player's input to the server
+Where a connection is in its life. Input from a player is held while the
+connection is WAITING, NAMING or RELAYING and processed in every other state.
+The last states only occur in a cluster.
 */
-typedef struct player_input
+typedef enum
 {
-    command_type type;
-    char name[128];
-    char x_or_o;                   // X , 0
-    char vertical_pos;             //  1 , 2 , 3
-    char horizontal_pos;           // 1, 2 , 3
-    char client_response_msg[100]; //
-} player_input;
-
-typedef struct client_pair_t client_pair_t;
+    CONN_NEW,        // Waiting for the PLAY command
+    CONN_WAITING,    // Queued for an opponent, or for the next round of a tournament
+    CONN_PLAYING,    // In a game
+    CONN_FINISHED,   // Game is over, may ask for a rematch or play someone else
+    CONN_DROPPED,    // Lost the connection mid-game, seat held for a reconnect
+    CONN_CARRIER,    // Carries the messages of many players, each on a channel of its own
+    CONN_NAMING,     // The coordinator is checking the name the player asked for
+    CONN_RELAYING,   // Connecting to the node that hosts the player's game
+    CONN_RELAYED,    // Plays on another node, messages are passed both ways
+    CONN_UPSTREAM,   // This node's connection to another, for a relayed player
+    CONN_COORDINATOR // The link to the cluster coordinator
+} connection_state;
 
 /*
-Stores data about a single connected client
+Stores data about a single connected client. Handling a message touches the
+socket's first cache line and the line of game state after it; who the
+player is and where they connected from come last, since they are only
+needed when a player arrives, leaves or reconnects.
 */
 struct connection_data
 {
-    struct sockaddr_storage addr; // Player's IP + Port
-    socklen_t addr_len;           // Length of address
-    int fd;                       // File Descriptor for players socket
-    char name[128];               // Player's name
+    io_conn io;                   // Socket and its buffers, must be first
+
+    // Game state, one cache line
+    connection_state state;
     char role;                    // Player's role
-    int index;
     char wants_draw;
-    client_pair_t *pair; // Reference to the client pair
-    pthread_t thread_id;
+    char wants_rematch;
+    int index;
+    int released;                 // The event loop is done with a dropped connection
+    game_handle game;             // Game at the player's table, GAME_NONE for none
+    room *room;                   // Room this player created and is waiting in
+
+    // Identity
+    char name[128] __attribute__((aligned(64))); // Player's name
+    char token[SESSION_TOKEN_SIZE];              // Lets the player reconnect to this game
+    socklen_t addr_len;                          // Length of address
+    struct sockaddr_storage addr;                // Player's IP + Port
+    io_task resume;                              // Handles input held while the player waited
+
+    // Cluster
+    unsigned long cluster_id;          // How the coordinator knows this player, 0 until it is asked
+    char *pending;                     // Message held while the coordinator checks the name
+    struct connection_data *relay;     // A relayed player and its upstream point at each other
+    char guest;                        // Relayed here by another node, which holds the name
+    char queued;                       // Waiting in the cluster's queue
+
+    // Tournament
+    event *event;                      // Tournament the player is still in, NULL for none
+    int entry;                         // The player's number in it
+
+    char counted;                      // Accepted from a listener, so it counts against max_clients
+
+    // Multiplexing
+    struct connection_data *carrier;   // Connection a channel's messages travel on, NULL for a socket of its own
+    struct connection_data **channels; // A carrier's channels by number, NULL where none is open
+    int channel;                       // A channel's number on its carrier
+    int num_channels;                  // Size of channels
 };
 
 /*
@@ -87,35 +146,147 @@ typedef struct ClientList
     struct ClientList *next;
 } ClientList;
 
-pthread_mutex_t connected_clients_mutex = PTHREAD_MUTEX_INITIALIZER;
 int numConnecting = 0;
 ClientList *connecting_clients = NULL;
+ClientList *free_nodes = NULL; // Nodes kept for reuse
 
 /*
-Stores data about a pair of clients connected to each other
+Stores data about a pair of clients connected to each other, in one slot of
+the game table. Only the event loop touches it, so it needs no locking.
 */
 typedef struct client_pair_t
 {
-    struct connection_data *clients[2]; // Two players
     char board[10];                     // Board data
     char currentTurn;                   // Current turn
+    char history[9];                    // Cell taken by each move, for the archive
     int moves;
-    int gameOver;
-} client_pair_t;
+    struct connection_data *clients[2]; // Two players
+} __attribute__((aligned(64))) client_pair_t;
+
+_Static_assert(sizeof(client_pair_t) == GAME_SLOT_SIZE, "A game must fit in one slot of the game table");
+_Static_assert(offsetof(struct connection_data, name) - offsetof(struct connection_data, state) == 64,
+               "A player's game state must fit in one cache line");
+
+int active = 1;
+
+io_loop *loop;
+unsigned long games_played = 0;
+unsigned long carriers = 0, channels_opened = 0;
+int grace_seconds = 30; // How long a dropped player's seat is held, 0 to forfeit at once
+session_table seats = SESSION_TABLE_INITIALIZER;       // Dropped players' seats, by RCON token
+session_table guest_seats = SESSION_TABLE_INITIALIZER; // Rooms held for a guest from another node, by name
+int dump_seconds = 5;   // How much of the flight recorder SIGUSR1 dumps
+int transports[MAX_LISTENERS]; // TRANSPORT_ bits for each listener
+char *archive_dir = NULL;      // Where finished games are archived, NULL for nowhere
+
+// Admission control. A limit of 0 is no limit.
+#define BUSY_CLIENTS 0
+#define BUSY_GAMES 1
+#define BUSY_WAITING 2
+const char *busy_reasons[] = {"Too many players.", "Too many games.", "Too many players waiting."};
+int max_clients = 0;           // Open connections from players
+int max_games = 0;             // Games in progress before new players are turned away
+int max_waiting = 0;           // Players waiting for an opponent, in the queue or a room
+int busy_retry_ms = 1000;      // How long a player turned away is asked to wait, at least
+int num_clients = 0;
+int games_in_progress = 0;
+int short_of_games = 0;        // A game found the game table full and waits for one to end
+void start_waiting_games(io_loop *loop, void *arg);
+io_task waiting_games = {start_waiting_games, NULL, NULL, 0};
+int overloaded = 0;            // Turning new players away until games drop to 90% of max_games
+unsigned long overloads = 0;
+unsigned long turned_away[3];  // By BUSY_ reason
+// New players let in and turned away this second and the second before
+unsigned long admitted_now = 0, busy_now = 0, admitted_before = 0, busy_before = 0;
+double admission_second = 0;
+
+/*
+A tournament players enter by name with TRNY. It starts once it is full,
+plays its rounds with no one waiting for anything but the games of the
+current round, and then opens for new entrants.
+*/
+struct event
+{
+    char name[ROOM_NAME_SIZE];
+    tournament t;
+    io_task advance;    // Pairs the next round once every game of this one is over
+    int starting;       // The round's first game not started yet, while the game table is full
+    double started;     // When the first round was paired
+    unsigned long games;
+    struct event *next;
+};
+
+event *events = NULL;
+
+struct connection_data *coordinator = NULL; // Link to the cluster coordinator, NULL when alone
+cluster_link coordinator_link;
+unsigned long next_cluster_id = 1;
+unsigned long relayed_players = 0, hosted_guests = 0;
+
+/*
+Stops the main loop once the current pass is over, so the shutdown report and
+cleanup run on the loop's thread like everything else.
+*/
+void shut_down(io_loop *loop, void *arg)
+{
+    active = 0;
+}
 
-volatile int active = 1;
+/*
+Counts a game by the moves made so far, or as over if its players are only
+still at the table for a rematch.
+*/
+void count_game(game_handle handle, void *slot, void *arg)
+{
+    client_pair_t *pair = slot;
+    unsigned long *by_moves = arg;
+    if (pair->clients[0] == NULL || pair->clients[1] == NULL || pair->clients[0]->state == CONN_FINISHED)
+        by_moves[10]++;
+    else
+        by_moves[pair->moves]++;
+}
+
+/*
+Dumps the flight recorder, the lock profile and the games in the table.
+*/
+void dump_recent(io_loop *loop, void *arg)
+{
+    trace_dump_recent(stderr, dump_seconds);
+    lockprof_report(stderr);
+
+    unsigned long by_moves[11] = {0};
+    int capacity, games = game_count(&capacity);
+    game_each(count_game, by_moves);
+    fprintf(stderr, "Game table: %d games in %d slots, %lu over. In progress by moves made:", games, capacity,
+            by_moves[10]);
+    for (int m = 0; m < 10; m++)
+        fprintf(stderr, " %lu", by_moves[m]);
+    fprintf(stderr, "\n");
+}
+
+io_task shutdown_task = {shut_down, NULL, NULL, 0};
+io_task dump_task = {dump_recent, NULL, NULL, 0};
 
 /*
 If signal is receieved that is bound to handler.
-Causes the system to report shutdown and close resources.
+Hands shutdown to the event loop, which is woken through its mailbox.
 */
 void handler(int signum)
 {
-    active = 0;
+    io_post(loop, &shutdown_task);
+}
+
+/*
+Asks the event loop to dump the flight recorder, on SIGUSR1.
+*/
+void dump_handler(int signum)
+{
+    io_post(loop, &dump_task);
 }
 
 /*
 Sets handlers for interrupt and terminate signals for primary thread.
+The loop must exist first, since the handlers post to it.
 */
 void install_handlers(sigset_t *mask)
 {
@@ -125,41 +296,39 @@ void install_handlers(sigset_t *mask)
     sigemptyset(&act.sa_mask);
     sigaction(SIGINT, &act, NULL);
     sigaction(SIGTERM, &act, NULL);
+    act.sa_handler = dump_handler;
+    sigaction(SIGUSR1, &act, NULL);
+    // OpenSSL writes to sockets without MSG_NOSIGNAL during handshakes
+    act.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &act, NULL);
     sigemptyset(mask);
     sigaddset(mask, SIGINT);
     sigaddset(mask, SIGTERM);
 }
 
-void thread_signal_handler(int sig)
-{
-    if (sig == SIGUSR1)
-    {
-        pthread_exit(NULL);
-    }
-}
-
 /*
 Adds a client that is attempting to connect
 */
 void add_client(struct connection_data *data)
 {
-    pthread_mutex_lock(&connected_clients_mutex);
-    ClientList *newNode = (ClientList *)malloc(sizeof(ClientList));
+    ClientList *newNode = free_nodes;
+    if (newNode != NULL)
+        free_nodes = newNode->next;
+    else
+        newNode = (ClientList *)malloc(sizeof(ClientList));
     newNode->data = data;
     newNode->next = connecting_clients;
     connecting_clients = newNode;
     numConnecting++;
-    pthread_mutex_unlock(&connected_clients_mutex);
 }
 
 void remove_client(struct connection_data *data)
 {
-    pthread_mutex_lock(&connected_clients_mutex);
     ClientList *current = connecting_clients;
     ClientList *prev = NULL;
     while (current != NULL)
     {
-        if (current->data->fd == data->fd)
+        if (current->data == data)
         {
             if (prev != NULL)
             {
@@ -170,28 +339,31 @@ void remove_client(struct connection_data *data)
                 connecting_clients = current->next;
             }
             numConnecting--;
-            free(current);
+            current->next = free_nodes;
+            free_nodes = current;
             break;
         }
 
         prev = current;
         current = current->next;
     }
-    pthread_mutex_unlock(&connected_clients_mutex);
 }
+// Doubles the table of names, or makes the first one
+HASH_GROW(grow_usernames, Node, next, name, hash_string, NAME_BUCKETS)
+
 /*
-Adds username to LL if not already taken.
+Adds username to the table if not already taken.
 */
 int add_username(const char *name)
 {
-    pthread_mutex_lock(&names_mutex);
-
-    Node *current = unique_names;
+    if (num_names >= num_name_buckets && grow_usernames(&unique_names, &num_name_buckets))
+        return EXIT_FAILURE;
+    Node **bucket = &unique_names[hash_string(name) & (num_name_buckets - 1)];
+    Node *current = *bucket;
     while (current != NULL)
     {
         if (strcmp(current->name, name) == 0)
         {
-            pthread_mutex_unlock(&names_mutex);
             return EXIT_FAILURE;
         }
         current = current->next;
@@ -199,44 +371,34 @@ int add_username(const char *name)
 
     Node *newNode = (Node *)malloc(sizeof(Node));
     newNode->name = strdup(name);
-    newNode->next = unique_names;
-    unique_names = newNode;
+    newNode->next = *bucket;
+    *bucket = newNode;
+    num_names++;
 
-    pthread_mutex_unlock(&names_mutex);
     return EXIT_SUCCESS;
 }
 
 /*
-Removes a username from the list.
+Removes a username from the table.
 */
 void remove_username(const char *name)
 {
-    pthread_mutex_lock(&names_mutex);
-
-    Node *current = unique_names;
-    Node *prev = NULL;
-    while (current != NULL)
+    if (num_name_buckets == 0)
+        return;
+    Node **prev = &unique_names[hash_string(name) & (num_name_buckets - 1)];
+    while (*prev != NULL)
     {
+        Node *current = *prev;
         if (strcmp(current->name, name) == 0)
         {
-            if (prev != NULL)
-            {
-                prev->next = current->next;
-            }
-            else
-            {
-                unique_names = current->next;
-            }
-
+            *prev = current->next;
             free(current->name);
             free(current);
+            num_names--;
             break;
         }
-
-        prev = current;
-        current = current->next;
+        prev = &current->next;
     }
-    pthread_mutex_unlock(&names_mutex);
 }
 
 /*
@@ -244,17 +406,21 @@ Frees all memory space allocated for storing usernames
 */
 void free_unique_names()
 {
-    pthread_mutex_unlock(&names_mutex);
-
-    Node *current = unique_names;
-    while (current != NULL)
+    for (size_t i = 0; i < num_name_buckets; i++)
     {
-        Node *next = current->next;
-        free(current->name);
-        free(current);
-        current = next;
+        Node *current = unique_names[i];
+        while (current != NULL)
+        {
+            Node *next = current->next;
+            free(current->name);
+            free(current);
+            current = next;
+        }
     }
-    pthread_mutex_unlock(&names_mutex);
+    free(unique_names);
+    unique_names = NULL;
+    num_name_buckets = 0;
+    num_names = 0;
 }
 
 /*
@@ -299,6 +465,9 @@ int open_listener(char *service, int queue_size)
         // if we could not create the socket, try the next method
         if (sock == -1)
             continue;
+        // the server closes games first, so allow a restart while they sit in TIME_WAIT
+        int one = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
         // bind socket to requested port
         error = bind(sock, info->ai_addr, info->ai_addrlen);
         if (error)
@@ -326,192 +495,106 @@ int open_listener(char *service, int queue_size)
     return sock;
 }
 
-player_input error_bad_command(char *error_msg)
-{
-    player_input ret;
-    int error_msg_len = strlen(error_msg) + 23;
-    
-    memset(&ret, 0, sizeof(player_input));
-    strcpy((char *)ret.client_response_msg, "OVER|");
-    sprintf((char*)(ret.client_response_msg + 5), "%d", error_msg_len);
-    strcat((char *)ret.client_response_msg, "|L|You gave bad input. ");
-    strcat((char *)ret.client_response_msg, error_msg);
-    strcat((char *)ret.client_response_msg, "|\n");
-    ret.type = BAD_COMMAND;
-    return ret;
-}
-
-int count_delimiters(char *str)
-{
-    int count = 0;
-
-    for (int i = 0; str[i]; i++)
-    {
-        if (str[i] == '|')
-            count++;
-    }
-
-    return count;
-}
-
-player_input parse(char *unparsed_input)
+/*
+Used to open a unix domain socket for clients on the same host.
+Any stale socket file left behind at path is removed first.
+*/
+int open_unix_listener(char *path, int queue_size)
 {
-    if (unparsed_input == NULL)
-    {
-        return error_bad_command("Error, null input string.");
-    }
-    char *state;
-    char input[BUFSIZE];
-    strcpy(input, unparsed_input);
-
-    player_input ret;
-    memset(&ret, 0, sizeof(player_input));
-
-    /*
-    Parse protocol type & number of bytes
-    */
-    char *protocol = strtok_r(input, "|", &state);
-    if (protocol == NULL)
-    {
-        return error_bad_command("Error, protocol is null.");
-    }
-    char *bytes = strtok_r(NULL, "|", &state);
-    if (bytes == NULL)
-    {
-        return error_bad_command("Error, bad format"); // Missing | after length
-    }
-    int first_msg_char = strlen(bytes) + strlen(protocol) + 2;
-    int msg_len = strlen(input + first_msg_char);
-
-    if (atoi(bytes) != msg_len || msg_len > 256)
-    {
-        return error_bad_command("Error, bad length");
-    }
+    struct sockaddr_un addr;
+    int sock;
 
-    char *field_1;
-    char *field_2;
-    if (strcmp(protocol, "WAIT") == 0 || strcmp(protocol, "BEGN") == 0 || strcmp(protocol, "MOVD") == 0 || strcmp(protocol, "INVL") == 0 || strcmp(protocol, "OVER") == 0)
+    if (strlen(path) >= sizeof(addr.sun_path))
     {
-        ret.type = INVALID;
-        strcpy(ret.client_response_msg, "INVL|39|User command contains server protocol.|\n");
-        return ret;
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
     }
-    else if (strcmp(protocol, "PLAY") == 0)
-    {
-        if (count_delimiters(unparsed_input) != 3) // Expecting 3 '|' characters for PLAY
-            return error_bad_command("Error, incorrect number of fields for PLAY.");
-
-        field_1 = strtok_r(NULL, "|", &state);
-        ret.type = PLAY;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
 
-        // Conditionals to verify format of the PLAY input
-        if (field_1 == NULL)
-            return error_bad_command("Error, no name given");
-        else
-        {
-            field_2 = strtok_r(NULL, "|", &state);
-            if (field_2 != NULL)
-            {
-                return error_bad_command("Error, unexpected data past the last delimiter.");
-            }
-        }
-        strcpy((char *)&ret.name, field_1);
-    }
-    else if (strcmp(protocol, "DRAW") == 0)
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1)
     {
-        if (count_delimiters(unparsed_input) != 3) // Expecting 3 '|' characters for DRAW
-            return error_bad_command("Error, incorrect number of fields for DRAW.");
-
-        field_1 = strtok_r(NULL, "|", &state);
-
-        // Conditionals to verify format of the DRAW input
-        if (field_1 == NULL)
-            return error_bad_command("Error, no message in requested draw.");
-        else
-        {
-            field_2 = strtok_r(NULL, "|", &state);
-            if (field_2 != NULL)
-                return error_bad_command("Error, unexpected data past the last delimiter.");
-        }
-
-        switch (field_1[0])
-        {
-        case 'R':
-            ret.type = REJDRAW;
-            break;
-        case 'S':
-            ret.type = SUGDRAW;
-            break;
-        case 'A':
-            ret.type = ACCDRAW;
-            break;
-        default:
-            ret.type = INVALID;
-            strcpy((char *)&ret.client_response_msg,
-                   "INVL|44|S to suggest draw, A to accept, R to reject|\n");
-        }
+        perror("socket");
+        return -1;
     }
-    else if (strcmp(protocol, "RSGN") == 0)
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) || listen(sock, queue_size))
     {
-        if (count_delimiters(unparsed_input) != 2) // Expecting 2 '|' characters for RSGN
-            return error_bad_command("Error, incorrect number of fields for RSGN.");
-
-        field_1 = strtok_r(NULL, "|", &state);
-        if (field_1 != NULL)
-            return error_bad_command("Error, unexpected data past the last delimiter.");
-
-        ret.type = RESIGN; // the command RSGN is always correct at this point
+        perror(path);
+        close(sock);
+        return -1;
     }
-    else if (strcmp(protocol, "MOVE") == 0)
-    {
-        if (count_delimiters(unparsed_input) != 4) // Expecting 4 '|' characters for MOVE
-            return error_bad_command("Error, incorrect number of fields for MOVE.");
-
-        field_1 = strtok_r(NULL, "|", &state);
-        field_2 = strtok_r(NULL, "|", &state);
-        ret.type = MOVE;
-        if (field_1 == NULL || field_2 == NULL)
-            return error_bad_command("Error, incomplete message.");
-        if (field_1[0] == 'X')
-            ret.x_or_o = 'X';
-        else if (field_1[0] == 'O')
-            ret.x_or_o = 'O';
-        else
-            return error_bad_command("Error, selected role other than X or O.");
-
-        if ((field_2[0] < '1' || field_2[0] > '3') || (field_2[2] < '1' || field_2[2] > '3'))
-        {
-            strcpy((char *)&ret.client_response_msg,
-                   "INVL|55|Position must be in the form x,y with {1,2,3} for each|\n");
-            ret.type = INVALID;
-        }
+    return sock;
+}
 
-        char *field_3 = strtok_r(NULL, "|", &state);
-        if (field_3 != NULL)
-            return error_bad_command("Error, unexpected data past the last delimiter.");
+/*
+Queues a message for a player on a channel on its carrier, with the channel's
+number after the length, which counts it. The messages of all the channels
+on a carrier go out in one write.
+*/
+void send_on_channel(struct connection_data *con, const char *msg, int len)
+{
+    char framed[BUFSIZE + 16], id[8];
+    struct connection_data *carrier = con->carrier;
+    if (con->io.closing || carrier->io.closing)
+        return;
+    const char *length = memchr(msg, '|', len);
+    const char *rest = length != NULL ? memchr(length + 1, '|', len - (length + 1 - msg)) : NULL;
+    if (rest == NULL)
+        return;
+    int id_len = snprintf(id, sizeof(id), "%d", con->channel);
+    int framed_len = snprintf(framed, sizeof(framed), "%.*s|%d|%s|%.*s", (int)(length - msg), msg,
+                              atoi(length + 1) + id_len + 1, id, (int)(len - (rest + 1 - msg)), rest + 1);
+    if (framed_len < (int)sizeof(framed))
+        io_send(loop, &carrier->io, framed, framed_len);
+}
 
-        ret.horizontal_pos = field_2[0];
-        ret.vertical_pos = field_2[2];
-    }
+/*
+Queues a message for a player. Everything queued while handling one batch
+of events is written when the batch is done.
+*/
+void send_message(struct connection_data *con, const char *msg)
+{
+    if (con->carrier != NULL)
+        send_on_channel(con, msg, strlen(msg));
     else
-        return error_bad_command("Error, command not recognized.");
+        io_send(loop, &con->io, msg, strlen(msg));
+}
 
-    return ret;
+/*
+The connection a player's messages are written to.
+*/
+io_conn *output_of(struct connection_data *con)
+{
+    return con->carrier != NULL ? &con->carrier->io : &con->io;
 }
 
 void movd(client_pair_t *gameInstance, int x, int y)
 {
     char board_message[BUFSIZE];
-    snprintf(board_message, BUFSIZE, "MOVD|16|%c|%d,%d|%s|\n", gameInstance->currentTurn, x, y, gameInstance->board);
+    int len = snprintf(board_message, BUFSIZE, "MOVD|16|%c|%d,%d|%s|\n", gameInstance->currentTurn, x, y, gameInstance->board);
 
-    write(gameInstance->clients[0]->fd, board_message, strlen(board_message));
-    write(gameInstance->clients[1]->fd, board_message, strlen(board_message));
+    if (gameInstance->clients[0]->carrier != NULL || gameInstance->clients[1]->carrier != NULL)
+    {
+        send_message(gameInstance->clients[0], board_message);
+        send_message(gameInstance->clients[1], board_message);
+    }
+    else
+        io_send_pair(loop, &gameInstance->clients[0]->io, &gameInstance->clients[1]->io, board_message, len);
+
+    // The move is timed from when the loop woke up with it until MOVD is written
+    uint64_t woke = trace_woke();
+    output_of(gameInstance->clients[0])->trace_since = woke;
+    output_of(gameInstance->clients[1])->trace_since = woke;
+    struct connection_data *mover = gameInstance->clients[gameInstance->currentTurn == 'X' ? 0 : 1];
+    trace_mark(TRACE_MOVED, mover->io.fd, gameInstance->moves + 1);
 }
 
-void send_termination_message(int fd)
+void send_termination_message(struct connection_data *con)
 {
-    char const *termination = "OVER|48|W|The other user has terminated the connection.|\n";
-    write(fd, termination, strlen(termination));
+    send_message(con, "OVER|48|W|The other user has terminated the connection.|\n");
 }
 
 char checkWinner(client_pair_t *gameInstance)
@@ -555,6 +638,7 @@ int playerMove(client_pair_t *gameInstance, int x, int y)
     else
     {
         gameInstance->board[location] = gameInstance->currentTurn;
+        gameInstance->history[gameInstance->moves] = location;
         movd(gameInstance, x, y);
         if (gameInstance->currentTurn == 'X')
             gameInstance->currentTurn = 'O';
@@ -565,289 +649,1677 @@ int playerMove(client_pair_t *gameInstance, int x, int y)
     }
 }
 
-void remove_newline(char *str)
+/*
+Gives up the name a player reserved, if it holds one. In a cluster the
+coordinator holds the names, except a guest's, which its own node gives up.
+*/
+void release_name(struct connection_data *con)
 {
-    int len = strlen(str);
-    if (len > 0 && str[len - 1] == '\n')
+    if (con->name[0] != '\0')
     {
-        str[len - 1] = '\0';
+        if (con->guest)
+            con->guest = 0;
+        else if (coordinator != NULL)
+            cluster_send(loop, &coordinator_link, "FREE", "%s|", con->name);
+        else
+            remove_username(con->name);
+        con->name[0] = '\0';
     }
 }
 
-void cleanup_and_close(client_pair_t *con, int player_index, int other_player_index)
+/*
+Returns the game at a player's table, or NULL if the player has none.
+*/
+client_pair_t *game_of(struct connection_data *con)
 {
-    // Close client connections
-    close(con->clients[player_index]->fd);
-    close(con->clients[other_player_index]->fd);
-
-    // Remove usernames
-    remove_username(con->clients[player_index]->name);
-    remove_username(con->clients[other_player_index]->name);
-    
-    // Free client resources
-    free(con->clients[player_index]);
+    return game_get(con->game);
+}
 
-    con->gameOver = 1;
+/*
+Takes a player away from the table of a finished game. The game's slot goes
+back to the table once both players have left it.
+*/
+void leave_table(struct connection_data *con)
+{
+    client_pair_t *pair = game_of(con);
+    if (pair == NULL)
+        return;
+    game_handle game = con->game;
+    pair->clients[con->index] = NULL;
+    con->game = GAME_NONE;
+
+    struct connection_data *other = pair->clients[1 - con->index];
+    if (other == NULL)
+    {
+        game_free(game);
+        if (short_of_games)
+            io_post(loop, &waiting_games);
+    }
+    else if (other->wants_rematch)
+    {
+        other->wants_rematch = 0;
+        send_message(other, "INVL|34|Your opponent has left the table.|\n");
+    }
+}
 
-    // Kill other thread
-    pthread_kill(con->clients[other_player_index]->thread_id, SIGUSR1);
+/*
+Takes a player out of the tournament it is in. Before the start the last
+entrant takes its number.
+*/
+void leave_event(struct connection_data *con)
+{
+    if (con->event == NULL)
+        return;
+    struct connection_data *moved = tournament_withdraw(&con->event->t, con->entry);
+    if (moved != NULL)
+        moved->entry = con->entry;
+    con->event = NULL;
 }
 
-int process_player_move(client_pair_t *con, int player_index)
+/*
+Tells a player where it finished, which ends its tournament.
+*/
+void send_place(struct connection_data *con)
 {
-    char buf[BUFSIZE];
-    player_input parsedInputs;
+    char board_message[BUFSIZE];
+    event *e = con->event;
+    int msgSize = snprintf(NULL, 0, "%s|%d|%d|", e->name, e->t.place[con->entry], e->t.entered);
+    snprintf(board_message, BUFSIZE, "RANK|%d|%s|%d|%d|\n", msgSize, e->name, e->t.place[con->entry], e->t.entered);
+    send_message(con, board_message);
+    e->t.players[con->entry] = NULL;
+    con->event = NULL;
+}
 
-    do
+/*
+Records a tournament game's result. A player knocked out hears its place
+and stays at the table like after any other game; the others wait for the
+next round, which is paired from the mailbox once the last game of this
+one is over.
+*/
+void event_result(client_pair_t *pair, int winner)
+{
+    event *e = pair->clients[0]->event;
+    e->games++;
+    if (tournament_result(&e->t, e->t.match[pair->clients[0]->entry], winner))
+        io_post(loop, &e->advance);
+    for (int i = 0; i < 2; i++)
     {
-        int bytes_read = 0;
-        int total_bytes = 0;
-        strcpy(buf,"");
-        // Continue reading until the desired number of bytes is received
-        while (total_bytes < BUFSIZE - 1)
-        {
-            bytes_read = read(con->clients[player_index]->fd, buf + total_bytes, BUFSIZE - total_bytes - 1);
-            if(con->gameOver == 1){
-                return 2;
-            }
-            if (bytes_read < 0)
-            {
-                // Error reading from the socket
-                send_termination_message(con->clients[1 - player_index]->fd);
-                cleanup_and_close(con, player_index, 1 - player_index);
-                return 1;
-            }
-            if (bytes_read == 0)
-            {
-                // Connection closed by the other end
-                send_termination_message(con->clients[1 - player_index]->fd);
-                cleanup_and_close(con, player_index, 1 - player_index);
-                return 1;
-            }
-
-            total_bytes += bytes_read;
-            if (buf[total_bytes - 1] == '\n')
-            {
-                // End of message reached
-                break;
-            }
-        }
-        buf[total_bytes] = '\0';
-        remove_newline(buf);
-        parsedInputs = parse(buf);
-        if(parsedInputs.type == INVALID){
-            snprintf(buf, BUFSIZE, "%s", parsedInputs.client_response_msg);
-            write(con->clients[player_index]->fd, buf, strlen(buf));
-        }
-        else if (con->clients[player_index]->wants_draw && parsedInputs.type != RESIGN)
-        {
-            parsedInputs.type = INVALID;
-            snprintf(buf, BUFSIZE, "INVL|48|Waiting for opponent's reponse to draw request.|\n");
-            write(con->clients[player_index]->fd, buf, strlen(buf));
-        }
-        else if (parsedInputs.type == PLAY)
-        {
-            parsedInputs.type = INVALID;
-            snprintf(buf, BUFSIZE, "INVL|42|You cannot start a new game at this time.|\n");
-            write(con->clients[player_index]->fd, buf, strlen(buf));
-        }
-        else if (parsedInputs.type == MOVE)
-        {
-            if (con->clients[1 - player_index]->wants_draw)
-            {
-                parsedInputs.type = INVALID;
-                snprintf(buf, BUFSIZE, "INVL|43|Draw request must be rejected or accepted.|\n");
-                write(con->clients[player_index]->fd, buf, strlen(buf));
-            }
-            else if (con->clients[player_index]->role != con->currentTurn)
-            {
-                parsedInputs.type = INVALID;
-                snprintf(buf, BUFSIZE, "INVL|21|It is not your turn.|\n");
-                write(con->clients[player_index]->fd, buf, strlen(buf));
-            }
-            else if (parsedInputs.x_or_o != con->clients[player_index]->role)
-            {
-                parsedInputs.type = INVALID;
-                snprintf(buf, BUFSIZE, "INVL|25|Incorrect role selected.|\n");
-                write(con->clients[player_index]->fd, buf, strlen(buf));
-            }
-            else if (playerMove(con, parsedInputs.horizontal_pos - '0', parsedInputs.vertical_pos - '0'))
-            {
-                parsedInputs.type = INVALID;
-                snprintf(buf, BUFSIZE, "INVL|24|That space is occupied.|\n");
-                write(con->clients[player_index]->fd, buf, strlen(buf));
-            }
-        }
-        else if (parsedInputs.type == REJDRAW)
-        {
-            if (con->clients[1 - player_index]->wants_draw)
-            {
-                buf[strlen(buf)] = '\n';
-                write(con->clients[1 - player_index]->fd, buf, strlen(buf));
-                con->clients[1 - player_index]->wants_draw = 0;
-            }
-            else
-            {
-                snprintf(buf, BUFSIZE, "INVL|23|No draw was requested.|\n");
-                write(con->clients[player_index]->fd, buf, strlen(buf));
-            }
-        }
-        else if (parsedInputs.type == ACCDRAW)
-        {
-            if (con->clients[1 - player_index]->wants_draw)
-            {
-                snprintf(buf, BUFSIZE, "OVER|26|D|Players agreed to draw.|\n");
-                write(con->clients[1]->fd, buf, strlen(buf));
-                write(con->clients[0]->fd, buf, strlen(buf));
-                cleanup_and_close(con, player_index, 1 - player_index);
-                return 1;
-            }
-            else
-            {
-                snprintf(buf, BUFSIZE, "INVL|23|No draw was requested.|\n"); 
-                write(con->clients[player_index]->fd, buf, strlen(buf));
-            }
-        }
-        else if (parsedInputs.type == SUGDRAW)
-        {
-            if (con->clients[1 - player_index]->wants_draw)
-            {
-                parsedInputs.type = INVALID;
-                snprintf(buf, BUFSIZE, "INVL|43|Draw request must be rejected or accepted.|\n");
-                write(con->clients[player_index]->fd, buf, strlen(buf));
-            }
-            else
-            {
-                con->clients[player_index]->wants_draw = 1;
-                buf[strlen(buf)] = '\n';
-                write(con->clients[1 - player_index]->fd, buf, strlen(buf));
-            }
-        }
-        else if (parsedInputs.type == RESIGN)
-        {
-            int msgSize = strlen(con->clients[player_index]->name) + 17;
-            snprintf(buf, BUFSIZE, "OVER|%d|W|%s has resigned.|\n", msgSize, con->clients[player_index]->name);
-            write(con->clients[1 - player_index]->fd, buf, strlen(buf));
-            snprintf(buf, BUFSIZE, "OVER|21|L|You have resigned.|\n");
-            write(con->clients[player_index]->fd, parsedInputs.client_response_msg, strlen(parsedInputs.client_response_msg));
-            cleanup_and_close(con, player_index, 1 - player_index);
-            return 1;
-        }
-        else if (parsedInputs.type == BAD_COMMAND)
+        struct connection_data *con = pair->clients[i];
+        if (con->io.closing)
+            continue; // Leaves the tournament once it is disposed of
+        if (e->t.place[con->entry] != 0)
+            send_place(con);
+        else
         {
-            int msgSize = strlen(con->clients[player_index]->name) + 17;
-            snprintf(buf, BUFSIZE, "OVER|%d|W|%s disconnected.|\n", msgSize, con->clients[player_index]->name);
-            write(con->clients[1 - player_index]->fd, buf, strlen(buf));
-            snprintf(buf, BUFSIZE, "INVL|44|Error reading data, terminating connection.|\n");
-            write(con->clients[player_index]->fd, buf, strlen(buf));
-            cleanup_and_close(con, player_index, 1 - player_index);
-            return 1;
+            leave_table(con);
+            con->state = CONN_WAITING;
         }
-
-    } while (parsedInputs.type == INVALID);
-
-    return 0;
+    }
 }
 
-client_pair_t *create_game()
+/*
+Closes a player's socket, or its channel, which the carrier hears about with
+QUIT.
+*/
+void close_io(struct connection_data *con)
 {
-    client_pair_t *client_pair = (client_pair_t *)malloc(sizeof(client_pair_t));
-
-    // Get the first two clients
-    client_pair->clients[1] = connecting_clients->data;
-    remove_client(connecting_clients->data);
-
-    client_pair->clients[0] = connecting_clients->data;
-    remove_client(connecting_clients->data);
-
-    client_pair->clients[1]->pair = client_pair;
-    client_pair->clients[0]->pair = client_pair;
+    if (con->carrier != NULL && !con->io.closing)
+    {
+        con->carrier->channels[con->channel] = NULL;
+        send_on_channel(con, "QUIT|0|\n", 8);
+    }
+    io_close(loop, &con->io);
+}
 
-    initializeNewGame(client_pair);
+/*
+Closes a player's connection and releases its name. Its memory is released
+by the event loop.
+*/
+void close_connection(struct connection_data *con)
+{
+    leave_event(con);
+    leave_table(con);
+    release_name(con);
+    close_io(con);
+}
 
-    return client_pair;
+/*
+Frees a connection's data, once nothing refers to it.
+*/
+void free_connection(struct connection_data *con)
+{
+    if (con->cluster_id != 0)
+        cluster_forget(con->cluster_id);
+    free(con->pending);
+    free(con->channels);
+    free(con);
 }
 
-void play_game(struct connection_data *con)
+/*
+Frees a dropped player's data once neither the game nor the event loop
+refers to it.
+*/
+void dispose_dropped(struct connection_data *con)
 {
-    // Initialize the game and other necessary game logic (SEG FAULT HERE)
-    char gameState;
-    char board_message[BUFSIZE];
-    int beginLength = strlen(con->pair->clients[1 - con->index]->name) + 3;
-    int len = snprintf(board_message, BUFSIZE, "BEGN|%d|%c|%s|\n", beginLength, con->role, con->pair->clients[1 - con->index]->name);
-    if (write(con->fd, board_message, len) != len)
-    {
-        perror("write");
+    if (con->released)
+        free_connection(con);
+    else
+        con->state = CONN_NEW; // on_release frees it
+}
+
+/*
+Hands a finished game to the archive: its moves, who played X and O, who won
+and whether the board decided it.
+*/
+void record_game(client_pair_t *con, int winner)
+{
+    int result = winner == TOURNAMENT_DRAW ? ARCHIVE_DRAW : winner == 0 ? ARCHIVE_X_WON : ARCHIVE_O_WON;
+    if (con->moves == 9 || checkWinner(con) != '.')
+        result |= ARCHIVE_ON_BOARD;
+    archive_add(con->history, con->moves, result, con->clients[0]->name, con->clients[1]->name);
+}
+
+/*
+Ends a game that winner, 0 or 1, won, or that was drawn when it is -1.
+Both connections stay open so the players can ask for a rematch, or go back
+to the queue or lobby under the same name. A player whose seat is still
+held gives it up.
+*/
+void finish_game(client_pair_t *con, int winner)
+{
+    struct connection_data *dropped[2];
+    int num_dropped = 0;
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (con->clients[i]->state == CONN_DROPPED)
+        {
+            session_take(&seats, con->clients[i]->token);
+            dropped[num_dropped++] = con->clients[i];
+        }
+        con->clients[i]->state = CONN_FINISHED;
+        con->clients[i]->wants_draw = 0;
+        con->clients[i]->wants_rematch = 0;
     }
-    int output;
-    // Game loop
-    while (active)
+    games_played++;
+    games_in_progress--;
+    if (archive_dir != NULL)
+        record_game(con, winner);
+    if (con->clients[0]->event != NULL)
+        event_result(con, winner);
+
+    for (int i = 0; i < num_dropped; i++)
+    {
+        leave_event(dropped[i]);
+        leave_table(dropped[i]);
+        release_name(dropped[i]);
+        dispose_dropped(dropped[i]);
+    }
+}
+
+void queue_player(struct connection_data *con);
+
+/*
+A player waiting in a room opened for someone on another node who never
+arrived goes back to the queue.
+*/
+void guest_seat_expired(void *player)
+{
+    struct connection_data *con = player;
+    lobby_cancel(con->room);
+    con->room = NULL;
+    queue_player(con);
+}
+
+/*
+A dropped player did not come back in time, so the opponent wins.
+*/
+void seat_expired(void *player)
+{
+    struct connection_data *con = player;
+    client_pair_t *pair = game_of(con);
+    struct connection_data *opponent = pair->clients[1 - con->index];
+
+    if (opponent->state != CONN_DROPPED)
+        send_termination_message(opponent);
+    finish_game(pair, 1 - con->index);
+}
+
+/*
+Reports the result once a move has been made. Returns 1 if the game is over.
+*/
+int check_game_over(client_pair_t *con, int player_index)
+{
+    char board_message[BUFSIZE];
+    char gameState;
+
+    con->moves++;
+    gameState = checkWinner(con);
+
+    // Report game state
+    if (gameState == '.')
+    {
+        printf("%s\n", con->board);
+        if (con->moves < 9)
+            return 0;
+        snprintf(board_message, BUFSIZE, "OVER|26|D|Draw, the grid is full.|\n");
+        send_message(con->clients[1 - player_index], board_message);
+        send_message(con->clients[player_index], board_message);
+        finish_game(con, TOURNAMENT_DRAW);
+        return 1;
+    }
+    else
+    {
+        // The player who just moved is the winner
+        snprintf(board_message, BUFSIZE, "OVER|24|W|Tic-tac-toe, you win!|\n");
+        send_message(con->clients[player_index], board_message);
+        int msgSize = strlen(con->clients[player_index]->name) + 22;
+        snprintf(board_message, BUFSIZE, "OVER|%d|L|Tic-tac-toe, %s wins!|\n", msgSize, con->clients[player_index]->name);
+        send_message(con->clients[1 - player_index], board_message);
+    }
+    finish_game(con, player_index);
+    return 1;
+}
+
+/*
+Sends one page of open public rooms, continuing after the room number the
+request gives, which is the one the previous page ended with.
+*/
+void send_room_list(struct connection_data *con, player_input *request)
+{
+    char names[BUFSIZE / 2], board_message[BUFSIZE], *end;
+    unsigned long after = 0, last = 0;
+
+    if (request->room[0])
+    {
+        errno = 0;
+        after = strtoul(request->room, &end, 10);
+        if (!isdigit((unsigned char)request->room[0]) || *end != '\0' || errno == ERANGE)
+        {
+            send_message(con, "INVL|43|Continue a list from the number ROOM gave.|\n");
+            return;
+        }
+    }
+    int count = lobby_list(after, names, sizeof(names), &last);
+    if (count == 0)
+        send_message(con, "ROOM|2|0|\n");
+    else
+    {
+        int msgSize = snprintf(NULL, 0, "%d|%s|%lu|", count, names, last);
+        snprintf(board_message, BUFSIZE, "ROOM|%d|%d|%s|%lu|\n", msgSize, count, names, last);
+        send_message(con, board_message);
+    }
+}
+
+/*
+Handles one message from a player in an active game.
+Returns 1 if the game ended.
+*/
+int process_player_move(client_pair_t *con, int player_index, char *message)
+{
+    char buf[BUFSIZE];
+    player_input parsedInputs;
+    struct connection_data *player = con->clients[player_index];
+    struct connection_data *opponent = con->clients[1 - player_index];
+
+    parsedInputs = parse(message);
+    trace_mark(TRACE_PARSED, player->io.fd, parsedInputs.type);
+    if (parsedInputs.type == INVALID)
+    {
+        send_message(player, parsedInputs.client_response_msg);
+    }
+    else if (player->wants_draw && parsedInputs.type != RESIGN)
+    {
+        send_message(player, "INVL|48|Waiting for opponent's reponse to draw request.|\n");
+    }
+    else if (parsedInputs.type == PLAY || parsedInputs.type == CREATE || parsedInputs.type == JOIN || parsedInputs.type == RECONNECT ||
+             parsedInputs.type == TOURNAMENT)
+    {
+        send_message(player, "INVL|42|You cannot start a new game at this time.|\n");
+    }
+    else if (parsedInputs.type == LIST)
+    {
+        send_room_list(player, &parsedInputs);
+    }
+    else if (parsedInputs.type == REMATCH)
+    {
+        send_message(player, "INVL|26|The game is not over yet.|\n");
+    }
+    else if (parsedInputs.type == MOVE)
+    {
+        if (opponent->wants_draw)
+        {
+            send_message(player, "INVL|43|Draw request must be rejected or accepted.|\n");
+        }
+        else if (player->role != con->currentTurn)
+        {
+            send_message(player, "INVL|21|It is not your turn.|\n");
+        }
+        else if (parsedInputs.x_or_o != player->role)
+        {
+            send_message(player, "INVL|25|Incorrect role selected.|\n");
+        }
+        else if (playerMove(con, parsedInputs.horizontal_pos - '0', parsedInputs.vertical_pos - '0'))
+        {
+            send_message(player, "INVL|24|That space is occupied.|\n");
+        }
+        else
+        {
+            return check_game_over(con, player_index);
+        }
+    }
+    else if (parsedInputs.type == REJDRAW)
+    {
+        if (opponent->wants_draw)
+        {
+            snprintf(buf, BUFSIZE, "%s\n", message);
+            send_message(opponent, buf);
+            opponent->wants_draw = 0;
+        }
+        else
+        {
+            send_message(player, "INVL|23|No draw was requested.|\n");
+        }
+    }
+    else if (parsedInputs.type == ACCDRAW)
+    {
+        if (opponent->wants_draw)
+        {
+            snprintf(buf, BUFSIZE, "OVER|26|D|Players agreed to draw.|\n");
+            send_message(con->clients[1], buf);
+            send_message(con->clients[0], buf);
+            finish_game(con, TOURNAMENT_DRAW);
+            return 1;
+        }
+        else
+        {
+            send_message(player, "INVL|23|No draw was requested.|\n");
+        }
+    }
+    else if (parsedInputs.type == SUGDRAW)
+    {
+        if (opponent->wants_draw)
+        {
+            send_message(player, "INVL|43|Draw request must be rejected or accepted.|\n");
+        }
+        else
+        {
+            player->wants_draw = 1;
+            snprintf(buf, BUFSIZE, "%s\n", message);
+            send_message(opponent, buf);
+        }
+    }
+    else if (parsedInputs.type == RESIGN)
+    {
+        int msgSize = strlen(player->name) + 17;
+        snprintf(buf, BUFSIZE, "OVER|%d|W|%s has resigned.|\n", msgSize, player->name);
+        send_message(opponent, buf);
+        send_message(player, "OVER|21|L|You have resigned.|\n");
+        finish_game(con, 1 - player_index);
+        return 1;
+    }
+    else if (parsedInputs.type == BAD_COMMAND)
+    {
+        int msgSize = strlen(player->name) + 17;
+        snprintf(buf, BUFSIZE, "OVER|%d|W|%s disconnected.|\n", msgSize, player->name);
+        send_message(opponent, buf);
+        send_message(player, "INVL|44|Error reading data, terminating connection.|\n");
+        finish_game(con, 1 - player_index);
+        close_connection(player);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+Creates a game between two players. The first one plays X. Returns NULL,
+leaving the players as they were, if the game table is full or memory runs
+out.
+*/
+client_pair_t *create_pair(struct connection_data *first, struct connection_data *second)
+{
+    game_handle game;
+    client_pair_t *client_pair = game_alloc(&game);
+    if (client_pair == NULL)
+    {
+        short_of_games = 1;
+        return NULL;
+    }
+
+    client_pair->clients[0] = first;
+    client_pair->clients[1] = second;
+    first->index = 0;
+    second->index = 1;
+    first->game = game;
+    second->game = game;
+
+    initializeNewGame(client_pair);
+
+    return client_pair;
+}
+
+/*
+Creates a game between the first two queued clients, and takes them out of
+the queue unless there was no room for it.
+*/
+client_pair_t *create_game()
+{
+    struct connection_data *second = connecting_clients->data;
+    struct connection_data *first = connecting_clients->next->data;
+    client_pair_t *client_pair = create_pair(first, second);
+    if (client_pair != NULL)
+    {
+        remove_client(second);
+        remove_client(first);
+    }
+    return client_pair;
+}
+
+int busy_message(char *buf, int reason);
+
+/*
+Tells two players their game found the game table full. They keep their
+place and the game starts once another one ends. Either may be NULL.
+*/
+void no_room_for_game(struct connection_data *first, struct connection_data *second)
+{
+    char board_message[BUFSIZE];
+    busy_message(board_message, BUSY_GAMES);
+    if (first != NULL)
+        send_message(first, board_message);
+    if (second != NULL)
+        send_message(second, board_message);
+}
+
+void on_read(io_loop *loop, io_conn *c);
+
+/*
+Handles what a player sent while it waited for an opponent. This runs from
+the loop's mailbox once the handler that started the game has returned, so
+one player's input is never handled from inside the other's. If the input
+filled the buffer, the loop stopped reading and starts again here.
+*/
+void resume_input(io_loop *loop, void *player)
+{
+    struct connection_data *con = player;
+    if (con->io.closing)
+        return;
+    on_read(loop, &con->io);
+    io_resume(loop, &con->io);
+}
+
+/*
+Allocates the data for a connection, before it is added to the loop.
+*/
+struct connection_data *new_connection(void)
+{
+    struct connection_data *con = (struct connection_data *)aligned_alloc(64, sizeof(struct connection_data));
+    if (con == NULL)
+        return NULL;
+    con->state = CONN_NEW;
+    con->name[0] = '\0';
+    con->game = GAME_NONE;
+    con->room = NULL;
+    con->released = 0;
+    con->resume.run = resume_input;
+    con->resume.arg = con;
+    con->resume.queued = 0;
+    con->addr_len = 0;
+    con->cluster_id = 0;
+    con->pending = NULL;
+    con->relay = NULL;
+    con->guest = 0;
+    con->queued = 0;
+    con->event = NULL;
+    con->entry = 0;
+    con->counted = 0;
+    con->carrier = NULL;
+    con->channels = NULL;
+    con->channel = 0;
+    con->num_channels = 0;
+    return con;
+}
+
+/*
+Gives a player a new token to reconnect with if its connection drops.
+*/
+void send_token(struct connection_data *con)
+{
+    char board_message[BUFSIZE];
+    if (grace_seconds == 0)
+        return;
+    session_new_token(con->token);
+    snprintf(board_message, BUFSIZE, "TOKN|%d|%s|\n", (int)strlen(con->token) + 1, con->token);
+    send_message(con, board_message);
+}
+
+/*
+Tells both players their role and opponent, then handles anything the
+players sent while they were queued.
+*/
+void begin_game(client_pair_t *pair)
+{
+    char board_message[BUFSIZE];
+    games_in_progress++;
+    for (int i = 0; i < 2; i++)
+    {
+        struct connection_data *con = pair->clients[i];
+        int held = con->state == CONN_WAITING;
+        int beginLength = strlen(pair->clients[1 - i]->name) + 3;
+        snprintf(board_message, BUFSIZE, "BEGN|%d|%c|%s|\n", beginLength, con->role, pair->clients[1 - i]->name);
+        send_message(con, board_message);
+        send_token(con);
+        con->state = CONN_PLAYING;
+        if (held && con->io.in_len > 0)
+            io_post(loop, &con->resume);
+    }
+}
+
+/*
+Starts another game between the same two players once both have asked for
+it. The player who was O plays X this time.
+*/
+void rematch(struct connection_data *con)
+{
+    client_pair_t *pair = game_of(con);
+    struct connection_data *other = pair->clients[1 - con->index];
+    if (other == NULL)
+    {
+        send_message(con, "INVL|34|Your opponent has left the table.|\n");
+        return;
+    }
+    if (!other->wants_rematch)
+    {
+        con->wants_rematch = 1;
+        send_message(other, "REMT|0|\n");
+        return;
+    }
+    pair->clients[0] = other->index == 0 ? con : other;
+    pair->clients[1] = other->index == 0 ? other : con;
+    pair->clients[0]->index = 0;
+    pair->clients[1]->index = 1;
+    pair->clients[0]->wants_rematch = 0;
+    pair->clients[1]->wants_rematch = 0;
+    initializeNewGame(pair);
+    begin_game(pair);
+}
+
+/*
+Opens a room for a player and waits in it for someone to JOIN.
+*/
+void create_room(struct connection_data *con, player_input *request)
+{
+    con->room = lobby_create(request->room, request->invitee, con);
+    if (con->room == NULL)
+    {
+        release_name(con);
+        send_message(con, "INVL|20|Room name is taken.|\n");
+        return;
+    }
+    send_message(con, "WAIT|0|\n");
+    con->index = 0;
+    con->state = CONN_WAITING;
+}
+
+/*
+Starts a game with the player waiting in the requested room.
+*/
+void join_room(struct connection_data *con, player_input *request)
+{
+    int error;
+    room *r = lobby_find(request->room, con->name, &error);
+    if (r == NULL)
+    {
+        release_name(con);
+        if (error == LOBBY_PRIVATE)
+            send_message(con, "INVL|22|That room is private.|\n");
+        else
+            send_message(con, "INVL|14|No such room.|\n");
+        return;
+    }
+    struct connection_data *owner = r->owner;
+    client_pair_t *pair = create_pair(owner, con);
+    if (pair == NULL)
+    {
+        // The owner keeps the room, and a guest its seat, for the JOIN to be
+        // tried again
+        if (con->guest)
+            session_hold(&guest_seats, r->name, owner, CLUSTER_SEAT_SECONDS);
+        release_name(con);
+        no_room_for_game(owner, con);
+        return;
+    }
+    lobby_cancel(r);
+    owner->room = NULL;
+    begin_game(pair);
+}
+
+event *find_event(const char *name)
+{
+    for (event *e = events; e != NULL; e = e->next)
+        if (strcmp(e->name, name) == 0)
+            return e;
+    return NULL;
+}
+
+double seconds_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+Enters a player in the requested tournament, to wait for its first round.
+The entrant that fills it starts it.
+*/
+void enter_event(struct connection_data *con, player_input *request)
+{
+    event *e = find_event(request->room);
+    int entry = e != NULL ? tournament_enter(&e->t, con) : -1;
+    if (entry < 0)
+    {
+        release_name(con);
+        if (e == NULL)
+            send_message(con, "INVL|20|No such tournament.|\n");
+        else
+            send_message(con, "INVL|29|That tournament has started.|\n");
+        return;
+    }
+    con->event = e;
+    con->entry = entry;
+    con->index = 0;
+    con->state = CONN_WAITING;
+    send_message(con, "WAIT|0|\n");
+    if (e->t.entered == e->t.size)
+    {
+        e->started = seconds_now();
+        e->games = 0;
+        io_post(loop, &e->advance);
+    }
+}
+
+/*
+Gives everyone still in a tournament that is over their place, and opens it
+for new entrants.
+*/
+void finish_event(event *e)
+{
+    tournament *t = &e->t;
+    const char *winner = "nobody";
+    for (int i = 0; i < t->entered; i++)
+    {
+        struct connection_data *con = t->players[i];
+        if (con == NULL)
+            continue;
+        if (t->place[i] == 1)
+            winner = con->name;
+        send_place(con);
+        con->state = CONN_FINISHED;
+        if (con->io.in_len > 0)
+            io_post(loop, &con->resume);
+    }
+    printf("Tournament %s: %d players, %d rounds, %lu games in %.3f s, won by %s\n", e->name, t->entered, t->round,
+           e->games, seconds_now() - e->started, winner);
+    tournament_reset(t);
+}
+
+/*
+Starts the games of a tournament's round from e->starting on. A game whose
+player left while it waited for room goes to the other player. Returns -1,
+with e->starting at the first game left, if the game table fills up.
+*/
+int start_matches(event *e)
+{
+    tournament *t = &e->t;
+    for (; e->starting < t->num_matches; e->starting++)
+    {
+        int m = e->starting;
+        struct connection_data *first = t->players[t->matches[m].first];
+        struct connection_data *second = t->players[t->matches[m].second];
+        if (first == NULL || second == NULL)
+        {
+            struct connection_data *stayed = first != NULL ? first : second;
+            if (tournament_result(t, m, first == NULL))
+                io_post(loop, &e->advance);
+            if (stayed != NULL && t->place[stayed->entry] != 0)
+            {
+                send_place(stayed);
+                stayed->state = CONN_FINISHED;
+                if (stayed->io.in_len > 0)
+                    io_post(loop, &stayed->resume);
+            }
+            continue;
+        }
+        client_pair_t *pair = create_pair(first, second);
+        if (pair == NULL)
+            return -1;
+        begin_game(pair);
+    }
+    return 0;
+}
+
+/*
+Starts every game of a tournament's next round in one pass, so all of their
+BEGN messages go out together, or ends the tournament after its last round.
+Games that find the game table full start once other games end.
+*/
+void advance_event(io_loop *loop, void *arg)
+{
+    event *e = arg;
+    tournament *t = &e->t;
+    if (tournament_next_round(t) == 0)
+    {
+        finish_event(e);
+        return;
+    }
+    e->starting = 0;
+    if (start_matches(e))
+        for (int m = e->starting; m < t->num_matches; m++)
+            no_room_for_game(t->players[t->matches[m].first], t->players[t->matches[m].second]);
+}
+
+/*
+Adds a tournament from -E name:single|swiss:entrants[:rounds].
+*/
+int schedule_event(const char *spec)
+{
+    char name[32], format[8];
+    int size, rounds = 0;
+    if (sscanf(spec, "%31[^:]:%7[^:]:%d:%d", name, format, &size, &rounds) < 3 || !lobby_valid_name(name) ||
+        (strcmp(format, "single") != 0 && strcmp(format, "swiss") != 0) || find_event(name) != NULL)
+    {
+        fprintf(stderr, "Expected -E name:single|swiss:entrants[:rounds] with a new name of 1-16 letters, digits, _ or -, not %s\n", spec);
+        return -1;
+    }
+    event *e = calloc(1, sizeof(event));
+    if (e == NULL || tournament_init(&e->t, format[1] == 'w' ? TOURNAMENT_SWISS : TOURNAMENT_SINGLE, size, rounds))
+    {
+        fprintf(stderr, "Could not set up tournament %s for %d entrants\n", name, size);
+        free(e);
+        return -1;
+    }
+    strcpy(e->name, name);
+    e->advance.run = advance_event;
+    e->advance.arg = e;
+    e->next = events;
+    events = e;
+    printf("Tournament %s: %s for %d players\n", name, format[1] == 'w' ? "Swiss" : "single elimination", size);
+    return 0;
+}
+
+/*
+Puts a player back into the game it dropped out of and sends the current
+board, then a fresh token.
+*/
+void reconnect(struct connection_data *con, player_input *request)
+{
+    char board_message[BUFSIZE];
+    struct connection_data *dropped = session_take(&seats, request->token);
+    if (dropped == NULL)
+    {
+        send_message(con, "INVL|25|No game to reconnect to.|\n");
+        return;
+    }
+    client_pair_t *pair = game_of(dropped);
+    struct connection_data *opponent = pair->clients[1 - dropped->index];
+
+    // The dropped player's name passes to this connection, which gives up
+    // any it reserved itself, such as before a BUSY reply
+    release_name(con);
+    strcpy(con->name, dropped->name);
+    con->guest = dropped->guest;
+    con->role = dropped->role;
+    con->index = dropped->index;
+    con->wants_draw = dropped->wants_draw;
+    con->wants_rematch = 0;
+    con->game = dropped->game;
+    pair->clients[con->index] = con;
+    con->state = CONN_PLAYING;
+    con->event = dropped->event;
+    con->entry = dropped->entry;
+    if (con->event != NULL)
+        con->event->t.players[con->entry] = con;
+    dropped->name[0] = '\0';
+    dropped->game = GAME_NONE;
+    dropped->event = NULL;
+    dispose_dropped(dropped);
+
+    int beginLength = strlen(opponent->name) + 3;
+    snprintf(board_message, BUFSIZE, "BEGN|%d|%c|%s|\n", beginLength, con->role, opponent->name);
+    send_message(con, board_message);
+    snprintf(board_message, BUFSIZE, "BORD|12|%c|%s|\n", pair->currentTurn, pair->board);
+    send_message(con, board_message);
+    send_token(con);
+}
+
+/*
+Gives a player an id the coordinator's answers about it refer to.
+*/
+int track_player(struct connection_data *con)
+{
+    if (con->cluster_id != 0)
+        return 0;
+    con->cluster_id = next_cluster_id++;
+    if (cluster_track(con->cluster_id, con) == 0)
+        return 0;
+    con->cluster_id = 0;
+    return -1;
+}
+
+/*
+Queues a player for the next opponent. In a cluster the coordinator keeps the
+queue, and answers with the game once there is one.
+*/
+void queue_player(struct connection_data *con)
+{
+    client_pair_t *client_pair = NULL;
+
+    if (coordinator != NULL && track_player(con) == 0)
+    {
+        con->index = 0;
+        con->state = CONN_WAITING;
+        con->queued = 1;
+        cluster_send(loop, &coordinator_link, "QUEU", "%lu|%s|", con->cluster_id, con->name);
+        return;
+    }
+    add_client(con);
+
+    if (numConnecting < 2)
+    {
+        // If there are fewer than 2 clients, wait for another client to connect
+        con->index = 0;
+        con->state = CONN_WAITING;
+        waiting_client = con;
+    }
+    else
+    {
+        // If there are at least 2 clients, create a new game with the waiting client
+        con->index = 1;
+        client_pair = create_game();
+        waiting_client = NULL;
+        if (client_pair == NULL)
+        {
+            // Both stay queued until a game ends
+            con->state = CONN_WAITING;
+            no_room_for_game(con, connecting_clients->next->data);
+        }
+    }
+
+    if (client_pair != NULL)
+        begin_game(client_pair);
+}
+
+/*
+Starts the games that found the game table full, once a game has ended: the
+players queued here, then the tournament rounds. Whatever still does not fit
+waits for the next game to end.
+*/
+void start_waiting_games(io_loop *loop, void *arg)
+{
+    short_of_games = 0;
+    while (numConnecting >= 2)
+    {
+        client_pair_t *client_pair = create_game();
+        if (client_pair == NULL)
+            return;
+        begin_game(client_pair);
+    }
+    for (event *e = events; e != NULL; e = e->next)
+        if (e->t.round > 0 && e->starting < e->t.num_matches && start_matches(e))
+            return;
+}
+
+/*
+Asks the coordinator whether a name is free anywhere in the cluster. The
+message is handled again once the answer is back; until then the player's
+input waits.
+*/
+int ask_for_name(struct connection_data *con, const char *buf, const char *name)
+{
+    if (track_player(con) || (con->pending = strdup(buf)) == NULL)
+        return -1;
+    con->state = CONN_NAMING;
+    cluster_send(loop, &coordinator_link, "NAME", "%lu|%s|", con->cluster_id, name);
+    return 0;
+}
+
+/*
+Whether a JOIN comes from the player another node relays to a room the
+coordinator had this node open.
+*/
+int announced_guest(player_input *request)
+{
+    if (coordinator == NULL || request->type != JOIN ||
+        strncmp(request->room, CLUSTER_ROOM_PREFIX, strlen(CLUSTER_ROOM_PREFIX)) != 0)
+        return 0;
+    struct connection_data *host = session_find(&guest_seats, request->room);
+    return host != NULL && strcmp(host->room->invitee, request->name) == 0;
+}
+
+/*
+Like announced_guest, and the seat stops expiring once the guest is here.
+*/
+int expecting_guest(player_input *request)
+{
+    if (!announced_guest(request))
+        return 0; // Someone else's JOIN
+    session_take(&guest_seats, request->room);
+    return 1;
+}
+
+/*
+Counts a new player let in or turned away.
+*/
+void count_admission(int busy)
+{
+    double now = seconds_now();
+    if (now - admission_second >= 1.0)
+    {
+        admitted_before = now - admission_second < 2.0 ? admitted_now : 0;
+        busy_before = now - admission_second < 2.0 ? busy_now : 0;
+        admitted_now = busy_now = 0;
+        admission_second = now;
+    }
+    if (busy)
+        busy_now++;
+    else
+        admitted_now++;
+}
+
+/*
+Writes a BUSY reply asking a player turned away to try again later. The wait
+is busy_retry_ms, times how many players were turned away last second for
+each one let in, up to 30 times, so players come back about as fast as
+there is room for them. It is spread out so that players turned away
+together do not all come back together.
+*/
+int busy_message(char *buf, int reason)
+{
+    unsigned long scale = 1 + busy_before / (admitted_before + 1);
+    int base = busy_retry_ms * (scale < 30 ? scale : 30);
+    int retry = base + rand() % (base / 2 + 1);
+    int msgSize = snprintf(NULL, 0, "%d|%s|", retry, busy_reasons[reason]);
+    return snprintf(buf, BUFSIZE, "BUSY|%d|%d|%s|\n", msgSize, retry, busy_reasons[reason]);
+}
+
+/*
+Returns the limit a new player asking to play would go over, or -1 if there
+is room. Once games in progress reach max_games every new player is turned
+away until they are back down to 90% of it, so admission does not open and
+shut with every game that ends. A player who would have to wait for an
+opponent also needs room to wait. Rematches and tournaments are not limited,
+since their players already hold a table or a place.
+*/
+int over_limit(int type)
+{
+    if (max_games > 0)
+    {
+        if (!overloaded && games_in_progress >= max_games)
+        {
+            overloaded = 1;
+            overloads++;
+            printf("Overloaded with %d games in progress, turning new players away\n", games_in_progress);
+        }
+        else if (overloaded && games_in_progress * 10 <= max_games * 9)
+        {
+            overloaded = 0;
+            printf("Taking new players again at %d games in progress\n", games_in_progress);
+        }
+        if (overloaded)
+            return BUSY_GAMES;
+    }
+    int waits = type == CREATE || (type == PLAY && coordinator == NULL && numConnecting == 0);
+    if (waits && max_waiting > 0 && numConnecting + lobby_count() >= max_waiting)
+        return BUSY_WAITING;
+    return -1;
+}
+
+/*
+Handles messages from a connection that is not in a game yet. PLAY queues for
+the next opponent, CREA and JOIN go through the lobby, LIST shows open rooms
+and TRNY enters a tournament.
+*/
+void handle_new_player(struct connection_data *con, char *buf)
+{
+    player_input parsedInputs = parse(buf);
+    if (parsedInputs.type == LIST)
+    {
+        send_room_list(con, &parsedInputs);
+        return;
+    }
+    if (parsedInputs.type == RECONNECT)
+    {
+        reconnect(con, &parsedInputs);
+        return;
+    }
+    if (parsedInputs.type == CHANNELS)
+    {
+        // From now on every message names the channel of the player it is for
+        if (con->carrier != NULL)
+        {
+            send_message(con, "INVL|31|A channel cannot carry others.|\n");
+            return;
+        }
+        con->state = CONN_CARRIER;
+        io_allow_backlog(&con->io, CARRIER_BACKLOG);
+        carriers++;
+        send_message(con, "CHAN|0|\n");
+        return;
+    }
+    if (parsedInputs.type != PLAY && parsedInputs.type != CREATE && parsedInputs.type != JOIN &&
+        parsedInputs.type != TOURNAMENT)
+    {
+        // User didn't submit PLAY as first protocol
+        send_message(con, "INVL|24|Expected PLAY protocol.|\n");
+        close_connection(con);
+        return;
+    }
+    if ((parsedInputs.type == CREATE || parsedInputs.type == JOIN) && !lobby_valid_name(parsedInputs.room))
+    {
+        send_message(con, "INVL|45|Room names are 1-16 letters, digits, _ or -.|\n");
+        return;
+    }
+    // Only the coordinator opens these, for a guest relayed from another node
+    if (parsedInputs.type == CREATE && strncmp(parsedInputs.room, CLUSTER_ROOM_PREFIX, strlen(CLUSTER_ROOM_PREFIX)) == 0)
+    {
+        send_message(con, "INVL|37|Room names starting c- are reserved.|\n");
+        return;
+    }
+    // Tournaments are sized when they are scheduled, and a guest the
+    // coordinator announced was let in on its own node
+    int limited = parsedInputs.type != TOURNAMENT && !announced_guest(&parsedInputs);
+    int busy = limited ? over_limit(parsedInputs.type) : -1;
+    if (limited)
+        count_admission(busy >= 0);
+    if (busy >= 0)
+    {
+        char board_message[BUFSIZE];
+        busy_message(board_message, busy);
+        send_message(con, board_message);
+        turned_away[busy]++;
+        return;
+    }
+    if (strcmp(parsedInputs.name, con->name) != 0)
+    {
+        // A player back from a finished game keeps the name it already holds
+        int guest = expecting_guest(&parsedInputs);
+        if (coordinator != NULL && !guest)
+        {
+            if (ask_for_name(con, buf, parsedInputs.name))
+                close_connection(con);
+            return;
+        }
+        if (!guest && add_username(parsedInputs.name))
+        {
+            // Bad username
+            send_message(con, "INVL|18|Username is taken|\n");
+            close_connection(con);
+            return;
+        }
+        release_name(con);
+        strcpy(con->name, parsedInputs.name);
+        con->guest = guest;
+        if (guest)
+            hosted_guests++;
+    }
+    con->wants_draw = 0;
+
+    if (parsedInputs.type == CREATE)
+    {
+        create_room(con, &parsedInputs);
+        return;
+    }
+    if (parsedInputs.type == JOIN)
+    {
+        join_room(con, &parsedInputs);
+        return;
+    }
+    if (parsedInputs.type == TOURNAMENT)
+    {
+        enter_event(con, &parsedInputs);
+        return;
+    }
+
+    send_message(con, "WAIT|0|\n");
+    queue_player(con);
+}
+
+/*
+Handles messages from a player whose game is over. REMT asks the same opponent
+for another game, while PLAY, CREA, JOIN and TRNY leave the table for a new one.
+*/
+void handle_finished_player(struct connection_data *con, char *buf)
+{
+    player_input parsedInputs = parse(buf);
+
+    switch (parsedInputs.type)
+    {
+    case REMATCH:
+        rematch(con);
+        break;
+    case PLAY:
+    case CREATE:
+    case JOIN:
+    case TOURNAMENT:
+        leave_table(con);
+        con->state = CONN_NEW;
+        handle_new_player(con, buf);
+        break;
+    case LIST:
+        send_room_list(con, &parsedInputs);
+        break;
+    case INVALID:
+        send_message(con, parsedInputs.client_response_msg);
+        break;
+    case BAD_COMMAND:
+        send_message(con, "INVL|44|Error reading data, terminating connection.|\n");
+        close_connection(con);
+        break;
+    default:
+        send_message(con, "INVL|18|The game is over.|\n");
+    }
+}
+
+/*
+The coordinator reserved the name, so the message that asked for it is
+handled now, and then whatever the player sent meanwhile.
+*/
+void name_granted(struct connection_data *con, const char *name)
+{
+    if (con == NULL || con->state != CONN_NAMING)
+    {
+        // The player left before the answer came
+        cluster_send(loop, &coordinator_link, "FREE", "%s|", name);
+        return;
+    }
+    char *request = con->pending;
+    con->pending = NULL;
+    release_name(con);
+    snprintf(con->name, sizeof(con->name), "%s", name);
+    con->state = CONN_NEW;
+    handle_new_player(con, request);
+    free(request);
+    if (!con->io.closing && con->io.in_len > 0)
+        io_post(loop, &con->resume);
+}
+
+void name_refused(struct connection_data *con)
+{
+    if (con == NULL || con->state != CONN_NAMING)
+        return;
+    send_message(con, "INVL|18|Username is taken|\n");
+    close_connection(con);
+}
+
+/*
+Starts a game between two players on this node that the coordinator paired.
+If one of them left meanwhile, the other goes back to the queue.
+*/
+void pair_players(struct connection_data *first, struct connection_data *second)
+{
+    int first_ok = first != NULL && first->state == CONN_WAITING && first->queued;
+    int second_ok = second != NULL && second->state == CONN_WAITING && second->queued;
+    if (first_ok && second_ok)
     {
-        output = process_player_move(con->pair, con->index);
-        if (output == 1)
+        first->queued = 0;
+        second->queued = 0;
+        client_pair_t *pair = create_pair(first, second);
+        if (pair != NULL)
+            begin_game(pair);
+        else
         {
-            break;
+            // They wait in this node's own queue until a game here ends,
+            // rather than being paired again while the table is still full
+            add_client(first);
+            add_client(second);
+            no_room_for_game(first, second);
         }
-        else if(output == 2){
-            free(con->pair);
-            free(con);
-            break;
+    }
+    else if (first_ok)
+        queue_player(first);
+    else if (second_ok)
+        queue_player(second);
+}
+
+/*
+Opens a private room for a waiting player, for a player the coordinator
+sends from another node once it hears the room is open. If the guest does
+not arrive in time the seat expires and the host goes back to the queue.
+*/
+void host_guest(struct connection_data *con, const char *room_name, const char *guest)
+{
+    if (con == NULL || con->state != CONN_WAITING || !con->queued)
+    {
+        cluster_send(loop, &coordinator_link, "SHUT", "%s|", room_name);
+        return;
+    }
+    con->queued = 0;
+    con->room = lobby_create(room_name, guest, con);
+    if (con->room != NULL && session_hold(&guest_seats, room_name, con, CLUSTER_SEAT_SECONDS) == 0)
+    {
+        cluster_send(loop, &coordinator_link, "OPEN", "%s|", room_name);
+        return;
+    }
+    if (con->room != NULL)
+        lobby_cancel(con->room);
+    con->room = NULL;
+    cluster_send(loop, &coordinator_link, "SHUT", "%s|", room_name);
+    queue_player(con);
+}
+
+/*
+Relays a waiting player to the node hosting its game: this node connects to
+it as the player, joins the room it opened, and passes messages both ways
+from then on. The player notices nothing. Connecting blocks, which is fine
+for nodes on one host or a local network.
+*/
+void relay_player(struct connection_data *con, const char *addr, const char *room_name)
+{
+    char board_message[BUFSIZE];
+    if (con == NULL || con->state != CONN_WAITING || !con->queued)
+        return;
+    con->queued = 0;
+    struct connection_data *up = NULL;
+    int fd = cluster_connect(addr);
+    if (fd >= 0 && (up = new_connection()) != NULL && io_add(loop, &up->io, fd) == 0)
+    {
+        up->state = CONN_UPSTREAM;
+        up->relay = con;
+        con->relay = up;
+        con->state = CONN_RELAYING;
+        int msgSize = strlen(con->name) + strlen(room_name) + 2;
+        snprintf(board_message, BUFSIZE, "JOIN|%d|%s|%s|\n", msgSize, con->name, room_name);
+        send_message(up, board_message);
+        relayed_players++;
+        return;
+    }
+    free(up);
+    if (fd >= 0)
+        close(fd);
+    queue_player(con);
+}
+
+/*
+Passes a message on to the other end of a relay, as one message, so a
+WebSocket player gets it in one frame.
+*/
+void relay_message(struct connection_data *to, const char *buf)
+{
+    char line[BUFSIZE + 1];
+    snprintf(line, sizeof(line), "%s\n", buf);
+    send_message(to, line);
+}
+
+/*
+Detaches a relayed player from its upstream connection and closes that.
+*/
+void end_relay(struct connection_data *con)
+{
+    struct connection_data *up = con->relay;
+    con->relay = NULL;
+    if (up != NULL)
+    {
+        up->relay = NULL;
+        io_close(loop, &up->io);
+    }
+}
+
+/*
+Handles a message from the node hosting a relayed player's game. The first
+answer to the JOIN says whether the room was still there.
+*/
+void relay_from_host(struct connection_data *up, char *buf)
+{
+    struct connection_data *con = up->relay;
+    if (con == NULL)
+        return;
+    if (con->state == CONN_RELAYING)
+    {
+        if (strncmp(buf, "BEGN|", 5) != 0)
+        {
+            // The seat expired or its player left, so look for someone else
+            end_relay(con);
+            queue_player(con);
+            return;
         }
-        
+        con->state = CONN_RELAYED;
+        if (con->io.in_len > 0)
+            io_post(loop, &con->resume);
+    }
+    relay_message(con, buf);
+}
+
+/*
+Handles a message from the coordinator.
+*/
+void coordinator_message(char *buf)
+{
+    char *f[CLUSTER_MAX_FIELDS];
+    int count = cluster_split(buf, f, CLUSTER_MAX_FIELDS);
+    if (count < 2)
+    {
+        fprintf(stderr, "Bad message from the coordinator\n");
+        return;
+    }
+    struct connection_data *con = cluster_find(strtoul(f[1], NULL, 10));
+    if (con != NULL && con->io.closing)
+        con = NULL;
+    if (strcmp(f[0], "OKAY") == 0 && count == 3)
+        name_granted(con, f[2]);
+    else if (strcmp(f[0], "TAKN") == 0)
+        name_refused(con);
+    else if (strcmp(f[0], "PAIR") == 0 && count == 3)
+    {
+        struct connection_data *second = cluster_find(strtoul(f[2], NULL, 10));
+        pair_players(con, second != NULL && !second->io.closing ? second : NULL);
+    }
+    else if (strcmp(f[0], "HOST") == 0 && count == 4)
+        host_guest(con, f[2], f[3]);
+    else if (strcmp(f[0], "SEND") == 0 && count == 4)
+        relay_player(con, f[2], f[3]);
+    else
+        fprintf(stderr, "Unknown message %s from the coordinator\n", f[0]);
+}
+
+/*
+Carries on without the coordinator once its link is gone: names it held for
+this node's players are kept here instead, players waiting on it are queued
+here, and everyone is paired on this node from now on.
+*/
+void play_alone(void *player)
+{
+    struct connection_data *con = player;
+    if (con->name[0] != '\0' && !con->guest)
+        add_username(con->name);
+    if (con->io.closing)
+        return;
+    if (con->state == CONN_NAMING)
+    {
+        char *request = con->pending;
+        con->pending = NULL;
+        con->state = CONN_NEW;
+        handle_new_player(con, request);
+        free(request);
+        if (!con->io.closing && con->io.in_len > 0)
+            io_post(loop, &con->resume);
+    }
+    else if (con->state == CONN_WAITING && con->queued)
+    {
+        con->queued = 0;
+        queue_player(con);
+    }
+}
+
+void coordinator_lost(void)
+{
+    fprintf(stderr, "Lost the coordinator, pairing players on this node only\n");
+    io_close(loop, &coordinator->io);
+    cluster_link_drop(&coordinator_link);
+    coordinator = NULL;
+    cluster_each(play_alone);
+}
+
+void on_hangup(io_loop *loop, io_conn *c);
+
+/*
+Takes the channel number out of a message that came in on a carrier and
+writes the message as the player would have sent it on a connection of its
+own. Returns the channel, or -1 if the message does not name one.
+*/
+int take_channel(const char *buf, char *message)
+{
+    char *end;
+    const char *length = strchr(buf, '|');
+    if (length == NULL || !isdigit((unsigned char)length[1]))
+        return -1;
+    long len = strtol(length + 1, &end, 10);
+    const char *id = end + 1;
+    if (*end != '|' || !isdigit((unsigned char)*id))
+        return -1;
+    long channel = strtol(id, &end, 10);
+    if (*end != '|' || channel < 1 || channel >= MAX_CHANNELS)
+        return -1;
+    snprintf(message, BUFSIZE, "%.*s|%ld|%s", (int)(length - buf), buf, len - (end + 1 - id), end + 1);
+    return channel;
+}
+
+/*
+Sets up a player on a channel of a carrier, as if it had just connected.
+*/
+struct connection_data *open_channel(struct connection_data *carrier, int channel)
+{
+    if (channel >= carrier->num_channels)
+    {
+        int size = carrier->num_channels ? carrier->num_channels : 64;
+        while (size <= channel)
+            size *= 2;
+        struct connection_data **grown = realloc(carrier->channels, size * sizeof(*grown));
+        if (grown == NULL)
+            return NULL;
+        memset(grown + carrier->num_channels, 0, (size - carrier->num_channels) * sizeof(*grown));
+        carrier->channels = grown;
+        carrier->num_channels = size;
+    }
+    struct connection_data *con = new_connection();
+    if (con == NULL)
+        return NULL;
+    io_add_virtual(loop, &con->io);
+    con->carrier = carrier;
+    con->channel = channel;
+    memcpy(&con->addr, &carrier->addr, carrier->addr_len);
+    con->addr_len = carrier->addr_len;
+    carrier->channels[channel] = con;
+    channels_opened++;
+    return con;
+}
+
+/*
+Hands a message that came in on a carrier to the player on its channel, as
+input of the player's own, so it is held while the player waits like any
+other. The first message on a channel opens it, and QUIT closes it as
+hanging up would.
+*/
+void carry_message(struct connection_data *carrier, const char *buf)
+{
+    char message[BUFSIZE];
+    int channel = take_channel(buf, message);
+    if (channel < 0)
+    {
+        send_message(carrier, "INVL|29|0|Expected a channel number.|\n");
+        return;
+    }
+    struct connection_data *con = channel < carrier->num_channels ? carrier->channels[channel] : NULL;
+    if (strncmp(message, "QUIT|", 5) == 0)
+    {
+        if (con != NULL)
+            on_hangup(loop, &con->io);
+        return;
+    }
+    if (con == NULL && (con = open_channel(carrier, channel)) == NULL)
+    {
+        send_message(carrier, "INVL|30|0|Could not open the channel.|\n");
+        return;
+    }
+    int len = strlen(message);
+    if (con->io.in_len + len + 1 > IO_INBUF - 1)
+    {
+        // A socket would stop being read, but the other channels must not wait
+        send_message(con, "INVL|44|Error reading data, terminating connection.|\n");
+        on_hangup(loop, &con->io);
+        return;
+    }
+    memcpy(con->io.in + con->io.in_len, message, len);
+    con->io.in[con->io.in_len + len] = '\n';
+    con->io.in_len += len + 1;
+    on_read(loop, &con->io);
+}
+
+/*
+Splits a connection's input into messages and handles each one. A message
+ends with a newline, or after BUFSIZE - 1 bytes if it is too long.
+*/
+void on_read(io_loop *loop, io_conn *c)
+{
+    struct connection_data *con = (struct connection_data *)c;
+    char buf[BUFSIZE];
+
+    while (!c->closing && con->state != CONN_WAITING && con->state != CONN_NAMING && con->state != CONN_RELAYING &&
+           c->in_len > 0)
+    {
+        char *end = memchr(c->in, '\n', c->in_len);
+        int len;
+        if (end != NULL)
+            len = end - c->in;
+        else if (c->in_len >= BUFSIZE - 1)
+            len = BUFSIZE - 1;
+        else
+            break; // Wait for the rest of the message
+
+        int used = len < BUFSIZE - 1 ? len : BUFSIZE - 1;
+        memcpy(buf, c->in, used);
+        buf[used] = '\0';
+        if (end != NULL)
+            len++;
+        c->in_len -= len;
+        memmove(c->in, c->in + len, c->in_len);
+
+        if (con->state == CONN_NEW)
+            handle_new_player(con, buf);
+        else if (con->state == CONN_FINISHED)
+            handle_finished_player(con, buf);
+        else if (con->state == CONN_RELAYED)
+            relay_message(con->relay, buf);
+        else if (con->state == CONN_UPSTREAM)
+            relay_from_host(con, buf);
+        else if (con->state == CONN_COORDINATOR)
+            coordinator_message(buf);
+        else if (con->state == CONN_CARRIER)
+            carry_message(con, buf);
+        else
+            process_player_move(game_of(con), con->index, buf);
+    }
+}
 
-        con->pair->moves++;
-        gameState = checkWinner(con->pair);
+/*
+The other end closed the connection or it failed.
+*/
+void on_hangup(io_loop *loop, io_conn *c)
+{
+    struct connection_data *con = (struct connection_data *)c;
 
-        // Report game state
-        if (gameState == '.')
+    if (con->state == CONN_COORDINATOR)
+    {
+        coordinator_lost();
+        return;
+    }
+    if (con->state == CONN_CARRIER)
+    {
+        // Every player on it loses its connection too
+        close_connection(con);
+        for (int i = 1; i < con->num_channels; i++)
+            if (con->channels[i] != NULL)
+                on_hangup(loop, &con->channels[i]->io);
+        return;
+    }
+    if (con->state == CONN_UPSTREAM)
+    {
+        // The node hosting the game went away, or would not have the player
+        struct connection_data *player = con->relay;
+        io_close(loop, &con->io);
+        if (player == NULL)
+            return;
+        player->relay = NULL;
+        if (player->state == CONN_RELAYING)
+            queue_player(player);
+        else
+            close_connection(player);
+        return;
+    }
+    if (con->state == CONN_PLAYING && grace_seconds > 0 && session_hold(&seats, con->token, con, grace_seconds) == 0)
+    {
+        // Keep the seat, the name and the game for a while in case the
+        // player comes back with RCON
+        con->state = CONN_DROPPED;
+        close_io(con);
+        return;
+    }
+    if (con->state == CONN_PLAYING)
+    {
+        client_pair_t *pair = game_of(con);
+        send_termination_message(pair->clients[1 - con->index]);
+        finish_game(pair, 1 - con->index);
+    }
+    else if (con->state == CONN_WAITING && con->event == NULL)
+    {
+        if (con->room != NULL)
         {
-            printf("%s\n", con->pair->board);
-            if (con->pair->moves == 9)
-            {
-                snprintf(board_message, BUFSIZE, "OVER|26|D|Draw, the grid is full.|\n");
-                write(con->pair->clients[1 - con->index]->fd, board_message, strlen(board_message));
-                write(con->pair->clients[con->index]->fd, board_message, strlen(board_message));
-                cleanup_and_close(con->pair, con->index, 1 - con->index);
-                break;
-            }
+            if (strncmp(con->room->name, CLUSTER_ROOM_PREFIX, strlen(CLUSTER_ROOM_PREFIX)) == 0)
+                session_take(&guest_seats, con->room->name);
+            lobby_cancel(con->room);
         }
+        else if (con->queued)
+            cluster_send(loop, &coordinator_link, "GONE", "%lu|", con->cluster_id);
         else
         {
-            if (con->pair->currentTurn == 'X')
-            {
-                snprintf(board_message, BUFSIZE, "OVER|24|W|Tic-tac-toe, you win!|\n");
-                write(con->pair->clients[con->index]->fd, board_message, strlen(board_message));
-                int msgSize = strlen(con->pair->clients[1 - con->index]->name) + 22;
-                snprintf(board_message, BUFSIZE, "OVER|%d|L|Tic-tac-toe, %s wins!|\n", msgSize, con->pair->clients[1 - con->index]->name);
-                write(con->pair->clients[1 - con->index]->fd, board_message, strlen(board_message));
-            }
-            else
-            {
-                snprintf(board_message, BUFSIZE, "OVER|24|W|Tic-tac-toe, you win!|\n");
-                write(con->pair->clients[con->index]->fd, board_message, strlen(board_message));
-                int msgSize = strlen(con->pair->clients[1 - con->index]->name) + 22;
-                snprintf(board_message, BUFSIZE, "OVER|%d|L|Tic-tac-toe, %s wins!|\n", msgSize, con->pair->clients[1 - con->index]->name);
-                write(con->pair->clients[1 - con->index]->fd, board_message, strlen(board_message));
-            }
-            cleanup_and_close(con->pair, con->index, 1 - con->index);
-            break;
+            remove_client(con);
+            waiting_client = NULL;
         }
     }
+    else if (con->state == CONN_RELAYING || con->state == CONN_RELAYED)
+        end_relay(con);
+    close_connection(con);
+}
+
+void on_release(io_loop *loop, io_conn *c)
+{
+    struct connection_data *con = (struct connection_data *)c;
+    if (con->counted)
+        num_clients--;
+    if (con->state == CONN_DROPPED)
+        con->released = 1; // Still holds a seat, freed once that ends
+    else
+        free_connection(con);
 }
 
 /*
-Reads data froma client thread, read_data is ran on seperate threads. Clients must go in the correct order which is 1st connection then second connection.
+Sets up a new connection. Sockets accepted over TCP or a unix domain socket,
+or one end of a socketpair() from spawn_pair_client(), all go through the same
+game handling. With TRANSPORT_TLS in transport the event loop runs a TLS
+handshake first, and with TRANSPORT_WS it answers a WebSocket upgrade and
+frames every message, so browsers play against everyone else unchanged.
 */
-void *read_data(void *arg)
+int spawn_client(int fd, struct sockaddr *addr, socklen_t addr_len, int transport)
 {
-    struct connection_data *con = arg;
-    char buf[BUFSIZE + 1], host[HOSTSIZE], port[PORTSIZE];
-    int bytes, error;
-    error = getnameinfo(
-        (struct sockaddr *)&con->addr, con->addr_len,
-        host, HOSTSIZE,
-        port, PORTSIZE,
-        NI_NUMERICSERV);
+    char host[HOSTSIZE], port[PORTSIZE];
+    int error = 0;
+    struct connection_data *con = new_connection();
+    if (con == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+    memcpy(&con->addr, addr, addr_len);
+    con->addr_len = addr_len;
+
+    if (addr_len == 0 || con->addr.ss_family == AF_UNIX)
+    {
+        // Local clients have no host or port, only the socket they came in on
+        strcpy(host, "local");
+        strcpy(port, "unix");
+    }
+    else
+    {
+        // Messages are small and latency matters more than packet count
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        error = getnameinfo(
+            (struct sockaddr *)&con->addr, con->addr_len,
+            host, HOSTSIZE,
+            port, PORTSIZE,
+            NI_NUMERICSERV);
+    }
     if (error)
     {
         fprintf(stderr, "getnameinfo: %s\n", gai_strerror(error));
@@ -855,144 +2327,325 @@ void *read_data(void *arg)
         strcpy(port, "??");
     }
     printf("Connection from %s:%s\n", host, port);
-    sigset_t mask;
 
-    // Block the signals for the worker threads
-    install_handlers(&mask);
-    pthread_sigmask(SIG_BLOCK, &mask, NULL);
-    char board_message[BUFSIZE];
+    tls_session *session = NULL;
+    if (transport & TRANSPORT_TLS && (session = tls_accept(fd)) == NULL)
+        error = -1;
+    else if (transport & TRANSPORT_WS)
+        error = io_add_websocket(loop, &con->io, fd, session);
+    else if (session != NULL)
+        error = io_add_tls(loop, &con->io, fd, session);
+    else
+        error = io_add(loop, &con->io, fd);
+    if (error)
+    {
+        fprintf(stderr, "Could not set up the connection from %s:%s\n", host, port);
+        if (session != NULL)
+            tls_free(session);
+        close(fd);
+        free(con);
+        return -1;
+    }
+    con->counted = 1;
+    num_clients++;
+    return 0;
+}
 
-    bytes = read(con->fd, buf, BUFSIZE);
-    if (bytes > 0)
+/*
+Connects an in-process bot or test without a listener: the loop takes one end
+of a new socketpair() as a local client and the other end is returned, for
+the caller to play over and close. Returns -1 if the pair cannot be set up.
+Runs on the loop's thread; other threads call it from a task given to io_post.
+bench/paircheck.c plays games through it.
+*/
+int spawn_pair_client(void)
+{
+    int fds[2];
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds))
     {
-        buf[bytes] = '\0';
-        remove_newline(buf);
-        player_input parsedInputs = parse(buf);
-        if (parsedInputs.type == PLAY)
-        {
-            error = add_username(parsedInputs.name);
-            if (error)
-            {
-                // Bad username
-                snprintf(board_message, BUFSIZE, "INVL|18|Username is taken|\n");
-                write(con->fd, board_message, strlen(board_message));
-                close(con->fd);
-                free(con);
-                return NULL;
-            }
-            else
-            {
-                pthread_mutex_lock(&connecting_mutex);
-                strcpy(con->name, parsedInputs.name);
-                con->wants_draw = 0;
-                snprintf(board_message, BUFSIZE, "WAIT|0|\n");
-                write(con->fd, board_message, strlen(board_message));
-                add_client(con);
-
-                if (numConnecting < 2)
-                {
-                    // If there are fewer than 2 clients, wait for another client to connect
-                    con->index = 0;
-                    waiting_client = con;
-                    pthread_cond_wait(&connecting_cond, &connecting_mutex);
-                }
-                else
-                {
-                    // If there are at least 2 clients, create a new game, signal the waiting client, and reset numConnecting
-                    con->index = 1;
-                    client_pair_t *client_pair = create_game();
-                    client_pair->gameOver = 0;
-
-                    con->pair = client_pair;
-                    waiting_client->pair = client_pair;
-                    waiting_client = NULL;
-                    pthread_cond_signal(&connecting_cond);
-                }
-
-                pthread_mutex_unlock(&connecting_mutex);
-                struct sigaction sa;
-                sa.sa_handler = thread_signal_handler;
-                sa.sa_flags = 0;
-                sigemptyset(&sa.sa_mask);
-                if (sigaction(SIGUSR1, &sa, NULL) == -1)
-                {
-                    perror("sigaction");
-                    return NULL;
-                }
-                play_game(con->pair->clients[1 - con->index]);
-            }
-        }
-        else
-        {
-            // User didn't submit PLAY as first protocol
-            snprintf(board_message, BUFSIZE, "INVL|24|Expected PLAY protocol.|\n");
-            write(con->fd, board_message, strlen(board_message));
-            close(con->fd);
-            free(con);
-            return NULL;
-        }
+        perror("socketpair");
+        return -1;
     }
-    else{
-        close(con->fd);
-        free(con);
+    // The loop's end is set up like an accepted socket: non-blocking, so a
+    // client that stops reading cannot stall an epoll write, except under
+    // io_uring, which waits on a blocking socket itself. The caller's end
+    // blocks like any socket it opened.
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) & ~O_NONBLOCK);
+    if (strcmp(io_loop_backend(loop), "uring") == 0)
+        fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) & ~O_NONBLOCK);
+    if (spawn_client(fds[0], (struct sockaddr *)&addr, sizeof(sa_family_t), 0))
+    {
+        close(fds[1]);
+        return -1;
     }
+    return fds[1];
+}
 
-    return NULL;
+/*
+Accepts a connection, or turns it away at once when max_clients are already
+connected. A plain connection hears BUSY first; TLS and WebSocket ones are
+closed without it, rather than spending a handshake on a player who cannot
+stay.
+*/
+void on_accept(io_loop *loop, int fd, int listener, struct sockaddr *addr, socklen_t addr_len)
+{
+    if (max_clients > 0 && num_clients >= max_clients)
+    {
+        char board_message[BUFSIZE];
+        if (transports[listener] == 0 && write(fd, board_message, busy_message(board_message, BUSY_CLIENTS)) < 0)
+            perror("write");
+        close(fd);
+        turned_away[BUSY_CLIENTS]++;
+        return;
+    }
+    spawn_client(fd, addr, addr_len, transports[listener]);
+}
+
+/*
+Registers with the coordinator as a node other nodes can relay players to at
+advertised, by default the game port on localhost, for a cluster of
+processes on one machine.
+*/
+int join_cluster(const char *addr, const char *advertised, const char *service)
+{
+    char self[CLUSTER_ADDR_SIZE];
+    if (advertised == NULL)
+    {
+        snprintf(self, sizeof(self), "localhost:%s", service);
+        advertised = self;
+    }
+    int fd = cluster_connect(addr);
+    if (fd < 0)
+        return -1;
+    coordinator = new_connection();
+    if (coordinator == NULL || io_add(loop, &coordinator->io, fd))
+    {
+        fprintf(stderr, "Could not set up the connection to the coordinator\n");
+        close(fd);
+        free(coordinator);
+        coordinator = NULL;
+        return -1;
+    }
+    coordinator->state = CONN_COORDINATOR;
+    cluster_link_init(&coordinator_link, &coordinator->io);
+    cluster_send(loop, &coordinator_link, "NODE", "%s|", advertised);
+    printf("Joined the cluster at %s as %s\n", addr, advertised);
+    return 0;
 }
 
 int main(int argc, char **argv)
 {
-    pthread_mutex_init(&connecting_mutex, NULL);
-    pthread_cond_init(&connecting_cond, NULL);
     sigset_t mask;
-    struct connection_data *con;
-    int error;
-    pthread_t tid;
+    int listeners[MAX_LISTENERS];
+    int nlisteners = 0, opt;
+    io_callbacks callbacks = {on_accept, on_read, on_hangup, on_release};
+
+    char *service = "15000";
+    char *unix_path = NULL;
+    char *backend = "epoll";
+    char *lock_json = NULL;
+    char *tls_service = NULL, *cert_file = "cert.pem", *key_file = "key.pem";
+    char *ws_service = NULL, *wss_service = NULL;
+    char *coordinator_addr = NULL, *advertised = NULL;
+    int cpu = -1;
+    while ((opt = getopt(argc, argv, "u:b:g:s:d:l:a:t:c:k:w:W:C:A:E:R:M:G:Q:B:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 'b':
+            backend = optarg;
+            break;
+        case 'g':
+            grace_seconds = atoi(optarg);
+            break;
+        case 's':
+            trace_slow_ns = strtoull(optarg, NULL, 10) * 1000;
+            break;
+        case 'd':
+            dump_seconds = atoi(optarg);
+            break;
+        case 'l':
+            lock_json = optarg;
+            break;
+        case 'a':
+            cpu = atoi(optarg);
+            break;
+        case 't':
+            tls_service = optarg;
+            break;
+        case 'c':
+            cert_file = optarg;
+            break;
+        case 'k':
+            key_file = optarg;
+            break;
+        case 'w':
+            ws_service = optarg;
+            break;
+        case 'W':
+            wss_service = optarg;
+            break;
+        case 'C':
+            coordinator_addr = optarg;
+            break;
+        case 'A':
+            advertised = optarg;
+            break;
+        case 'E':
+            if (schedule_event(optarg))
+                exit(EXIT_FAILURE);
+            break;
+        case 'R':
+            archive_dir = optarg;
+            break;
+        case 'M':
+            max_clients = atoi(optarg);
+            break;
+        case 'G':
+            max_games = atoi(optarg);
+            break;
+        case 'Q':
+            max_waiting = atoi(optarg);
+            break;
+        case 'B':
+            busy_retry_ms = atoi(optarg) > 0 ? atoi(optarg) : 0;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-u socket_path] [-t tls_port] [-w websocket_port] [-W secure_websocket_port] [-c cert.pem] [-k key.pem] [-b epoll|uring] [-g grace_seconds] [-s slow_move_us] [-d dump_seconds] [-l lock_profile.json] [-a cpu] [-C coordinator_host:port] [-A this_host:port] [-E name:single|swiss:entrants[:rounds]] [-R archive_dir] [-M max_connections] [-G max_games] [-Q max_waiting] [-B busy_retry_ms] [port]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (optind < argc)
+        service = argv[optind];
 
-    char *service = argc == 2 ? argv[1] : "15000";
-    install_handlers(&mask);
+    // Pin before anything is allocated, so the rings, buffers, connections and
+    // games all come from this CPU's node
+    if (cpu >= 0)
+    {
+        int node = pin_to_cpu(cpu);
+        if (node < 0)
+            exit(EXIT_FAILURE);
+        printf("Event loop pinned to CPU %d, NUMA node %d\n", cpu, node);
+    }
 
-    int listener = open_listener(service, QUEUE_SIZE);
-    if (listener < 0) // failed to bind server to requested port
+    loop = io_loop_create(backend, &callbacks);
+    if (loop == NULL)
         exit(EXIT_FAILURE);
+    install_handlers(&mask);
 
+    listeners[nlisteners] = open_listener(service, QUEUE_SIZE);
+    if (listeners[nlisteners] < 0) // failed to bind server to requested port
+        exit(EXIT_FAILURE);
+    io_add_listener(loop, listeners[nlisteners++]);
     printf("Listening for incoming connections on %s\n", service);
-    while (active)
+
+    if (unix_path != NULL)
     {
-        con = (struct connection_data *)malloc(sizeof(struct connection_data));
-        con->addr_len = sizeof(struct sockaddr_storage);
-        con->fd = accept(listener, // accept() waits accepts incoming TCP requests and assigns it to a connection's file descriptor
-                         (struct sockaddr *)&con->addr,
-                         &con->addr_len);
+        listeners[nlisteners] = open_unix_listener(unix_path, QUEUE_SIZE);
+        if (listeners[nlisteners] < 0)
+            exit(EXIT_FAILURE);
+        io_add_listener(loop, listeners[nlisteners++]);
+        printf("Listening for local connections on %s\n", unix_path);
+    }
 
-        if (con->fd < 0)
-        {
-            perror("\naccept");
-            free(con);
-            // TODO check for specific error conditions (when the fuck does this happen)
+    if ((tls_service != NULL || wss_service != NULL) && tls_server_init(cert_file, key_file))
+        exit(EXIT_FAILURE);
+    // Ports whose clients speak TLS, WebSocket or both on top of TCP
+    const struct
+    {
+        char *service;
+        int transport;
+        const char *what;
+    } layered[] = {{tls_service, TRANSPORT_TLS, "TLS"},
+                  {ws_service, TRANSPORT_WS, "WebSocket"},
+                  {wss_service, TRANSPORT_WS | TRANSPORT_TLS, "secure WebSocket"}};
+    for (int i = 0; i < 3; i++)
+    {
+        if (layered[i].service == NULL)
             continue;
+        listeners[nlisteners] = open_listener(layered[i].service, QUEUE_SIZE);
+        if (listeners[nlisteners] < 0)
+            exit(EXIT_FAILURE);
+        transports[nlisteners] = layered[i].transport;
+        io_add_listener(loop, listeners[nlisteners++]);
+        printf("Listening for %s connections on %s\n", layered[i].what, layered[i].service);
+    }
+    printf("Using the %s backend\n", io_loop_backend(loop));
+    if (coordinator_addr != NULL && join_cluster(coordinator_addr, advertised, service))
+        exit(EXIT_FAILURE);
+    if (archive_dir != NULL)
+    {
+        if (archive_open(archive_dir))
+            exit(EXIT_FAILURE);
+        printf("Archiving finished games in %s\n", archive_dir);
+    }
+
+    while (active)
+    {
+        // Wake up once a second while seats are held so they can expire or
+        // games wait to be archived, and at once while messages for the
+        // coordinator are waiting
+        int held = session_count(&seats) + session_count(&guest_seats) > 0;
+        int unarchived = archive_tick();
+        int backlog = cluster_flush(loop);
+        if (io_run_once(loop, backlog ? 0 : held || unarchived ? 1000 : -1) < 0)
+        {
+            perror("event loop");
+            break;
         }
-        else
+        if (held)
         {
-            error = pthread_create(&tid, NULL, read_data, con); // creates client in separate thread
-            if (error != 0)
-            {
-                fprintf(stderr, "pthread_create: %s\n", strerror(error));
-                close(con->fd);
-                free(con);
-                continue;
-            }
-            else
-            {
-                con->thread_id = tid;
-                pthread_detach(tid);
-            }
+            session_expire(&seats, seat_expired);
+            session_expire(&guest_seats, guest_seat_expired);
         }
     }
-    pthread_mutex_destroy(&connecting_mutex);
-    pthread_cond_destroy(&connecting_cond);
     free_unique_names();
+    while (events != NULL)
+    {
+        event *next = events->next;
+        tournament_free(&events->t);
+        free(events);
+        events = next;
+    }
 
     puts("Shutting down");
-    close(listener);
+    printf("%s: %lu games, %lu syscalls (%.1f per game)\n", io_loop_backend(loop), games_played,
+           io_syscalls(loop), games_played ? (double)io_syscalls(loop) / games_played : 0.0);
+    if (tls_service != NULL || wss_service != NULL)
+    {
+        const io_tls_stats *tls = io_tls_counts(loop);
+        printf("TLS: %lu handshakes, %lu resumed, %lu failed, kernel encrypts %lu and decrypts %lu\n",
+               tls->handshakes, tls->resumed, tls->failed, tls->kernel_send, tls->kernel_recv);
+    }
+    if (archive_dir != NULL)
+        printf("Archive: %lu games written to %s\n", archive_close(), archive_dir);
+    if (max_clients > 0 || max_games > 0 || max_waiting > 0)
+        printf("Admission: turned away %lu for connections, %lu for games and %lu for waiting players, overloaded %lu times\n",
+               turned_away[BUSY_CLIENTS], turned_away[BUSY_GAMES], turned_away[BUSY_WAITING], overloads);
+    if (carriers > 0)
+        printf("Multiplexing: %lu players on channels of %lu connections\n", channels_opened, carriers);
+    if (coordinator_addr != NULL)
+        printf("Cluster: %lu players relayed to other nodes, %lu guests from them\n", relayed_players, hosted_guests);
+    lockprof_report(stdout);
+    if (lock_json != NULL)
+    {
+        FILE *out = fopen(lock_json, "w");
+        if (out == NULL)
+            perror(lock_json);
+        else
+        {
+            lockprof_export_json(out);
+            fclose(out);
+        }
+    }
+    for (int i = 0; i < nlisteners; i++)
+        close(listeners[i]);
+    if (unix_path != NULL)
+        unlink(unix_path);
+    io_loop_destroy(loop);
     return EXIT_SUCCESS;
+}
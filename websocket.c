@@ -0,0 +1,232 @@
+// The WebSocket protocol (RFC 6455), as much as a game server needs: the
+// upgrade request, with its own SHA-1 and base64 for the accept value so
+// there is no dependency on a crypto library, and frame headers. The event
+// loop does the rest in place in each connection's buffers.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include "websocket.h"
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+static uint32_t rol(uint32_t x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+static void sha1_block(uint32_t h[5], const unsigned char *block)
+{
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)block[4 * i] << 24 | block[4 * i + 1] << 16 | block[4 * i + 2] << 8 | block[4 * i + 3];
+    for (int i = 16; i < 80; i++)
+        w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++)
+    {
+        uint32_t f, k;
+        if (i < 20)
+            f = (b & c) | (~b & d), k = 0x5A827999;
+        else if (i < 40)
+            f = b ^ c ^ d, k = 0x6ED9EBA1;
+        else if (i < 60)
+            f = (b & c) | (b & d) | (c & d), k = 0x8F1BBCDC;
+        else
+            f = b ^ c ^ d, k = 0xCA62C1D6;
+        uint32_t t = rol(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rol(b, 30);
+        b = a;
+        a = t;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+/*
+SHA-1 of a short message: the key and the GUID, 60 bytes.
+*/
+static void sha1(const char *msg, int len, unsigned char digest[20])
+{
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    unsigned char block[64];
+    int done = 0;
+    for (; len - done >= 64; done += 64)
+        sha1_block(h, (const unsigned char *)msg + done);
+
+    // The last bytes, a 1 bit, and the length in bits at the end of a block
+    int rest = len - done;
+    memset(block, 0, sizeof(block));
+    memcpy(block, msg + done, rest);
+    block[rest] = 0x80;
+    if (rest >= 56)
+    {
+        sha1_block(h, block);
+        memset(block, 0, sizeof(block));
+    }
+    uint64_t bits = (uint64_t)len * 8;
+    for (int i = 0; i < 8; i++)
+        block[63 - i] = bits >> (8 * i);
+    sha1_block(h, block);
+
+    for (int i = 0; i < 20; i++)
+        digest[i] = h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+static void base64(const unsigned char *in, int len, char *out)
+{
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for (int i = 0; i < len; i += 3)
+    {
+        uint32_t v = in[i] << 16 | (i + 1 < len ? in[i + 1] << 8 : 0) | (i + 2 < len ? in[i + 2] : 0);
+        *out++ = digits[v >> 18];
+        *out++ = digits[(v >> 12) & 63];
+        *out++ = i + 1 < len ? digits[(v >> 6) & 63] : '=';
+        *out++ = i + 2 < len ? digits[v & 63] : '=';
+    }
+    *out = '\0';
+}
+
+/*
+Looks at one line of the request, without its CRLF.
+*/
+static int request_line(const char *line, int len, unsigned char *state, char accept[WS_ACCEPT_SIZE])
+{
+    static const char key_header[] = "Sec-WebSocket-Key:";
+    if (*state == WS_REQUEST_LINE)
+    {
+        if (len < 4 || memcmp(line, "GET ", 4) != 0)
+            return -1;
+        *state = WS_HEADERS;
+        return 0;
+    }
+    if (len == 0)
+    {
+        // The end of the request; without a key it was not an upgrade
+        if (accept[0] == '\0')
+            return -1;
+        *state = WS_UPGRADED;
+        return 0;
+    }
+    int name_len = sizeof(key_header) - 1;
+    if (len > name_len && strncasecmp(line, key_header, name_len) == 0)
+    {
+        char key[64 + sizeof(WS_GUID)];
+        unsigned char digest[20];
+        const char *value = line + name_len, *end = line + len;
+        while (value < end && *value == ' ')
+            value++;
+        while (end > value && end[-1] == ' ')
+            end--;
+        if (end - value > 64)
+            return -1;
+        memcpy(key, value, end - value);
+        memcpy(key + (end - value), WS_GUID, sizeof(WS_GUID) - 1);
+        sha1(key, (end - value) + sizeof(WS_GUID) - 1, digest);
+        base64(digest, 20, accept);
+    }
+    return 0;
+}
+
+int ws_read_request(const char *buf, int len, int full, unsigned char *state, char accept[WS_ACCEPT_SIZE])
+{
+    int used = 0;
+    while (*state != WS_UPGRADED)
+    {
+        const char *end = memmem(buf + used, len - used, "\r\n", 2);
+        if (end == NULL)
+        {
+            // A line that fills the buffer on its own is skipped, keeping the
+            // last byte, which may be the \r of the CRLF
+            if (full && used == 0 && len > 1)
+            {
+                if (*state == WS_REQUEST_LINE)
+                    return -1;
+                *state = WS_SKIPPING;
+                used = len - 1;
+            }
+            break;
+        }
+        int line_len = end - (buf + used);
+        if (*state == WS_SKIPPING)
+            *state = WS_HEADERS;
+        else if (request_line(buf + used, line_len, state, accept))
+            return -1;
+        used += line_len + 2;
+    }
+    return used;
+}
+
+int ws_upgrade_reply(char *out, int size, const char *accept)
+{
+    return snprintf(out, size,
+                    "HTTP/1.1 101 Switching Protocols\r\n"
+                    "Upgrade: websocket\r\n"
+                    "Connection: Upgrade\r\n"
+                    "Sec-WebSocket-Accept: %s\r\n\r\n",
+                    accept);
+}
+
+int ws_parse_frame(const char *buf, int len, int max_payload, ws_frame *f)
+{
+    const unsigned char *b = (const unsigned char *)buf;
+    if (len < 2)
+        return 0;
+    if ((b[0] & 0x70) || !(b[1] & 0x80))
+        return -1; // Reserved bits mean an extension the server did not agree to
+    f->fin = b[0] >> 7;
+    f->opcode = b[0] & 0x0F;
+    uint64_t payload = b[1] & 0x7F;
+    int header = 2;
+    if (payload == 126)
+    {
+        if (len < 4)
+            return 0;
+        payload = b[2] << 8 | b[3];
+        header = 4;
+    }
+    else if (payload == 127)
+    {
+        if (len < 10)
+            return 0;
+        payload = 0;
+        for (int i = 2; i < 10; i++)
+            payload = payload << 8 | b[i];
+        header = 10;
+    }
+    if (payload > (uint64_t)max_payload)
+        return -1;
+    if (len < header + 4)
+        return 0;
+    memcpy(f->mask, b + header, 4);
+    f->header = header + 4;
+    f->payload = payload;
+    return len >= f->header + f->payload;
+}
+
+void ws_unmask(char *payload, int len, const unsigned char mask[4])
+{
+    for (int i = 0; i < len; i++)
+        payload[i] ^= mask[i & 3];
+}
+
+int ws_frame_header(char *out, int opcode, int len)
+{
+    unsigned char *o = (unsigned char *)out;
+    o[0] = 0x80 | opcode;
+    if (len < 126)
+    {
+        o[1] = len;
+        return 2;
+    }
+    o[1] = 126;
+    o[2] = len >> 8;
+    o[3] = len;
+    return 4;
+}
@@ -0,0 +1,69 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <stdint.h>
+
+#define WS_ACCEPT_SIZE 29 // Sec-WebSocket-Accept value and its terminator
+#define WS_MAX_HEADER 14  // Largest frame header: 2 bytes, 8 of length, 4 of mask
+
+// Frame opcodes
+#define WS_CONTINUATION 0x0
+#define WS_TEXT 0x1
+#define WS_BINARY 0x2
+#define WS_CLOSE 0x8
+#define WS_PING 0x9
+#define WS_PONG 0xA
+
+// Where a connection is in its upgrade request
+#define WS_REQUEST_LINE 1 // Waiting for GET
+#define WS_HEADERS 2
+#define WS_SKIPPING 3     // Inside a header line too long to keep, such as a cookie
+#define WS_UPGRADED 4     // The blank line ending the request arrived
+#define WS_CLOSED 5       // A close frame was sent, nothing more may be
+
+/*
+Reads the HTTP upgrade request a line at a time from buf. Each header line is
+dropped once it has been looked at; the only one kept is the key, as the
+accept value the reply needs. full says buf cannot grow, so a line that does
+not fit is skipped rather than waited for. Returns the bytes consumed, or -1
+if the request is not a WebSocket upgrade. The request is complete once
+*state is WS_UPGRADED; anything after it in buf is already WebSocket frames.
+*/
+int ws_read_request(const char *buf, int len, int full, unsigned char *state, char accept[WS_ACCEPT_SIZE]);
+
+/*
+Writes the 101 reply that finishes the upgrade. Returns its length.
+*/
+int ws_upgrade_reply(char *out, int size, const char *accept);
+
+/*
+The fixed part of a frame from the client. Client frames are always masked.
+*/
+typedef struct ws_frame
+{
+    int opcode;
+    int fin;     // Last frame of its message
+    int header;  // Bytes before the payload
+    int payload; // Payload bytes
+    unsigned char mask[4];
+} ws_frame;
+
+/*
+Parses the frame at the front of buf. Returns 1 once the whole frame is in buf,
+0 if more bytes are needed, or -1 for a frame the server refuses: unmasked,
+with reserved bits set, or with a payload over max_payload.
+*/
+int ws_parse_frame(const char *buf, int len, int max_payload, ws_frame *f);
+
+/*
+Unmasks a payload in place.
+*/
+void ws_unmask(char *payload, int len, const unsigned char mask[4]);
+
+/*
+Writes the header of an unmasked, final frame, as the server sends them.
+Returns its length, 2 or 4 bytes for anything the server sends.
+*/
+int ws_frame_header(char *out, int opcode, int len);
+
+#endif
@@ -4,8 +4,13 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include "capture.h"
+#include "tls.h"
 
 #define BUFLEN 256
 
@@ -46,49 +51,162 @@ int connect_inet(char *host, char *service)
     return sock;
 }
 
+int connect_unix(char *path)
+{
+    struct sockaddr_un addr;
+    int sock;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        fprintf(stderr, "Unable to connect to %s\n", path);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int signum)
+{
+    (void)signum;
+    stopping = 1;
+}
+
 int main(int argc, char **argv)
 {
-    int sock, bytes;
+    int sock, bytes, server_closed = 0;
     char buf[BUFLEN];
-    if (argc != 3)
+    tls_session *tls = NULL;
+    char *record_path = NULL;
+    capture_writer capture;
+    if (argc >= 3 && strcmp(argv[1], "-r") == 0)
     {
-        printf("Specify host and service\n");
+        // Record the session, to replay later with playback
+        record_path = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc == 4 && strcmp(argv[1], "-t") == 0)
+    {
+        // Over TLS: the same game, encrypted
+        if (tls_client_init(0))
+            exit(EXIT_FAILURE);
+        argv++;
+        argc--;
+        sock = connect_inet(argv[1], argv[2]);
+        if (sock >= 0 && ((tls = tls_connect(sock)) == NULL || tls_handshake(tls)))
+        {
+            fprintf(stderr, "TLS handshake with %s:%s failed\n", argv[1], argv[2]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (argc != 3)
+    {
+        printf("Specify host and service, -t, host and service for TLS, or -u and a socket path, optionally after -r and a capture file to record the session into\n");
         exit(EXIT_FAILURE);
     }
-    sock = connect_inet(argv[1], argv[2]);
+    else if (strcmp(argv[1], "-u") == 0)
+        sock = connect_unix(argv[2]);
+    else
+        sock = connect_inet(argv[1], argv[2]);
     if (sock < 0)
         exit(EXIT_FAILURE);
+    if (record_path != NULL)
+    {
+        // Interrupted, the session is still saved
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = stop;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        sigaction(SIGHUP, &sa, NULL);
+        capture_begin(&capture, (tls != NULL ? CAPTURE_TLS : 0) | (strcmp(argv[1], "-u") == 0 ? CAPTURE_UNIX : 0));
+    }
 
-    while (1)
+    while (!stopping)
     {
         fd_set read_fds;
         FD_ZERO(&read_fds);
         FD_SET(STDIN_FILENO, &read_fds);
         FD_SET(sock, &read_fds);
 
-        if (select(sock + 1, &read_fds, NULL, NULL, NULL) < 0)
+        // Bytes OpenSSL already decrypted are not on the socket any more
+        if (tls == NULL || tls_buffered(tls) == 0)
         {
-            perror("select");
-            exit(EXIT_FAILURE);
+            if (select(sock + 1, &read_fds, NULL, NULL, NULL) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                perror("select");
+                exit(EXIT_FAILURE);
+            }
         }
+        else
+            FD_ZERO(&read_fds);
 
         if (FD_ISSET(STDIN_FILENO, &read_fds))
         {
             bytes = read(STDIN_FILENO, buf, BUFLEN);
             if (bytes <= 0)
                 break;
-            write(sock, buf, bytes);
+            if (record_path != NULL)
+                capture_data(&capture, 0, buf, bytes);
+            if (tls != NULL)
+                tls_write(tls, buf, bytes);
+            else
+                write(sock, buf, bytes);
         }
 
-        if (FD_ISSET(sock, &read_fds))
+        if (tls != NULL && (FD_ISSET(sock, &read_fds) || tls_buffered(tls) > 0))
+        {
+            bytes = tls_read(tls, buf, BUFLEN);
+            if (bytes == TLS_WANT_READ) // Only part of a record has arrived
+                continue;
+            if (bytes <= 0)
+            {
+                server_closed = 1;
+                break;
+            }
+            if (record_path != NULL)
+                capture_data(&capture, 1, buf, bytes);
+            write(STDOUT_FILENO, buf, bytes);
+        }
+        else if (FD_ISSET(sock, &read_fds))
         {
             bytes = read(sock, buf, BUFLEN);
             if (bytes <= 0)
+            {
+                server_closed = 1;
                 break;
+            }
+            if (record_path != NULL)
+                capture_data(&capture, 1, buf, bytes);
             write(STDOUT_FILENO, buf, bytes);
         }
     }
 
+    if (tls != NULL)
+        tls_free(tls);
     close(sock);
+    if (record_path != NULL)
+    {
+        capture_close(&capture, server_closed);
+        if (capture_save(&capture, record_path))
+            return EXIT_FAILURE;
+    }
     return EXIT_SUCCESS;
 }